@@ -0,0 +1,65 @@
+/*
+ * Copyright 2020 Mnemosyne LLC
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <cstdio>
+#include <cstring>  // strstr()
+
+#include "bench.h"
+
+namespace bench {
+
+std::vector<Benchmark>& registry() {
+    static auto benchmarks = std::vector<Benchmark>{};
+    return benchmarks;
+}
+
+void report(char const* label, double seconds, size_t n_ops, size_t n_bytes) {
+    auto const ns_per_op = seconds * 1e9 / static_cast<double>(n_ops);
+    std::printf("  %-40s %10.2f ns/op", label, ns_per_op);
+    if (n_bytes > 0) {
+        auto const mib_per_sec = static_cast<double>(n_bytes) / seconds / (1024.0 * 1024.0);
+        std::printf(" %10.1f MiB/s", mib_per_sec);
+    }
+    std::printf("\n");
+}
+
+void const* volatile sink = nullptr;
+
+void do_not_optimize(void const* p) {
+    sink = p;
+}
+
+}  // namespace bench
+
+// Usage: buffer-bench [substring]
+// Runs every benchmark whose name contains `substring`, or all of them.
+int main(int argc, char** argv) {
+    char const* const filter = argc > 1 ? argv[1] : "";
+    for (auto const& benchmark : bench::registry()) {
+        if (std::strstr(benchmark.name, filter) != nullptr) {
+            std::printf("%s\n", benchmark.name);
+            benchmark.func();
+        }
+    }
+    return 0;
+}
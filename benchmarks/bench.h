@@ -0,0 +1,70 @@
+/*
+ * Copyright 2020 Mnemosyne LLC
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef BENCHMARKS_BENCH_H_
+#define BENCHMARKS_BENCH_H_
+
+#include <chrono>
+#include <cstddef>  // size_t
+#include <vector>
+
+namespace bench {
+
+using bench_func = void();
+
+struct Benchmark {
+    char const* name;
+    bench_func* func;
+};
+
+std::vector<Benchmark>& registry();
+
+struct Registrar {
+    Registrar(char const* name, bench_func* func) {
+        registry().push_back({ name, func });
+    }
+};
+
+// Returns how many seconds it takes to call `func` once.
+template<typename Func>
+double time(Func&& func) {
+    auto const begin = std::chrono::steady_clock::now();
+    func();
+    auto const end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - begin).count();
+}
+
+// Prints a result line. `n_bytes` may be 0 if throughput isn't relevant.
+void report(char const* label, double seconds, size_t n_ops, size_t n_bytes = 0);
+
+// Keeps the compiler from optimizing away a benchmark's results.
+void do_not_optimize(void const* p);
+
+}  // namespace bench
+
+#define BFY_BENCHMARK(name) \
+    static void name(); \
+    static bench::Registrar name##_registrar { #name, name }; \
+    static void name()
+
+#endif  // BENCHMARKS_BENCH_H_
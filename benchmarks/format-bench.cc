@@ -0,0 +1,75 @@
+/*
+ * Copyright 2020 Mnemosyne LLC
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string>
+#include <version>  // __cpp_lib_format
+
+#include "buffy/buffer.h"
+#include "buffy/buffer.hpp"
+
+#include "bench.h"
+
+// Compares formatting a request line through buffy's output iterator
+// with add_printf() and with formatting to a std::string first.
+// This needs std::format, or {fmt} when the standard library lacks it.
+#if defined(__cpp_lib_format)
+#include <format>
+namespace fmtlib = std;
+#define BFY_BENCH_FORMAT
+#elif defined(BFY_HAVE_FMT)
+#include <fmt/format.h>
+namespace fmtlib = fmt;
+#define BFY_BENCH_FORMAT
+#endif
+
+#if defined(BFY_BENCH_FORMAT)
+
+BFY_BENCHMARK(format_request_line) {
+    auto constexpr n = size_t { 1 << 18 };
+    auto buf = bfy_buffer_init();
+    auto run = [&](char const* label, auto&& add) {
+        auto const seconds = bench::time([&]() {
+            for (size_t i = 0; i < n; ++i) {
+                add(int(i));
+            }
+        });
+        bench::report(label, seconds, n, bfy_buffer_get_content_len(&buf));
+        bfy_buffer_drain_all(&buf);
+    };
+
+    run("bfy_buffer_add_printf", [&](int i) {
+        bfy_buffer_add_printf(&buf, "GET /items/%d?page=%d HTTP/1.1\r\n", i, i & 63);
+    });
+    run("format to std::string, bfy_buffer_add", [&](int i) {
+        auto const str = fmtlib::format("GET /items/{}?page={} HTTP/1.1\r\n", i, i & 63);
+        bfy_buffer_add(&buf, std::data(str), std::size(str));
+    });
+    run("format_to(bfy::buffer_writer::out())", [&](int i) {
+        auto w = bfy::buffer_writer { &buf };
+        fmtlib::format_to(w.out(), "GET /items/{}?page={} HTTP/1.1\r\n", i, i & 63);
+    });
+
+    bfy_buffer_destruct(&buf);
+}
+
+#endif
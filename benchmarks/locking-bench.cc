@@ -0,0 +1,106 @@
+/*
+ * Copyright 2020 Mnemosyne LLC
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "buffy/buffer.h"
+
+#include "bench.h"
+
+namespace {
+
+auto constexpr n_adds = size_t { 1 << 21 };
+auto constexpr batch_size = size_t { 64 };
+
+void use_std_recursive_mutex() {
+    auto fns = bfy_lock_functions {
+        .lock_new = []() -> void* { return new std::recursive_mutex{}; },
+        .lock_free = [](void* lock) { delete static_cast<std::recursive_mutex*>(lock); },
+        .lock = [](void* lock) { static_cast<std::recursive_mutex*>(lock)->lock(); },
+        .unlock = [](void* lock) { static_cast<std::recursive_mutex*>(lock)->unlock(); }
+    };
+    bfy_set_lock_functions(&fns);
+}
+
+void add_chars(bfy_buffer* buf, size_t n, bool batched) {
+    for (size_t i = 0; i < n; i += batch_size) {
+        if (batched) {
+            bfy_buffer_begin_coalescing_change_events(buf);
+        }
+        for (size_t j = 0; j < batch_size; ++j) {
+            bfy_buffer_add_ch(buf, 'x');
+        }
+        if (batched) {
+            bfy_buffer_end_coalescing_change_events(buf);
+        }
+    }
+}
+
+void run_threads(char const* label, size_t n_threads, bool batched) {
+    auto buf = bfy_buffer_init();
+    bfy_buffer_enable_locking(&buf, nullptr);
+
+    auto const seconds = bench::time([&]() {
+        auto threads = std::vector<std::thread>{};
+        for (size_t i = 0; i < n_threads; ++i) {
+            threads.emplace_back(add_chars, &buf, n_adds / n_threads, batched);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    });
+
+    bench::report(label, seconds, n_adds);
+    bfy_buffer_destruct(&buf);
+}
+
+}  // anonymous namespace
+
+BFY_BENCHMARK(locking_uncontended) {
+    use_std_recursive_mutex();
+
+    auto unlocked = bfy_buffer_init();
+    auto seconds = bench::time([&]() { add_chars(&unlocked, n_adds, false); });
+    bench::report("add_ch, locking disabled", seconds, n_adds);
+    bfy_buffer_destruct(&unlocked);
+
+    auto locked = bfy_buffer_init();
+    bfy_buffer_enable_locking(&locked, nullptr);
+    seconds = bench::time([&]() { add_chars(&locked, n_adds, false); });
+    bench::report("add_ch, locking enabled", seconds, n_adds);
+    bfy_buffer_destruct(&locked);
+}
+
+BFY_BENCHMARK(locking_contended) {
+    use_std_recursive_mutex();
+
+    auto const n_cores = std::max(2u, std::thread::hardware_concurrency());
+    for (size_t n_threads = 1; n_threads <= n_cores; n_threads *= 2) {
+        auto label = std::string { "add_ch, " } + std::to_string(n_threads) + " threads";
+        run_threads(label.c_str(), n_threads, false);
+        label += ", batched";
+        run_threads(label.c_str(), n_threads, true);
+    }
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright 2020 Mnemosyne LLC
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "buffy/buffer.h"
+#include "../src/endianness.h"
+
+#include "bench.h"
+
+namespace {
+
+auto constexpr n_values = size_t { 1 << 18 };
+auto constexpr page_len = size_t { 4096 };
+
+// a buffer of big-endian uint32_t values, split into pages like network reads
+std::vector<uint32_t> make_values() {
+    auto values = std::vector<uint32_t>(n_values);
+    for (size_t i = 0; i < n_values; ++i) {
+        values[i] = hton32(uint32_t(i * 2654435761u));
+    }
+    return values;
+}
+
+bfy_buffer make_buffer(std::vector<uint32_t> const& values) {
+    auto buf = bfy_buffer_init();
+    auto const* const bytes = reinterpret_cast<char const*>(std::data(values));
+    auto const n_bytes = std::size(values) * sizeof(uint32_t);
+    for (size_t pos = 0; pos < n_bytes; pos += page_len) {
+        bfy_buffer_add_readonly(&buf, bytes + pos, std::min(page_len, n_bytes - pos));
+    }
+    return buf;
+}
+
+}  // anonymous namespace
+
+BFY_BENCHMARK(remove_ntoh_u32) {
+    // decode a stream of fixed-width fields
+    auto const values = make_values();
+
+    auto buf = make_buffer(values);
+    auto sum = uint32_t {};
+    auto seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_values; ++i) {
+            auto val = uint32_t {};
+            bfy_buffer_remove(&buf, sizeof(val), &val);
+            sum += ntoh32(val);
+        }
+    });
+    bench::report("bfy_buffer_remove + ntoh32", seconds, n_values, n_values * sizeof(uint32_t));
+    bfy_buffer_destruct(&buf);
+
+    buf = make_buffer(values);
+    seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_values; ++i) {
+            sum += bfy_buffer_remove_ntoh_u32(&buf);
+        }
+    });
+    bench::report("bfy_buffer_remove_ntoh_u32", seconds, n_values, n_values * sizeof(uint32_t));
+    bfy_buffer_destruct(&buf);
+
+    bench::do_not_optimize(&sum);
+}
+
+BFY_BENCHMARK(peek_ntoh_u32_at) {
+    // read a length prefix before deciding whether a message has arrived
+    auto const values = make_values();
+    auto buf = make_buffer(values);
+    auto constexpr n_peeks = size_t { 1 << 24 };
+
+    auto sum = uint32_t {};
+    auto seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_peeks; ++i) {
+            auto val = uint32_t {};
+            bfy_buffer_copyout_range(&buf, i & 1023, (i & 1023) + sizeof(val), &val);
+            sum += ntoh32(val);
+        }
+    });
+    bench::report("bfy_buffer_copyout_range + ntoh32", seconds, n_peeks, 0);
+
+    seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_peeks; ++i) {
+            auto val = uint32_t {};
+            bfy_buffer_peek_ntoh_u32_at(&buf, i & 1023, &val);
+            sum += val;
+        }
+    });
+    bench::report("bfy_buffer_peek_ntoh_u32_at", seconds, n_peeks, 0);
+
+    bfy_buffer_destruct(&buf);
+    bench::do_not_optimize(&sum);
+}
+
+BFY_BENCHMARK(hton_u32_array) {
+    // serialize a block of samples
+    auto samples = make_values();
+    auto constexpr n_bytes = n_values * sizeof(uint32_t);
+    auto constexpr n_reps = 16;
+
+    auto sum = uint32_t {};
+    auto buf = bfy_buffer_init();
+    auto seconds = bench::time([&]() {
+        for (int rep = 0; rep < n_reps; ++rep) {
+            for (size_t i = 0; i < n_values; ++i) {
+                bfy_buffer_add_hton_u32(&buf, samples[i]);
+            }
+            bfy_buffer_drain_all(&buf);
+        }
+    });
+    bench::report("bfy_buffer_add_hton_u32 loop", seconds, n_reps * n_values, n_reps * n_bytes);
+
+    seconds = bench::time([&]() {
+        for (int rep = 0; rep < n_reps; ++rep) {
+            bfy_buffer_add_hton_u32_array(&buf, std::data(samples), n_values);
+            bfy_buffer_drain_all(&buf);
+        }
+    });
+    bench::report("bfy_buffer_add_hton_u32_array", seconds, n_reps * n_values, n_reps * n_bytes);
+
+    auto out = std::vector<uint32_t>(n_values);
+    seconds = bench::time([&]() {
+        for (int rep = 0; rep < n_reps; ++rep) {
+            bfy_buffer_add_readonly(&buf, std::data(samples), n_bytes);
+            for (size_t i = 0; i < n_values; ++i) {
+                out[i] = bfy_buffer_remove_ntoh_u32(&buf);
+            }
+            sum += out[rep];
+        }
+    });
+    bench::report("bfy_buffer_remove_ntoh_u32 loop", seconds, n_reps * n_values, n_reps * n_bytes);
+
+    seconds = bench::time([&]() {
+        for (int rep = 0; rep < n_reps; ++rep) {
+            bfy_buffer_add_readonly(&buf, std::data(samples), n_bytes);
+            bfy_buffer_remove_ntoh_u32_array(&buf, std::data(out), n_values);
+            sum += out[rep];
+        }
+    });
+    bench::report("bfy_buffer_remove_ntoh_u32_array", seconds, n_reps * n_values, n_reps * n_bytes);
+
+    bfy_buffer_destruct(&buf);
+    bench::do_not_optimize(&sum);
+}
+
+BFY_BENCHMARK(remove_varint_u64) {
+    // decode Protobuf-style varints of mixed lengths
+    auto encoded = bfy_buffer_init();
+    for (size_t i = 0; i < n_values; ++i) {
+        bfy_buffer_add_varint_u64(&encoded, uint64_t(i * 2654435761u) >> (i % 32));
+    }
+    auto const n_bytes = bfy_buffer_get_content_len(&encoded);
+    auto bytes = std::vector<char>(n_bytes);
+    bfy_buffer_remove(&encoded, n_bytes, std::data(bytes));
+    bfy_buffer_destruct(&encoded);
+
+    auto const make_varint_buffer = [&bytes]() {
+        auto buf = bfy_buffer_init();
+        for (size_t pos = 0; pos < std::size(bytes); pos += page_len) {
+            bfy_buffer_add_readonly(&buf, std::data(bytes) + pos, std::min(page_len, std::size(bytes) - pos));
+        }
+        return buf;
+    };
+
+    auto buf = make_varint_buffer();
+    auto sum = uint64_t {};
+    auto seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_values; ++i) {
+            auto val = uint64_t {};
+            for (int shift = 0; ; shift += 7) {
+                auto const byte = bfy_buffer_remove_ntoh_u8(&buf);
+                val |= uint64_t(byte & 0x7F) << shift;
+                if (byte < 0x80) {
+                    break;
+                }
+            }
+            sum += val;
+        }
+    });
+    bench::report("bfy_buffer_remove_ntoh_u8 loop", seconds, n_values, n_bytes);
+    bfy_buffer_destruct(&buf);
+
+    buf = make_varint_buffer();
+    seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_values; ++i) {
+            auto val = uint64_t {};
+            bfy_buffer_remove_varint_u64(&buf, &val);
+            sum += val;
+        }
+    });
+    bench::report("bfy_buffer_remove_varint_u64", seconds, n_values, n_bytes);
+    bfy_buffer_destruct(&buf);
+
+    bench::do_not_optimize(&sum);
+}
+
+BFY_BENCHMARK(writer_small_fields) {
+    // compose messages of 48 small fields each
+    auto constexpr n_messages = size_t { 1 << 16 };
+    auto constexpr n_fields = 48;
+    auto constexpr msg_len = (n_fields / 3) * (sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t));
+    auto n_changes = size_t {};
+    auto const changed_cb = [](auto* /*buf*/, auto const* /*info*/, void* data) {
+        ++*reinterpret_cast<size_t*>(data);
+    };
+
+    auto buf = bfy_buffer_init();
+    bfy_buffer_set_changed_cb(&buf, changed_cb, &n_changes);
+    auto seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_messages; ++i) {
+            for (int field = 0; field < n_fields; field += 3) {
+                bfy_buffer_add_ch(&buf, 'x');
+                bfy_buffer_add_hton_u16(&buf, uint16_t(field));
+                bfy_buffer_add_hton_u32(&buf, uint32_t(i));
+            }
+            bfy_buffer_drain_all(&buf);
+        }
+    });
+    bench::report("bfy_buffer_add_* per field", seconds, n_messages, n_messages * msg_len);
+
+    seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_messages; ++i) {
+            auto w = bfy_writer_init(&buf);
+            for (int field = 0; field < n_fields; field += 3) {
+                bfy_writer_add_ch(&w, 'x');
+                bfy_writer_add_hton_u16(&w, uint16_t(field));
+                bfy_writer_add_hton_u32(&w, uint32_t(i));
+            }
+            bfy_writer_destruct(&w);
+            bfy_buffer_drain_all(&buf);
+        }
+    });
+    bench::report("bfy_writer_add_*, one commit", seconds, n_messages, n_messages * msg_len);
+
+    bfy_buffer_destruct(&buf);
+    bench::do_not_optimize(&n_changes);
+}
+
+BFY_BENCHMARK(reader_small_fields) {
+    // parse messages of 48 small fields each
+    auto constexpr n_messages = size_t { 1 << 16 };
+    auto constexpr n_fields = 48;
+    auto constexpr msg_len = (n_fields / 3) * (sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t));
+    auto bytes = std::vector<char>(n_messages * msg_len);
+    for (size_t pos = 0; pos < std::size(bytes); ++pos) {
+        bytes[pos] = char(pos * 2654435761u >> 24);
+    }
+    auto const make_message_buffer = [&bytes]() {
+        auto buf = bfy_buffer_init();
+        for (size_t pos = 0; pos < std::size(bytes); pos += page_len) {
+            bfy_buffer_add_readonly(&buf, std::data(bytes) + pos, std::min(page_len, std::size(bytes) - pos));
+        }
+        return buf;
+    };
+
+    auto buf = make_message_buffer();
+    auto sum = uint32_t {};
+    auto seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_messages; ++i) {
+            for (int field = 0; field < n_fields; field += 3) {
+                sum += bfy_buffer_remove_ntoh_u8(&buf);
+                sum += bfy_buffer_remove_ntoh_u16(&buf);
+                sum += bfy_buffer_remove_ntoh_u32(&buf);
+            }
+        }
+    });
+    bench::report("bfy_buffer_remove_ntoh_* per field", seconds, n_messages, n_messages * msg_len);
+    bfy_buffer_destruct(&buf);
+
+    buf = make_message_buffer();
+    seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_messages; ++i) {
+            auto r = bfy_reader_init(&buf);
+            for (int field = 0; field < n_fields; field += 3) {
+                auto u8 = uint8_t {};
+                auto u16 = uint16_t {};
+                auto u32 = uint32_t {};
+                bfy_reader_read_u8(&r, &u8);
+                bfy_reader_read_ntoh_u16(&r, &u16);
+                bfy_reader_read_ntoh_u32(&r, &u32);
+                sum += u8 + u16 + u32;
+            }
+            bfy_reader_destruct(&r);
+        }
+    });
+    bench::report("bfy_reader_read_*, one drain", seconds, n_messages, n_messages * msg_len);
+    bfy_buffer_destruct(&buf);
+
+    bench::do_not_optimize(&sum);
+}
+
+BFY_BENCHMARK(pack_header) {
+    // a fixed-layout "!HIQ8s" header, as in many wire protocols
+    auto constexpr n_messages = size_t { 1 << 18 };
+    auto constexpr msg_len = sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint64_t) + 8;
+    auto constexpr tag = std::array<char, 8> { 'b', 'u', 'f', 'f', 'y', 'h', 'd', 'r' };
+    auto* const fmt = bfy_format_new("!HIQ8s");
+
+    auto buf = bfy_buffer_init();
+    auto seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_messages; ++i) {
+            bfy_buffer_add_hton_u16(&buf, uint16_t(i));
+            bfy_buffer_add_hton_u32(&buf, uint32_t(i));
+            bfy_buffer_add_hton_u64(&buf, uint64_t(i));
+            bfy_buffer_add(&buf, std::data(tag), std::size(tag));
+        }
+    });
+    bench::report("bfy_buffer_add_hton_* per field", seconds, n_messages, n_messages * msg_len);
+    bfy_buffer_drain_all(&buf);
+
+    seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_messages; ++i) {
+            bfy_buffer_pack(&buf, "!HIQ8s", uint16_t(i), uint32_t(i), uint64_t(i), std::data(tag));
+        }
+    });
+    bench::report("bfy_buffer_pack", seconds, n_messages, n_messages * msg_len);
+    bfy_buffer_drain_all(&buf);
+
+    seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_messages; ++i) {
+            bfy_buffer_pack_format(&buf, fmt, uint16_t(i), uint32_t(i), uint64_t(i), std::data(tag));
+        }
+    });
+    bench::report("bfy_buffer_pack_format", seconds, n_messages, n_messages * msg_len);
+
+    auto packed = std::vector<char>(bfy_buffer_get_content_len(&buf));
+    bfy_buffer_copyout(&buf, std::size(packed), std::data(packed));
+    auto setme = std::array<char, 8> {};
+    auto sum = uint64_t {};
+    auto refill = [&]() {
+        bfy_buffer_drain_all(&buf);
+        bfy_buffer_add_readonly(&buf, std::data(packed), std::size(packed));
+    };
+
+    refill();
+    seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_messages; ++i) {
+            sum += bfy_buffer_remove_ntoh_u16(&buf);
+            sum += bfy_buffer_remove_ntoh_u32(&buf);
+            sum += bfy_buffer_remove_ntoh_u64(&buf);
+            bfy_buffer_remove(&buf, std::size(setme), std::data(setme));
+        }
+    });
+    bench::report("bfy_buffer_remove_ntoh_* per field", seconds, n_messages, n_messages * msg_len);
+
+    refill();
+    seconds = bench::time([&]() {
+        for (size_t i = 0; i < n_messages; ++i) {
+            auto H = uint16_t {};
+            auto I = uint32_t {};
+            auto Q = uint64_t {};
+            bfy_buffer_unpack_format(&buf, fmt, &H, &I, &Q, std::data(setme));
+            sum += H + I + Q;
+        }
+    });
+    bench::report("bfy_buffer_unpack_format", seconds, n_messages, n_messages * msg_len);
+
+    bfy_buffer_destruct(&buf);
+    bfy_format_free(fmt);
+    bench::do_not_optimize(&sum);
+    bench::do_not_optimize(std::data(setme));
+}
+
+BFY_BENCHMARK(number_text) {
+    // a spread of magnitudes, as in text protocols' ids and counters
+    auto constexpr n = size_t { 1 << 18 };
+    auto ints = std::vector<uint64_t>(n);
+    auto doubles = std::vector<double>(n);
+    auto rng = std::mt19937_64 { 2020 };
+    for (size_t i = 0; i < n; ++i) {
+        ints[i] = rng() >> (rng() % 64);
+        doubles[i] = double(rng() % 1000000) / 1000.0;
+    }
+
+    auto buf = bfy_buffer_init();
+    auto run = [&](char const* label, auto&& add) {
+        auto const seconds = bench::time([&]() {
+            for (size_t i = 0; i < n; ++i) {
+                add(i);
+            }
+        });
+        bench::report(label, seconds, n, bfy_buffer_get_content_len(&buf));
+        bfy_buffer_drain_all(&buf);
+    };
+
+    run("bfy_buffer_add_printf(\"%\" PRIu64)", [&](size_t i) {
+        bfy_buffer_add_printf(&buf, "%" PRIu64, ints[i]);
+    });
+    run("bfy_buffer_add_u64_dec", [&](size_t i) {
+        bfy_buffer_add_u64_dec(&buf, ints[i]);
+    });
+    run("bfy_buffer_add_printf(\"%\" PRIx64)", [&](size_t i) {
+        bfy_buffer_add_printf(&buf, "%" PRIx64, ints[i]);
+    });
+    run("bfy_buffer_add_u64_hex", [&](size_t i) {
+        bfy_buffer_add_u64_hex(&buf, ints[i]);
+    });
+    run("bfy_buffer_add_printf(\"%.17g\")", [&](size_t i) {
+        bfy_buffer_add_printf(&buf, "%.17g", doubles[i]);
+    });
+    run("bfy_buffer_add_double", [&](size_t i) {
+        bfy_buffer_add_double(&buf, doubles[i]);
+    });
+
+    bfy_buffer_destruct(&buf);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2020 Mnemosyne LLC
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "buffy/buffer.h"
+
+#include "bench.h"
+
+namespace {
+
+auto constexpr content_len = size_t { 128 * 1024 * 1024 };
+auto constexpr page_len = size_t { 1024 * 1024 };
+auto constexpr n_reps = 5;
+
+void run_tasks_on_threads(bfy_task_cb* task, void* task_data, size_t n_tasks, void* /*user_data*/) {
+    auto threads = std::vector<std::thread>{};
+    for (size_t i = 1; i < n_tasks; ++i) {
+        threads.emplace_back(task, task_data, i);
+    }
+    task(task_data, 0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+}  // anonymous namespace
+
+BFY_BENCHMARK(copyout_parallel) {
+    auto content = std::vector<char>(content_len, 'x');
+    auto buf = bfy_buffer_init();
+    for (size_t pos = 0; pos < content_len; pos += page_len) {
+        bfy_buffer_add_readonly(&buf, std::data(content) + pos, page_len);
+    }
+    auto out = std::vector<char>(content_len);
+
+    auto seconds = bench::time([&]() {
+        for (int i = 0; i < n_reps; ++i) {
+            bfy_buffer_copyout(&buf, content_len, std::data(out));
+        }
+    });
+    bench::report("copyout", seconds, n_reps, content_len * n_reps);
+
+    auto const n_cores = std::max(2u, std::thread::hardware_concurrency());
+    for (size_t n_threads = 1; n_threads <= n_cores; n_threads *= 2) {
+        seconds = bench::time([&]() {
+            for (int i = 0; i < n_reps; ++i) {
+                bfy_buffer_copyout_range_parallel(&buf, 0, content_len, std::data(out),
+                                                  n_threads, run_tasks_on_threads, nullptr);
+            }
+        });
+        auto const label = std::string { "copyout_range_parallel, " } + std::to_string(n_threads) + " threads";
+        bench::report(label.c_str(), seconds, n_reps, content_len * n_reps);
+    }
+
+    bench::do_not_optimize(std::data(out));
+    bfy_buffer_destruct(&buf);
+}
+
+BFY_BENCHMARK(search_parallel) {
+    // worst case: the needle is at the very end
+    auto constexpr needle = std::string_view { "marker" };
+    auto content = std::vector<char>(content_len, 'x');
+    std::copy(std::begin(needle), std::end(needle), std::end(content) - std::size(needle));
+    auto buf = bfy_buffer_init();
+    for (size_t pos = 0; pos < content_len; pos += page_len) {
+        bfy_buffer_add_readonly(&buf, std::data(content) + pos, page_len);
+    }
+
+    auto match = size_t {};
+    auto seconds = bench::time([&]() {
+        for (int i = 0; i < n_reps; ++i) {
+            bfy_buffer_search_all(&buf, std::data(needle), std::size(needle), &match);
+        }
+    });
+    bench::report("search_all", seconds, n_reps, content_len * n_reps);
+
+    auto const n_cores = std::max(2u, std::thread::hardware_concurrency());
+    for (size_t n_threads = 1; n_threads <= n_cores; n_threads *= 2) {
+        seconds = bench::time([&]() {
+            for (int i = 0; i < n_reps; ++i) {
+                bfy_buffer_search_range_parallel(&buf, 0, SIZE_MAX,
+                                                 std::data(needle), std::size(needle), &match,
+                                                 n_threads, run_tasks_on_threads, nullptr);
+            }
+        });
+        auto const label = std::string { "search_range_parallel, " } + std::to_string(n_threads) + " threads";
+        bench::report(label.c_str(), seconds, n_reps, content_len * n_reps);
+    }
+
+    bench::do_not_optimize(&match);
+    bfy_buffer_destruct(&buf);
+}
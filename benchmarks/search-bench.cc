@@ -0,0 +1,416 @@
+/*
+ * Copyright 2020 Mnemosyne LLC
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cstdint>  // SIZE_MAX
+#include <cstring>  // memchr(), memcmp()
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "buffy/buffer.h"
+
+#include "bench.h"
+
+namespace {
+
+auto constexpr content_len = size_t { 16 * 1024 * 1024 };
+auto constexpr n_reps = 5;
+
+// the memchr-then-memcmp loop that the page search used to run
+size_t naive_search(std::string_view haystack, std::string_view needle) {
+    char const* walk = std::data(haystack);
+    char const* const end = walk + std::size(haystack);
+    while ((walk = static_cast<char const*>(memchr(walk, needle.front(), end - walk)))) {
+        if (size_t(end - walk) >= std::size(needle) &&
+            memcmp(walk, std::data(needle), std::size(needle)) == 0) {
+            return walk - std::data(haystack);
+        }
+        ++walk;
+    }
+    return std::string_view::npos;
+}
+
+std::string repeat(std::string_view str, size_t len) {
+    auto ret = std::string {};
+    while (std::size(ret) < len) {
+        ret += str;
+    }
+    ret.resize(len);
+    return ret;
+}
+
+// searches for a needle that isn't in the content, so every byte gets looked at
+void search_unmatched(char const* name, std::string_view content, std::string_view needle) {
+    auto match = size_t {};
+    auto seconds = bench::time([&]() {
+        for (int i = 0; i < n_reps; ++i) {
+            match += naive_search(content, needle);
+        }
+    });
+    auto label = std::string { name } + ", memchr+memcmp, contiguous";
+    bench::report(label.c_str(), seconds, n_reps, std::size(content) * n_reps);
+
+    for (size_t const page_len : { std::size(content), size_t { 4096 }, size_t { 16 } }) {
+        auto buf = bfy_buffer_init();
+        for (size_t pos = 0; pos < std::size(content); pos += page_len) {
+            bfy_buffer_add_readonly(&buf, std::data(content) + pos, page_len);
+        }
+        seconds = bench::time([&]() {
+            for (int i = 0; i < n_reps; ++i) {
+                bfy_buffer_search_all(&buf, std::data(needle), std::size(needle), &match);
+            }
+        });
+        label = std::string { name } + ", bfy_buffer_search_all, " + std::to_string(page_len) + " byte pages";
+        bench::report(label.c_str(), seconds, n_reps, std::size(content) * n_reps);
+        bfy_buffer_destruct(&buf);
+    }
+
+    bench::do_not_optimize(&match);
+}
+
+}  // anonymous namespace
+
+BFY_BENCHMARK(search_common_first_byte) {
+    // e.g. looking for the end of http headers
+    // in a stream full of almost-blank lines
+    search_unmatched("\\r\\n\\r\\n", repeat("\r\n\r", content_len), "\r\n\r\n");
+}
+
+BFY_BENCHMARK(search_periodic_needle) {
+    // the classic worst case for a naive search
+    auto const needle = std::string(63, 'a') + 'b';
+    search_unmatched("a{63}b", std::string(content_len, 'a'), needle);
+}
+
+BFY_BENCHMARK(search_long_needle) {
+    // a long needle in text; lets the search skip ahead
+    auto constexpr text = std::string_view {
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+        "eiusmod tempor incididunt ut labore et dolore magna aliqua. " };
+    auto const needle = repeat("Ut enim ad minim veniam, quis nostrud exercitation", 256);
+    search_unmatched("256 byte needle", repeat(text, content_len), needle);
+}
+
+BFY_BENCHMARK(search_many_small_buffers) {
+    // e.g. a proxy looking for the end of every request's headers
+    auto constexpr request = std::string_view {
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:80.0) Gecko/20100101 Firefox/80.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n" };
+    auto constexpr needle = std::string_view { "\r\n\r\n" };
+    auto constexpr n_searches = 1000000;
+
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add_readonly(&buf, std::data(request), std::size(request));
+
+    auto match = size_t {};
+    auto seconds = bench::time([&]() {
+        for (int i = 0; i < n_searches; ++i) {
+            bfy_buffer_search_all(&buf, std::data(needle), std::size(needle), &match);
+        }
+    });
+    bench::report("bfy_buffer_search_all", seconds, n_searches, std::size(request) * n_searches);
+
+    auto* searcher = bfy_searcher_new(std::data(needle), std::size(needle));
+    seconds = bench::time([&]() {
+        for (int i = 0; i < n_searches; ++i) {
+            bfy_buffer_search_all_with(&buf, searcher, &match);
+        }
+    });
+    bench::report("bfy_buffer_search_all_with", seconds, n_searches, std::size(request) * n_searches);
+    bfy_searcher_free(searcher);
+
+    bench::do_not_optimize(&match);
+    bfy_buffer_destruct(&buf);
+}
+
+BFY_BENCHMARK(search_many_needles) {
+    auto constexpr needles = std::array<std::string_view, 24> {
+        "Accept:", "Accept-Charset:", "Accept-Encoding:", "Accept-Language:",
+        "Authorization:", "Cache-Control:", "Connection:", "Content-Length:",
+        "Content-Type:", "Cookie:", "Date:", "Expect:",
+        "Forwarded:", "From:", "Host:", "If-Match:",
+        "If-Modified-Since:", "If-None-Match:", "Origin:", "Pragma:",
+        "Range:", "Referer:", "Upgrade:", "User-Agent:" };
+    auto constexpr text = std::string_view {
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+        "eiusmod tempor incididunt ut labore et dolore magna aliqua. " };
+    auto const content = repeat(text, content_len);
+
+    auto buf = bfy_buffer_init();
+    for (size_t pos = 0; pos < content_len; pos += 4096) {
+        bfy_buffer_add_readonly(&buf, std::data(content) + pos, 4096);
+    }
+
+    auto match = size_t {};
+    auto seconds = bench::time([&]() {
+        for (auto const& needle : needles) {
+            bfy_buffer_search_all(&buf, std::data(needle), std::size(needle), &match);
+        }
+    });
+    bench::report("bfy_buffer_search_all, once per needle", seconds, 1, content_len);
+
+    auto ptrs = std::vector<void const*>{};
+    auto lens = std::vector<size_t>{};
+    for (auto const& needle : needles) {
+        ptrs.push_back(std::data(needle));
+        lens.push_back(std::size(needle));
+    }
+    auto* ms = bfy_multisearcher_new(std::data(ptrs), std::data(lens), std::size(needles));
+    auto which = size_t {};
+    seconds = bench::time([&]() {
+        bfy_buffer_search_all_any(&buf, ms, &match, &which);
+    });
+    bench::report("bfy_buffer_search_all_any", seconds, 1, content_len);
+    bfy_multisearcher_free(ms);
+
+    bench::do_not_optimize(&match);
+    bfy_buffer_destruct(&buf);
+}
+
+BFY_BENCHMARK(search_slow_drip) {
+    // a client sends 16 KiB of headers a few bytes at a time,
+    // and the server checks for the end of headers after every read
+    auto constexpr needle = std::string_view { "\r\n\r\n" };
+    auto constexpr header = std::string_view { "X-Padding: xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n" };
+    auto const request = repeat(header, 16 * 1024) + "\r\n";
+    auto constexpr read_len = size_t { 8 };
+    auto const n_reads = (std::size(request) + read_len - 1) / read_len;
+
+    auto match = size_t {};
+    auto seconds = bench::time([&]() {
+        auto buf = bfy_buffer_init();
+        for (size_t pos = 0; pos < std::size(request); pos += read_len) {
+            bfy_buffer_add(&buf, std::data(request) + pos, std::min(read_len, std::size(request) - pos));
+            bfy_buffer_search_all(&buf, std::data(needle), std::size(needle), &match);
+        }
+        bfy_buffer_destruct(&buf);
+    });
+    bench::report("bfy_buffer_search_all after each read", seconds, n_reads, std::size(request));
+
+    seconds = bench::time([&]() {
+        auto const searcher = bfy_searcher_init(std::data(needle), std::size(needle));
+        auto state = bfy_search_state_init();
+        auto buf = bfy_buffer_init();
+        for (size_t pos = 0; pos < std::size(request); pos += read_len) {
+            bfy_buffer_add(&buf, std::data(request) + pos, std::min(read_len, std::size(request) - pos));
+            bfy_buffer_search_resume(&buf, &state, &searcher, &match);
+        }
+        bfy_buffer_destruct(&buf);
+    });
+    bench::report("bfy_buffer_search_resume after each read", seconds, n_reads, std::size(request));
+
+    bench::do_not_optimize(&match);
+}
+
+BFY_BENCHMARK(find_any_whitespace) {
+    // a tokenizer skipping over long tokens to find the next whitespace
+    auto constexpr whitespace = std::string_view { " \t\r\n" };
+    auto const content = repeat("abcdefghijklmnopqrstuvwxyz0123456789", content_len - 1) + " ";
+
+    auto match = size_t {};
+    auto seconds = bench::time([&]() {
+        for (int i = 0; i < n_reps; ++i) {
+            match += std::string_view { content }.find_first_of(whitespace);
+        }
+    });
+    bench::report("std::string_view::find_first_of, contiguous", seconds, n_reps, std::size(content) * n_reps);
+
+    for (size_t const page_len : { size_t { 4096 }, size_t { 64 } }) {
+        auto buf = bfy_buffer_init();
+        for (size_t pos = 0; pos < std::size(content); pos += page_len) {
+            bfy_buffer_add_readonly(&buf, std::data(content) + pos, std::min(page_len, std::size(content) - pos));
+        }
+        seconds = bench::time([&]() {
+            for (int i = 0; i < n_reps; ++i) {
+                bfy_buffer_find_any(&buf, 0, SIZE_MAX, std::data(whitespace), std::size(whitespace), &match);
+            }
+        });
+        auto const label = "bfy_buffer_find_any, " + std::to_string(page_len) + " byte pages";
+        bench::report(label.c_str(), seconds, n_reps, std::size(content) * n_reps);
+        bfy_buffer_destruct(&buf);
+    }
+
+    bench::do_not_optimize(&match);
+}
+
+BFY_BENCHMARK(rsearch_trailer) {
+    // find the last newline, e.g. to split off a partial line at the end
+    auto constexpr needle = std::string_view { "\n" };
+    auto const content = repeat("2020-01-01T00:00:00 INFO something happened\n", content_len);
+
+    auto buf = bfy_buffer_init();
+    for (size_t pos = 0; pos < std::size(content); pos += 4096) {
+        bfy_buffer_add_readonly(&buf, std::data(content) + pos, std::min(size_t { 4096 }, std::size(content) - pos));
+    }
+
+    auto match = size_t {};
+    auto seconds = bench::time([&]() {
+        for (int i = 0; i < n_reps; ++i) {
+            size_t pos = 0;
+            while (bfy_buffer_search_range(&buf, pos, SIZE_MAX, std::data(needle), std::size(needle), &match) == 0) {
+                pos = match + 1;
+            }
+        }
+    });
+    bench::report("bfy_buffer_search_range, repeated", seconds, n_reps, std::size(content) * n_reps);
+
+    seconds = bench::time([&]() {
+        for (int i = 0; i < n_reps; ++i) {
+            bfy_buffer_rsearch_all(&buf, std::data(needle), std::size(needle), &match);
+        }
+    });
+    bench::report("bfy_buffer_rsearch_all", seconds, n_reps, std::size(content) * n_reps);
+
+    bfy_buffer_destruct(&buf);
+    bench::do_not_optimize(&match);
+}
+
+BFY_BENCHMARK(search_nocase_header) {
+    // look for a header name that isn't there, ignoring case
+    auto constexpr needle = std::string_view { "\r\ncontent-length:" };
+    auto constexpr header = std::string_view { "X-Padding: xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n" };
+    auto const content = repeat(header, content_len);
+
+    auto buf = bfy_buffer_init();
+    for (size_t pos = 0; pos < std::size(content); pos += 4096) {
+        bfy_buffer_add_readonly(&buf, std::data(content) + pos, std::min(size_t { 4096 }, std::size(content) - pos));
+    }
+
+    auto match = size_t {};
+    auto seconds = bench::time([&]() {
+        for (int i = 0; i < n_reps; ++i) {
+            auto lowered = std::string(bfy_buffer_get_content_len(&buf), '\0');
+            bfy_buffer_copyout(&buf, std::size(lowered), std::data(lowered));
+            for (auto& ch : lowered) {
+                ch = (ch >= 'A' && ch <= 'Z') ? char(ch + 'a' - 'A') : ch;
+            }
+            match += naive_search(lowered, needle);
+        }
+    });
+    bench::report("lowercased copy, memchr+memcmp", seconds, n_reps, std::size(content) * n_reps);
+
+    seconds = bench::time([&]() {
+        for (int i = 0; i < n_reps; ++i) {
+            bfy_buffer_search_all_nocase(&buf, std::data(needle), std::size(needle), &match);
+        }
+    });
+    bench::report("bfy_buffer_search_all_nocase", seconds, n_reps, std::size(content) * n_reps);
+
+    bfy_buffer_destruct(&buf);
+    bench::do_not_optimize(&match);
+}
+
+BFY_BENCHMARK(search_split_lines) {
+    // split a big buffer of log lines into records
+    auto constexpr needle = std::string_view { "\n" };
+    auto const content = repeat("2020-01-01T00:00:00 INFO something happened\n", content_len);
+
+    auto buf = bfy_buffer_init();
+    for (size_t pos = 0; pos < std::size(content); pos += 4096) {
+        bfy_buffer_add_readonly(&buf, std::data(content) + pos, std::min(size_t { 4096 }, std::size(content) - pos));
+    }
+
+    auto n_records = size_t {};
+    auto seconds = bench::time([&]() {
+        size_t pos = 0;
+        size_t match;
+        while (bfy_buffer_search_range(&buf, pos, SIZE_MAX, std::data(needle), std::size(needle), &match) == 0) {
+            ++n_records;
+            pos = match + 1;
+        }
+    });
+    bench::report("bfy_buffer_search_range loop", seconds, 1, std::size(content));
+
+    seconds = bench::time([&]() {
+        auto const searcher = bfy_searcher_init(std::data(needle), std::size(needle));
+        auto matches = std::array<size_t, 1024> {};
+        size_t pos = 0;
+        for (;;) {
+            auto const n = bfy_buffer_search_range_many(&buf, pos, SIZE_MAX, &searcher,
+                                                        std::data(matches), std::size(matches));
+            n_records += n;
+            if (n < std::size(matches)) {
+                break;
+            }
+            pos = matches[n - 1] + 1;
+        }
+    });
+    bench::report("bfy_buffer_search_range_many", seconds, 1, std::size(content));
+
+    bfy_buffer_destruct(&buf);
+    bench::do_not_optimize(&n_records);
+}
+
+BFY_BENCHMARK(search_regex_request_line) {
+    // e.g. a router matching each request line against a route
+    auto constexpr request = std::string_view {
+        "GET /api/v2/users/123456/profile HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Accept: application/json\r\n"
+        "\r\n" };
+    auto constexpr pattern = std::string_view { "^GET /api/v\\d+/users/\\d+(/\\w+)* HTTP/1\\.[01]\r\n" };
+    auto constexpr n_searches = 200000;
+
+    // the request arrived in two reads
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add_readonly(&buf, std::data(request), 20);
+    bfy_buffer_add_readonly(&buf, std::data(request) + 20, std::size(request) - 20);
+
+    auto match = size_t {};
+    auto const std_re = std::regex { std::string { pattern } };
+    auto seconds = bench::time([&]() {
+        for (int i = 0; i < n_searches; ++i) {
+            auto const len = bfy_buffer_get_content_len(&buf);
+            auto const* const str = static_cast<char const*>(bfy_buffer_make_contiguous(&buf, len));
+            auto results = std::cmatch {};
+            match += std::regex_search(str, str + len, results, std_re) ? results.length(0) : 0;
+            // split it again for the next pass
+            bfy_buffer_drain_all(&buf);
+            bfy_buffer_add_readonly(&buf, std::data(request), 20);
+            bfy_buffer_add_readonly(&buf, std::data(request) + 20, std::size(request) - 20);
+        }
+    });
+    bench::report("make_contiguous + std::regex_search", seconds, n_searches, std::size(request) * n_searches);
+
+    auto* re = bfy_regex_new(std::data(pattern), std::size(pattern));
+    seconds = bench::time([&]() {
+        for (int i = 0; i < n_searches; ++i) {
+            auto len = size_t {};
+            bfy_buffer_search_all_regex(&buf, re, &match, &len);
+            match += len;
+        }
+    });
+    bench::report("bfy_buffer_search_all_regex", seconds, n_searches, std::size(request) * n_searches);
+    bfy_regex_free(re);
+
+    bench::do_not_optimize(&match);
+    bfy_buffer_destruct(&buf);
+}
@@ -57,6 +57,8 @@ struct bfy_page {
     void* unref_arg;
 };
 
+struct bfy_deferred_queue;
+
 struct bfy_buffer {
     /* aggregate a page so that simple bufers won't need to
        allocate a pages array */
@@ -70,6 +72,10 @@ struct bfy_buffer {
     /* number of content bytes in the entire buffer across all pages */
     size_t content_len;
 
+    /* number of content bytes ever drained from the front of the buffer.
+       @see bfy_buffer_search_resume() */
+    size_t n_drained_front;
+
     /* buffer-changed callback */
     bfy_changed_cb* changed_cb;
 
@@ -89,6 +95,101 @@ struct bfy_buffer {
        a buffer's internals but not the content itself, e.g.
        bfy_buffer_make_contiguous() */
     int changed_muted;
+
+    /* The recursive lock held by public API calls, or NULL if this
+       buffer isn't shared between threads.
+       @see bfy_buffer_enable_locking() */
+    void* lock;
+
+    /* Nonzero if bfy allocated `lock` and must free it */
+    int lock_owned;
+
+    /* If not NULL, changed_cb is not invoked when the buffer changes.
+       Instead the buffer is queued here until bfy_run_deferred_callbacks().
+       @see bfy_buffer_defer_callbacks() */
+    struct bfy_deferred_queue* deferred;
+
+    /* Nonzero if this buffer is waiting in `deferred` */
+    int deferred_pending;
+
+    /* The next buffer waiting in `deferred` */
+    struct bfy_buffer* deferred_next;
+};
+
+struct bfy_deferred_queue {
+    /* buffers with pending change callbacks, oldest first */
+    struct bfy_buffer* head;
+    struct bfy_buffer* tail;
+
+    /* the rest of the batch that bfy_run_deferred_callbacks() is running */
+    struct bfy_buffer* running;
+
+    /* called when the queue goes from empty to not-empty */
+    bfy_deferred_wakeup_cb* wakeup_cb;
+    void* wakeup_data;
+};
+
+struct bfy_searcher {
+    unsigned char const* str;
+    size_t len;
+
+    /* Two-Way critical factorization */
+    size_t ms;    /* needle[0..ms] is the left half */
+    size_t p;     /* how far to shift after a left-half mismatch */
+    size_t mem0;  /* for periodic needles, bytes known to match after a shift */
+
+    /* nonzero if ASCII letters match regardless of case */
+    int nocase;
+
+    /* Horspool-style bad-character shift on the needle's last byte.
+       shift[c] is only valid when c is in byteset. */
+    size_t byteset[256 / (8 * sizeof(size_t))];
+    size_t shift[256];
+
+    /* the SIMD kernel that finds candidate matches, chosen for this CPU */
+    size_t (*kernel)(unsigned char const* h, size_t n_pos,
+                     unsigned char first, unsigned char last,
+                     size_t last_offset);
+};
+
+struct bfy_search_state {
+    /* where the next match could start, counting from the first byte
+       ever added to the buffer, including bytes since drained */
+    size_t next_match_pos;
+};
+
+struct bfy_writer {
+    struct bfy_buffer* buf;
+
+    /* Free space reserved at the end of `buf`. [begin..pos) has been
+       written but not yet committed, and [pos..end) is still free. */
+    unsigned char* begin;
+    unsigned char* pos;
+    unsigned char* end;
+};
+
+struct bfy_reader {
+    struct bfy_buffer* buf;
+
+    /* The unread part of the current page */
+    unsigned char const* pos;
+    unsigned char const* end;
+
+    /* The current page, where its content begins,
+       and how much content the pages before it hold */
+    size_t page_idx;
+    unsigned char const* page_begin;
+    size_t n_before;
+};
+
+struct bfy_pagequeue_node;
+
+struct bfy_pagequeue {
+    /* Pages waiting to be moved into the consumer's buffer.
+       This is a lock-free LIFO stack: producers push onto it with
+       compare-and-swap, and the consumer takes the whole stack at
+       once with an atomic exchange. */
+    struct bfy_pagequeue_node* head;
 };
 
 void bfy_buffer_mute_change_events(struct bfy_buffer* buf);
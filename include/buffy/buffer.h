@@ -27,6 +27,7 @@
 #include <stdarg.h>  /* va_list */
 #include <stddef.h>  /* size_t */
 #include <stdint.h>  /* uint8_t, uint16_t, uint32_t, uint64_t */
+#include <string.h>  /* memcpy() */
 
 #ifdef __cplusplus
 extern "C" {
@@ -51,6 +52,24 @@ typedef void (bfy_changed_cb)(struct bfy_buffer*,
 
 typedef void (bfy_unref_cb)(void* data, size_t len, void* user_data);
 
+struct bfy_deferred_queue;
+
+typedef void (bfy_deferred_wakeup_cb)(struct bfy_deferred_queue*,
+                                      void* user_data);
+
+/* One unit of work in a parallel operation. */
+typedef void (bfy_task_cb)(void* task_data, size_t task_idx);
+
+/**
+ * Runs a batch of tasks, e.g. on a thread pool.
+ *
+ * Implementations must call `task(task_data, i)` exactly once for each
+ * `i` in [0..n_tasks), in any order and on any threads, and must not
+ * return until all of the tasks have finished.
+ */
+typedef void (bfy_run_tasks_cb)(bfy_task_cb* task, void* task_data,
+                                size_t n_tasks, void* user_data);
+
 #include <buffy/buffer-impl.h>
 
 struct bfy_iovec {
@@ -60,6 +79,24 @@ struct bfy_iovec {
 
 typedef struct bfy_buffer bfy_buffer;
 
+typedef struct bfy_pagequeue bfy_pagequeue;
+
+typedef struct bfy_deferred_queue bfy_deferred_queue;
+
+typedef struct bfy_searcher bfy_searcher;
+
+typedef struct bfy_multisearcher bfy_multisearcher;
+
+typedef struct bfy_regex bfy_regex;
+
+typedef struct bfy_search_state bfy_search_state;
+
+typedef struct bfy_writer bfy_writer;
+
+typedef struct bfy_reader bfy_reader;
+
+typedef struct bfy_format bfy_format;
+
 /* LIFE CYCLE */
 
 /**
@@ -198,6 +235,57 @@ int bfy_buffer_add_printf(bfy_buffer* buf, char const* fmt, ...);
  */
 int bfy_buffer_add_vprintf(bfy_buffer* buf, char const* fmt, va_list args);
 
+/**
+ * Add a number's decimal text to a buffer.
+ *
+ * This is equivalent to `bfy_buffer_add_printf(buf, "%" PRIu64, addme)`,
+ * but formats the number straight into the buffer's free space
+ * without going through printf.
+ *
+ * @see bfy_buffer_add_i64_dec()
+ * @param buf the buffer to which the text will be added
+ * @param addme the number to add
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_u64_dec(bfy_buffer* buf, uint64_t addme);
+
+/**
+ * Add a number's decimal text to a buffer, with a '-' if negative.
+ *
+ * @see bfy_buffer_add_u64_dec()
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_i64_dec(bfy_buffer* buf, int64_t addme);
+
+/**
+ * Add a number's lowercase hexadecimal text to a buffer.
+ *
+ * This is equivalent to `bfy_buffer_add_printf(buf, "%" PRIx64, addme)`:
+ * there's no "0x" prefix and no zero padding.
+ *
+ * @see bfy_buffer_add_u64_dec()
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_u64_hex(bfy_buffer* buf, uint64_t addme);
+
+/**
+ * Add a double's round-trip text to a buffer.
+ *
+ * The text parses back to the same double with strtod(), almost
+ * always with as few digits as possible. It's written in the style of
+ * JavaScript's Number.prototype.toString(): "100", "0.1", "1.5e-7",
+ * and "1e+21". Zero, infinity and NaN are "0", "-0", "inf", "-inf",
+ * and "nan".
+ *
+ * The digits come from Grisu2, which gives the shortest form for all
+ * but a tiny fraction of doubles; those get one extra digit.
+ *
+ * @param buf the buffer to which the text will be added
+ * @param addme the number to add
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_double(bfy_buffer* buf, double addme);
+
 /**
  * Move content from one buffer to another.
  *
@@ -265,6 +353,126 @@ int bfy_buffer_add_hton_u32(bfy_buffer* buf, uint32_t addme);
  */
 int bfy_buffer_add_hton_u64(bfy_buffer* buf, uint64_t addme);
 
+/**
+ * Adds a little-endian number to the buffer.
+ *
+ * Many wire formats, e.g. Protobuf's fixed32 and fixed64, are
+ * little-endian. On little-endian hosts this is a plain store.
+ *
+ * @see bfy_buffer_remove_le_u16()
+ * @param buf the buffer to which the content will be added
+ * @param value host-endian number to be converted and added
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_le_u16(bfy_buffer* buf, uint16_t addme);
+
+/**
+ * Adds a little-endian number to the buffer.
+ *
+ * @see bfy_buffer_remove_le_u32()
+ * @param buf the buffer to which the content will be added
+ * @param value host-endian number to be converted and added
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_le_u32(bfy_buffer* buf, uint32_t addme);
+
+/**
+ * Adds a little-endian number to the buffer.
+ *
+ * @see bfy_buffer_remove_le_u64()
+ * @param buf the buffer to which the content will be added
+ * @param value host-endian number to be converted and added
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_le_u64(bfy_buffer* buf, uint64_t addme);
+
+/**
+ * Adds a little-endian number to the buffer.
+ *
+ * The float's IEEE 754 bits are added as a little-endian uint32_t.
+ *
+ * @see bfy_buffer_remove_le_float()
+ * @param buf the buffer to which the content will be added
+ * @param value host-endian number to be converted and added
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_le_float(bfy_buffer* buf, float addme);
+
+/**
+ * Adds a little-endian number to the buffer.
+ *
+ * The double's IEEE 754 bits are added as a little-endian uint64_t.
+ *
+ * @see bfy_buffer_remove_le_double()
+ * @param buf the buffer to which the content will be added
+ * @param value host-endian number to be converted and added
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_le_double(bfy_buffer* buf, double addme);
+
+/**
+ * Adds an array of numbers to the buffer in network-endian order.
+ *
+ * The numbers are byte-swapped straight into the buffer's free space,
+ * using SIMD shuffles where the CPU has them. This is much cheaper than
+ * calling bfy_buffer_add_hton_u32() once per element.
+ *
+ * @see bfy_buffer_remove_ntoh_u16_array()
+ * @param buf the buffer to which the content will be added
+ * @param addme the host-endian numbers to be converted and added
+ * @param n how many numbers are in `addme`
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_hton_u16_array(bfy_buffer* buf, uint16_t const* addme, size_t n);
+
+/**
+ * Adds an array of numbers to the buffer in network-endian order.
+ *
+ * @see bfy_buffer_remove_ntoh_u32_array()
+ * @param buf the buffer to which the content will be added
+ * @param addme the host-endian numbers to be converted and added
+ * @param n how many numbers are in `addme`
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_hton_u32_array(bfy_buffer* buf, uint32_t const* addme, size_t n);
+
+/**
+ * Adds an array of numbers to the buffer in network-endian order.
+ *
+ * @see bfy_buffer_remove_ntoh_u64_array()
+ * @param buf the buffer to which the content will be added
+ * @param addme the host-endian numbers to be converted and added
+ * @param n how many numbers are in `addme`
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_hton_u64_array(bfy_buffer* buf, uint64_t const* addme, size_t n);
+
+/**
+ * Adds a number to the buffer as an LEB128 varint.
+ *
+ * This is the variable-length encoding used by Protobuf:
+ * seven bits per byte, so small numbers take fewer bytes.
+ *
+ * @see bfy_buffer_remove_varint_u64()
+ * @param buf the buffer to which the content will be added
+ * @param addme the number to be encoded and added
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_varint_u64(bfy_buffer* buf, uint64_t addme);
+
+/**
+ * Adds a signed number to the buffer as a zigzag LEB128 varint.
+ *
+ * Zigzag encoding, as in Protobuf's sint64, maps small negative
+ * numbers to small unsigned ones so that they stay short too.
+ *
+ * @see bfy_buffer_remove_varint_s64()
+ * @param buf the buffer to which the content will be added
+ * @param addme the number to be encoded and added
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_add_varint_s64(bfy_buffer* buf, int64_t addme);
+
 /**
  * Adds a page break to the buffer's internal bookkeeping.
  *
@@ -385,9 +593,41 @@ size_t bfy_buffer_copyout_range(bfy_buffer const* buf,
 size_t bfy_buffer_copyout(bfy_buffer const* buf, size_t len,
                           void* setme);
 
+/**
+ * Copy contents [begin..end) from the buffer using several threads.
+ *
+ * The range is split into `n_tasks` parts of nearly equal byte count.
+ * Since each part's destination offset is known before copying begins,
+ * the parts are copied independently by tasks handed to `run_tasks`.
+ * This is only worthwhile for very large copies, where a single core
+ * can't saturate memory bandwidth.
+ *
+ * bfy does not create threads itself. If `run_tasks` is NULL or
+ * `n_tasks` is less than 2, this is equivalent to
+ * `bfy_buffer_copyout_range()`.
+ *
+ * @see bfy_buffer_copyout_range()
+ * @param buf the buffer whose contents will be copied
+ * @param begin offset into the buffer's contents to begin copying from
+ * @param end offset into the buffer's contents to not copy
+ * @param setme address where the content will be copied to
+ * @param n_tasks how many parts to split the work into
+ * @param run_tasks runs the tasks and waits for them to finish
+ * @param run_tasks_data user data passed to `run_tasks`
+ * @return the number of bytes copied
+ */
+size_t bfy_buffer_copyout_range_parallel(bfy_buffer const* buf,
+                                         size_t begin, size_t end,
+                                         void* setme, size_t n_tasks,
+                                         bfy_run_tasks_cb* run_tasks,
+                                         void* run_tasks_data);
+
 /**
  * Search buffer contents [begin..end) for a substring.
  *
+ * The search takes linear time however the needle repeats itself and
+ * however the content is split into pages.
+ *
  * @param buf the buffer to search
  * @param begin offset inside `buf` where the search should begin
  * @param end offset inside `buf` where the search should stop
@@ -422,171 +662,1063 @@ int bfy_buffer_search(bfy_buffer const* buf,
                       void const* needle, size_t needle_len,
                       size_t* match);
 
-
-/* CONSUMING CONTENT */
-
 /**
- * Copy and remove contents [begin..end) from a buffer.
+ * Search buffer contents [begin..end) for a substring, ignoring ASCII case.
  *
- * @param buf the buffer to remove content from
- * @param begin offset into the buffer's contents to begin removing
- * @param end offset into the buffer's contents to not remove
- * @param setme where to copy the content to
- * @return the number of bytes removed
+ * ASCII letters in `needle` match content in either case, e.g. so that
+ * "content-length:" finds "Content-Length:". Other bytes must match
+ * exactly.
+ *
+ * @see bfy_searcher_new_nocase()
+ * @param buf the buffer to search
+ * @param begin offset inside `buf` where the search should begin
+ * @param end offset inside `buf` where the search should stop
+ * @param needle the string to search for
+ * @param needle_len len the length of `needle`
+ * @param match pointer to size_t offset that, if non-NULL and a match
+ *   is found, will be set to the offset in `buf` of the match.
+ * @return 0 if a match was found, -1 on failure.
  */
-size_t bfy_buffer_remove_range(bfy_buffer* buf,
-                               size_t begin, size_t end,
-                               void* setme);
+int bfy_buffer_search_range_nocase(bfy_buffer const* buf,
+                                   size_t begin, size_t end,
+                                   void const* needle, size_t needle_len,
+                                   size_t* match);
 
 /**
- * Copy and remove the first `len` bytes of content from `buf`.
+ * Search buffer contents for a substring, ignoring ASCII case.
  *
- * Equivalent to `bfy_buffer_remove_range(buf, 0, len, setme)`
+ * Equivalent to
+ * `bfy_buffer_search_range_nocase(buf, 0, SIZE_MAX, needle, needle_len, match)`
  */
-size_t bfy_buffer_remove(bfy_buffer* buf, size_t len, void* setme);
+int bfy_buffer_search_all_nocase(bfy_buffer const* buf,
+                                 void const* needle, size_t needle_len,
+                                 size_t* match);
 
 /**
- * Move data from one buffer to another.
+ * Search buffer contents [begin..end) for the last match of a substring.
  *
- * When possible this operation will move pages from one buffer
- * to the other, avoiding unnecessary memory allocation and copying.
+ * Pages are searched back to front, so finding a trailer near the end
+ * of a large buffer doesn't need to look at the content before it.
+ * An empty needle matches at `end`.
  *
- * @see bfy_buffer_add_buffer()
- * @param buf the buffer to remove content from
- * @param len how many bytes of content to move from `buf` to `setme`
- * @param setme the buffer to receive the content
- * @return the number of bytes moved
+ * @see bfy_buffer_search_range()
+ * @param buf the buffer to search
+ * @param begin offset inside `buf` where the search should stop
+ * @param end offset inside `buf` where the search should begin
+ * @param needle the string to search for
+ * @param needle_len len the length of `needle`
+ * @param match pointer to size_t offset that, if non-NULL and a match
+ *   is found, will be set to the offset in `buf` of the match's start.
+ * @return 0 if a match was found, -1 on failure.
  */
-size_t bfy_buffer_remove_buffer(bfy_buffer* buf, size_t len, bfy_buffer* setme);
+int bfy_buffer_rsearch_range(bfy_buffer const* buf,
+                             size_t begin, size_t end,
+                             void const* needle, size_t needle_len,
+                             size_t* match);
 
 /**
- * Removes a network-endian number from the buffer.
- *
- * Convenience utility to convert a number from network-endian
- * into host-endian after removing it from the buffer.
- * This uint8_t function is provided for consistency with the other
- * endian functions, although endian order is moot on a uint8_t.
+ * Search buffer contents for the last match of a substring.
  *
- * Sets errno on failure.
- *
- * @see bfy_buffer_add_hton_u8()
- * @param buf the buffer from which the content will be removed
- * @return the uint8_t value
+ * Equivalent to
+ * `bfy_buffer_rsearch_range(buf, 0, SIZE_MAX, needle, needle_len, match)`
  */
-uint8_t bfy_buffer_remove_ntoh_u8(bfy_buffer* buf);
+int bfy_buffer_rsearch_all(bfy_buffer const* buf,
+                           void const* needle, size_t needle_len,
+                           size_t* match);
 
 /**
- * Removes a network-endian number from the buffer.
- *
- * Convenience utility to convert a number from network-endian
- * into host-endian after removing it from the buffer.
+ * Allocate a searcher that can find `needle` in any number of buffers.
  *
- * Sets errno on failure.
+ * The needle is preprocessed once, so searching for the same needle
+ * many times is cheaper with a searcher than with
+ * `bfy_buffer_search_range()`. The searcher keeps its own copy of
+ * the needle and is not changed by searches, so it can be shared
+ * between threads.
  *
- * @see bfy_buffer_add_hton_u16()
- * @param buf the buffer from which the content will be removed
- * @return the uint16_t value
+ * @see bfy_buffer_search_range_with()
+ * @see bfy_searcher_free()
+ * @param needle the string to search for
+ * @param needle_len the length of `needle`
+ * @return a pointer to the new searcher, or NULL if an error occurred
  */
-uint16_t bfy_buffer_remove_ntoh_u16(bfy_buffer* buf);
+bfy_searcher* bfy_searcher_new(void const* needle, size_t needle_len);
 
 /**
- * Removes a network-endian number from the buffer.
- *
- * Convenience utility to convert a number from network-endian
- * into host-endian after removing it from the buffer.
- *
- * Sets errno on failure.
- *
- * @see bfy_buffer_add_hton_u32()
- * @param buf the buffer from which the content will be removed
- * @return 0 on success, -1 on failure
- * @return the uint32_t value
+ * Destructs a searcher created with `bfy_searcher_new()` and frees its memory.
  */
-uint32_t bfy_buffer_remove_ntoh_u32(bfy_buffer* buf);
+void bfy_searcher_free(bfy_searcher* searcher);
 
 /**
- * Removes a network-endian number from the buffer.
- *
- * Convenience utility to convert a number from network-endian
- * into host-endian after removing it from the buffer.
+ * Initialize a searcher and return it by value.
  *
- * Sets errno on failure.
+ * Unlike `bfy_searcher_new()`, this does not copy `needle`,
+ * so `needle` must outlive the searcher.
  *
- * @see bfy_buffer_add_hton_u64()
- * @param buf the buffer from which the content will be removed
- * @return the uint64_t value
+ * @see bfy_searcher_destruct()
+ * @param needle the string to search for
+ * @param needle_len the length of `needle`
+ * @return an initialized searcher
  */
-uint64_t bfy_buffer_remove_ntoh_u64(bfy_buffer* buf);
+bfy_searcher bfy_searcher_init(void const* needle, size_t needle_len);
 
 /**
- * Removes the entire buffer as a newly-allocated string.
+ * Like `bfy_searcher_new()`, but ASCII letters in the needle match
+ * content in either case, e.g. for HTTP header names.
  *
- * This operation also drains the entire buffer.
- *
- * @see bfy_buffer_peek_string()
- * @see bfy_buffer_add_printf()
- * @see bfy_buffer_add_vprintf()
+ * Bytes outside of 'A'..'Z' and 'a'..'z' must match exactly.
  *
- * @param buf the buffer to drain into a newly-allocated string
- * @param len pointer to a size_t which, if not NULL, is set with the strlen
- * @return pointer to a newly-allocated string
+ * @see bfy_searcher_init_nocase()
  */
-char* bfy_buffer_remove_string(bfy_buffer* buf, size_t* len);
-
-/* DRAINING CONTENT */
+bfy_searcher* bfy_searcher_new_nocase(void const* needle, size_t needle_len);
 
 /**
- * Remove contents [begin..end) from a buffer.
+ * Like `bfy_searcher_init()`, but ASCII letters in the needle match
+ * content in either case.
  *
- * @see bfy_buffer_remove()
- * @see bfy_buffer_copyout()
- * @param buf the buffer to remove content from
- * @param len how much content to remove, in bytes
- * @return how much content was removed, in bytes
+ * @see bfy_searcher_new_nocase()
  */
-size_t bfy_buffer_drain_range(bfy_buffer* buf, size_t begin, size_t end);
+bfy_searcher bfy_searcher_init_nocase(void const* needle, size_t needle_len);
 
 /**
- * Drain all content from the buffer.
- *
- * Equivalent to `bfy_buffer_drain_range(buf, 0, SIZE_MAX)`
+ * Destroys a searcher created with `bfy_searcher_init()` or `bfy_searcher_init_nocase()`.
  */
-size_t bfy_buffer_drain_all(bfy_buffer* buf);
+void bfy_searcher_destruct(bfy_searcher* searcher);
 
 /**
- * Drain the first `len` bytes of content from a buffer.
+ * Search buffer contents [begin..end) for a searcher's needle.
  *
- * Equivalent to `bfy_buffer_drain_range(buf, 0, len)`
+ * @see bfy_buffer_search_range()
+ * @param buf the buffer to search
+ * @param begin offset inside `buf` where the search should begin
+ * @param end offset inside `buf` where the search should stop
+ * @param searcher the searcher from bfy_searcher_new() or bfy_searcher_init()
+ * @param match pointer to size_t offset that, if non-NULL and a match
+ *   is found, will be set to the offset in `buf` of the match.
+ * @return 0 if a match was found, -1 on failure.
  */
-size_t bfy_buffer_drain(bfy_buffer* buf, size_t len);
-
-/* CHANGE NOTIFICATIONS */
+int bfy_buffer_search_range_with(bfy_buffer const* buf,
+                                 size_t begin, size_t end,
+                                 bfy_searcher const* searcher,
+                                 size_t* match);
 
 /**
- * Set a callback to be invoked whenever the buffer's contents change.
+ * Search buffer contents for a searcher's needle.
  *
- * @param buf the buffer to watch
- * @param cb the callback to be invoked when the buffer's contents change
- * @param cb_data argument to be passed to the `cb` callback when called
+ * Equivalent to
+ * `bfy_buffer_search_range_with(buf, 0, SIZE_MAX, searcher, match)`
  */
-void bfy_buffer_set_changed_cb(bfy_buffer* buf,
-                               bfy_changed_cb* cb,
-                               void* cb_data);
+int bfy_buffer_search_all_with(bfy_buffer const* buf,
+                               bfy_searcher const* searcher,
+                               size_t* match);
 
 /**
- * Begin coalescing change events.
+ * Find every match of a searcher's needle in buffer contents [begin..end).
  *
- * All content changes made while coalescing is enabled will be folded
- * into a single change event that fires as coalescing is disabled.
- * This can be useful when making a batch of changes that should be
- * seen as one single change.
+ * This walks the content once, so splitting a large buffer into records
+ * is linear no matter how many records there are. Matches don't overlap:
+ * each search starts where the previous match ended.
  *
- * @see bfy_buffer_set_changed_cb()
- * @see bfy_buffer_end_coalescing_change_events()
- * @param buf the buffer whose change events were coalesced
- */
-void bfy_buffer_begin_coalescing_change_events(bfy_buffer* buf);
-
+ * If `max_matches` matches are found, there may be more. Call this again
+ * with `begin` set to the end of the last match to get the next batch.
+ *
+ * @see bfy_buffer_search_range_with()
+ * @param buf the buffer to search
+ * @param begin offset inside `buf` where the search should begin
+ * @param end offset inside `buf` where the search should stop
+ * @param searcher the searcher from bfy_searcher_new() or bfy_searcher_init()
+ * @param matches array that will be filled with the offsets of the matches
+ * @param max_matches the number of offsets that fit in `matches`
+ * @return the number of matches found
+ */
+size_t bfy_buffer_search_range_many(bfy_buffer const* buf,
+                                    size_t begin, size_t end,
+                                    bfy_searcher const* searcher,
+                                    size_t* matches, size_t max_matches);
+
+/**
+ * Search buffer contents [begin..end) for the first byte that's in a set.
+ *
+ * This is for tokenizers, e.g. to find the next whitespace character.
+ *
+ * @see bfy_buffer_find_not_any()
+ * @param buf the buffer to search
+ * @param begin offset inside `buf` where the search should begin
+ * @param end offset inside `buf` where the search should stop
+ * @param set the bytes to search for
+ * @param set_len the number of bytes in `set`
+ * @param match pointer to size_t offset that, if non-NULL and a match
+ *   is found, will be set to the offset in `buf` of the match.
+ * @return 0 if a match was found, -1 on failure.
+ */
+int bfy_buffer_find_any(bfy_buffer const* buf,
+                        size_t begin, size_t end,
+                        void const* set, size_t set_len,
+                        size_t* match);
+
+/**
+ * Search buffer contents [begin..end) for the first byte that's not in a set.
+ *
+ * This is for tokenizers, e.g. to find the end of a run of digits.
+ *
+ * @see bfy_buffer_find_any()
+ * @param buf the buffer to search
+ * @param begin offset inside `buf` where the search should begin
+ * @param end offset inside `buf` where the search should stop
+ * @param set the bytes to skip past
+ * @param set_len the number of bytes in `set`
+ * @param match pointer to size_t offset that, if non-NULL and a match
+ *   is found, will be set to the offset in `buf` of the match.
+ * @return 0 if a match was found, -1 on failure.
+ */
+int bfy_buffer_find_not_any(bfy_buffer const* buf,
+                            size_t begin, size_t end,
+                            void const* set, size_t set_len,
+                            size_t* match);
+
+/**
+ * Initialize the state of a resumable search.
+ *
+ * @see bfy_buffer_search_resume()
+ * @return an initialized search state
+ */
+bfy_search_state bfy_search_state_init(void);
+
+/**
+ * Search a growing buffer without rescanning content that's already
+ * been searched.
+ *
+ * This is for protocols that wait for a delimiter to arrive, e.g.
+ * the blank line at the end of HTTP headers. Call this after each read:
+ * it only searches the new content plus the last `needle_len - 1`
+ * bytes that were searched before, so it takes linear time in total
+ * no matter how many small reads the content arrives in.
+ *
+ * Once a match is found, later calls keep returning it until it's drained.
+ * The state stays valid when content is added to the end of the buffer
+ * or drained from its front. If content is changed in any other way,
+ * reset the state with bfy_search_state_init().
+ *
+ * @param buf the buffer to search
+ * @param state the search's state, from bfy_search_state_init()
+ * @param searcher the needle to search for
+ * @param match pointer to size_t offset that, if non-NULL and a match
+ *   is found, will be set to the offset in `buf` of the match.
+ * @return 0 if a match was found, -1 on failure.
+ */
+int bfy_buffer_search_resume(bfy_buffer const* buf,
+                             bfy_search_state* state,
+                             bfy_searcher const* searcher,
+                             size_t* match);
+
+/**
+ * Allocate a searcher that looks for many needles at once.
+ *
+ * Searching with it walks the content once, no matter how many
+ * needles there are. Its memory use grows with the total length
+ * of the needles times the number of distinct bytes in them.
+ * Like bfy_searcher, it is not changed by searches and can be
+ * shared between threads.
+ *
+ * @see bfy_buffer_search_range_any()
+ * @see bfy_multisearcher_free()
+ * @param needles the strings to search for
+ * @param needle_lens the lengths of each string in `needles`
+ * @param n_needles the number of strings in `needles`
+ * @return a pointer to the new searcher, or NULL if an error occurred.
+ *   errno is set to EINVAL if there are no needles or a needle is empty,
+ *   or to ENOMEM if memory couldn't be allocated.
+ */
+bfy_multisearcher* bfy_multisearcher_new(void const* const* needles,
+                                         size_t const* needle_lens,
+                                         size_t n_needles);
+
+/**
+ * Frees a searcher created with `bfy_multisearcher_new()`.
+ */
+void bfy_multisearcher_free(bfy_multisearcher* ms);
+
+/**
+ * Search buffer contents [begin..end) for the first match of any needle.
+ *
+ * The match that starts first wins. If several needles match at the
+ * same offset, the one that came first in bfy_multisearcher_new() wins.
+ *
+ * @param buf the buffer to search
+ * @param begin offset inside `buf` where the search should begin
+ * @param end offset inside `buf` where the search should stop
+ * @param ms the needles to search for
+ * @param match pointer to size_t offset that, if non-NULL and a match
+ *   is found, will be set to the offset in `buf` of the match.
+ * @param which pointer to size_t that, if non-NULL and a match is found,
+ *   will be set to the index of the needle that matched.
+ * @return 0 if a match was found, -1 on failure.
+ */
+int bfy_buffer_search_range_any(bfy_buffer const* buf,
+                                size_t begin, size_t end,
+                                bfy_multisearcher const* ms,
+                                size_t* match, size_t* which);
+
+/**
+ * Search buffer contents for the first match of any needle.
+ *
+ * Equivalent to
+ * `bfy_buffer_search_range_any(buf, 0, SIZE_MAX, ms, match, which)`
+ */
+int bfy_buffer_search_all_any(bfy_buffer const* buf,
+                              bfy_multisearcher const* ms,
+                              size_t* match, size_t* which);
+
+/**
+ * Compile a regular expression.
+ *
+ * The pattern is compiled to a DFA, so searching with it takes linear
+ * time, without backtracking. It supports literals, the escapes
+ * `\n` `\r` `\t` `\f` `\v` `\0` and `\xHH`, `.` (any byte but a newline),
+ * classes like `[a-z]` and `[^,]`, `\d` `\w` `\s` and their complements
+ * `\D` `\W` `\S`, groups `(...)` and `(?:...)`, alternation `|`, the
+ * quantifiers `*` `+` `?` `{n}` `{n,}` `{n,m}`, and the anchors `^` and `$`,
+ * which match at the beginning and end of the searched range.
+ * Backreferences and captures are not supported.
+ *
+ * Like bfy_searcher, it is not changed by searches and can be
+ * shared between threads.
+ *
+ * @see bfy_buffer_search_range_regex()
+ * @see bfy_regex_free()
+ * @param pattern the regular expression
+ * @param pattern_len the length of `pattern`
+ * @return a pointer to the new regex, or NULL if an error occurred.
+ *   errno is set to EINVAL if the pattern is malformed, or to ENOMEM
+ *   if memory couldn't be allocated or the DFA would be too large.
+ */
+bfy_regex* bfy_regex_new(char const* pattern, size_t pattern_len);
+
+/**
+ * Frees a regex created with `bfy_regex_new()`.
+ */
+void bfy_regex_free(bfy_regex* re);
+
+/**
+ * Search buffer contents [begin..end) for the first match of a regex.
+ *
+ * Matches are leftmost-longest, as in POSIX: the match that starts
+ * first wins, and of those, the longest one.
+ *
+ * @param buf the buffer to search
+ * @param begin offset inside `buf` where the search should begin
+ * @param end offset inside `buf` where the search should stop
+ * @param re the regex from bfy_regex_new()
+ * @param match pointer to size_t offset that, if non-NULL and a match
+ *   is found, will be set to the offset in `buf` of the match.
+ * @param match_len pointer to size_t that, if non-NULL and a match
+ *   is found, will be set to the length of the match.
+ * @return 0 if a match was found, -1 on failure.
+ */
+int bfy_buffer_search_range_regex(bfy_buffer const* buf,
+                                  size_t begin, size_t end,
+                                  bfy_regex const* re,
+                                  size_t* match, size_t* match_len);
+
+/**
+ * Search buffer contents for the first match of a regex.
+ *
+ * Equivalent to
+ * `bfy_buffer_search_range_regex(buf, 0, SIZE_MAX, re, match, match_len)`
+ */
+int bfy_buffer_search_all_regex(bfy_buffer const* buf,
+                                bfy_regex const* re,
+                                size_t* match, size_t* match_len);
+
+/**
+ * Search buffer contents [begin..end) for a substring using several threads.
+ *
+ * The range is split into `n_tasks` parts that overlap by `needle_len - 1`
+ * bytes, so that matches crossing from one part into the next are found.
+ * Each part is searched by a task handed to `run_tasks`, and the earliest
+ * match is returned. This is only worthwhile for very large buffers.
+ *
+ * bfy does not create threads itself. If `run_tasks` is NULL or
+ * `n_tasks` is less than 2, this is equivalent to
+ * `bfy_buffer_search_range()`.
+ *
+ * @see bfy_buffer_search_range()
+ * @see bfy_buffer_copyout_range_parallel()
+ * @param n_tasks how many parts to split the work into
+ * @param run_tasks runs the tasks and waits for them to finish
+ * @param run_tasks_data user data passed to `run_tasks`
+ * @return 0 if a match was found, -1 on failure.
+ */
+int bfy_buffer_search_range_parallel(bfy_buffer const* buf,
+                                     size_t begin, size_t end,
+                                     void const* needle, size_t needle_len,
+                                     size_t* match, size_t n_tasks,
+                                     bfy_run_tasks_cb* run_tasks,
+                                     void* run_tasks_data);
+
+
+/* CONSUMING CONTENT */
+
+/**
+ * Copy and remove contents [begin..end) from a buffer.
+ *
+ * @param buf the buffer to remove content from
+ * @param begin offset into the buffer's contents to begin removing
+ * @param end offset into the buffer's contents to not remove
+ * @param setme where to copy the content to
+ * @return the number of bytes removed
+ */
+size_t bfy_buffer_remove_range(bfy_buffer* buf,
+                               size_t begin, size_t end,
+                               void* setme);
+
+/**
+ * Copy and remove the first `len` bytes of content from `buf`.
+ *
+ * Equivalent to `bfy_buffer_remove_range(buf, 0, len, setme)`
+ */
+size_t bfy_buffer_remove(bfy_buffer* buf, size_t len, void* setme);
+
+/**
+ * Copy and remove contents [begin..end) using several threads.
+ *
+ * The copy is done as in `bfy_buffer_copyout_range_parallel()`,
+ * then the range is drained.
+ *
+ * @see bfy_buffer_copyout_range_parallel()
+ * @see bfy_buffer_remove_range()
+ * @return the number of bytes removed
+ */
+size_t bfy_buffer_remove_range_parallel(bfy_buffer* buf,
+                                        size_t begin, size_t end,
+                                        void* setme, size_t n_tasks,
+                                        bfy_run_tasks_cb* run_tasks,
+                                        void* run_tasks_data);
+
+/**
+ * Move data from one buffer to another.
+ *
+ * When possible this operation will move pages from one buffer
+ * to the other, avoiding unnecessary memory allocation and copying.
+ *
+ * @see bfy_buffer_add_buffer()
+ * @param buf the buffer to remove content from
+ * @param len how many bytes of content to move from `buf` to `setme`
+ * @param setme the buffer to receive the content
+ * @return the number of bytes moved
+ */
+size_t bfy_buffer_remove_buffer(bfy_buffer* buf, size_t len, bfy_buffer* setme);
+
+/**
+ * Removes a network-endian number from the buffer.
+ *
+ * Convenience utility to convert a number from network-endian
+ * into host-endian after removing it from the buffer.
+ * This uint8_t function is provided for consistency with the other
+ * endian functions, although endian order is moot on a uint8_t.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_hton_u8()
+ * @param buf the buffer from which the content will be removed
+ * @return the uint8_t value
+ */
+uint8_t bfy_buffer_remove_ntoh_u8(bfy_buffer* buf);
+
+/**
+ * Removes a network-endian number from the buffer.
+ *
+ * Convenience utility to convert a number from network-endian
+ * into host-endian after removing it from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_hton_u16()
+ * @param buf the buffer from which the content will be removed
+ * @return the uint16_t value
+ */
+uint16_t bfy_buffer_remove_ntoh_u16(bfy_buffer* buf);
+
+/**
+ * Removes a network-endian number from the buffer.
+ *
+ * Convenience utility to convert a number from network-endian
+ * into host-endian after removing it from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_hton_u32()
+ * @param buf the buffer from which the content will be removed
+ * @return 0 on success, -1 on failure
+ * @return the uint32_t value
+ */
+uint32_t bfy_buffer_remove_ntoh_u32(bfy_buffer* buf);
+
+/**
+ * Removes a network-endian number from the buffer.
+ *
+ * Convenience utility to convert a number from network-endian
+ * into host-endian after removing it from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_hton_u64()
+ * @param buf the buffer from which the content will be removed
+ * @return the uint64_t value
+ */
+uint64_t bfy_buffer_remove_ntoh_u64(bfy_buffer* buf);
+
+/**
+ * Reads a network-endian number from the buffer without removing it.
+ *
+ * This is for decoders that need to look at a header, e.g. a length
+ * prefix, before deciding whether the whole message has arrived.
+ *
+ * @see bfy_buffer_remove_ntoh_u8()
+ * @param buf the buffer to read from
+ * @param offset where the number starts in the buffer's content
+ * @param setme where the host-endian value is stored
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_ntoh_u8_at(bfy_buffer const* buf, size_t offset, uint8_t* setme);
+
+/**
+ * Reads a network-endian number from the buffer without removing it.
+ *
+ * @see bfy_buffer_remove_ntoh_u16()
+ * @param buf the buffer to read from
+ * @param offset where the number starts in the buffer's content
+ * @param setme where the host-endian value is stored
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_ntoh_u16_at(bfy_buffer const* buf, size_t offset, uint16_t* setme);
+
+/**
+ * Reads a network-endian number from the buffer without removing it.
+ *
+ * @see bfy_buffer_remove_ntoh_u32()
+ * @param buf the buffer to read from
+ * @param offset where the number starts in the buffer's content
+ * @param setme where the host-endian value is stored
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_ntoh_u32_at(bfy_buffer const* buf, size_t offset, uint32_t* setme);
+
+/**
+ * Reads a network-endian number from the buffer without removing it.
+ *
+ * @see bfy_buffer_remove_ntoh_u64()
+ * @param buf the buffer to read from
+ * @param offset where the number starts in the buffer's content
+ * @param setme where the host-endian value is stored
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_ntoh_u64_at(bfy_buffer const* buf, size_t offset, uint64_t* setme);
+
+/**
+ * Removes a little-endian number from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_le_u16()
+ * @param buf the buffer from which the content will be removed
+ * @return the uint16_t value
+ */
+uint16_t bfy_buffer_remove_le_u16(bfy_buffer* buf);
+
+/**
+ * Removes a little-endian number from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_le_u32()
+ * @param buf the buffer from which the content will be removed
+ * @return the uint32_t value
+ */
+uint32_t bfy_buffer_remove_le_u32(bfy_buffer* buf);
+
+/**
+ * Removes a little-endian number from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_le_u64()
+ * @param buf the buffer from which the content will be removed
+ * @return the uint64_t value
+ */
+uint64_t bfy_buffer_remove_le_u64(bfy_buffer* buf);
+
+/**
+ * Removes a little-endian number from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_le_float()
+ * @param buf the buffer from which the content will be removed
+ * @return the float value
+ */
+float bfy_buffer_remove_le_float(bfy_buffer* buf);
+
+/**
+ * Removes a little-endian number from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_le_double()
+ * @param buf the buffer from which the content will be removed
+ * @return the double value
+ */
+double bfy_buffer_remove_le_double(bfy_buffer* buf);
+
+/**
+ * Reads a little-endian number from the buffer without removing it.
+ *
+ * @see bfy_buffer_remove_le_u16()
+ * @param buf the buffer to read from
+ * @param offset where the number starts in the buffer's content
+ * @param setme where the host-endian value is stored
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_le_u16_at(bfy_buffer const* buf, size_t offset, uint16_t* setme);
+
+/**
+ * Reads a little-endian number from the buffer without removing it.
+ *
+ * @see bfy_buffer_remove_le_u32()
+ * @param buf the buffer to read from
+ * @param offset where the number starts in the buffer's content
+ * @param setme where the host-endian value is stored
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_le_u32_at(bfy_buffer const* buf, size_t offset, uint32_t* setme);
+
+/**
+ * Reads a little-endian number from the buffer without removing it.
+ *
+ * @see bfy_buffer_remove_le_u64()
+ * @param buf the buffer to read from
+ * @param offset where the number starts in the buffer's content
+ * @param setme where the host-endian value is stored
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_le_u64_at(bfy_buffer const* buf, size_t offset, uint64_t* setme);
+
+/**
+ * Reads a little-endian number from the buffer without removing it.
+ *
+ * @see bfy_buffer_remove_le_float()
+ * @param buf the buffer to read from
+ * @param offset where the number starts in the buffer's content
+ * @param setme where the host-endian value is stored
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_le_float_at(bfy_buffer const* buf, size_t offset, float* setme);
+
+/**
+ * Reads a little-endian number from the buffer without removing it.
+ *
+ * @see bfy_buffer_remove_le_double()
+ * @param buf the buffer to read from
+ * @param offset where the number starts in the buffer's content
+ * @param setme where the host-endian value is stored
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_le_double_at(bfy_buffer const* buf, size_t offset, double* setme);
+
+/**
+ * Removes an array of network-endian numbers from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_hton_u16_array()
+ * @param buf the buffer from which the content will be removed
+ * @param setme where the host-endian numbers are stored
+ * @param n how many numbers to remove
+ * @return 0 on success, or -1 on failure
+ */
+int bfy_buffer_remove_ntoh_u16_array(bfy_buffer* buf, uint16_t* setme, size_t n);
+
+/**
+ * Removes an array of network-endian numbers from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_hton_u32_array()
+ * @param buf the buffer from which the content will be removed
+ * @param setme where the host-endian numbers are stored
+ * @param n how many numbers to remove
+ * @return 0 on success, or -1 on failure
+ */
+int bfy_buffer_remove_ntoh_u32_array(bfy_buffer* buf, uint32_t* setme, size_t n);
+
+/**
+ * Removes an array of network-endian numbers from the buffer.
+ *
+ * If the buffer holds too little content, nothing is removed
+ * and errno is set to ENOMSG.
+ *
+ * @see bfy_buffer_add_hton_u64_array()
+ * @param buf the buffer from which the content will be removed
+ * @param setme where the host-endian numbers are stored
+ * @param n how many numbers to remove
+ * @return 0 on success, or -1 on failure
+ */
+int bfy_buffer_remove_ntoh_u64_array(bfy_buffer* buf, uint64_t* setme, size_t n);
+
+/**
+ * Reads an array of network-endian numbers without removing them.
+ *
+ * @see bfy_buffer_remove_ntoh_u16_array()
+ * @param buf the buffer to read from
+ * @param offset where the first number starts in the buffer's content
+ * @param setme where the host-endian numbers are stored
+ * @param n how many numbers to read
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_ntoh_u16_array_at(bfy_buffer const* buf, size_t offset, uint16_t* setme, size_t n);
+
+/**
+ * Reads an array of network-endian numbers without removing them.
+ *
+ * @see bfy_buffer_remove_ntoh_u32_array()
+ * @param buf the buffer to read from
+ * @param offset where the first number starts in the buffer's content
+ * @param setme where the host-endian numbers are stored
+ * @param n how many numbers to read
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_ntoh_u32_array_at(bfy_buffer const* buf, size_t offset, uint32_t* setme, size_t n);
+
+/**
+ * Reads an array of network-endian numbers without removing them.
+ *
+ * @see bfy_buffer_remove_ntoh_u64_array()
+ * @param buf the buffer to read from
+ * @param offset where the first number starts in the buffer's content
+ * @param setme where the host-endian numbers are stored
+ * @param n how many numbers to read
+ * @return 0 on success, or -1 with errno set to ENOMSG if the buffer
+ *   holds too little content
+ */
+int bfy_buffer_peek_ntoh_u64_array_at(bfy_buffer const* buf, size_t offset, uint64_t* setme, size_t n);
+
+/**
+ * Removes an LEB128 varint from the buffer.
+ *
+ * The varint may span pages. If the buffer ends before the varint
+ * does, nothing is removed and errno is set to ENOMSG. If the varint
+ * is longer than ten bytes or overflows a uint64_t, nothing is
+ * removed and errno is set to EINVAL.
+ *
+ * @see bfy_buffer_add_varint_u64()
+ * @param buf the buffer from which the content will be removed
+ * @param setme where the decoded number is stored
+ * @return 0 on success, or -1 on failure
+ */
+int bfy_buffer_remove_varint_u64(bfy_buffer* buf, uint64_t* setme);
+
+/**
+ * Removes a zigzag LEB128 varint from the buffer.
+ *
+ * Errors are handled as in bfy_buffer_remove_varint_u64().
+ *
+ * @see bfy_buffer_add_varint_s64()
+ * @param buf the buffer from which the content will be removed
+ * @param setme where the decoded number is stored
+ * @return 0 on success, or -1 on failure
+ */
+int bfy_buffer_remove_varint_s64(bfy_buffer* buf, int64_t* setme);
+
+/**
+ * Reads an LEB128 varint from the buffer without removing it.
+ *
+ * Errors are handled as in bfy_buffer_remove_varint_u64().
+ *
+ * @see bfy_buffer_remove_varint_u64()
+ * @param buf the buffer to read from
+ * @param offset where the varint starts in the buffer's content
+ * @param setme where the decoded number is stored
+ * @param setme_len if not NULL, where the varint's length in bytes is stored
+ * @return 0 on success, or -1 on failure
+ */
+int bfy_buffer_peek_varint_u64_at(bfy_buffer const* buf, size_t offset,
+                                  uint64_t* setme, size_t* setme_len);
+
+/**
+ * Reads a zigzag LEB128 varint from the buffer without removing it.
+ *
+ * Errors are handled as in bfy_buffer_remove_varint_u64().
+ *
+ * @see bfy_buffer_remove_varint_s64()
+ * @param buf the buffer to read from
+ * @param offset where the varint starts in the buffer's content
+ * @param setme where the decoded number is stored
+ * @param setme_len if not NULL, where the varint's length in bytes is stored
+ * @return 0 on success, or -1 on failure
+ */
+int bfy_buffer_peek_varint_s64_at(bfy_buffer const* buf, size_t offset,
+                                  int64_t* setme, size_t* setme_len);
+
+/**
+ * Compiles a pack format for bfy_buffer_pack_format() and
+ * bfy_buffer_unpack_format().
+ *
+ * Formats follow Python's struct module. An optional first character
+ * sets the byte order: `!` or `>` for network (big-endian), `<` for
+ * little-endian, or `=` for the host's (the default). Fields are never
+ * aligned or padded. Each field code may have a repeat count, e.g. `3H`,
+ * and spaces between fields are ignored.
+ *
+ * | code | bytes | pack argument | unpack argument |
+ * |------|-------|---------------|-----------------|
+ * | `x`  | 1     | none, adds a zero byte | none, skips a byte |
+ * | `c`  | 1     | `char`        | `char*`         |
+ * | `b` `B` | 1  | `int8_t` `uint8_t`   | `int8_t*` `uint8_t*` |
+ * | `h` `H` | 2  | `int16_t` `uint16_t` | `int16_t*` `uint16_t*` |
+ * | `i` `I` `l` `L` | 4 | `int32_t` `uint32_t` | `int32_t*` `uint32_t*` |
+ * | `q` `Q` | 8  | `int64_t` `uint64_t` | `int64_t*` `uint64_t*` |
+ * | `f`  | 4     | `float` or `double` | `float*`  |
+ * | `d`  | 8     | `double`      | `double*`       |
+ * | `s`  | 1     | `void const*` | `void*`         |
+ *
+ * For `s`, the count is the length of the byte string, e.g. `8s` takes
+ * one pointer to 8 bytes. For `x`, the count is the number of bytes.
+ *
+ * A compiled format isn't changed by packing or unpacking, so it
+ * can be shared between threads.
+ *
+ * @see bfy_format_free()
+ * @param format the format string
+ * @return a pointer to the new format, or NULL if an error occurred.
+ *   errno is set to EINVAL if the format is malformed, or to ENOMEM
+ *   if memory couldn't be allocated.
+ */
+bfy_format* bfy_format_new(char const* format);
+
+/**
+ * Frees a format created with `bfy_format_new()`.
+ */
+void bfy_format_free(bfy_format* fmt);
+
+/**
+ * @return how many bytes a record packed with this format takes
+ */
+size_t bfy_format_get_size(bfy_format const* fmt);
+
+/**
+ * Adds a record of fixed-size fields to the buffer.
+ *
+ * The record's size is computed before anything is written,
+ * so it costs a single reservation and a single change event.
+ * Hot loops should compile the format once with bfy_format_new()
+ * and use bfy_buffer_pack_format() instead.
+ *
+ * @see bfy_format_new() for the format syntax
+ * @see bfy_buffer_unpack()
+ * @param buf the buffer to be appended to
+ * @param format the format string
+ * @return 0 on success, or -1 on failure. errno is set to EINVAL
+ *   if the format is malformed.
+ */
+int bfy_buffer_pack(bfy_buffer* buf, char const* format, ...);
+
+/**
+ * Like bfy_buffer_pack(), but with a compiled format.
+ *
+ * @see bfy_format_new()
+ * @return 0 on success, or -1 on failure
+ */
+int bfy_buffer_pack_format(bfy_buffer* buf, bfy_format const* fmt, ...);
+
+/**
+ * Removes a record of fixed-size fields from the buffer.
+ *
+ * The record may span pages. If the buffer holds less than a whole
+ * record, nothing is removed and errno is set to ENOMSG.
+ *
+ * @see bfy_format_new() for the format syntax
+ * @see bfy_buffer_pack()
+ * @param buf the buffer from which the record will be removed
+ * @param format the format string
+ * @return 0 on success, or -1 on failure. errno is set to EINVAL
+ *   if the format is malformed.
+ */
+int bfy_buffer_unpack(bfy_buffer* buf, char const* format, ...);
+
+/**
+ * Like bfy_buffer_unpack(), but with a compiled format.
+ *
+ * @see bfy_format_new()
+ * @return 0 on success, or -1 on failure
+ */
+int bfy_buffer_unpack_format(bfy_buffer* buf, bfy_format const* fmt, ...);
+
+/**
+ * Removes the entire buffer as a newly-allocated string.
+ *
+ * This operation also drains the entire buffer.
+ *
+ * @see bfy_buffer_peek_string()
+ * @see bfy_buffer_add_printf()
+ * @see bfy_buffer_add_vprintf()
+ *
+ * @param buf the buffer to drain into a newly-allocated string
+ * @param len pointer to a size_t which, if not NULL, is set with the strlen
+ * @return pointer to a newly-allocated string
+ */
+char* bfy_buffer_remove_string(bfy_buffer* buf, size_t* len);
+
+/**
+ * Ways that a line of text can end.
+ *
+ * @see bfy_buffer_readln()
+ */
+enum bfy_eol {
+    /* a "\n" */
+    BFY_EOL_LF,
+
+    /* a "\n", optionally preceded by a "\r" */
+    BFY_EOL_CRLF,
+
+    /* a "\r\n" */
+    BFY_EOL_CRLF_STRICT,
+
+    /* a '\0' */
+    BFY_EOL_NUL,
+
+    /* any run of '\r' and '\n' characters */
+    BFY_EOL_ANY
+};
+
+/**
+ * Finds the first line in a buffer without removing it.
+ *
+ * The line doesn't need to be contiguous. To access it without
+ * copying, pass `line_len` to `bfy_buffer_peek()`.
+ *
+ * @param buf the buffer to search
+ * @param style how the line ends
+ * @param line_len pointer to a size_t which, if not NULL, is set with
+ *   the length of the line, not including the EOL
+ * @param eol_len pointer to a size_t which, if not NULL, is set with
+ *   the length of the EOL
+ * @return 0 on success, or -1 and sets errno to ENOMSG if the buffer
+ *   doesn't hold a complete line.
+ */
+int bfy_buffer_peekln(bfy_buffer const* buf, enum bfy_eol style,
+                      size_t* line_len, size_t* eol_len);
+
+/**
+ * Removes the first line from a buffer, copying it into `setme`.
+ *
+ * The line is not zero-terminated. Its EOL is drained but not copied.
+ *
+ * @param buf the buffer to remove the line from
+ * @param style how the line ends
+ * @param setme where to copy the line to
+ * @param setme_len the size of `setme`
+ * @param line_len pointer to a size_t which, if not NULL and a line was
+ *   found, is set with the length of the line
+ * @return 0 on success, or -1 and sets errno to ENOMSG if the buffer
+ *   doesn't hold a complete line, or to ENOBUFS if the line is longer
+ *   than `setme_len`. In both cases, nothing is removed.
+ */
+int bfy_buffer_readln(bfy_buffer* buf, enum bfy_eol style,
+                      void* setme, size_t setme_len,
+                      size_t* line_len);
+
+/**
+ * Removes the first line from a buffer as a newly-allocated string.
+ *
+ * The EOL is drained but not included in the string. As with
+ * `bfy_buffer_remove_string()`, the buffer's memory is handed to
+ * the caller instead of copied when possible.
+ *
+ * @param buf the buffer to remove the line from
+ * @param style how the line ends
+ * @param len pointer to a size_t which, if not NULL, is set with the strlen
+ * @return pointer to a newly-allocated string, or NULL and sets errno
+ *   to ENOMSG if the buffer doesn't hold a complete line.
+ */
+char* bfy_buffer_readln_string(bfy_buffer* buf, enum bfy_eol style, size_t* len);
+
+/* DRAINING CONTENT */
+
+/**
+ * Remove contents [begin..end) from a buffer.
+ *
+ * @see bfy_buffer_remove()
+ * @see bfy_buffer_copyout()
+ * @param buf the buffer to remove content from
+ * @param len how much content to remove, in bytes
+ * @return how much content was removed, in bytes
+ */
+size_t bfy_buffer_drain_range(bfy_buffer* buf, size_t begin, size_t end);
+
+/**
+ * Drain all content from the buffer.
+ *
+ * Equivalent to `bfy_buffer_drain_range(buf, 0, SIZE_MAX)`
+ */
+size_t bfy_buffer_drain_all(bfy_buffer* buf);
+
+/**
+ * Drain the first `len` bytes of content from a buffer.
+ *
+ * Equivalent to `bfy_buffer_drain_range(buf, 0, len)`
+ */
+size_t bfy_buffer_drain(bfy_buffer* buf, size_t len);
+
+/* CHANGE NOTIFICATIONS */
+
+/**
+ * Set a callback to be invoked whenever the buffer's contents change.
+ *
+ * @param buf the buffer to watch
+ * @param cb the callback to be invoked when the buffer's contents change
+ * @param cb_data argument to be passed to the `cb` callback when called
+ */
+void bfy_buffer_set_changed_cb(bfy_buffer* buf,
+                               bfy_changed_cb* cb,
+                               void* cb_data);
+
+/**
+ * Begin coalescing change events.
+ *
+ * All content changes made while coalescing is enabled will be folded
+ * into a single change event that fires as coalescing is disabled.
+ * This can be useful when making a batch of changes that should be
+ * seen as one single change.
+ *
+ * If locking is enabled, the buffer stays locked until coalescing ends.
+ *
+ * @see bfy_buffer_set_changed_cb()
+ * @see bfy_buffer_end_coalescing_change_events()
+ * @param buf the buffer whose change events were coalesced
+ */
+void bfy_buffer_begin_coalescing_change_events(bfy_buffer* buf);
+
 /**
  * End coalescing change events.
  *
@@ -600,6 +1732,241 @@ void bfy_buffer_begin_coalescing_change_events(bfy_buffer* buf);
  */
 void bfy_buffer_end_coalescing_change_events(bfy_buffer* buf);
 
+/**
+ * Allocate a new heap-allocated deferred callback queue.
+ *
+ * Buffers that defer their change callbacks to a queue don't invoke
+ * them in the middle of an add or drain. Instead, all the changes made
+ * until the next `bfy_run_deferred_callbacks()` are folded into a single
+ * callback invocation.
+ *
+ * A queue and its buffers must be used from one thread at a time.
+ *
+ * @see bfy_buffer_defer_callbacks()
+ * @see bfy_deferred_queue_free()
+ * @return a pointer to the new queue, or NULL if an error occurred
+ */
+bfy_deferred_queue* bfy_deferred_queue_new(void);
+
+/**
+ * Destructs a deferred callback queue and frees its memory.
+ *
+ * Callbacks still pending in the queue are run first. Buffers that
+ * defer to this queue must be destroyed or pointed to another queue
+ * before the queue is destroyed.
+ *
+ * @see bfy_deferred_queue_new()
+ */
+void bfy_deferred_queue_free(bfy_deferred_queue* queue);
+
+/**
+ * Initialize an empty deferred callback queue and return it by value.
+ *
+ * @see bfy_buffer_init()
+ * @see bfy_deferred_queue_destruct()
+ * @return an initialized deferred callback queue
+ */
+bfy_deferred_queue bfy_deferred_queue_init(void);
+
+/**
+ * Destroys a deferred callback queue created with bfy_deferred_queue_init().
+ *
+ * @see bfy_deferred_queue_free()
+ */
+void bfy_deferred_queue_destruct(bfy_deferred_queue* queue);
+
+/**
+ * Set a callback to be invoked when a deferred callback queue gets work.
+ *
+ * This is the hook for integrating with an event loop: the callback is
+ * invoked when the queue goes from empty to not-empty, and can schedule
+ * a call to `bfy_run_deferred_callbacks()` on the next loop iteration.
+ *
+ * @param queue the queue to watch
+ * @param cb the callback to be invoked when the queue gets work
+ * @param cb_data argument to be passed to the `cb` callback when called
+ */
+void bfy_deferred_queue_set_wakeup_cb(bfy_deferred_queue* queue,
+                                      bfy_deferred_wakeup_cb* cb,
+                                      void* cb_data);
+
+/**
+ * Defer a buffer's change callbacks to a queue.
+ *
+ * @see bfy_run_deferred_callbacks()
+ * @param buf the buffer whose change callbacks should be deferred
+ * @param queue the queue to defer callbacks to, or NULL to go back
+ *   to invoking callbacks immediately. Any change that was waiting
+ *   in the previous queue fires right away.
+ */
+void bfy_buffer_defer_callbacks(bfy_buffer* buf, bfy_deferred_queue* queue);
+
+/**
+ * Invoke the pending change callbacks in a deferred callback queue.
+ *
+ * Each buffer with pending changes gets one callback that covers all
+ * of its changes since its last callback. If a callback changes its
+ * buffer again, that change waits for the next run.
+ *
+ * @param queue the queue whose callbacks will be run
+ * @return the number of callbacks invoked
+ */
+size_t bfy_run_deferred_callbacks(bfy_deferred_queue* queue);
+
+/* LOCKING */
+
+struct bfy_lock_functions {
+    /* Creates a new recursive lock */
+    void* (*lock_new)(void);
+    void (*lock_free)(void* lock);
+    void (*lock)(void* lock);
+    void (*unlock)(void* lock);
+};
+
+/**
+ * Sets the lock functions singleton used by buffers that enable locking.
+ *
+ * bfy has no threading dependencies of its own, so a buffer can't be
+ * shared between threads until you provide these functions.
+ * Locks must be recursive: the same thread may lock one several times
+ * and will unlock it the same number of times.
+ *
+ * As with `bfy_set_allocator()`, do this **first** before enabling
+ * locking on any buffers.
+ *
+ * @see bfy_buffer_enable_locking()
+ * @param fns a struct with lock management function pointers
+ */
+void bfy_set_lock_functions(struct bfy_lock_functions* fns);
+
+/**
+ * Make a buffer safe to use from multiple threads.
+ *
+ * Once locking is enabled, each public function that takes `buf` will
+ * hold its lock for the duration of the call. Buffers are unlocked by
+ * default, and those buffers pay no locking costs.
+ *
+ * Change callbacks are invoked while the lock is held.
+ *
+ * To make a batch of changes atomic, hold the lock across them either
+ * explicitly with `bfy_buffer_lock()` or implicitly by coalescing them
+ * with `bfy_buffer_begin_coalescing_change_events()`, which keeps the
+ * lock until `bfy_buffer_end_coalescing_change_events()`.
+ *
+ * Returns -1 and sets errno to ENOTSUP if no lock functions have been
+ * set or if bfy was built with BFY_DISABLE_LOCKING.
+ *
+ * @see bfy_set_lock_functions()
+ * @param buf the buffer to make threadsafe
+ * @param lock a recursive lock to use, or NULL to have bfy create one
+ *   with `bfy_lock_functions.lock_new()`. A lock passed in here is not
+ *   freed by bfy, so it can be shared by several buffers.
+ * @return 0 on success, -1 on failure
+ */
+int bfy_buffer_enable_locking(bfy_buffer* buf, void* lock);
+
+/**
+ * Acquire a buffer's lock.
+ *
+ * This is a no-op if locking is not enabled.
+ *
+ * @see bfy_buffer_enable_locking()
+ * @see bfy_buffer_unlock()
+ * @param buf the buffer to lock
+ */
+void bfy_buffer_lock(bfy_buffer* buf);
+
+/**
+ * Release a buffer's lock.
+ *
+ * @see bfy_buffer_enable_locking()
+ * @see bfy_buffer_lock()
+ * @param buf the buffer to unlock
+ */
+void bfy_buffer_unlock(bfy_buffer* buf);
+
+
+/* MULTI-PRODUCER PAGE QUEUE */
+
+/**
+ * Allocate a new heap-allocated page queue and initialize it.
+ *
+ * A page queue lets any number of producer threads hand content to a
+ * single consumer buffer. Producers move pages into the queue with
+ * `bfy_pagequeue_add_buffer()`, which never blocks, and the consumer
+ * moves all of the queued pages into its buffer in one batch with
+ * `bfy_pagequeue_remove_buffer()`.
+ *
+ * @return a pointer to the new queue, or NULL if an error occurred
+ * @see bfy_pagequeue_free()
+ */
+bfy_pagequeue* bfy_pagequeue_new(void);
+
+/**
+ * Destructs a page queue and frees its memory.
+ *
+ * Any pages still in the queue are released.
+ *
+ * @see bfy_pagequeue_new()
+ */
+void bfy_pagequeue_free(bfy_pagequeue* queue);
+
+/**
+ * Initialize an empty page queue and return it by value.
+ *
+ * @see bfy_buffer_init()
+ * @see bfy_pagequeue_destruct()
+ * @return an initialized page queue
+ */
+bfy_pagequeue bfy_pagequeue_init(void);
+
+/**
+ * Destroys a page queue created with bfy_pagequeue_init().
+ *
+ * Any pages still in the queue are released.
+ *
+ * @see bfy_pagequeue_init()
+ */
+void bfy_pagequeue_destruct(bfy_pagequeue* queue);
+
+/**
+ * Move all of a buffer's content into a page queue.
+ *
+ * This is the producer side of the queue. It is safe to call from
+ * any number of threads at once, and it never waits on the consumer.
+ * The buffer's content pages are moved, not copied. Empty pages are
+ * left in `src` so that it can reuse their memory.
+ *
+ * To queue only part of a buffer, first move that part into a
+ * scratch buffer with `bfy_buffer_remove_buffer()`.
+ *
+ * @see bfy_pagequeue_remove_buffer()
+ * @param queue the queue that will receive the content
+ * @param src the buffer whose content will be moved into `queue`
+ * @return 0 on success, -1 on failure
+ */
+int bfy_pagequeue_add_buffer(bfy_pagequeue* queue, bfy_buffer* src);
+
+/**
+ * Move everything in a page queue to the end of a buffer.
+ *
+ * This is the consumer side of the queue. Only one thread at a time
+ * may consume from a queue. Content is appended in the order in which
+ * it was added by each producer, and all of it is spliced into `tgt`
+ * at once so that `tgt` fires a single change event.
+ *
+ * If memory runs out partway through, whatever couldn't be moved is
+ * left in the queue, in order, for the next call to retry. So a
+ * return value shorter than the queued content means that the rest
+ * of it is still queued, not lost.
+ *
+ * @see bfy_pagequeue_add_buffer()
+ * @param queue the queue whose content will be moved
+ * @param tgt the buffer to receive the content
+ * @return the number of bytes moved
+ */
+size_t bfy_pagequeue_remove_buffer(bfy_pagequeue* queue, bfy_buffer* tgt);
+
 
 /* MEMORY MANAGEMENT */
 
@@ -724,6 +2091,409 @@ int bfy_buffer_commit_space(bfy_buffer* buf, size_t len);
  */
 struct bfy_iovec bfy_buffer_peek_space(bfy_buffer* buf);
 
+/**
+ * Starts a batch of small appends to a buffer.
+ *
+ * A writer reserves free space at the end of the buffer and appends
+ * through a cached pointer, so each bfy_writer_add*() call is a bounds
+ * check and a store. Nothing is committed to the buffer until
+ * bfy_writer_flush() or bfy_writer_destruct(), which commit everything
+ * written so far in one go and fire at most one change event.
+ *
+ * If locking is enabled, the buffer stays locked until the writer
+ * is destructed. As with bfy_buffer_reserve_space(), don't change
+ * the buffer in other ways while the writer is in use.
+ *
+ * @see bfy_writer_destruct()
+ * @param buf the buffer to be appended to
+ * @return an initialized writer
+ */
+bfy_writer bfy_writer_init(bfy_buffer* buf);
+
+/**
+ * Commits the writer's pending content and releases the buffer.
+ *
+ * @see bfy_writer_init()
+ */
+void bfy_writer_destruct(bfy_writer* w);
+
+/**
+ * Commits the content written so far to the buffer.
+ *
+ * The writer can still be used afterwards.
+ *
+ * @param w the writer to flush
+ * @return 0 on success, -1 on failure
+ */
+int bfy_writer_flush(bfy_writer* w);
+
+/**
+ * Makes sure the writer has at least `len` bytes of free space.
+ *
+ * The bfy_writer_add*() functions call this when they run out of
+ * reserved space. Content that was already written is committed first.
+ *
+ * @param w the writer that needs more space
+ * @param len size of the space wanted, in bytes
+ * @return 0 on success, -1 on failure
+ */
+int bfy_writer_reserve(bfy_writer* w, size_t len);
+
+/**
+ * Claims the next `len` bytes of the writer's space.
+ *
+ * This is for callers that encode their own fields:
+ * write exactly `len` bytes to the returned pointer.
+ *
+ * A zero-length claim always succeeds without reserving anything,
+ * so its return value may be NULL and must not be written to.
+ *
+ * @param w the writer to be appended to
+ * @param len how many bytes will be written
+ * @return where to write them, or NULL if space couldn't be reserved
+ */
+static inline unsigned char*
+bfy_writer_claim(bfy_writer* w, size_t len) {
+    if ((size_t)(w->end - w->pos) < len && bfy_writer_reserve(w, len) != 0) {
+        return NULL;
+    }
+    unsigned char* const p = w->pos;
+    w->pos += len;
+    return p;
+}
+
+/**
+ * Appends content through a writer.
+ *
+ * @see bfy_buffer_add()
+ * @return 0 on success, -1 on failure
+ */
+static inline int
+bfy_writer_add(bfy_writer* w, void const* addme, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    unsigned char* const p = bfy_writer_claim(w, len);
+    if (p == NULL) {
+        return -1;
+    }
+    memcpy(p, addme, len);
+    return 0;
+}
+
+/**
+ * Appends a single character through a writer.
+ *
+ * @see bfy_buffer_add_ch()
+ * @return 0 on success, -1 on failure
+ */
+static inline int
+bfy_writer_add_ch(bfy_writer* w, char addme) {
+    unsigned char* const p = bfy_writer_claim(w, 1);
+    if (p == NULL) {
+        return -1;
+    }
+    p[0] = (unsigned char) addme;
+    return 0;
+}
+
+/**
+ * Appends a network-endian number through a writer.
+ *
+ * @see bfy_buffer_add_hton_u16()
+ * @return 0 on success, -1 on failure
+ */
+static inline int
+bfy_writer_add_hton_u16(bfy_writer* w, uint16_t addme) {
+    unsigned char* const p = bfy_writer_claim(w, 2);
+    if (p == NULL) {
+        return -1;
+    }
+    p[0] = (unsigned char)(addme >> 8);
+    p[1] = (unsigned char)(addme);
+    return 0;
+}
+
+/**
+ * Appends a network-endian number through a writer.
+ *
+ * @see bfy_buffer_add_hton_u32()
+ * @return 0 on success, -1 on failure
+ */
+static inline int
+bfy_writer_add_hton_u32(bfy_writer* w, uint32_t addme) {
+    unsigned char* const p = bfy_writer_claim(w, 4);
+    if (p == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char)(addme >> (24 - 8 * i));
+    }
+    return 0;
+}
+
+/**
+ * Appends a network-endian number through a writer.
+ *
+ * @see bfy_buffer_add_hton_u64()
+ * @return 0 on success, -1 on failure
+ */
+static inline int
+bfy_writer_add_hton_u64(bfy_writer* w, uint64_t addme) {
+    unsigned char* const p = bfy_writer_claim(w, 8);
+    if (p == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (unsigned char)(addme >> (56 - 8 * i));
+    }
+    return 0;
+}
+
+/**
+ * Appends a little-endian number through a writer.
+ *
+ * @see bfy_buffer_add_le_u16()
+ * @return 0 on success, -1 on failure
+ */
+static inline int
+bfy_writer_add_le_u16(bfy_writer* w, uint16_t addme) {
+    unsigned char* const p = bfy_writer_claim(w, 2);
+    if (p == NULL) {
+        return -1;
+    }
+    p[0] = (unsigned char)(addme);
+    p[1] = (unsigned char)(addme >> 8);
+    return 0;
+}
+
+/**
+ * Appends a little-endian number through a writer.
+ *
+ * @see bfy_buffer_add_le_u32()
+ * @return 0 on success, -1 on failure
+ */
+static inline int
+bfy_writer_add_le_u32(bfy_writer* w, uint32_t addme) {
+    unsigned char* const p = bfy_writer_claim(w, 4);
+    if (p == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char)(addme >> (8 * i));
+    }
+    return 0;
+}
+
+/**
+ * Appends a little-endian number through a writer.
+ *
+ * @see bfy_buffer_add_le_u64()
+ * @return 0 on success, -1 on failure
+ */
+static inline int
+bfy_writer_add_le_u64(bfy_writer* w, uint64_t addme) {
+    unsigned char* const p = bfy_writer_claim(w, 8);
+    if (p == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (unsigned char)(addme >> (8 * i));
+    }
+    return 0;
+}
+
+/**
+ * Starts a batch of small reads from the front of a buffer.
+ *
+ * A reader caches a pointer into the buffer's first page, so each
+ * bfy_reader_read*() call is a bounds check and a load. Reads may
+ * span pages. Nothing is removed from the buffer until the reader is
+ * destructed, which drains everything read in one go and fires at
+ * most one change event.
+ *
+ * If locking is enabled, the buffer stays locked until the reader
+ * is destructed. Don't change the buffer in other ways while the
+ * reader is in use.
+ *
+ * @see bfy_reader_destruct()
+ * @param buf the buffer to be read from
+ * @return an initialized reader
+ */
+bfy_reader bfy_reader_init(bfy_buffer* buf);
+
+/**
+ * Drains the content that was read and releases the buffer.
+ *
+ * @see bfy_reader_init()
+ */
+void bfy_reader_destruct(bfy_reader* r);
+
+/**
+ * Returns how much of the buffer's content hasn't been read yet.
+ *
+ * @param r the reader to query
+ * @return the number of unread bytes
+ */
+size_t bfy_reader_get_content_len(bfy_reader const* r);
+
+/**
+ * Reads content that isn't all in the reader's current page.
+ *
+ * The bfy_reader_read*() functions call this when a read
+ * reaches past the end of the current page.
+ *
+ * @param r the reader to read from
+ * @param setme where the content is copied
+ * @param len how many bytes to read
+ * @return 0 on success, or -1 with errno set to ENOMSG if too
+ *   little content is left, in which case nothing is read
+ */
+int bfy_reader_read_pages(bfy_reader* r, void* setme, size_t len);
+
+/**
+ * Reads content through a reader.
+ *
+ * @see bfy_buffer_remove()
+ * @return 0 on success, or -1 with errno set to ENOMSG if too
+ *   little content is left, in which case nothing is read
+ */
+static inline int
+bfy_reader_read(bfy_reader* r, void* setme, size_t len) {
+    if ((size_t)(r->end - r->pos) < len) {
+        return bfy_reader_read_pages(r, setme, len);
+    }
+    memcpy(setme, r->pos, len);
+    r->pos += len;
+    return 0;
+}
+
+/**
+ * Reads a single byte through a reader.
+ *
+ * @see bfy_buffer_remove_ntoh_u8()
+ * @return 0 on success, or -1 with errno set to ENOMSG if
+ *   no content is left
+ */
+static inline int
+bfy_reader_read_u8(bfy_reader* r, uint8_t* setme) {
+    if (r->pos == r->end) {
+        return bfy_reader_read_pages(r, setme, 1);
+    }
+    *setme = *r->pos++;
+    return 0;
+}
+
+/**
+ * Reads a network-endian number through a reader.
+ *
+ * @see bfy_buffer_remove_ntoh_u16()
+ * @return 0 on success, or -1 with errno set to ENOMSG if too
+ *   little content is left
+ */
+static inline int
+bfy_reader_read_ntoh_u16(bfy_reader* r, uint16_t* setme) {
+    unsigned char b[2];
+    if (bfy_reader_read(r, b, sizeof(b)) != 0) {
+        return -1;
+    }
+    *setme = (uint16_t)((b[0] << 8) | b[1]);
+    return 0;
+}
+
+/**
+ * Reads a network-endian number through a reader.
+ *
+ * @see bfy_buffer_remove_ntoh_u32()
+ * @return 0 on success, or -1 with errno set to ENOMSG if too
+ *   little content is left
+ */
+static inline int
+bfy_reader_read_ntoh_u32(bfy_reader* r, uint32_t* setme) {
+    unsigned char b[4];
+    if (bfy_reader_read(r, b, sizeof(b)) != 0) {
+        return -1;
+    }
+    *setme = ((uint32_t) b[0] << 24) | ((uint32_t) b[1] << 16) | ((uint32_t) b[2] << 8) | b[3];
+    return 0;
+}
+
+/**
+ * Reads a network-endian number through a reader.
+ *
+ * @see bfy_buffer_remove_ntoh_u64()
+ * @return 0 on success, or -1 with errno set to ENOMSG if too
+ *   little content is left
+ */
+static inline int
+bfy_reader_read_ntoh_u64(bfy_reader* r, uint64_t* setme) {
+    unsigned char b[8];
+    if (bfy_reader_read(r, b, sizeof(b)) != 0) {
+        return -1;
+    }
+    uint64_t val = 0;
+    for (int i = 0; i < 8; ++i) {
+        val = (val << 8) | b[i];
+    }
+    *setme = val;
+    return 0;
+}
+
+/**
+ * Reads a little-endian number through a reader.
+ *
+ * @see bfy_buffer_remove_le_u16()
+ * @return 0 on success, or -1 with errno set to ENOMSG if too
+ *   little content is left
+ */
+static inline int
+bfy_reader_read_le_u16(bfy_reader* r, uint16_t* setme) {
+    unsigned char b[2];
+    if (bfy_reader_read(r, b, sizeof(b)) != 0) {
+        return -1;
+    }
+    *setme = (uint16_t)(b[0] | (b[1] << 8));
+    return 0;
+}
+
+/**
+ * Reads a little-endian number through a reader.
+ *
+ * @see bfy_buffer_remove_le_u32()
+ * @return 0 on success, or -1 with errno set to ENOMSG if too
+ *   little content is left
+ */
+static inline int
+bfy_reader_read_le_u32(bfy_reader* r, uint32_t* setme) {
+    unsigned char b[4];
+    if (bfy_reader_read(r, b, sizeof(b)) != 0) {
+        return -1;
+    }
+    *setme = b[0] | ((uint32_t) b[1] << 8) | ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+    return 0;
+}
+
+/**
+ * Reads a little-endian number through a reader.
+ *
+ * @see bfy_buffer_remove_le_u64()
+ * @return 0 on success, or -1 with errno set to ENOMSG if too
+ *   little content is left
+ */
+static inline int
+bfy_reader_read_le_u64(bfy_reader* r, uint64_t* setme) {
+    unsigned char b[8];
+    if (bfy_reader_read(r, b, sizeof(b)) != 0) {
+        return -1;
+    }
+    uint64_t val = 0;
+    for (int i = 8; i-- > 0; ) {
+        val = (val << 8) | b[i];
+    }
+    *setme = val;
+    return 0;
+}
+
 #ifdef __cplusplus
 }
 #endif
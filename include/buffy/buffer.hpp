@@ -0,0 +1,131 @@
+/*
+ * Copyright 2020 Mnemosyne LLC
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef INCLUDE_LIBBUFFY_BUFFER_HPP_
+#define INCLUDE_LIBBUFFY_BUFFER_HPP_
+
+#include <cstddef>  // std::ptrdiff_t, std::size_t
+#include <iterator>  // std::output_iterator_tag
+#include <utility>  // std::forward()
+
+#if __has_include(<format>)
+#include <format>
+#endif
+
+#include <buffy/buffer.h>
+
+namespace bfy {
+
+/**
+ * A C++ wrapper around bfy_writer for formatting libraries.
+ *
+ * out() returns an output iterator that appends chars through the
+ * writer, so `std::format_to(w.out(), ...)` or `fmt::format_to(w.out(), ...)`
+ * formats straight into the buffer's pages, reserving a new page
+ * whenever the current one fills up. Nothing is committed until
+ * flush() or the destructor.
+ *
+ * Like bfy_writer, this holds the buffer's lock until it's destroyed.
+ */
+class buffer_writer {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::output_iterator_tag;
+        using value_type = void;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = void;
+
+        iterator() = default;
+        explicit iterator(buffer_writer* w): w_{w} {}
+
+        iterator& operator=(char ch) {
+            w_->put(ch);
+            return *this;
+        }
+        iterator& operator*() { return *this; }
+        iterator& operator++() { return *this; }
+        iterator& operator++(int) { return *this; }
+
+    private:
+        buffer_writer* w_ = nullptr;
+    };
+
+    explicit buffer_writer(bfy_buffer* buf): w_{bfy_writer_init(buf)} {}
+    ~buffer_writer() { bfy_writer_destruct(&w_); }
+
+    buffer_writer(buffer_writer const&) = delete;
+    buffer_writer& operator=(buffer_writer const&) = delete;
+
+    /**
+     * @return an output iterator that appends to the buffer
+     */
+    iterator out() { return iterator { this }; }
+
+    void put(char ch) {
+        if (bfy_writer_add_ch(&w_, ch) != 0) {
+            failed_ = true;
+        }
+    }
+
+    void write(char const* str, std::size_t len) {
+        if (bfy_writer_add(&w_, str, len) != 0) {
+            failed_ = true;
+        }
+    }
+
+    /**
+     * Commits what's been written so far.
+     *
+     * @return 0 on success, or -1 if anything written since the
+     *   writer was created couldn't be added
+     */
+    int flush() {
+        return bfy_writer_flush(&w_) == 0 && !failed_ ? 0 : -1;
+    }
+
+private:
+    bfy_writer w_;
+    bool failed_ = false;
+};
+
+#if defined(__cpp_lib_format)
+
+/**
+ * Formats into the buffer with std::format_to().
+ *
+ * @return 0 on success, -1 on failure
+ */
+template<typename... Args>
+int format_to(bfy_buffer* buf, std::format_string<Args...> fmt, Args&&... args) {
+    auto w = buffer_writer { buf };
+    std::format_to(w.out(), fmt, std::forward<Args>(args)...);
+    return w.flush();
+}
+
+#endif
+
+}  // namespace bfy
+
+#endif  // INCLUDE_LIBBUFFY_BUFFER_HPP_
@@ -25,6 +25,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <math.h>  // isinf(), isnan(), signbit()
 #include <stdbool.h>
 #include <stdio.h>  // vsprintf()
 #include <string.h>  // memcpy()
@@ -32,6 +33,10 @@
 
 #include "endianness.h"
 
+#if defined(_MSC_VER)
+#include <intrin.h>  // _InterlockedExchangePointer()
+#endif
+
 static struct bfy_allocator allocator = {
     .malloc = malloc,
     .free = free,
@@ -43,11 +48,138 @@ void bfy_set_allocator(struct bfy_allocator* alloc) {
     allocator = *alloc;
 }
 
+/// locking
+
+static struct bfy_lock_functions lock_functions = {
+    .lock_new = NULL,
+    .lock_free = NULL,
+    .lock = NULL,
+    .unlock = NULL
+};
+
+void bfy_set_lock_functions(struct bfy_lock_functions* fns) {
+    lock_functions = *fns;
+}
+
+static void
+buffer_lock(bfy_buffer const* buf) {
+#ifndef BFY_DISABLE_LOCKING
+    if (buf->lock != NULL) {
+        lock_functions.lock(buf->lock);
+    }
+#else
+    (void) buf;
+#endif
+}
+
+static void
+buffer_unlock(bfy_buffer const* buf) {
+#ifndef BFY_DISABLE_LOCKING
+    if (buf->lock != NULL) {
+        lock_functions.unlock(buf->lock);
+    }
+#else
+    (void) buf;
+#endif
+}
+
+// lock two buffers in a consistent order to avoid lock-order deadlocks
+static void
+buffer_lock2(bfy_buffer const* a, bfy_buffer const* b) {
+    if (a < b) {
+        buffer_lock(a);
+        buffer_lock(b);
+    } else {
+        buffer_lock(b);
+        buffer_lock(a);
+    }
+}
+
+static void
+buffer_unlock2(bfy_buffer const* a, bfy_buffer const* b) {
+    buffer_unlock(a);
+    buffer_unlock(b);
+}
+
+void
+bfy_buffer_lock(bfy_buffer* buf) {
+    buffer_lock(buf);
+}
+
+void
+bfy_buffer_unlock(bfy_buffer* buf) {
+    buffer_unlock(buf);
+}
+
+int
+bfy_buffer_enable_locking(bfy_buffer* buf, void* lock) {
+#ifndef BFY_DISABLE_LOCKING
+    if (buf->lock != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (lock_functions.lock == NULL || lock_functions.unlock == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (lock == NULL) {
+        if (lock_functions.lock_new == NULL || (lock = lock_functions.lock_new()) == NULL) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        buf->lock_owned = 1;
+    }
+    buf->lock = lock;
+    return 0;
+#else
+    (void) buf;
+    (void) lock;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
 static size_t
 size_t_min(size_t a, size_t b) {
     return a < b ? a : b;
 }
 
+/// atomics
+
+static void*
+atomic_load_ptr(void* const* ptr) {
+#if defined(_MSC_VER)
+    return _InterlockedCompareExchangePointer((void* volatile*)ptr, NULL, NULL);
+#else
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static void*
+atomic_exchange_ptr(void** ptr, void* val) {
+#if defined(_MSC_VER)
+    return _InterlockedExchangePointer((void* volatile*)ptr, val);
+#else
+    return __atomic_exchange_n(ptr, val, __ATOMIC_ACQ_REL);
+#endif
+}
+
+// on failure, `expected` is updated to hold the current value
+static bool
+atomic_compare_exchange_ptr(void** ptr, void** expected, void* desired) {
+#if defined(_MSC_VER)
+    void* const prev = _InterlockedCompareExchangePointer((void* volatile*)ptr, desired, *expected);
+    if (prev == *expected) {
+        return true;
+    }
+    *expected = prev;
+    return false;
+#else
+    return __atomic_compare_exchange_n(ptr, expected, desired, false,
+                                       __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+#endif
+}
+
 struct bfy_pos {
     /* Which page this position is in. */
     size_t page_idx;
@@ -219,6 +351,61 @@ iter_advance_n_bytes(struct bfy_iter* const iter, size_t n) {
     return true;
 }
 
+// Walks the pages of [begin..end) back to front
+struct bfy_riter {
+    struct bfy_buffer const* buf;
+    struct bfy_pos begin;
+    size_t page_idx;
+    size_t page_len;     // content in the current page before the walk's position
+    size_t content_pos;  // content_pos of io.iov_base
+    struct bfy_iovec io;
+};
+
+static bool
+riter_impl_settle(struct bfy_riter* const iter, size_t seg_end) {
+    for (;;) {
+        size_t const skip = iter->page_idx == iter->begin.page_idx ? iter->begin.page_pos : 0;
+        if (iter->page_len > skip) {
+            struct bfy_page const* const page = pages_cbegin(iter->buf) + iter->page_idx;
+            iter->io.iov_base = (char*) page_read_cbegin(page) + skip;
+            iter->io.iov_len = iter->page_len - skip;
+            iter->content_pos = seg_end - iter->io.iov_len;
+            return true;
+        }
+        if (iter->page_idx == iter->begin.page_idx) {
+            return false;
+        }
+        --iter->page_idx;
+        iter->page_len = page_get_content_len(pages_cbegin(iter->buf) + iter->page_idx);
+    }
+}
+
+static bool
+riter_begin(struct bfy_riter* const iter,
+            struct bfy_buffer const* const buf,
+            struct bfy_pos begin,
+            struct bfy_pos end) {
+    if (begin.content_pos >= end.content_pos) {
+        return false;
+    }
+
+    iter->buf = buf;
+    iter->begin = begin;
+    iter->page_idx = end.page_idx;
+    iter->page_len = end.page_pos;
+    return riter_impl_settle(iter, end.content_pos);
+}
+
+static bool
+riter_prev_page(struct bfy_riter* const iter) {
+    if (iter->page_idx == iter->begin.page_idx) {
+        return false;
+    }
+    --iter->page_idx;
+    iter->page_len = page_get_content_len(pages_cbegin(iter->buf) + iter->page_idx);
+    return riter_impl_settle(iter, iter->content_pos);
+}
+
 ///  change notifications
 
 static void
@@ -231,23 +418,89 @@ buffer_reset_changed_info(bfy_buffer* buf) {
 
 void
 bfy_buffer_set_changed_cb(bfy_buffer* buf, bfy_changed_cb* cb, void* cb_data) {
+    buffer_lock(buf);
     buf->changed_cb = cb;
     buf->changed_data = cb_data;
     buffer_reset_changed_info(buf);
+    buffer_unlock(buf);
+}
+
+static bool
+buffer_has_pending_change(bfy_buffer const* buf) {
+    return buf->changed_cb != NULL
+        && buf->changed_muted == 0
+        && buf->changed_coalescing == 0
+        && (buf->changed_info.n_added != 0 || buf->changed_info.n_deleted != 0);
 }
 
 static void
-buffer_check_changed_cb(bfy_buffer* buf) {
-    if (buf->changed_cb == NULL) {
-        return;
+deferred_queue_push(bfy_deferred_queue* queue, bfy_buffer* buf) {
+    buf->deferred_pending = 1;
+    buf->deferred_next = NULL;
+
+    bool const was_empty = queue->head == NULL;
+    if (was_empty) {
+        queue->head = buf;
+    } else {
+        queue->tail->deferred_next = buf;
+    }
+    queue->tail = buf;
+
+    if (was_empty && queue->wakeup_cb != NULL) {
+        queue->wakeup_cb(queue, queue->wakeup_data);
+    }
+}
+
+// unlink `buf` from the list starting at `head`.
+// on success, `setme_prev` is set to the node before it, or NULL if it was first.
+static bool
+deferred_list_unlink(bfy_buffer** head, bfy_buffer* buf, bfy_buffer** setme_prev) {
+    bfy_buffer* prev = NULL;
+    for (bfy_buffer* walk = *head; walk != NULL; walk = walk->deferred_next) {
+        if (walk == buf) {
+            if (prev == NULL) {
+                *head = walk->deferred_next;
+            } else {
+                prev->deferred_next = walk->deferred_next;
+            }
+            *setme_prev = prev;
+            return true;
+        }
+        prev = walk;
     }
-    if (buf->changed_muted != 0) {
+    return false;
+}
+
+static void
+deferred_queue_remove(bfy_deferred_queue* queue, bfy_buffer* buf) {
+    // `buf` is either waiting for the next run or is still
+    // in the batch that bfy_run_deferred_callbacks() is working on
+    bfy_buffer* prev = NULL;
+    if (deferred_list_unlink(&queue->head, buf, &prev)) {
+        if (queue->tail == buf) {
+            queue->tail = prev;
+        }
+    } else {
+        deferred_list_unlink(&queue->running, buf, &prev);
+    }
+
+    buf->deferred_pending = 0;
+    buf->deferred_next = NULL;
+}
+
+static void
+buffer_check_changed_cb(bfy_buffer* buf) {
+    if (buf->deferred_pending) {
+        // already waiting for bfy_run_deferred_callbacks();
+        // the change info will keep accumulating until then
         return;
     }
-    if (buf->changed_coalescing != 0) {
+    if (!buffer_has_pending_change(buf)) {
         return;
     }
-    if (buf->changed_info.n_added == 0 && buf->changed_info.n_deleted == 0) {
+
+    if (buf->deferred != NULL) {
+        deferred_queue_push(buf->deferred, buf);
         return;
     }
 
@@ -287,8 +540,10 @@ bfy_buffer_unmute_change_events(bfy_buffer* buf) {
     }
 }
 
+// the lock is held until coalescing ends so that the batch is atomic
 void
 bfy_buffer_begin_coalescing_change_events(bfy_buffer* buf) {
+    buffer_lock(buf);
     ++buf->changed_coalescing;
 }
 
@@ -297,6 +552,94 @@ bfy_buffer_end_coalescing_change_events(bfy_buffer* buf) {
     if(--buf->changed_coalescing == 0) {
         buffer_check_changed_cb(buf);
     }
+    buffer_unlock(buf);
+}
+
+/// deferred callbacks
+
+void
+bfy_buffer_defer_callbacks(bfy_buffer* buf, bfy_deferred_queue* queue) {
+    buffer_lock(buf);
+    if (buf->deferred_pending) {
+        deferred_queue_remove(buf->deferred, buf);
+    }
+    buf->deferred = queue;
+    buffer_check_changed_cb(buf);
+    buffer_unlock(buf);
+}
+
+size_t
+bfy_run_deferred_callbacks(bfy_deferred_queue* queue) {
+    // Take the current batch. Buffers that change again during their
+    // callbacks are queued for the next run instead of this one,
+    // so a callback that keeps changing its buffer can't loop forever.
+    // The batch stays in `running` so that a callback which destroys
+    // or un-defers another buffer in it can still unlink that buffer.
+    // If a callback runs the queue itself, that nested run finishes
+    // the outer batch too, so append to whatever's still running.
+    bfy_buffer** batch_end = &queue->running;
+    while (*batch_end != NULL) {
+        batch_end = &(*batch_end)->deferred_next;
+    }
+    *batch_end = queue->head;
+    queue->head = queue->tail = NULL;
+
+    size_t n_invoked = 0;
+    while (queue->running != NULL) {
+        bfy_buffer* const buf = queue->running;
+        queue->running = buf->deferred_next;
+
+        buffer_lock(buf);
+        buf->deferred_pending = 0;
+        buf->deferred_next = NULL;
+        if (buffer_has_pending_change(buf)) {
+            // reset before invoking so that changes made by the
+            // callback itself are kept for the next run
+            struct bfy_changed_cb_info const info = buf->changed_info;
+            buffer_reset_changed_info(buf);
+            buf->changed_cb(buf, &info, buf->changed_data);
+            ++n_invoked;
+        }
+        buffer_unlock(buf);
+    }
+
+    return n_invoked;
+}
+
+void
+bfy_deferred_queue_set_wakeup_cb(bfy_deferred_queue* queue,
+                                 bfy_deferred_wakeup_cb* cb,
+                                 void* cb_data) {
+    queue->wakeup_cb = cb;
+    queue->wakeup_data = cb_data;
+}
+
+bfy_deferred_queue
+bfy_deferred_queue_init(void) {
+    bfy_deferred_queue const queue = {
+        .head = NULL
+    };
+    return queue;
+}
+
+bfy_deferred_queue*
+bfy_deferred_queue_new(void) {
+    bfy_deferred_queue* queue = allocator.malloc(sizeof(bfy_deferred_queue));
+    if (queue != NULL) {
+        *queue = bfy_deferred_queue_init();
+    }
+    return queue;
+}
+
+void
+bfy_deferred_queue_destruct(bfy_deferred_queue* queue) {
+    bfy_run_deferred_callbacks(queue);
+}
+
+void
+bfy_deferred_queue_free(bfy_deferred_queue* queue) {
+    bfy_deferred_queue_destruct(queue);
+    allocator.free(queue);
 }
 
 /// page memory management
@@ -400,15 +743,48 @@ buffer_get_pos(bfy_buffer const* buf, size_t content_pos) {
     return ret;
 }
 
+// Like buffer_get_pos(), but walks forward from `from` instead of from
+// the first page. `content_pos` must not be before `from`.
+static struct bfy_pos
+buffer_get_pos_from(bfy_buffer const* buf, struct bfy_pos from, size_t content_pos) {
+    if (content_pos >= buf->content_len) {
+        return buffer_get_pos(buf, content_pos);
+    }
+
+    struct bfy_page const* const begin = pages_cbegin(buf);
+    struct bfy_page const* const end = pages_cend(buf);
+    size_t page_begin = from.content_pos - from.page_pos;
+    for (struct bfy_page const* it = begin + from.page_idx; it != end; ++it) {
+        size_t const page_len = page_get_content_len(it);
+        if (content_pos < page_begin + page_len) {
+            struct bfy_pos const ret = {
+                .page_idx = it - begin,
+                .page_pos = content_pos - page_begin,
+                .content_pos = content_pos
+            };
+            return ret;
+        }
+        page_begin += page_len;
+    }
+
+    return buffer_get_pos(buf, SIZE_MAX);
+}
+
 size_t
 bfy_buffer_get_content_len(bfy_buffer const* buf) {
+    buffer_lock(buf);
     assert(buf->content_len == buffer_get_pos(buf, SIZE_MAX).content_pos);
-    return buf->content_len;
+    size_t const len = buf->content_len;
+    buffer_unlock(buf);
+    return len;
 }
 
 size_t
 bfy_buffer_get_space_len(bfy_buffer const* buf) {
-    return page_get_space_len(pages_cback(buf));
+    buffer_lock(buf);
+    size_t const len = page_get_space_len(pages_cback(buf));
+    buffer_unlock(buf);
+    return len;
 }
 
 /// peek
@@ -420,6 +796,7 @@ bfy_buffer_peek_range(bfy_buffer const* buf,
     size_t needed = 0;
     struct bfy_iovec const* const vec_end = vec + n_vec;
 
+    buffer_lock(buf);
     struct bfy_iter iter;
     if (iter_begin(&iter, buf, buffer_get_pos(buf, begin_at), buffer_get_pos(buf, end_at))) do {
         ++needed;
@@ -427,6 +804,7 @@ bfy_buffer_peek_range(bfy_buffer const* buf,
             *vec++ = iter.io;
         }
     } while (iter_next_page(&iter));
+    buffer_unlock(buf);
 
     return needed;
 }
@@ -551,36 +929,6 @@ page_peek_space(struct bfy_page const* page) {
     return vec;
 }
 
-struct bfy_iovec
-bfy_buffer_peek_space(struct bfy_buffer* buf) {
-    return page_peek_space(pages_back(buf));
-}
-
-struct bfy_iovec
-bfy_buffer_reserve_space(struct bfy_buffer* buf, size_t wanted) {
-    bfy_buffer_ensure_space(buf, wanted);
-    struct bfy_iovec io = bfy_buffer_peek_space(buf);
-    io.iov_len = size_t_min(io.iov_len, wanted);
-    return io;
-}
-
-int
-bfy_buffer_commit_space(struct bfy_buffer* buf, size_t len) {
-    size_t n_committed = 0;
-
-    struct bfy_page* page = buffer_get_writable_back(buf);
-    if (page != NULL) {
-        size_t const n_writable = page_get_space_len(page);
-        assert (len <= n_writable);
-        len = size_t_min(len, n_writable);
-        page->write_pos += len;
-        n_committed = len;
-        buffer_record_content_added(buf, len);
-    }
-
-    return n_committed == len ? 0 : -1;
-}
-
 // move all the content to the beginning of the page
 static void
 page_make_space_contiguous(struct bfy_page* page) {
@@ -592,8 +940,8 @@ page_make_space_contiguous(struct bfy_page* page) {
     }
 }
 
-int
-bfy_buffer_ensure_space(bfy_buffer* buf, size_t len) {
+static int
+buffer_ensure_space(bfy_buffer* buf, size_t len) {
     struct bfy_page* page = pages_back(buf);
     if (page_is_writable(page)) {
         size_t const space_len = page_get_space_len(page);
@@ -616,6 +964,68 @@ bfy_buffer_ensure_space(bfy_buffer* buf, size_t len) {
     return -1;
 }
 
+int
+bfy_buffer_ensure_space(bfy_buffer* buf, size_t len) {
+    buffer_lock(buf);
+    int const ret = buffer_ensure_space(buf, len);
+    buffer_unlock(buf);
+    return ret;
+}
+
+static struct bfy_iovec
+buffer_peek_space(struct bfy_buffer* buf) {
+    return page_peek_space(pages_back(buf));
+}
+
+struct bfy_iovec
+bfy_buffer_peek_space(struct bfy_buffer* buf) {
+    buffer_lock(buf);
+    struct bfy_iovec const io = buffer_peek_space(buf);
+    buffer_unlock(buf);
+    return io;
+}
+
+static struct bfy_iovec
+buffer_reserve_space(struct bfy_buffer* buf, size_t wanted) {
+    buffer_ensure_space(buf, wanted);
+    struct bfy_iovec io = buffer_peek_space(buf);
+    io.iov_len = size_t_min(io.iov_len, wanted);
+    return io;
+}
+
+struct bfy_iovec
+bfy_buffer_reserve_space(struct bfy_buffer* buf, size_t wanted) {
+    buffer_lock(buf);
+    struct bfy_iovec const io = buffer_reserve_space(buf, wanted);
+    buffer_unlock(buf);
+    return io;
+}
+
+static int
+buffer_commit_space(struct bfy_buffer* buf, size_t len) {
+    size_t n_committed = 0;
+
+    struct bfy_page* page = buffer_get_writable_back(buf);
+    if (page != NULL) {
+        size_t const n_writable = page_get_space_len(page);
+        assert (len <= n_writable);
+        len = size_t_min(len, n_writable);
+        page->write_pos += len;
+        n_committed = len;
+        buffer_record_content_added(buf, len);
+    }
+
+    return n_committed == len ? 0 : -1;
+}
+
+int
+bfy_buffer_commit_space(struct bfy_buffer* buf, size_t len) {
+    buffer_lock(buf);
+    int const ret = buffer_commit_space(buf, len);
+    buffer_unlock(buf);
+    return ret;
+}
+
 /// add
 
 int
@@ -627,7 +1037,10 @@ bfy_buffer_add_readonly(bfy_buffer* buf, const void* data, size_t len) {
         .write_pos = len,
         .flags = BFY_PAGE_FLAGS_READONLY | BFY_PAGE_FLAGS_UNMANAGED
     };
-    return buffer_append_pages(buf, &page, 1);
+    buffer_lock(buf);
+    int const ret = buffer_append_pages(buf, &page, 1);
+    buffer_unlock(buf);
+    return ret;
 }
 
 int
@@ -643,17 +1056,28 @@ bfy_buffer_add_reference(bfy_buffer* buf,
         .unref_cb = cb,
         .unref_arg = unref_arg
     };
-    return buffer_append_pages(buf, &page, 1);
+    buffer_lock(buf);
+    int const ret = buffer_append_pages(buf, &page, 1);
+    buffer_unlock(buf);
+    return ret;
 }
 
-int
-bfy_buffer_add(bfy_buffer* buf, const void* data, size_t len) {
-    struct bfy_iovec const io = bfy_buffer_reserve_space(buf, len);
+static int
+buffer_add(bfy_buffer* buf, const void* data, size_t len) {
+    struct bfy_iovec const io = buffer_reserve_space(buf, len);
     if (data == NULL || io.iov_base == NULL || io.iov_len < len) {
         return -1;
     }
     memcpy(io.iov_base, data, len);
-    return bfy_buffer_commit_space(buf, len);
+    return buffer_commit_space(buf, len);
+}
+
+int
+bfy_buffer_add(bfy_buffer* buf, const void* data, size_t len) {
+    buffer_lock(buf);
+    int const ret = buffer_add(buf, data, len);
+    buffer_unlock(buf);
+    return ret;
 }
 
 int
@@ -670,10 +1094,10 @@ bfy_buffer_add_printf(bfy_buffer* buf, char const* fmt, ...) {
     return ret;
 }
 
-int
-bfy_buffer_add_vprintf(bfy_buffer* buf, char const* fmt, va_list args_in) {
+static int
+buffer_add_vprintf(bfy_buffer* buf, char const* fmt, va_list args_in) {
     // see if we can print it into already-available space
-    struct bfy_iovec space = bfy_buffer_peek_space(buf);
+    struct bfy_iovec space = buffer_peek_space(buf);
     va_list args;
     va_copy(args, args_in);
     size_t n = vsnprintf(space.iov_base, space.iov_len, fmt, args);
@@ -692,7 +1116,7 @@ bfy_buffer_add_vprintf(bfy_buffer* buf, char const* fmt, va_list args_in) {
         ++space_wanted;
     }
     if (space_wanted > space.iov_len) {
-        space = bfy_buffer_reserve_space(buf, space_wanted);
+        space = buffer_reserve_space(buf, space_wanted);
         va_copy(args, args_in);
         n = vsnprintf(space.iov_base, space.iov_len, fmt, args);
         va_end(args);
@@ -700,12 +1124,20 @@ bfy_buffer_add_vprintf(bfy_buffer* buf, char const* fmt, va_list args_in) {
 
     // if we succeeded, commit our work
     if (n < space.iov_len) {
-        return bfy_buffer_commit_space(buf, n);
+        return buffer_commit_space(buf, n);
     }
 
     return -1;
 }
 
+int
+bfy_buffer_add_vprintf(bfy_buffer* buf, char const* fmt, va_list args) {
+    buffer_lock(buf);
+    int const ret = buffer_add_vprintf(buf, fmt, args);
+    buffer_unlock(buf);
+    return ret;
+}
+
 int
 bfy_buffer_add_hton_u8(struct bfy_buffer* buf, uint8_t addme) {
     return bfy_buffer_add(buf, &addme, 1);
@@ -729,25 +1161,549 @@ bfy_buffer_add_hton_u64(struct bfy_buffer* buf, uint64_t addme) {
     return bfy_buffer_add(buf, &be, sizeof(be));
 }
 
+int
+bfy_buffer_add_le_u16(struct bfy_buffer* buf, uint16_t addme) {
+    uint16_t const le = htol16(addme);
+    return bfy_buffer_add(buf, &le, sizeof(le));
+}
+
+int
+bfy_buffer_add_le_u32(struct bfy_buffer* buf, uint32_t addme) {
+    uint32_t const le = htol32(addme);
+    return bfy_buffer_add(buf, &le, sizeof(le));
+}
+
+int
+bfy_buffer_add_le_u64(struct bfy_buffer* buf, uint64_t addme) {
+    uint64_t const le = htol64(addme);
+    return bfy_buffer_add(buf, &le, sizeof(le));
+}
+
+int
+bfy_buffer_add_le_float(struct bfy_buffer* buf, float addme) {
+    uint32_t bits;
+    memcpy(&bits, &addme, sizeof(bits));
+    return bfy_buffer_add_le_u32(buf, bits);
+}
+
+int
+bfy_buffer_add_le_double(struct bfy_buffer* buf, double addme) {
+    uint64_t bits;
+    memcpy(&bits, &addme, sizeof(bits));
+    return bfy_buffer_add_le_u64(buf, bits);
+}
+
 int
 bfy_buffer_add_pagebreak(struct bfy_buffer* buf) {
     struct bfy_page page = InitPage;
-    return buffer_append_pages(buf, &page, 1);
+    buffer_lock(buf);
+    int const ret = buffer_append_pages(buf, &page, 1);
+    buffer_unlock(buf);
+    return ret;
 }
 
+static size_t buffer_remove_buffer(bfy_buffer* buf, size_t wanted, bfy_buffer* tgt);
+
 int
 bfy_buffer_add_buffer(bfy_buffer* buf, bfy_buffer* src) {
-    size_t const new_content_len = bfy_buffer_get_content_len(src);
-    return new_content_len == bfy_buffer_remove_buffer(src, new_content_len, buf) ? 0 : -1;
+    buffer_lock2(buf, src);
+    size_t const new_content_len = src->content_len;
+    int const ret = new_content_len == buffer_remove_buffer(src, new_content_len, buf) ? 0 : -1;
+    buffer_unlock2(buf, src);
+    return ret;
 }
 
-/// drain
+/// number formatting
 
-enum {
-    // pages will usually release their memory when draining,
-    // but we need to skip that if the page is being given
-    // to another buffer
-    DRAIN_FLAG_NORELEASE = (1<<0),
+// Long enough for any number formatted below, e.g. "-1.7976931348623157e+308"
+enum { FORMAT_MAX_LEN = 32 };
+
+static char const digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static size_t
+count_dec_digits(uint64_t val) {
+    size_t n = 1;
+    for (;;) {
+        if (val < 10) return n;
+        if (val < 100) return n + 1;
+        if (val < 1000) return n + 2;
+        if (val < 10000) return n + 3;
+        val /= 10000;
+        n += 4;
+    }
+}
+
+// Writes `val` in decimal, two digits at a time from the back.
+// Returns how many chars were written.
+static size_t
+format_u64_dec(char* out, uint64_t val) {
+    size_t const len = count_dec_digits(val);
+    char* p = out + len;
+    while (val >= 100) {
+        size_t const i = (size_t)(val % 100) * 2;
+        val /= 100;
+        *--p = digit_pairs[i + 1];
+        *--p = digit_pairs[i];
+    }
+    if (val >= 10) {
+        *--p = digit_pairs[val * 2 + 1];
+        *--p = digit_pairs[val * 2];
+    } else {
+        *--p = (char)('0' + val);
+    }
+    return len;
+}
+
+static size_t
+format_i64_dec(char* out, int64_t val) {
+    if (val >= 0) {
+        return format_u64_dec(out, (uint64_t) val);
+    }
+    *out = '-';
+    return 1 + format_u64_dec(out + 1, 0 - (uint64_t) val);
+}
+
+static size_t
+format_u64_hex(char* out, uint64_t val) {
+    size_t len = 1;
+    while (len < 16 && (val >> (len * 4)) != 0) {
+        ++len;
+    }
+    for (char* p = out + len; p != out; val >>= 4) {
+        *--p = "0123456789abcdef"[val & 0xF];
+    }
+    return len;
+}
+
+// Shortest round-trip doubles with Grisu2, from Florian Loitsch's
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers".
+// It always round-trips and finds the shortest digits for all but a
+// tiny fraction of doubles, which get one digit more than needed.
+
+// A floating-point number f * 2^e with a 64-bit significand
+struct diyfp {
+    uint64_t f;
+    int e;
+};
+
+static struct diyfp
+diyfp_sub(struct diyfp x, struct diyfp y) {
+    struct diyfp const ret = { x.f - y.f, x.e };
+    return ret;
+}
+
+// The upper 64 bits of the 128-bit product, rounded
+static struct diyfp
+diyfp_mul(struct diyfp x, struct diyfp y) {
+    uint64_t const x_lo = x.f & 0xFFFFFFFFu;
+    uint64_t const x_hi = x.f >> 32;
+    uint64_t const y_lo = y.f & 0xFFFFFFFFu;
+    uint64_t const y_hi = y.f >> 32;
+    uint64_t const p0 = x_lo * y_lo;
+    uint64_t const p1 = x_lo * y_hi;
+    uint64_t const p2 = x_hi * y_lo;
+    uint64_t const p3 = x_hi * y_hi;
+    uint64_t mid = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
+    mid += UINT64_C(1) << 31;
+    struct diyfp const ret = { p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32), x.e + y.e + 64 };
+    return ret;
+}
+
+static struct diyfp
+diyfp_normalize(struct diyfp x) {
+    while ((x.f >> 56) == 0) {
+        x.f <<= 8;
+        x.e -= 8;
+    }
+    while ((x.f >> 63) == 0) {
+        x.f <<= 1;
+        --x.e;
+    }
+    return x;
+}
+
+// 10^k, normalized, for k = -300, -292, ..., 340
+struct cached_power {
+    uint64_t f;
+    int e;
+    int k;
+};
+
+static struct cached_power const cached_powers[] = {
+    { UINT64_C(0xAB70FE17C79AC6CA), -1060, -300 },
+    { UINT64_C(0xFF77B1FCBEBCDC4F), -1034, -292 },
+    { UINT64_C(0xBE5691EF416BD60C), -1007, -284 },
+    { UINT64_C(0x8DD01FAD907FFC3C),  -980, -276 },
+    { UINT64_C(0xD3515C2831559A83),  -954, -268 },
+    { UINT64_C(0x9D71AC8FADA6C9B5),  -927, -260 },
+    { UINT64_C(0xEA9C227723EE8BCB),  -901, -252 },
+    { UINT64_C(0xAECC49914078536D),  -874, -244 },
+    { UINT64_C(0x823C12795DB6CE57),  -847, -236 },
+    { UINT64_C(0xC21094364DFB5637),  -821, -228 },
+    { UINT64_C(0x9096EA6F3848984F),  -794, -220 },
+    { UINT64_C(0xD77485CB25823AC7),  -768, -212 },
+    { UINT64_C(0xA086CFCD97BF97F4),  -741, -204 },
+    { UINT64_C(0xEF340A98172AACE5),  -715, -196 },
+    { UINT64_C(0xB23867FB2A35B28E),  -688, -188 },
+    { UINT64_C(0x84C8D4DFD2C63F3B),  -661, -180 },
+    { UINT64_C(0xC5DD44271AD3CDBA),  -635, -172 },
+    { UINT64_C(0x936B9FCEBB25C996),  -608, -164 },
+    { UINT64_C(0xDBAC6C247D62A584),  -582, -156 },
+    { UINT64_C(0xA3AB66580D5FDAF6),  -555, -148 },
+    { UINT64_C(0xF3E2F893DEC3F126),  -529, -140 },
+    { UINT64_C(0xB5B5ADA8AAFF80B8),  -502, -132 },
+    { UINT64_C(0x87625F056C7C4A8B),  -475, -124 },
+    { UINT64_C(0xC9BCFF6034C13053),  -449, -116 },
+    { UINT64_C(0x964E858C91BA2655),  -422, -108 },
+    { UINT64_C(0xDFF9772470297EBD),  -396, -100 },
+    { UINT64_C(0xA6DFBD9FB8E5B88F),  -369,  -92 },
+    { UINT64_C(0xF8A95FCF88747D94),  -343,  -84 },
+    { UINT64_C(0xB94470938FA89BCF),  -316,  -76 },
+    { UINT64_C(0x8A08F0F8BF0F156B),  -289,  -68 },
+    { UINT64_C(0xCDB02555653131B6),  -263,  -60 },
+    { UINT64_C(0x993FE2C6D07B7FAC),  -236,  -52 },
+    { UINT64_C(0xE45C10C42A2B3B06),  -210,  -44 },
+    { UINT64_C(0xAA242499697392D3),  -183,  -36 },
+    { UINT64_C(0xFD87B5F28300CA0E),  -157,  -28 },
+    { UINT64_C(0xBCE5086492111AEB),  -130,  -20 },
+    { UINT64_C(0x8CBCCC096F5088CC),  -103,  -12 },
+    { UINT64_C(0xD1B71758E219652C),   -77,   -4 },
+    { UINT64_C(0x9C40000000000000),   -50,    4 },
+    { UINT64_C(0xE8D4A51000000000),   -24,   12 },
+    { UINT64_C(0xAD78EBC5AC620000),     3,   20 },
+    { UINT64_C(0x813F3978F8940984),    30,   28 },
+    { UINT64_C(0xC097CE7BC90715B3),    56,   36 },
+    { UINT64_C(0x8F7E32CE7BEA5C70),    83,   44 },
+    { UINT64_C(0xD5D238A4ABE98068),   109,   52 },
+    { UINT64_C(0x9F4F2726179A2245),   136,   60 },
+    { UINT64_C(0xED63A231D4C4FB27),   162,   68 },
+    { UINT64_C(0xB0DE65388CC8ADA8),   189,   76 },
+    { UINT64_C(0x83C7088E1AAB65DB),   216,   84 },
+    { UINT64_C(0xC45D1DF942711D9A),   242,   92 },
+    { UINT64_C(0x924D692CA61BE758),   269,  100 },
+    { UINT64_C(0xDA01EE641A708DEA),   295,  108 },
+    { UINT64_C(0xA26DA3999AEF774A),   322,  116 },
+    { UINT64_C(0xF209787BB47D6B85),   348,  124 },
+    { UINT64_C(0xB454E4A179DD1877),   375,  132 },
+    { UINT64_C(0x865B86925B9BC5C2),   402,  140 },
+    { UINT64_C(0xC83553C5C8965D3D),   428,  148 },
+    { UINT64_C(0x952AB45CFA97A0B3),   455,  156 },
+    { UINT64_C(0xDE469FBD99A05FE3),   481,  164 },
+    { UINT64_C(0xA59BC234DB398C25),   508,  172 },
+    { UINT64_C(0xF6C69A72A3989F5C),   534,  180 },
+    { UINT64_C(0xB7DCBF5354E9BECE),   561,  188 },
+    { UINT64_C(0x88FCF317F22241E2),   588,  196 },
+    { UINT64_C(0xCC20CE9BD35C78A5),   614,  204 },
+    { UINT64_C(0x98165AF37B2153DF),   641,  212 },
+    { UINT64_C(0xE2A0B5DC971F303A),   667,  220 },
+    { UINT64_C(0xA8D9D1535CE3B396),   694,  228 },
+    { UINT64_C(0xFB9B7CD9A4A7443C),   720,  236 },
+    { UINT64_C(0xBB764C4CA7A44410),   747,  244 },
+    { UINT64_C(0x8BAB8EEFB6409C1A),   774,  252 },
+    { UINT64_C(0xD01FEF10A657842C),   800,  260 },
+    { UINT64_C(0x9B10A4E5E9913129),   827,  268 },
+    { UINT64_C(0xE7109BFBA19C0C9D),   853,  276 },
+    { UINT64_C(0xAC2820D9623BF429),   880,  284 },
+    { UINT64_C(0x80444B5E7AA7CF85),   907,  292 },
+    { UINT64_C(0xBF21E44003ACDD2D),   933,  300 },
+    { UINT64_C(0x8E679C2F5E44FF8F),   960,  308 },
+    { UINT64_C(0xD433179D9C8CB841),   986,  316 },
+    { UINT64_C(0x9E19DB92B4E31BA9),  1013,  324 },
+    { UINT64_C(0xEB96BF6EBADF77D9),  1039,  332 },
+    { UINT64_C(0xAF87023B9BF0EE6B),  1066,  340 },
+};
+
+// Finds a cached power c = 10^-k such that scaling a number with
+// binary exponent `e` by c puts its exponent in [-60, -32], which
+// leaves the integer part of the scaled number in 32 bits
+static struct cached_power
+get_cached_power(int e) {
+    int const f = -60 - e - 1;
+    int const k = (f * 78913) / (1 << 18) + (f > 0);  // ceil(f * log10(2))
+    int const idx = (300 + k + 7) / 8;
+    return cached_powers[idx];
+}
+
+// Steps the last digit down while that brings it closer to the exact value
+static void
+grisu2_round(char* digits, size_t len, uint64_t dist, uint64_t delta,
+             uint64_t rest, uint64_t ten_k) {
+    while (rest < dist && delta - rest >= ten_k &&
+           (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+        --digits[len - 1];
+        rest += ten_k;
+    }
+}
+
+// Generates the shortest digits in (m_minus, m_plus) that are closest to w.
+// Returns how many digits were written and adds to `exponent` as needed.
+static size_t
+grisu2_digits(char* digits, int* exponent,
+              struct diyfp m_minus, struct diyfp w, struct diyfp m_plus) {
+    static uint32_t const pow10s[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+    };
+    uint64_t delta = diyfp_sub(m_plus, m_minus).f;
+    uint64_t dist = diyfp_sub(m_plus, w).f;
+    int const shift = -m_plus.e;
+    uint64_t const one = UINT64_C(1) << shift;
+    uint32_t p1 = (uint32_t)(m_plus.f >> shift);  // integer part
+    uint64_t p2 = m_plus.f & (one - 1);            // fractional part
+    size_t len = 0;
+
+    int n = 10;
+    while (n > 1 && p1 < pow10s[n - 1]) {
+        --n;
+    }
+    while (n > 0) {
+        uint32_t const pow10 = pow10s[n - 1];
+        digits[len++] = (char)('0' + p1 / pow10);
+        p1 %= pow10;
+        --n;
+        uint64_t const rest = ((uint64_t) p1 << shift) + p2;
+        if (rest <= delta) {
+            *exponent += n;
+            grisu2_round(digits, len, dist, delta, rest, (uint64_t) pow10 << shift);
+            return len;
+        }
+    }
+
+    int m = 0;
+    for (;;) {
+        p2 *= 10;
+        digits[len++] = (char)('0' + (p2 >> shift));
+        p2 &= one - 1;
+        ++m;
+        delta *= 10;
+        dist *= 10;
+        if (p2 <= delta) {
+            break;
+        }
+    }
+    *exponent -= m;
+    grisu2_round(digits, len, dist, delta, p2, one);
+    return len;
+}
+
+// Writes the shortest digits of a positive, finite double.
+// Returns how many digits were written; the value is digits * 10^exponent.
+static size_t
+grisu2(char* digits, int* exponent, double val) {
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    uint64_t const hidden_bit = UINT64_C(1) << 52;
+    uint64_t const frac = bits & (hidden_bit - 1);
+    int const biased_e = (int)(bits >> 52);
+
+    struct diyfp const v = biased_e == 0
+        ? (struct diyfp) { frac, 1 - 1075 }
+        : (struct diyfp) { frac + hidden_bit, biased_e - 1075 };
+
+    // the boundaries halfway to the neighboring doubles. At a power
+    // of two, the gap to the next double down is half as big.
+    struct diyfp const w_plus = diyfp_normalize((struct diyfp) { 2 * v.f + 1, v.e - 1 });
+    struct diyfp w_minus = frac == 0 && biased_e > 1
+        ? (struct diyfp) { 4 * v.f - 1, v.e - 2 }
+        : (struct diyfp) { 2 * v.f - 1, v.e - 1 };
+    w_minus.f <<= w_minus.e - w_plus.e;
+    w_minus.e = w_plus.e;
+
+    struct cached_power const cached = get_cached_power(w_plus.e);
+    struct diyfp const c = { cached.f, cached.e };
+    struct diyfp const w = diyfp_mul(diyfp_normalize(v), c);
+    struct diyfp m_minus = diyfp_mul(w_minus, c);
+    struct diyfp m_plus = diyfp_mul(w_plus, c);
+
+    // the products may be off by one ulp, so narrow the range to be safe
+    ++m_minus.f;
+    --m_plus.f;
+
+    *exponent = -cached.k;
+    return grisu2_digits(digits, exponent, m_minus, w, m_plus);
+}
+
+// Writes a double's shortest round-trip form in the style of
+// JavaScript's Number.prototype.toString(), e.g. "100", "0.1",
+// "1.5e-7", or "1e+21". Returns how many chars were written.
+static size_t
+format_double(char* out, double val) {
+    char* p = out;
+    if (isnan(val)) {
+        memcpy(p, "nan", 3);
+        return 3;
+    }
+    if (signbit(val)) {
+        *p++ = '-';
+        val = -val;
+    }
+    if (val == 0) {
+        *p++ = '0';
+        return (size_t)(p - out);
+    }
+    if (isinf(val)) {
+        memcpy(p, "inf", 3);
+        return (size_t)(p - out) + 3;
+    }
+
+    char digits[18];
+    int exponent;
+    int const k = (int) grisu2(digits, &exponent, val);
+    int const n = k + exponent;  // where the decimal point goes
+
+    if (k <= n && n <= 21) {
+        // an integer: 1234500
+        memcpy(p, digits, (size_t) k);
+        memset(p + k, '0', (size_t)(n - k));
+        p += n;
+    } else if (0 < n && n <= 21) {
+        // 1234.5
+        memcpy(p, digits, (size_t) n);
+        p[n] = '.';
+        memcpy(p + n + 1, digits + n, (size_t)(k - n));
+        p += k + 1;
+    } else if (-6 < n && n <= 0) {
+        // 0.0012345
+        p[0] = '0';
+        p[1] = '.';
+        memset(p + 2, '0', (size_t) -n);
+        memcpy(p + 2 - n, digits, (size_t) k);
+        p += 2 - n + k;
+    } else {
+        // 1.2345e-7
+        *p++ = digits[0];
+        if (k > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, (size_t)(k - 1));
+            p += k - 1;
+        }
+        int const e = n - 1;
+        *p++ = 'e';
+        *p++ = e < 0 ? '-' : '+';
+        p += format_u64_dec(p, (uint64_t)(e < 0 ? -e : e));
+    }
+    return (size_t)(p - out);
+}
+
+// Returns where to format a number of up to FORMAT_MAX_LEN chars:
+// straight into the buffer's free space if there's room, or else
+// into `tmp`, so that no more space is reserved than is used
+static char*
+buffer_format_begin(bfy_buffer* buf, char* tmp) {
+    struct bfy_iovec const space = buffer_peek_space(buf);
+    return space.iov_len >= FORMAT_MAX_LEN ? space.iov_base : tmp;
+}
+
+static int
+buffer_format_end(bfy_buffer* buf, char const* out, char const* tmp, size_t len) {
+    return out == tmp ? buffer_add(buf, tmp, len) : buffer_commit_space(buf, len);
+}
+
+int
+bfy_buffer_add_u64_dec(bfy_buffer* buf, uint64_t addme) {
+    char tmp[FORMAT_MAX_LEN];
+    buffer_lock(buf);
+    char* const out = buffer_format_begin(buf, tmp);
+    int const ret = buffer_format_end(buf, out, tmp, format_u64_dec(out, addme));
+    buffer_unlock(buf);
+    return ret;
+}
+
+int
+bfy_buffer_add_i64_dec(bfy_buffer* buf, int64_t addme) {
+    char tmp[FORMAT_MAX_LEN];
+    buffer_lock(buf);
+    char* const out = buffer_format_begin(buf, tmp);
+    int const ret = buffer_format_end(buf, out, tmp, format_i64_dec(out, addme));
+    buffer_unlock(buf);
+    return ret;
+}
+
+int
+bfy_buffer_add_u64_hex(bfy_buffer* buf, uint64_t addme) {
+    char tmp[FORMAT_MAX_LEN];
+    buffer_lock(buf);
+    char* const out = buffer_format_begin(buf, tmp);
+    int const ret = buffer_format_end(buf, out, tmp, format_u64_hex(out, addme));
+    buffer_unlock(buf);
+    return ret;
+}
+
+int
+bfy_buffer_add_double(bfy_buffer* buf, double addme) {
+    char tmp[FORMAT_MAX_LEN];
+    buffer_lock(buf);
+    char* const out = buffer_format_begin(buf, tmp);
+    int const ret = buffer_format_end(buf, out, tmp, format_double(out, addme));
+    buffer_unlock(buf);
+    return ret;
+}
+
+/// writer
+
+bfy_writer
+bfy_writer_init(bfy_buffer* buf) {
+    buffer_lock(buf);
+    bfy_writer const w = {
+        .buf = buf,
+        .begin = NULL,
+        .pos = NULL,
+        .end = NULL
+    };
+    return w;
+}
+
+int
+bfy_writer_flush(bfy_writer* w) {
+    size_t const n_pending = w->pos - w->begin;
+    w->begin = w->pos;
+    return n_pending != 0 ? buffer_commit_space(w->buf, n_pending) : 0;
+}
+
+int
+bfy_writer_reserve(bfy_writer* w, size_t len) {
+    int ret = bfy_writer_flush(w);
+    w->begin = w->pos = w->end = NULL;
+
+    if (ret == 0) {
+        struct bfy_iovec io = buffer_reserve_space(w->buf, len);
+        if (io.iov_base != NULL && io.iov_len >= len) {
+            // take all the free space, not just `len`,
+            // so that the next appends don't need to come back here
+            io = buffer_peek_space(w->buf);
+            w->begin = w->pos = io.iov_base;
+            w->end = w->begin + io.iov_len;
+        } else {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+void
+bfy_writer_destruct(bfy_writer* w) {
+    bfy_writer_flush(w);
+    buffer_unlock(w->buf);
+    w->begin = w->pos = w->end = NULL;
+}
+
+/// drain
+
+enum {
+    // pages will usually release their memory when draining,
+    // but we need to skip that if the page is being given
+    // to another buffer
+    DRAIN_FLAG_NORELEASE = (1<<0),
 
     // buffer usually recycles a page for subsequent use,
     // but we need to skip that if the buffer is being destroyed
@@ -820,7 +1776,10 @@ buffer_drain_range(bfy_buffer* const buf,
         if (recycle.size > 0) {
             *keep++ = recycle;
         }
-        buf->n_pages = keep - pages_cbegin(buf);
+        // n_pages only counts pages in buf->pages, not buf->page
+        if (buf->pages != NULL) {
+            buf->n_pages = keep - pages_cbegin(buf);
+        }
     }
 
     // if we've drained everything, remove the page containers
@@ -831,16 +1790,36 @@ buffer_drain_range(bfy_buffer* const buf,
     }
 
     assert(n_drained == (end.content_pos - begin.content_pos));
+    if (begin.content_pos == 0) {
+        buf->n_drained_front += n_drained;
+    }
     buffer_record_content_removed(buf, n_drained);
     return n_drained;
 }
 
+// Drains the first `len` bytes. When they're all in the first page and
+// don't empty it, skip buffer_drain_range()'s page walks and compaction.
+static void
+buffer_drain_front(bfy_buffer* buf, size_t len) {
+    struct bfy_page* const page = pages_begin(buf);
+    if (len < page_get_content_len(page)) {
+        page->read_pos += len;
+        buf->n_drained_front += len;
+        buffer_record_content_removed(buf, len);
+    } else {
+        buffer_drain_range(buf, buffer_get_pos(buf, 0), buffer_get_pos(buf, len), 0);
+    }
+}
+
 size_t
 bfy_buffer_drain_range(bfy_buffer* buf, size_t begin, size_t end) {
-    return buffer_drain_range(buf,
-                              buffer_get_pos(buf, begin),
-                              buffer_get_pos(buf, end),
-                              0);
+    buffer_lock(buf);
+    size_t const ret = buffer_drain_range(buf,
+                                          buffer_get_pos(buf, begin),
+                                          buffer_get_pos(buf, end),
+                                          0);
+    buffer_unlock(buf);
+    return ret;
 }
 
 size_t
@@ -861,6 +1840,89 @@ bfy_buffer_drain_all(bfy_buffer* buf) {
     return bfy_buffer_drain_range(buf, 0, SIZE_MAX);
 }
 
+/// reader
+
+static void
+reader_set_page(bfy_reader* r, size_t page_idx) {
+    struct bfy_page const* const page = pages_cbegin(r->buf) + page_idx;
+    r->page_idx = page_idx;
+    r->page_begin = r->pos = page_read_cbegin(page);
+    r->end = r->pos + page_get_content_len(page);
+}
+
+// step past exhausted pages so the next read can take the fast path
+static void
+reader_skip_empty_pages(bfy_reader* r) {
+    size_t const n_pages = buffer_count_pages(r->buf);
+    while (r->pos == r->end && r->page_idx + 1 < n_pages) {
+        r->n_before += (size_t)(r->end - r->page_begin);
+        reader_set_page(r, r->page_idx + 1);
+    }
+}
+
+static size_t
+reader_get_n_read(bfy_reader const* r) {
+    return r->n_before + (size_t)(r->pos - r->page_begin);
+}
+
+bfy_reader
+bfy_reader_init(bfy_buffer* buf) {
+    buffer_lock(buf);
+    bfy_reader r = {
+        .buf = buf,
+        .pos = NULL,
+        .end = NULL,
+        .page_idx = 0,
+        .page_begin = NULL,
+        .n_before = 0
+    };
+    if (buffer_count_pages(buf) > 0) {
+        reader_set_page(&r, 0);
+        reader_skip_empty_pages(&r);
+    }
+    return r;
+}
+
+size_t
+bfy_reader_get_content_len(bfy_reader const* r) {
+    return r->buf->content_len - reader_get_n_read(r);
+}
+
+int
+bfy_reader_read_pages(bfy_reader* r, void* vsetme, size_t len) {
+    if (len > bfy_reader_get_content_len(r)) {
+        errno = ENOMSG;
+        return -1;
+    }
+
+    unsigned char* setme = vsetme;
+    for (;;) {
+        size_t const n = size_t_min(len, (size_t)(r->end - r->pos));
+        memcpy(setme, r->pos, n);
+        setme += n;
+        r->pos += n;
+        len -= n;
+        if (len == 0) {
+            break;
+        }
+        r->n_before += (size_t)(r->end - r->page_begin);
+        reader_set_page(r, r->page_idx + 1);
+    }
+
+    reader_skip_empty_pages(r);
+    return 0;
+}
+
+void
+bfy_reader_destruct(bfy_reader* r) {
+    size_t const n_read = reader_get_n_read(r);
+    if (n_read > 0) {
+        buffer_drain_front(r->buf, n_read);
+    }
+    buffer_unlock(r->buf);
+    r->pos = r->end = r->page_begin = NULL;
+}
+
 /// copyout
 
 static size_t
@@ -885,16 +1947,107 @@ size_t
 bfy_buffer_copyout_range(bfy_buffer const* buf,
                          size_t begin, size_t end,
                          void* setme) {
-    return buffer_copyout(buf,
-                          buffer_get_pos(buf, begin),
-                          buffer_get_pos(buf, end),
-                          setme);
+    buffer_lock(buf);
+    size_t const ret = buffer_copyout(buf,
+                                      buffer_get_pos(buf, begin),
+                                      buffer_get_pos(buf, end),
+                                      setme);
+    buffer_unlock(buf);
+    return ret;
 }
 size_t
 bfy_buffer_copyout(bfy_buffer const* buf, size_t len, void* setme) {
     return bfy_buffer_copyout_range(buf, 0, len, setme);
 }
 
+/// parallel tasks
+
+// Split [begin..end) into n_parts ranges of nearly the same byte count.
+// `setme` must have room for n_parts + 1 positions; range i is
+// [setme[i]..setme[i+1]). Walks the pages once.
+static void
+buffer_split_range(bfy_buffer const* buf,
+                   struct bfy_pos begin, struct bfy_pos end,
+                   size_t n_parts, struct bfy_pos* setme) {
+    size_t const len = end.content_pos - begin.content_pos;
+    size_t const part_len = len / n_parts;
+    size_t const n_longer = len % n_parts;
+
+    struct bfy_iter iter;
+    setme[0] = begin;
+    if (iter_begin(&iter, buf, begin, end)) {
+        for (size_t i = 1; i < n_parts; ++i) {
+            iter_advance_n_bytes(&iter, part_len + (i <= n_longer ? 1 : 0));
+            setme[i] = iter.cur;
+        }
+    } else {
+        for (size_t i = 1; i < n_parts; ++i) {
+            setme[i] = begin;
+        }
+    }
+    setme[n_parts] = end;
+}
+
+struct copyout_tasks {
+    bfy_buffer const* buf;
+    struct bfy_pos const* bounds;
+    char* setme;
+};
+
+static void
+copyout_task(void* vtasks, size_t i) {
+    struct copyout_tasks const* const tasks = vtasks;
+    struct bfy_pos const begin = tasks->bounds[i];
+    struct bfy_pos const end = tasks->bounds[i + 1];
+    size_t const offset = begin.content_pos - tasks->bounds[0].content_pos;
+    buffer_copyout(tasks->buf, begin, end, tasks->setme + offset);
+}
+
+static size_t
+buffer_copyout_parallel(bfy_buffer const* buf,
+                        struct bfy_pos begin, struct bfy_pos end,
+                        void* setme, size_t n_tasks,
+                        bfy_run_tasks_cb* run_tasks, void* run_tasks_data) {
+    size_t const len = end.content_pos > begin.content_pos ? end.content_pos - begin.content_pos : 0;
+    n_tasks = size_t_min(n_tasks, len);
+    if (n_tasks <= 1 || run_tasks == NULL) {
+        return len == 0 ? 0 : buffer_copyout(buf, begin, end, setme);
+    }
+
+    struct bfy_pos* bounds = allocator.malloc(sizeof(struct bfy_pos) * (n_tasks + 1));
+    if (bounds == NULL) {
+        return buffer_copyout(buf, begin, end, setme);
+    }
+
+    // each range's destination offset is known up front,
+    // so the ranges can be copied independently
+    buffer_split_range(buf, begin, end, n_tasks, bounds);
+    struct copyout_tasks tasks = {
+        .buf = buf,
+        .bounds = bounds,
+        .setme = setme
+    };
+    run_tasks(copyout_task, &tasks, n_tasks, run_tasks_data);
+
+    allocator.free(bounds);
+    return len;
+}
+
+size_t
+bfy_buffer_copyout_range_parallel(bfy_buffer const* buf,
+                                  size_t begin, size_t end,
+                                  void* setme, size_t n_tasks,
+                                  bfy_run_tasks_cb* run_tasks, void* run_tasks_data) {
+    buffer_lock(buf);
+    size_t const ret = buffer_copyout_parallel(buf,
+                                               buffer_get_pos(buf, begin),
+                                               buffer_get_pos(buf, end),
+                                               setme, n_tasks,
+                                               run_tasks, run_tasks_data);
+    buffer_unlock(buf);
+    return ret;
+}
+
 /// remove
 
 static size_t
@@ -906,10 +2059,13 @@ buffer_remove(bfy_buffer* buf, struct bfy_pos begin, struct bfy_pos end, void* d
 
 size_t
 bfy_buffer_remove_range(bfy_buffer* buf, size_t begin, size_t end, void* setme) {
-    return buffer_remove(buf,
-                         buffer_get_pos(buf, begin),
-                         buffer_get_pos(buf, end),
-                         setme);
+    buffer_lock(buf);
+    size_t const ret = buffer_remove(buf,
+                                     buffer_get_pos(buf, begin),
+                                     buffer_get_pos(buf, end),
+                                     setme);
+    buffer_unlock(buf);
+    return ret;
 }
 
 size_t
@@ -917,6 +2073,22 @@ bfy_buffer_remove(bfy_buffer* buf, size_t len, void* setme) {
     return bfy_buffer_remove_range(buf, 0, len, setme);
 }
 
+size_t
+bfy_buffer_remove_range_parallel(bfy_buffer* buf,
+                                 size_t begin, size_t end,
+                                 void* setme, size_t n_tasks,
+                                 bfy_run_tasks_cb* run_tasks, void* run_tasks_data) {
+    buffer_lock(buf);
+    struct bfy_pos const begin_pos = buffer_get_pos(buf, begin);
+    struct bfy_pos const end_pos = buffer_get_pos(buf, end);
+    size_t const n_copied = buffer_copyout_parallel(buf, begin_pos, end_pos,
+                                                    setme, n_tasks,
+                                                    run_tasks, run_tasks_data);
+    buffer_drain_range(buf, begin_pos, end_pos, 0);
+    buffer_unlock(buf);
+    return n_copied;
+}
+
 static void*
 buffer_read_begin(bfy_buffer* buf) {
     return page_read_begin(pages_begin(buf));
@@ -927,6 +2099,7 @@ bfy_buffer_peek_string(bfy_buffer* buf, size_t* setme_len) {
     // ensure the string we return is zero-terminated,
     // but don't commit the nul because the user may
     // keep building a string and we don't want embedded nuls
+    buffer_lock(buf);
     bfy_buffer_mute_change_events(buf);
     char const nul = '\0';
     bfy_buffer_add_ch(buf, nul);
@@ -940,30 +2113,45 @@ bfy_buffer_peek_string(bfy_buffer* buf, size_t* setme_len) {
         *setme_len = page_get_content_len(page);
     }
 
-    return buffer_read_begin(buf);
+    char const* const ret = buffer_read_begin(buf);
+    buffer_unlock(buf);
+    return ret;
+}
+
+// If the first page holds exactly `len` bytes of content in a malloc'ed
+// block, drain it and transfer ownership of that block to the caller.
+// Returns NULL if the first page doesn't qualify.
+static char*
+buffer_take_first_page(bfy_buffer* buf, size_t len) {
+    if (buffer_count_pages(buf) == 0) {
+        return NULL;
+    }
+    struct bfy_page* const page = pages_begin(buf);
+    if (!page_can_realloc(page) || page_get_content_len(page) != len) {
+        return NULL;
+    }
+
+    page_make_space_contiguous(page);
+    char* const ret = page_read_begin(page);
+    page->flags |= BFY_PAGE_FLAGS_UNMANAGED;  // the caller owns it now
+    buffer_drain_range(buf, buffer_get_pos(buf, 0), buffer_get_pos(buf, len), DRAIN_FLAG_NORECYCLE);
+    return ret;
 }
 
 char*
 bfy_buffer_remove_string(bfy_buffer* buf, size_t* setme_len) {
+    bfy_buffer_begin_coalescing_change_events(buf);
     if (setme_len != NULL) {
         *setme_len = bfy_buffer_get_content_len(buf);
     }
 
-    bfy_buffer_begin_coalescing_change_events(buf);
     bfy_buffer_add_ch(buf, '\0');
     char* ret = NULL;
 
     // Plan A: if the whole buffer is in one contiguous malloc'ed
     // block, transfer ownership of that block to the caller
     bfy_buffer_make_all_contiguous(buf);
-    if (buffer_count_pages(buf) == 1) {
-        struct bfy_page* const page = pages_begin(buf);
-        if (page_can_realloc(page)) {
-            page_make_space_contiguous(page);
-            ret = page_read_begin(page);
-            buffer_drain_all(buf, DRAIN_FLAG_NORELEASE | DRAIN_FLAG_NORECYCLE);
-        }
-    }
+    ret = buffer_take_first_page(buf, bfy_buffer_get_content_len(buf));
 
     if (ret == NULL) {
         // Plan B: build a new string
@@ -975,6 +2163,7 @@ bfy_buffer_remove_string(bfy_buffer* buf, size_t* setme_len) {
         if (ret != NULL) {
             moved_len = buffer_remove(buf, begin, end, ret);
             assert(moved_len == wanted);
+            (void) moved_len;
         }
     }
 
@@ -982,24 +2171,80 @@ bfy_buffer_remove_string(bfy_buffer* buf, size_t* setme_len) {
     return ret;
 }
 
+// Removes `len` bytes from the front of the buffer into `setme`.
+// When they're all in the first page, skip buffer_remove()'s page walks
+// and compaction: just bump the page's read_pos. A page that would be
+// emptied goes the slow way so that it's recycled or released as usual.
+static bool
+buffer_remove_front(bfy_buffer* buf, void* setme, size_t len) {
+    struct bfy_page* const page = pages_begin(buf);
+    if (len < page_get_content_len(page)) {
+        memcpy(setme, page_read_cbegin(page), len);
+        page->read_pos += len;
+        buf->n_drained_front += len;
+        buffer_record_content_removed(buf, len);
+        return true;
+    }
+
+    if (len > buf->content_len) {
+        return false;
+    }
+    buffer_remove(buf, buffer_get_pos(buf, 0), buffer_get_pos(buf, len), setme);
+    return true;
+}
+
+// Copies the `len` bytes at `offset` into `setme` without removing them
+static bool
+buffer_peek_at(bfy_buffer const* buf, size_t offset, void* setme, size_t len) {
+    struct bfy_page const* const page = pages_cbegin(buf);
+    size_t const page_len = page_get_content_len(page);
+    if (offset <= page_len && len <= page_len - offset) {
+        memcpy(setme, (char const*) page_read_cbegin(page) + offset, len);
+        return true;
+    }
+
+    if (offset > buf->content_len || len > buf->content_len - offset) {
+        return false;
+    }
+    buffer_copyout(buf, buffer_get_pos(buf, offset), buffer_get_pos(buf, offset + len), setme);
+    return true;
+}
+
+static bool
+buffer_remove_number(bfy_buffer* buf, void* setme, size_t len) {
+    buffer_lock(buf);
+    bool const ok = buffer_remove_front(buf, setme, len);
+    buffer_unlock(buf);
+    if (!ok) {
+        errno = ENOMSG;
+    }
+    return ok;
+}
+
+static int
+buffer_peek_number(bfy_buffer const* buf, size_t offset, void* setme, size_t len) {
+    buffer_lock(buf);
+    bool const ok = buffer_peek_at(buf, offset, setme, len);
+    buffer_unlock(buf);
+    if (!ok) {
+        errno = ENOMSG;
+        return -1;
+    }
+    return 0;
+}
+
 uint8_t
 bfy_buffer_remove_ntoh_u8(struct bfy_buffer* buf) {
     uint8_t val = 0;
-    size_t const len = bfy_buffer_remove(buf, sizeof(val), &val);
-    if (len != sizeof(val)) {
-        errno = ENOMSG;
-    }
+    buffer_remove_number(buf, &val, sizeof(val));
     return val;
 }
 
 uint16_t
 bfy_buffer_remove_ntoh_u16(struct bfy_buffer* buf) {
     uint16_t val = 0;
-    size_t const len = bfy_buffer_remove(buf, sizeof(val), &val);
-    if (len == sizeof(val)) {
+    if (buffer_remove_number(buf, &val, sizeof(val))) {
         val = ntoh16(val);
-    } else {
-        errno = ENOMSG;
     }
     return val;
 }
@@ -1007,11 +2252,8 @@ bfy_buffer_remove_ntoh_u16(struct bfy_buffer* buf) {
 uint32_t
 bfy_buffer_remove_ntoh_u32(struct bfy_buffer* buf) {
     uint32_t val = 0;
-    size_t const len = bfy_buffer_remove(buf, sizeof(val),  &val);
-    if (len == sizeof(val)) {
+    if (buffer_remove_number(buf, &val, sizeof(val))) {
         val = ntoh32(val);
-    } else {
-        errno = ENOMSG;
     }
     return val;
 }
@@ -1019,170 +2261,4460 @@ bfy_buffer_remove_ntoh_u32(struct bfy_buffer* buf) {
 uint64_t
 bfy_buffer_remove_ntoh_u64(struct bfy_buffer* buf) {
     uint64_t val = 0;
-    size_t const len = bfy_buffer_remove(buf, sizeof(val), &val);
-    if (len == sizeof(val)) {
+    if (buffer_remove_number(buf, &val, sizeof(val))) {
         val = ntoh64(val);
-    } else {
-        errno = ENOMSG;
     }
     return val;
 }
 
-size_t
-bfy_buffer_remove_buffer(bfy_buffer* buf, size_t wanted, bfy_buffer* tgt) {
-    struct bfy_pos end = buffer_get_pos(buf, wanted);
+int
+bfy_buffer_peek_ntoh_u8_at(bfy_buffer const* buf, size_t offset, uint8_t* setme) {
+    return buffer_peek_number(buf, offset, setme, sizeof(*setme));
+}
 
-    if (end.page_idx > 0 && end.content_pos > 0) {
-        buffer_append_pages(tgt, pages_cbegin(buf), end.page_idx);
-    }
-    if (end.page_pos > 0) {
-        struct bfy_page const* page = pages_cbegin(buf) + end.page_idx;
-        bfy_buffer_add_pagebreak(tgt);
-        bfy_buffer_add(tgt, page_read_cbegin(page), end.page_pos);
+int
+bfy_buffer_peek_ntoh_u16_at(bfy_buffer const* buf, size_t offset, uint16_t* setme) {
+    uint16_t val;
+    int const ret = buffer_peek_number(buf, offset, &val, sizeof(val));
+    if (ret == 0) {
+        *setme = ntoh16(val);
     }
-
+    return ret;
+}
+
+int
+bfy_buffer_peek_ntoh_u32_at(bfy_buffer const* buf, size_t offset, uint32_t* setme) {
+    uint32_t val;
+    int const ret = buffer_peek_number(buf, offset, &val, sizeof(val));
+    if (ret == 0) {
+        *setme = ntoh32(val);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_peek_ntoh_u64_at(bfy_buffer const* buf, size_t offset, uint64_t* setme) {
+    uint64_t val;
+    int const ret = buffer_peek_number(buf, offset, &val, sizeof(val));
+    if (ret == 0) {
+        *setme = ntoh64(val);
+    }
+    return ret;
+}
+
+uint16_t
+bfy_buffer_remove_le_u16(struct bfy_buffer* buf) {
+    uint16_t val = 0;
+    if (buffer_remove_number(buf, &val, sizeof(val))) {
+        val = ltoh16(val);
+    }
+    return val;
+}
+
+uint32_t
+bfy_buffer_remove_le_u32(struct bfy_buffer* buf) {
+    uint32_t val = 0;
+    if (buffer_remove_number(buf, &val, sizeof(val))) {
+        val = ltoh32(val);
+    }
+    return val;
+}
+
+uint64_t
+bfy_buffer_remove_le_u64(struct bfy_buffer* buf) {
+    uint64_t val = 0;
+    if (buffer_remove_number(buf, &val, sizeof(val))) {
+        val = ltoh64(val);
+    }
+    return val;
+}
+
+float
+bfy_buffer_remove_le_float(struct bfy_buffer* buf) {
+    uint32_t const bits = bfy_buffer_remove_le_u32(buf);
+    float val;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+double
+bfy_buffer_remove_le_double(struct bfy_buffer* buf) {
+    uint64_t const bits = bfy_buffer_remove_le_u64(buf);
+    double val;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+int
+bfy_buffer_peek_le_u16_at(bfy_buffer const* buf, size_t offset, uint16_t* setme) {
+    uint16_t val;
+    int const ret = buffer_peek_number(buf, offset, &val, sizeof(val));
+    if (ret == 0) {
+        *setme = ltoh16(val);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_peek_le_u32_at(bfy_buffer const* buf, size_t offset, uint32_t* setme) {
+    uint32_t val;
+    int const ret = buffer_peek_number(buf, offset, &val, sizeof(val));
+    if (ret == 0) {
+        *setme = ltoh32(val);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_peek_le_u64_at(bfy_buffer const* buf, size_t offset, uint64_t* setme) {
+    uint64_t val;
+    int const ret = buffer_peek_number(buf, offset, &val, sizeof(val));
+    if (ret == 0) {
+        *setme = ltoh64(val);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_peek_le_float_at(bfy_buffer const* buf, size_t offset, float* setme) {
+    uint32_t bits;
+    int const ret = bfy_buffer_peek_le_u32_at(buf, offset, &bits);
+    if (ret == 0) {
+        memcpy(setme, &bits, sizeof(*setme));
+    }
+    return ret;
+}
+
+int
+bfy_buffer_peek_le_double_at(bfy_buffer const* buf, size_t offset, double* setme) {
+    uint64_t bits;
+    int const ret = bfy_buffer_peek_le_u64_at(buf, offset, &bits);
+    if (ret == 0) {
+        memcpy(setme, &bits, sizeof(*setme));
+    }
+    return ret;
+}
+
+static size_t
+buffer_remove_buffer(bfy_buffer* buf, size_t wanted, bfy_buffer* tgt) {
+    struct bfy_pos end = buffer_get_pos(buf, wanted);
+
+    if (end.page_idx > 0 && end.content_pos > 0) {
+        buffer_append_pages(tgt, pages_cbegin(buf), end.page_idx);
+    }
+    if (end.page_pos > 0) {
+        struct bfy_page const* page = pages_cbegin(buf) + end.page_idx;
+        struct bfy_page const pagebreak = InitPage;
+        buffer_append_pages(tgt, &pagebreak, 1);
+        buffer_add(tgt, page_read_cbegin(page), end.page_pos);
+    }
+
     return buffer_drain_range(buf, buffer_get_pos(buf, 0), end, DRAIN_FLAG_NORECYCLE | DRAIN_FLAG_NORELEASE);
 }
 
-// make_contiguous
+size_t
+bfy_buffer_remove_buffer(bfy_buffer* buf, size_t wanted, bfy_buffer* tgt) {
+    buffer_lock2(buf, tgt);
+    size_t const ret = buffer_remove_buffer(buf, wanted, tgt);
+    buffer_unlock2(buf, tgt);
+    return ret;
+}
+
+// make_contiguous
+
+static void*
+buffer_make_contiguous(bfy_buffer* buf, size_t wanted) {
+    struct bfy_pos const pos = buffer_get_pos(buf, wanted);
+
+    // if the first page already holds wanted, then we're done
+    if ((pos.page_idx == 0) || (pos.page_idx == 1 && pos.page_pos == 0)) {
+        return buffer_read_begin(buf);
+    }
+
+    bfy_buffer_mute_change_events(buf);
+
+    // if we have enough space, use it
+    struct bfy_iovec space = bfy_buffer_peek_space(buf);
+    if (space.iov_len >= pos.content_pos) {
+        size_t const n_copied = buffer_copyout(buf, buffer_get_pos(buf, 0), pos, space.iov_base);
+        bfy_buffer_commit_space(buf, n_copied);
+        bfy_buffer_drain(buf, n_copied);
+    } else {
+        // make some new free space, use it, and prepend it
+        int8_t* data = allocator.malloc(pos.content_pos);
+        size_t const n_moved = buffer_remove(buf, buffer_get_pos(buf, 0), pos, data);
+        struct bfy_page const newpage = {
+            .data = data,
+            .size = n_moved,
+            .write_pos = n_moved
+        };
+        buffer_prepend_pages(buf, &newpage, 1);
+    }
+
+    bfy_buffer_unmute_change_events(buf);
+    return buffer_read_begin(buf);
+}
+
+void*
+bfy_buffer_make_contiguous(bfy_buffer* buf, size_t wanted) {
+    buffer_lock(buf);
+    void* const ret = buffer_make_contiguous(buf, wanted);
+    buffer_unlock(buf);
+    return ret;
+}
+
+void*
+bfy_buffer_make_all_contiguous(bfy_buffer* buf) {
+    return bfy_buffer_make_contiguous(buf, SIZE_MAX);
+}
+
+/// lines
+
+// Returns the number of consecutive '\r' and '\n' bytes starting at `iter`
+static size_t
+iter_count_eol_run(struct bfy_iter iter) {
+    size_t n = 0;
+    do {
+        char const* const begin = iter.io.iov_base;
+        char const* const end = begin + iter.io.iov_len;
+        for (char const* walk = begin; walk != end; ++walk) {
+            if (*walk != '\r' && *walk != '\n') {
+                return n + (size_t)(walk - begin);
+            }
+        }
+        n += iter.io.iov_len;
+    } while (iter_next_page(&iter));
+
+    return n;
+}
+
+static bool
+buffer_find_eol(bfy_buffer const* buf, enum bfy_eol style,
+                size_t* setme_line_len, size_t* setme_eol_len) {
+    struct bfy_iter iter;
+    if (!iter_begin(&iter, buf, buffer_get_pos(buf, 0), buffer_get_pos(buf, SIZE_MAX))) {
+        return false;
+    }
+
+    // memchr() is vectorized by libc, so scan with it instead of byte by byte
+    char const delim = style == BFY_EOL_NUL ? '\0' : '\n';
+    int prev_ch = EOF;  // the last byte of the previous page
+    do {
+        char const* const begin = iter.io.iov_base;
+        char const* const end = begin + iter.io.iov_len;
+        char const* walk = begin;
+        while (walk != end) {
+            char const* hit = memchr(walk, delim, end - walk);
+            if (style == BFY_EOL_ANY) {
+                // look for a '\r' that comes before the '\n'
+                char const* const cr = memchr(walk, '\r', (hit != NULL ? hit : end) - walk);
+                if (cr != NULL) {
+                    hit = cr;
+                }
+            }
+            if (hit == NULL) {
+                break;
+            }
+
+            size_t const pos = iter.cur.content_pos + (size_t)(hit - begin);
+            bool const after_cr = (hit != begin ? hit[-1] : prev_ch) == '\r';
+            if (style == BFY_EOL_CRLF_STRICT && !after_cr) {
+                walk = hit + 1;
+                continue;
+            }
+
+            if (style == BFY_EOL_ANY) {
+                struct bfy_iter run = iter;
+                iter_advance_n_bytes(&run, (size_t)(hit - begin));
+                *setme_line_len = pos;
+                *setme_eol_len = iter_count_eol_run(run);
+            } else if ((style == BFY_EOL_CRLF || style == BFY_EOL_CRLF_STRICT) && after_cr) {
+                *setme_line_len = pos - 1;
+                *setme_eol_len = 2;
+            } else {
+                *setme_line_len = pos;
+                *setme_eol_len = 1;
+            }
+            return true;
+        }
+
+        if (begin != end) {
+            prev_ch = end[-1];
+        }
+    } while (iter_next_page(&iter));
+
+    return false;
+}
+
+int
+bfy_buffer_peekln(bfy_buffer const* buf, enum bfy_eol style,
+                  size_t* setme_line_len, size_t* setme_eol_len) {
+    size_t line_len;
+    size_t eol_len;
+
+    buffer_lock(buf);
+    bool const found = buffer_find_eol(buf, style, &line_len, &eol_len);
+    buffer_unlock(buf);
+
+    if (!found) {
+        errno = ENOMSG;
+        return -1;
+    }
+    if (setme_line_len != NULL) {
+        *setme_line_len = line_len;
+    }
+    if (setme_eol_len != NULL) {
+        *setme_eol_len = eol_len;
+    }
+    return 0;
+}
+
+int
+bfy_buffer_readln(bfy_buffer* buf, enum bfy_eol style,
+                  void* setme, size_t setme_len,
+                  size_t* setme_line_len) {
+    size_t line_len;
+    size_t eol_len;
+    int ret = -1;
+
+    buffer_lock(buf);
+    if (!buffer_find_eol(buf, style, &line_len, &eol_len)) {
+        errno = ENOMSG;
+    } else {
+        if (setme_line_len != NULL) {
+            *setme_line_len = line_len;
+        }
+        if (line_len > setme_len) {
+            errno = ENOBUFS;
+        } else {
+            struct bfy_pos const begin = buffer_get_pos(buf, 0);
+            buffer_copyout(buf, begin, buffer_get_pos(buf, line_len), setme);
+            buffer_drain_range(buf, begin, buffer_get_pos(buf, line_len + eol_len), 0);
+            ret = 0;
+        }
+    }
+    buffer_unlock(buf);
+
+    return ret;
+}
+
+char*
+bfy_buffer_readln_string(bfy_buffer* buf, enum bfy_eol style, size_t* setme_len) {
+    size_t line_len;
+    size_t eol_len;
+    char* ret = NULL;
+
+    buffer_lock(buf);
+    if (!buffer_find_eol(buf, style, &line_len, &eol_len)) {
+        errno = ENOMSG;
+    } else {
+        // Plan A: if the line and its EOL are the first page's content,
+        // zero-terminate the line in place and hand the page to the caller
+        struct bfy_page* const page = pages_begin(buf);
+        size_t const len = line_len + eol_len;
+        if (page_can_realloc(page) && page_get_content_len(page) == len) {
+            ((char*)page_read_begin(page))[line_len] = '\0';
+            ret = buffer_take_first_page(buf, len);
+        }
+
+        if (ret == NULL) {
+            // Plan B: build a new string
+            ret = allocator.malloc(line_len + 1);
+            if (ret == NULL) {
+                errno = ENOMEM;
+            } else {
+                struct bfy_pos const begin = buffer_get_pos(buf, 0);
+                buffer_copyout(buf, begin, buffer_get_pos(buf, line_len), ret);
+                ret[line_len] = '\0';
+                buffer_drain_range(buf, begin, buffer_get_pos(buf, len), 0);
+            }
+        }
+
+        if (ret != NULL && setme_len != NULL) {
+            *setme_len = line_len;
+        }
+    }
+    buffer_unlock(buf);
+
+    return ret;
+}
+
+/// search kernels
+
+// Each kernel returns the first i in [0..n_pos) where
+// h[i] == first && h[i + last_offset] == last, or n_pos if there is none.
+// The rsearch kernels return the last such i instead.
+// Comparing two bytes of the needle at once rules out most false
+// candidates that memchr() on the first byte alone would stop at.
+
+typedef size_t (search_kernel_func)(unsigned char const* h, size_t n_pos,
+                                    unsigned char first, unsigned char last,
+                                    size_t last_offset);
+
+static size_t
+search_kernel_scalar(unsigned char const* h, size_t n_pos,
+                     unsigned char first, unsigned char last,
+                     size_t last_offset) {
+    unsigned char const* walk = h;
+    unsigned char const* const end = h + n_pos;
+    while ((walk = memchr(walk, first, end - walk))) {
+        if (walk[last_offset] == last) {
+            return walk - h;
+        }
+        ++walk;
+    }
+    return n_pos;
+}
+
+static inline unsigned char
+ascii_tolower(unsigned char ch) {
+    return (unsigned)(ch - 'A') < 26u ? (unsigned char)(ch | 0x20) : ch;
+}
+
+// Like search_kernel_scalar(), but ignores ASCII case
+static size_t
+search_kernel_nocase_scalar(unsigned char const* h, size_t n_pos,
+                            unsigned char first, unsigned char last,
+                            size_t last_offset) {
+    first = ascii_tolower(first);
+    last = ascii_tolower(last);
+    for (size_t i = 0; i < n_pos; ++i) {
+        if (ascii_tolower(h[i]) == first && ascii_tolower(h[i + last_offset]) == last) {
+            return i;
+        }
+    }
+    return n_pos;
+}
+
+// Returns true if a[0..len) and b[0..len) are equal, ignoring ASCII case
+static bool
+ascii_caseeq_scalar(unsigned char const* a, unsigned char const* b, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (ascii_tolower(a[i]) != ascii_tolower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Like search_kernel_scalar(), but returns the last candidate instead
+static size_t
+rsearch_kernel_scalar(unsigned char const* h, size_t n_pos,
+                      unsigned char first, unsigned char last,
+                      size_t last_offset) {
+    for (size_t i = n_pos; i-- > 0; ) {
+        if (h[i] == first && h[i + last_offset] == last) {
+            return i;
+        }
+    }
+    return n_pos;
+}
+
+// A set of bytes, stored as a 256-bit bitmap for scalar lookups and as
+// two nibble-indexed tables for SIMD lookups: lo_tbl[h / 8][lo] has bit
+// (h % 8) set if the byte (h << 4 | lo) is in the set.
+struct byteset {
+    uint8_t bits[32];
+    uint8_t lo_tbl[2][16];
+};
+
+static void
+byteset_init(struct byteset* set, void const* vbytes, size_t n_bytes) {
+    unsigned char const* const bytes = vbytes;
+    memset(set, 0, sizeof(*set));
+    for (size_t i = 0; i < n_bytes; ++i) {
+        unsigned char const ch = bytes[i];
+        set->bits[ch >> 3] |= (uint8_t)(1u << (ch & 7));
+        set->lo_tbl[ch >> 7][ch & 15] |= (uint8_t)(1u << ((ch >> 4) & 7));
+    }
+}
+
+static inline bool
+byteset_has(struct byteset const* set, unsigned char ch) {
+    return (set->bits[ch >> 3] >> (ch & 7)) & 1;
+}
+
+// Returns the index of the first byte in h[0..len) that is in the set
+// (or, if `negate` is true, that isn't in it), or `len` if there is none.
+typedef size_t (byteset_kernel_func)(unsigned char const* h, size_t len,
+                                     struct byteset const* set, bool negate);
+
+static size_t
+byteset_kernel_scalar(unsigned char const* h, size_t len,
+                      struct byteset const* set, bool negate) {
+    for (size_t i = 0; i < len; ++i) {
+        if (byteset_has(set, h[i]) != negate) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#if !defined(BFY_DISABLE_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define BFY_SEARCH_KERNEL_X86 1
+#elif !defined(BFY_DISABLE_SIMD) && (defined(__aarch64__) || defined(_M_ARM64))
+#define BFY_SEARCH_KERNEL_NEON 1
+#endif
+
+static inline unsigned
+count_trailing_zeros(uint64_t val) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward64(&idx, val);
+    return (unsigned) idx;
+#else
+    return (unsigned) __builtin_ctzll(val);
+#endif
+}
+
+static inline unsigned
+highest_set_bit(uint64_t val) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanReverse64(&idx, val);
+    return (unsigned) idx;
+#else
+    return 63u - (unsigned) __builtin_clzll(val);
+#endif
+}
+
+#if defined(BFY_SEARCH_KERNEL_X86)
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#define BFY_TARGET_AVX2
+#else
+#define BFY_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// SSE2 is part of x86-64, so this kernel needs no runtime check
+static size_t
+search_kernel_sse2(unsigned char const* h, size_t n_pos,
+                   unsigned char first, unsigned char last,
+                   size_t last_offset) {
+    __m128i const vfirst = _mm_set1_epi8((char) first);
+    __m128i const vlast = _mm_set1_epi8((char) last);
+    size_t i = 0;
+    for (; i + 16 <= n_pos; i += 16) {
+        __m128i const a = _mm_loadu_si128((__m128i const*)(h + i));
+        __m128i const b = _mm_loadu_si128((__m128i const*)(h + i + last_offset));
+        __m128i const eq = _mm_and_si128(_mm_cmpeq_epi8(a, vfirst), _mm_cmpeq_epi8(b, vlast));
+        unsigned const mask = (unsigned) _mm_movemask_epi8(eq);
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + search_kernel_scalar(h + i, n_pos - i, first, last, last_offset);
+}
+
+// Adds 0x20 to 'A'..'Z'. An unsigned (x - 'A') < 26 is done as a
+// signed compare by flipping the top bit: (x - 'A') ^ 0x80 == x + 63.
+static inline __m128i
+sse2_tolower(__m128i x) {
+    __m128i const is_upper = _mm_cmplt_epi8(_mm_add_epi8(x, _mm_set1_epi8(63)),
+                                            _mm_set1_epi8(-128 + 26));
+    return _mm_or_si128(x, _mm_and_si128(is_upper, _mm_set1_epi8(0x20)));
+}
+
+static size_t
+search_kernel_nocase_sse2(unsigned char const* h, size_t n_pos,
+                          unsigned char first, unsigned char last,
+                          size_t last_offset) {
+    __m128i const vfirst = _mm_set1_epi8((char) ascii_tolower(first));
+    __m128i const vlast = _mm_set1_epi8((char) ascii_tolower(last));
+    size_t i = 0;
+    for (; i + 16 <= n_pos; i += 16) {
+        __m128i const a = sse2_tolower(_mm_loadu_si128((__m128i const*)(h + i)));
+        __m128i const b = sse2_tolower(_mm_loadu_si128((__m128i const*)(h + i + last_offset)));
+        __m128i const eq = _mm_and_si128(_mm_cmpeq_epi8(a, vfirst), _mm_cmpeq_epi8(b, vlast));
+        unsigned const mask = (unsigned) _mm_movemask_epi8(eq);
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + search_kernel_nocase_scalar(h + i, n_pos - i, first, last, last_offset);
+}
+
+static bool
+ascii_caseeq(unsigned char const* a, unsigned char const* b, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i const va = sse2_tolower(_mm_loadu_si128((__m128i const*)(a + i)));
+        __m128i const vb = sse2_tolower(_mm_loadu_si128((__m128i const*)(b + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) {
+            return false;
+        }
+    }
+    return ascii_caseeq_scalar(a + i, b + i, len - i);
+}
+
+BFY_TARGET_AVX2
+static size_t
+search_kernel_avx2(unsigned char const* h, size_t n_pos,
+                   unsigned char first, unsigned char last,
+                   size_t last_offset) {
+    __m256i const vfirst = _mm256_set1_epi8((char) first);
+    __m256i const vlast = _mm256_set1_epi8((char) last);
+    size_t i = 0;
+    for (; i + 32 <= n_pos; i += 32) {
+        __m256i const a = _mm256_loadu_si256((__m256i const*)(h + i));
+        __m256i const b = _mm256_loadu_si256((__m256i const*)(h + i + last_offset));
+        __m256i const eq = _mm256_and_si256(_mm256_cmpeq_epi8(a, vfirst), _mm256_cmpeq_epi8(b, vlast));
+        unsigned const mask = (unsigned) _mm256_movemask_epi8(eq);
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + search_kernel_sse2(h + i, n_pos - i, first, last, last_offset);
+}
+
+BFY_TARGET_AVX2
+static inline __m256i
+avx2_tolower(__m256i x) {
+    __m256i const is_upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26),
+                                               _mm256_add_epi8(x, _mm256_set1_epi8(63)));
+    return _mm256_or_si256(x, _mm256_and_si256(is_upper, _mm256_set1_epi8(0x20)));
+}
+
+BFY_TARGET_AVX2
+static size_t
+search_kernel_nocase_avx2(unsigned char const* h, size_t n_pos,
+                          unsigned char first, unsigned char last,
+                          size_t last_offset) {
+    __m256i const vfirst = _mm256_set1_epi8((char) ascii_tolower(first));
+    __m256i const vlast = _mm256_set1_epi8((char) ascii_tolower(last));
+    size_t i = 0;
+    for (; i + 32 <= n_pos; i += 32) {
+        __m256i const a = avx2_tolower(_mm256_loadu_si256((__m256i const*)(h + i)));
+        __m256i const b = avx2_tolower(_mm256_loadu_si256((__m256i const*)(h + i + last_offset)));
+        __m256i const eq = _mm256_and_si256(_mm256_cmpeq_epi8(a, vfirst), _mm256_cmpeq_epi8(b, vlast));
+        unsigned const mask = (unsigned) _mm256_movemask_epi8(eq);
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + search_kernel_nocase_sse2(h + i, n_pos - i, first, last, last_offset);
+}
+
+static size_t
+rsearch_kernel_sse2(unsigned char const* h, size_t n_pos,
+                    unsigned char first, unsigned char last,
+                    size_t last_offset) {
+    __m128i const vfirst = _mm_set1_epi8((char) first);
+    __m128i const vlast = _mm_set1_epi8((char) last);
+    size_t i = n_pos;
+    for (; i >= 16; i -= 16) {
+        __m128i const a = _mm_loadu_si128((__m128i const*)(h + i - 16));
+        __m128i const b = _mm_loadu_si128((__m128i const*)(h + i - 16 + last_offset));
+        __m128i const eq = _mm_and_si128(_mm_cmpeq_epi8(a, vfirst), _mm_cmpeq_epi8(b, vlast));
+        unsigned const mask = (unsigned) _mm_movemask_epi8(eq);
+        if (mask != 0) {
+            return i - 16 + highest_set_bit(mask);
+        }
+    }
+    size_t const hit = rsearch_kernel_scalar(h, i, first, last, last_offset);
+    return hit < i ? hit : n_pos;
+}
+
+BFY_TARGET_AVX2
+static size_t
+rsearch_kernel_avx2(unsigned char const* h, size_t n_pos,
+                    unsigned char first, unsigned char last,
+                    size_t last_offset) {
+    __m256i const vfirst = _mm256_set1_epi8((char) first);
+    __m256i const vlast = _mm256_set1_epi8((char) last);
+    size_t i = n_pos;
+    for (; i >= 32; i -= 32) {
+        __m256i const a = _mm256_loadu_si256((__m256i const*)(h + i - 32));
+        __m256i const b = _mm256_loadu_si256((__m256i const*)(h + i - 32 + last_offset));
+        __m256i const eq = _mm256_and_si256(_mm256_cmpeq_epi8(a, vfirst), _mm256_cmpeq_epi8(b, vlast));
+        unsigned const mask = (unsigned) _mm256_movemask_epi8(eq);
+        if (mask != 0) {
+            return i - 32 + highest_set_bit(mask);
+        }
+    }
+    size_t const hit = rsearch_kernel_sse2(h, i, first, last, last_offset);
+    return hit < i ? hit : n_pos;
+}
+
+static bool
+cpu_has_avx2(void) {
+#if defined(_MSC_VER)
+    // 0 == unknown, 1 == no, 2 == yes. Racing threads all store the same value.
+    static int has_avx2 = 0;
+    if (has_avx2 == 0) {
+        int regs[4];
+        bool ok = false;
+        __cpuid(regs, 0);
+        if (regs[0] >= 7) {
+            __cpuid(regs, 1);
+            bool const osxsave = (regs[2] & (1 << 27)) != 0;
+            bool const avx = (regs[2] & (1 << 28)) != 0;
+            // the OS must save the ymm registers on context switches
+            if (osxsave && avx && (_xgetbv(0) & 6) == 6) {
+                __cpuidex(regs, 7, 0);
+                ok = (regs[1] & (1 << 5)) != 0;
+            }
+        }
+        has_avx2 = ok ? 2 : 1;
+    }
+    return has_avx2 == 2;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static search_kernel_func*
+search_kernel_select(void) {
+    return cpu_has_avx2() ? search_kernel_avx2 : search_kernel_sse2;
+}
+
+static search_kernel_func*
+rsearch_kernel_select(void) {
+    return cpu_has_avx2() ? rsearch_kernel_avx2 : rsearch_kernel_sse2;
+}
+
+static search_kernel_func*
+search_kernel_nocase_select(void) {
+    return cpu_has_avx2() ? search_kernel_nocase_avx2 : search_kernel_nocase_sse2;
+}
+
+// Looks up 32 bytes at a time in the set's nibble tables: the low nibble
+// picks a row, and the high nibble picks a bit in that row.
+BFY_TARGET_AVX2
+static size_t
+byteset_kernel_avx2(unsigned char const* h, size_t len,
+                    struct byteset const* set, bool negate) {
+    __m256i const tbl_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const*)set->lo_tbl[0]));
+    __m256i const tbl_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const*)set->lo_tbl[1]));
+    __m256i const bit_of_hi = _mm256_setr_epi8(
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m256i const nibble = _mm256_set1_epi8(0x0f);
+    __m256i const zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i const x = _mm256_loadu_si256((__m256i const*)(h + i));
+        __m256i const lo = _mm256_and_si256(x, nibble);
+        __m256i const hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+        // bytes >= 0x80 have their top bit set, which picks tbl_hi
+        __m256i const row = _mm256_blendv_epi8(_mm256_shuffle_epi8(tbl_lo, lo),
+                                               _mm256_shuffle_epi8(tbl_hi, lo), x);
+        __m256i const bit = _mm256_shuffle_epi8(bit_of_hi, hi);
+        __m256i const absent = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), zero);
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(absent);
+        if (!negate) {
+            mask = ~mask;
+        }
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + byteset_kernel_scalar(h + i, len - i, set, negate);
+}
+
+static byteset_kernel_func*
+byteset_kernel_select(void) {
+    return cpu_has_avx2() ? byteset_kernel_avx2 : byteset_kernel_scalar;
+}
+
+#elif defined(BFY_SEARCH_KERNEL_NEON)
+
+#include <arm_neon.h>
+
+// NEON is part of AArch64, so this kernel needs no runtime check
+static size_t
+search_kernel_neon(unsigned char const* h, size_t n_pos,
+                   unsigned char first, unsigned char last,
+                   size_t last_offset) {
+    uint8x16_t const vfirst = vdupq_n_u8(first);
+    uint8x16_t const vlast = vdupq_n_u8(last);
+    size_t i = 0;
+    for (; i + 16 <= n_pos; i += 16) {
+        uint8x16_t const a = vld1q_u8(h + i);
+        uint8x16_t const b = vld1q_u8(h + i + last_offset);
+        uint8x16_t const eq = vandq_u8(vceqq_u8(a, vfirst), vceqq_u8(b, vlast));
+        // narrow each 0x00/0xFF byte to 4 bits of a 64-bit mask
+        uint8x8_t const narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        uint64_t const mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask) / 4;
+        }
+    }
+    return i + search_kernel_scalar(h + i, n_pos - i, first, last, last_offset);
+}
+
+static search_kernel_func*
+search_kernel_select(void) {
+    return search_kernel_neon;
+}
+
+static size_t
+rsearch_kernel_neon(unsigned char const* h, size_t n_pos,
+                    unsigned char first, unsigned char last,
+                    size_t last_offset) {
+    uint8x16_t const vfirst = vdupq_n_u8(first);
+    uint8x16_t const vlast = vdupq_n_u8(last);
+    size_t i = n_pos;
+    for (; i >= 16; i -= 16) {
+        uint8x16_t const a = vld1q_u8(h + i - 16);
+        uint8x16_t const b = vld1q_u8(h + i - 16 + last_offset);
+        uint8x16_t const eq = vandq_u8(vceqq_u8(a, vfirst), vceqq_u8(b, vlast));
+        uint8x8_t const narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        uint64_t const mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        if (mask != 0) {
+            return i - 16 + highest_set_bit(mask) / 4;
+        }
+    }
+    size_t const hit = rsearch_kernel_scalar(h, i, first, last, last_offset);
+    return hit < i ? hit : n_pos;
+}
+
+static search_kernel_func*
+rsearch_kernel_select(void) {
+    return rsearch_kernel_neon;
+}
+
+static inline uint8x16_t
+neon_tolower(uint8x16_t x) {
+    uint8x16_t const is_upper = vcltq_u8(vsubq_u8(x, vdupq_n_u8('A')), vdupq_n_u8(26));
+    return vorrq_u8(x, vandq_u8(is_upper, vdupq_n_u8(0x20)));
+}
+
+static size_t
+search_kernel_nocase_neon(unsigned char const* h, size_t n_pos,
+                          unsigned char first, unsigned char last,
+                          size_t last_offset) {
+    uint8x16_t const vfirst = vdupq_n_u8(ascii_tolower(first));
+    uint8x16_t const vlast = vdupq_n_u8(ascii_tolower(last));
+    size_t i = 0;
+    for (; i + 16 <= n_pos; i += 16) {
+        uint8x16_t const a = neon_tolower(vld1q_u8(h + i));
+        uint8x16_t const b = neon_tolower(vld1q_u8(h + i + last_offset));
+        uint8x16_t const eq = vandq_u8(vceqq_u8(a, vfirst), vceqq_u8(b, vlast));
+        uint8x8_t const narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        uint64_t const mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask) / 4;
+        }
+    }
+    return i + search_kernel_nocase_scalar(h + i, n_pos - i, first, last, last_offset);
+}
+
+static search_kernel_func*
+search_kernel_nocase_select(void) {
+    return search_kernel_nocase_neon;
+}
+
+static bool
+ascii_caseeq(unsigned char const* a, unsigned char const* b, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t const eq = vceqq_u8(neon_tolower(vld1q_u8(a + i)), neon_tolower(vld1q_u8(b + i)));
+        if (vminvq_u8(eq) != 0xFF) {
+            return false;
+        }
+    }
+    return ascii_caseeq_scalar(a + i, b + i, len - i);
+}
+
+static size_t
+byteset_kernel_neon(unsigned char const* h, size_t len,
+                    struct byteset const* set, bool negate) {
+    uint8x16_t const tbl_lo = vld1q_u8(set->lo_tbl[0]);
+    uint8x16_t const tbl_hi = vld1q_u8(set->lo_tbl[1]);
+    static uint8_t const bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t const bit_of_hi = vld1q_u8(bits);
+    uint8x16_t const nibble = vdupq_n_u8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t const x = vld1q_u8(h + i);
+        uint8x16_t const lo = vandq_u8(x, nibble);
+        uint8x16_t const hi = vshrq_n_u8(x, 4);
+        uint8x16_t const use_hi = vcgeq_u8(x, vdupq_n_u8(0x80));
+        uint8x16_t const row = vbslq_u8(use_hi, vqtbl1q_u8(tbl_hi, lo), vqtbl1q_u8(tbl_lo, lo));
+        uint8x16_t present = vtstq_u8(row, vqtbl1q_u8(bit_of_hi, hi));
+        if (negate) {
+            present = vmvnq_u8(present);
+        }
+        uint8x8_t const narrowed = vshrn_n_u16(vreinterpretq_u16_u8(present), 4);
+        uint64_t const mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask) / 4;
+        }
+    }
+    return i + byteset_kernel_scalar(h + i, len - i, set, negate);
+}
+
+static byteset_kernel_func*
+byteset_kernel_select(void) {
+    return byteset_kernel_neon;
+}
+
+#else
+
+static search_kernel_func*
+search_kernel_select(void) {
+    return search_kernel_scalar;
+}
+
+static search_kernel_func*
+rsearch_kernel_select(void) {
+    return rsearch_kernel_scalar;
+}
+
+static search_kernel_func*
+search_kernel_nocase_select(void) {
+    return search_kernel_nocase_scalar;
+}
+
+static bool
+ascii_caseeq(unsigned char const* a, unsigned char const* b, size_t len) {
+    return ascii_caseeq_scalar(a, b, len);
+}
+
+static byteset_kernel_func*
+byteset_kernel_select(void) {
+    return byteset_kernel_scalar;
+}
+
+#endif
+
+/// byte swap kernels
+
+// Each kernel copies `n_elems` numbers, each `width` (2, 4, or 8) bytes
+// wide, from src to dst while reversing each number's bytes.
+// src and dst may be the same array to swap it in place.
+
+typedef void (bswap_kernel_func)(unsigned char* dst, unsigned char const* src,
+                                 size_t n_elems, size_t width);
+
+static void
+bswap_kernel_scalar(unsigned char* dst, unsigned char const* src,
+                    size_t n_elems, size_t width) {
+    size_t const len = n_elems * width;
+    switch (width) {
+    case 2:
+        for (size_t i = 0; i < len; i += 2) {
+            uint16_t val;
+            memcpy(&val, src + i, sizeof(val));
+            val = bswap16(val);
+            memcpy(dst + i, &val, sizeof(val));
+        }
+        break;
+    case 4:
+        for (size_t i = 0; i < len; i += 4) {
+            uint32_t val;
+            memcpy(&val, src + i, sizeof(val));
+            val = bswap32(val);
+            memcpy(dst + i, &val, sizeof(val));
+        }
+        break;
+    default:
+        for (size_t i = 0; i < len; i += 8) {
+            uint64_t val;
+            memcpy(&val, src + i, sizeof(val));
+            val = bswap64(val);
+            memcpy(dst + i, &val, sizeof(val));
+        }
+        break;
+    }
+}
+
+#if defined(BFY_SEARCH_KERNEL_X86)
+
+// SSE2 has no byte shuffle, so reverse the 16-bit words inside each
+// number and then swap the bytes inside each word. `width` is a constant
+// at every call site, so the branches fold away.
+static inline __m128i
+sse2_bswap(__m128i x, size_t width) {
+    if (width == 4) {
+        x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+    } else if (width == 8) {
+        x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+    }
+    return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static inline size_t
+bswap_loop_sse2(unsigned char* dst, unsigned char const* src, size_t len, size_t width) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i const x = _mm_loadu_si128((__m128i const*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), sse2_bswap(x, width));
+    }
+    return i;
+}
+
+static void
+bswap_kernel_sse2(unsigned char* dst, unsigned char const* src,
+                  size_t n_elems, size_t width) {
+    size_t const len = n_elems * width;
+    size_t i;
+    switch (width) {
+    case 2: i = bswap_loop_sse2(dst, src, len, 2); break;
+    case 4: i = bswap_loop_sse2(dst, src, len, 4); break;
+    default: i = bswap_loop_sse2(dst, src, len, 8); break;
+    }
+    bswap_kernel_scalar(dst + i, src + i, (len - i) / width, width);
+}
+
+BFY_TARGET_AVX2
+static void
+bswap_kernel_avx2(unsigned char* dst, unsigned char const* src,
+                  size_t n_elems, size_t width) {
+    static int8_t const masks[3][16] = {
+        { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+        { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+        { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 }
+    };
+    int8_t const* const mask = masks[width == 2 ? 0 : width == 4 ? 1 : 2];
+    __m256i const shuf = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const*)mask));
+    size_t const len = n_elems * width;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i const x = _mm256_loadu_si256((__m256i const*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(x, shuf));
+    }
+    bswap_kernel_sse2(dst + i, src + i, (len - i) / width, width);
+}
+
+static bswap_kernel_func*
+bswap_kernel_select(void) {
+    return cpu_has_avx2() ? bswap_kernel_avx2 : bswap_kernel_sse2;
+}
+
+#elif defined(BFY_SEARCH_KERNEL_NEON)
+
+static void
+bswap_kernel_neon(unsigned char* dst, unsigned char const* src,
+                  size_t n_elems, size_t width) {
+    size_t const len = n_elems * width;
+    size_t i = 0;
+    switch (width) {
+    case 2:
+        for (; i + 16 <= len; i += 16) {
+            vst1q_u8(dst + i, vrev16q_u8(vld1q_u8(src + i)));
+        }
+        break;
+    case 4:
+        for (; i + 16 <= len; i += 16) {
+            vst1q_u8(dst + i, vrev32q_u8(vld1q_u8(src + i)));
+        }
+        break;
+    default:
+        for (; i + 16 <= len; i += 16) {
+            vst1q_u8(dst + i, vrev64q_u8(vld1q_u8(src + i)));
+        }
+        break;
+    }
+    bswap_kernel_scalar(dst + i, src + i, (len - i) / width, width);
+}
+
+static bswap_kernel_func*
+bswap_kernel_select(void) {
+    return bswap_kernel_neon;
+}
+
+#else
+
+static bswap_kernel_func*
+bswap_kernel_select(void) {
+    return bswap_kernel_scalar;
+}
+
+#endif
+
+/// number arrays
+
+// Converts between host and network byte order while copying
+static void
+ntoh_array(void* dst, void const* src, size_t n_elems, size_t width) {
+#if defined(__BIG_ENDIAN__)
+    if (dst != src) {
+        memcpy(dst, src, n_elems * width);
+    }
+#else
+    bswap_kernel_select()(dst, src, n_elems, width);
+#endif
+}
+
+// Swaps straight into reserved space, so the numbers are copied once
+static int
+buffer_add_hton_array(bfy_buffer* buf, void const* addme, size_t n_elems, size_t width) {
+    if (n_elems > SIZE_MAX / width) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t const len = n_elems * width;
+    buffer_lock(buf);
+    int ret = -1;
+    struct bfy_iovec const io = buffer_reserve_space(buf, len);
+    if ((addme != NULL || len == 0) && io.iov_base != NULL && io.iov_len >= len) {
+        ntoh_array(io.iov_base, addme, n_elems, width);
+        ret = buffer_commit_space(buf, len);
+    }
+    buffer_unlock(buf);
+    return ret;
+}
+
+int
+bfy_buffer_add_hton_u16_array(bfy_buffer* buf, uint16_t const* addme, size_t n) {
+    return buffer_add_hton_array(buf, addme, n, sizeof(*addme));
+}
+
+int
+bfy_buffer_add_hton_u32_array(bfy_buffer* buf, uint32_t const* addme, size_t n) {
+    return buffer_add_hton_array(buf, addme, n, sizeof(*addme));
+}
+
+int
+bfy_buffer_add_hton_u64_array(bfy_buffer* buf, uint64_t const* addme, size_t n) {
+    return buffer_add_hton_array(buf, addme, n, sizeof(*addme));
+}
+
+// The bytes are copied out as-is and then swapped in place:
+// the copy is a plain memcpy() and the swap runs on warm cache lines.
+static int
+buffer_remove_ntoh_array(bfy_buffer* buf, void* setme, size_t n_elems, size_t width) {
+    if (n_elems > SIZE_MAX / width) {
+        errno = ENOMSG;
+        return -1;
+    }
+    if (!buffer_remove_number(buf, setme, n_elems * width)) {
+        return -1;
+    }
+    ntoh_array(setme, setme, n_elems, width);
+    return 0;
+}
+
+int
+bfy_buffer_remove_ntoh_u16_array(bfy_buffer* buf, uint16_t* setme, size_t n) {
+    return buffer_remove_ntoh_array(buf, setme, n, sizeof(*setme));
+}
+
+int
+bfy_buffer_remove_ntoh_u32_array(bfy_buffer* buf, uint32_t* setme, size_t n) {
+    return buffer_remove_ntoh_array(buf, setme, n, sizeof(*setme));
+}
+
+int
+bfy_buffer_remove_ntoh_u64_array(bfy_buffer* buf, uint64_t* setme, size_t n) {
+    return buffer_remove_ntoh_array(buf, setme, n, sizeof(*setme));
+}
+
+static int
+buffer_peek_ntoh_array_at(bfy_buffer const* buf, size_t offset,
+                          void* setme, size_t n_elems, size_t width) {
+    if (n_elems > SIZE_MAX / width) {
+        errno = ENOMSG;
+        return -1;
+    }
+    int const ret = buffer_peek_number(buf, offset, setme, n_elems * width);
+    if (ret == 0) {
+        ntoh_array(setme, setme, n_elems, width);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_peek_ntoh_u16_array_at(bfy_buffer const* buf, size_t offset, uint16_t* setme, size_t n) {
+    return buffer_peek_ntoh_array_at(buf, offset, setme, n, sizeof(*setme));
+}
+
+int
+bfy_buffer_peek_ntoh_u32_array_at(bfy_buffer const* buf, size_t offset, uint32_t* setme, size_t n) {
+    return buffer_peek_ntoh_array_at(buf, offset, setme, n, sizeof(*setme));
+}
+
+int
+bfy_buffer_peek_ntoh_u64_array_at(bfy_buffer const* buf, size_t offset, uint64_t* setme, size_t n) {
+    return buffer_peek_ntoh_array_at(buf, offset, setme, n, sizeof(*setme));
+}
+
+/// varints
+
+// LEB128: seven bits per byte, least significant group first, with
+// the high bit set on every byte but the last. Signed values are
+// zigzag-encoded first so that small negative numbers stay short.
+
+enum { VARINT_MAX_LEN = 10 };
+
+static size_t
+varint_encode(unsigned char* out, uint64_t val) {
+    size_t n = 0;
+    while (val >= 0x80) {
+        out[n++] = (unsigned char)(val | 0x80);
+        val >>= 7;
+    }
+    out[n++] = (unsigned char) val;
+    return n;
+}
+
+static inline uint64_t
+zigzag_encode(int64_t val) {
+    return ((uint64_t) val << 1) ^ (0 - ((uint64_t) val >> 63));
+}
+
+static inline int64_t
+zigzag_decode(uint64_t val) {
+    return (int64_t)((val >> 1) ^ (0 - (val & 1)));
+}
+
+// Decodes the varint at p[0..VARINT_MAX_LEN) and returns its length,
+// or 0 if it's longer than VARINT_MAX_LEN bytes or overflows a uint64_t.
+// All VARINT_MAX_LEN bytes are read, so callers with fewer bytes pad
+// the rest with zeroes and compare the returned length to what they had.
+static size_t
+varint_decode(unsigned char const* p, uint64_t* setme) {
+    if (p[0] < 0x80) {
+        *setme = p[0];
+        return 1;
+    }
+
+    // the first byte without a continuation bit ends the varint
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    word = ltoh64(word);
+    uint64_t const stops = ~word & UINT64_C(0x8080808080808080);
+    uint64_t high = 0;
+    size_t len;
+    if (stops != 0) {
+        // keep the bytes up to and including the lowest stop bit
+        word &= stops ^ (stops - 1);
+        len = count_trailing_zeros(stops) / 8 + 1;
+    } else if (p[8] < 0x80) {
+        high = (uint64_t) p[8] << 56;
+        len = 9;
+    } else if (p[9] <= 1) {
+        high = ((uint64_t)(p[8] & 0x7f) << 56) | ((uint64_t) p[9] << 63);
+        len = 10;
+    } else {
+        return 0;
+    }
+
+    // squeeze out the continuation bits: 8x7 -> 4x14 -> 2x28 -> 1x56
+    word = ((word & UINT64_C(0x7f007f007f007f00)) >> 1) | (word & UINT64_C(0x007f007f007f007f));
+    word = ((word & UINT64_C(0x3fff00003fff0000)) >> 2) | (word & UINT64_C(0x00003fff00003fff));
+    word = ((word & UINT64_C(0x0fffffff00000000)) >> 4) | (word & UINT64_C(0x000000000fffffff));
+    word |= high;
+    *setme = word;
+    return len;
+}
+
+// Returns the length of the varint at `offset`, 0 if it's malformed,
+// or SIZE_MAX if the buffer ends before the varint does
+static size_t
+buffer_peek_varint(bfy_buffer const* buf, size_t offset, uint64_t* setme) {
+    struct bfy_page const* const page = pages_cbegin(buf);
+    size_t const page_len = page_get_content_len(page);
+    if (offset <= page_len && VARINT_MAX_LEN <= page_len - offset) {
+        unsigned char const* const p = page_read_cbegin(page);
+        return varint_decode(p + offset, setme);
+    }
+
+    // near the end of the first page, copy it out and pad it
+    unsigned char tmp[VARINT_MAX_LEN] = { 0 };
+    size_t n_avail = 0;
+    if (offset < buf->content_len) {
+        n_avail = size_t_min(buf->content_len - offset, VARINT_MAX_LEN);
+        buffer_peek_at(buf, offset, tmp, n_avail);
+    }
+    size_t const len = varint_decode(tmp, setme);
+    return len > n_avail ? SIZE_MAX : len;
+}
+
+static size_t
+buffer_remove_varint(bfy_buffer* buf, uint64_t* setme) {
+    buffer_lock(buf);
+    struct bfy_page* const page = pages_begin(buf);
+    size_t len;
+    if (VARINT_MAX_LEN < page_get_content_len(page)) {
+        // the varint can't empty the page, so just step past it
+        len = varint_decode(page_read_cbegin(page), setme);
+        if (len != 0) {
+            page->read_pos += len;
+            buf->n_drained_front += len;
+            buffer_record_content_removed(buf, len);
+        }
+    } else {
+        len = buffer_peek_varint(buf, 0, setme);
+        if (len != 0 && len != SIZE_MAX) {
+            unsigned char tmp[VARINT_MAX_LEN];
+            buffer_remove_front(buf, tmp, len);
+        }
+    }
+    buffer_unlock(buf);
+    return len;
+}
+
+// Sets errno and returns -1 if a varint couldn't be read
+static int
+varint_check(size_t len) {
+    if (len == SIZE_MAX) {
+        errno = ENOMSG;
+        return -1;
+    }
+    if (len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int
+bfy_buffer_add_varint_u64(bfy_buffer* buf, uint64_t addme) {
+    unsigned char tmp[VARINT_MAX_LEN];
+    size_t const len = varint_encode(tmp, addme);
+    return bfy_buffer_add(buf, tmp, len);
+}
+
+int
+bfy_buffer_add_varint_s64(bfy_buffer* buf, int64_t addme) {
+    return bfy_buffer_add_varint_u64(buf, zigzag_encode(addme));
+}
+
+int
+bfy_buffer_remove_varint_u64(bfy_buffer* buf, uint64_t* setme) {
+    uint64_t val;
+    int const ret = varint_check(buffer_remove_varint(buf, &val));
+    if (ret == 0) {
+        *setme = val;
+    }
+    return ret;
+}
+
+int
+bfy_buffer_remove_varint_s64(bfy_buffer* buf, int64_t* setme) {
+    uint64_t val;
+    int const ret = varint_check(buffer_remove_varint(buf, &val));
+    if (ret == 0) {
+        *setme = zigzag_decode(val);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_peek_varint_u64_at(bfy_buffer const* buf, size_t offset,
+                              uint64_t* setme, size_t* setme_len) {
+    uint64_t val;
+    buffer_lock(buf);
+    size_t const len = buffer_peek_varint(buf, offset, &val);
+    buffer_unlock(buf);
+    int const ret = varint_check(len);
+    if (ret == 0) {
+        *setme = val;
+        if (setme_len != NULL) {
+            *setme_len = len;
+        }
+    }
+    return ret;
+}
+
+int
+bfy_buffer_peek_varint_s64_at(bfy_buffer const* buf, size_t offset,
+                              int64_t* setme, size_t* setme_len) {
+    uint64_t val;
+    int const ret = bfy_buffer_peek_varint_u64_at(buf, offset, &val, setme_len);
+    if (ret == 0) {
+        *setme = zigzag_decode(val);
+    }
+    return ret;
+}
+
+/// pack
+
+// One field code from a pack format, with its repeat count folded in
+struct format_op {
+    char code;
+    size_t count;  // how many fields, or how many bytes for 's' and 'x'
+};
+
+struct bfy_format {
+    bool swap;    // true if the format's byte order isn't the host's
+    size_t size;  // how many bytes a packed record takes
+    size_t n_ops;
+    struct format_op* ops;
+};
+
+struct format_parser {
+    char const* pos;
+    bool swap;
+};
+
+// Returns how many bytes one field of `code` takes, or 0 if it's unknown
+static size_t
+format_code_width(char code) {
+    switch (code) {
+        case 'x': case 's': case 'c': case 'b': case 'B':
+            return 1;
+        case 'h': case 'H':
+            return 2;
+        case 'i': case 'I': case 'l': case 'L': case 'f':
+            return 4;
+        case 'q': case 'Q': case 'd':
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+static struct format_parser
+format_parser_init(char const* format) {
+    bool const little_host = htol16(1) == 1;
+    struct format_parser p = {
+        .pos = format,
+        .swap = false
+    };
+    switch (*format) {
+        case '!': case '>': p.swap = little_host; ++p.pos; break;
+        case '<': p.swap = !little_host; ++p.pos; break;
+        case '=': ++p.pos; break;
+        default: break;
+    }
+    return p;
+}
+
+// Reads the next op and adds its length to `size`.
+// Returns 1 if an op was read, 0 at the end of the format,
+// or -1 with errno set to EINVAL if the format is malformed.
+static int
+format_parser_next(struct format_parser* p, struct format_op* setme, size_t* size) {
+    while (*p->pos == ' ') {
+        ++p->pos;
+    }
+    if (*p->pos == '\0') {
+        return 0;
+    }
+
+    size_t count = 1;
+    if ('0' <= *p->pos && *p->pos <= '9') {
+        count = 0;
+        for (; '0' <= *p->pos && *p->pos <= '9'; ++p->pos) {
+            size_t const digit = (size_t)(*p->pos - '0');
+            if (count > (SIZE_MAX - digit) / 10) {
+                errno = EINVAL;
+                return -1;
+            }
+            count = count * 10 + digit;
+        }
+    }
+
+    char const code = *p->pos;
+    size_t const width = format_code_width(code);
+    // no width is more than 8, so this bound avoids a division
+    if (width == 0 || count > SIZE_MAX / 8 || width * count > SIZE_MAX - *size) {
+        errno = EINVAL;
+        return -1;
+    }
+    ++p->pos;
+    *size += width * count;
+    setme->code = code;
+    setme->count = count;
+    return 1;
+}
+
+static unsigned char*
+format_put16(unsigned char* out, uint16_t val, bool swap) {
+    val = swap ? bswap16(val) : val;
+    memcpy(out, &val, sizeof(val));
+    return out + sizeof(val);
+}
+
+static unsigned char*
+format_put32(unsigned char* out, uint32_t val, bool swap) {
+    val = swap ? bswap32(val) : val;
+    memcpy(out, &val, sizeof(val));
+    return out + sizeof(val);
+}
+
+static unsigned char*
+format_put64(unsigned char* out, uint64_t val, bool swap) {
+    val = swap ? bswap64(val) : val;
+    memcpy(out, &val, sizeof(val));
+    return out + sizeof(val);
+}
+
+static unsigned char*
+format_pack_op(unsigned char* out, struct format_op op, bool swap, va_list* args) {
+    if (op.code == 'x') {
+        memset(out, 0, op.count);
+        return out + op.count;
+    }
+    if (op.code == 's') {
+        void const* const addme = va_arg(*args, void const*);
+        if (op.count > 0) {
+            memcpy(out, addme, op.count);
+        }
+        return out + op.count;
+    }
+
+    for (size_t i = 0; i < op.count; ++i) {
+        switch (op.code) {
+            case 'c': case 'b': case 'B':
+                *out++ = (unsigned char) va_arg(*args, int);
+                break;
+            case 'h': case 'H':
+                out = format_put16(out, (uint16_t) va_arg(*args, int), swap);
+                break;
+            case 'i': case 'l':
+                out = format_put32(out, (uint32_t) va_arg(*args, int32_t), swap);
+                break;
+            case 'I': case 'L':
+                out = format_put32(out, va_arg(*args, uint32_t), swap);
+                break;
+            case 'q':
+                out = format_put64(out, (uint64_t) va_arg(*args, int64_t), swap);
+                break;
+            case 'Q':
+                out = format_put64(out, va_arg(*args, uint64_t), swap);
+                break;
+            case 'f': {
+                float const val = (float) va_arg(*args, double);
+                uint32_t bits;
+                memcpy(&bits, &val, sizeof(bits));
+                out = format_put32(out, bits, swap);
+                break;
+            }
+            case 'd': {
+                double const val = va_arg(*args, double);
+                uint64_t bits;
+                memcpy(&bits, &val, sizeof(bits));
+                out = format_put64(out, bits, swap);
+                break;
+            }
+        }
+    }
+    return out;
+}
+
+static uint16_t
+format_get16(unsigned char const* in, bool swap) {
+    uint16_t val;
+    memcpy(&val, in, sizeof(val));
+    return swap ? bswap16(val) : val;
+}
+
+static uint32_t
+format_get32(unsigned char const* in, bool swap) {
+    uint32_t val;
+    memcpy(&val, in, sizeof(val));
+    return swap ? bswap32(val) : val;
+}
+
+static uint64_t
+format_get64(unsigned char const* in, bool swap) {
+    uint64_t val;
+    memcpy(&val, in, sizeof(val));
+    return swap ? bswap64(val) : val;
+}
+
+static unsigned char const*
+format_unpack_op(unsigned char const* in, struct format_op op, bool swap, va_list* args) {
+    if (op.code == 'x') {
+        return in + op.count;
+    }
+    if (op.code == 's') {
+        void* const setme = va_arg(*args, void*);
+        if (op.count > 0) {
+            memcpy(setme, in, op.count);
+        }
+        return in + op.count;
+    }
+
+    for (size_t i = 0; i < op.count; ++i) {
+        switch (op.code) {
+            case 'c':
+                *va_arg(*args, char*) = (char) *in++;
+                break;
+            case 'b':
+                *va_arg(*args, int8_t*) = (int8_t) *in++;
+                break;
+            case 'B':
+                *va_arg(*args, uint8_t*) = *in++;
+                break;
+            case 'h':
+                *va_arg(*args, int16_t*) = (int16_t) format_get16(in, swap);
+                in += 2;
+                break;
+            case 'H':
+                *va_arg(*args, uint16_t*) = format_get16(in, swap);
+                in += 2;
+                break;
+            case 'i': case 'l':
+                *va_arg(*args, int32_t*) = (int32_t) format_get32(in, swap);
+                in += 4;
+                break;
+            case 'I': case 'L':
+                *va_arg(*args, uint32_t*) = format_get32(in, swap);
+                in += 4;
+                break;
+            case 'q':
+                *va_arg(*args, int64_t*) = (int64_t) format_get64(in, swap);
+                in += 8;
+                break;
+            case 'Q':
+                *va_arg(*args, uint64_t*) = format_get64(in, swap);
+                in += 8;
+                break;
+            case 'f': {
+                uint32_t const bits = format_get32(in, swap);
+                memcpy(va_arg(*args, float*), &bits, sizeof(bits));
+                in += 4;
+                break;
+            }
+            case 'd': {
+                uint64_t const bits = format_get64(in, swap);
+                memcpy(va_arg(*args, double*), &bits, sizeof(bits));
+                in += 8;
+                break;
+            }
+        }
+    }
+    return in;
+}
+
+// Compiles `format` into `fmt`, whose ops array has room for `max_ops`.
+// Returns 0 on success, 1 if the format has more ops than that,
+// or -1 with errno set to EINVAL if the format is malformed.
+static int
+format_compile(bfy_format* fmt, char const* format, size_t max_ops) {
+    struct format_parser p = format_parser_init(format);
+    struct format_op op;
+    int ret;
+    fmt->swap = p.swap;
+    fmt->size = 0;
+    fmt->n_ops = 0;
+    while ((ret = format_parser_next(&p, &op, &fmt->size)) == 1) {
+        if (fmt->n_ops == max_ops) {
+            return 1;
+        }
+        fmt->ops[fmt->n_ops++] = op;
+    }
+    return ret;
+}
+
+bfy_format*
+bfy_format_new(char const* format) {
+    // every op takes at least one character of the format
+    size_t const max_ops = strlen(format);
+    bfy_format* fmt = allocator.malloc(sizeof(bfy_format) + sizeof(struct format_op) * max_ops);
+    if (fmt == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    fmt->ops = (struct format_op*)(fmt + 1);
+    if (format_compile(fmt, format, max_ops) != 0) {
+        allocator.free(fmt);
+        return NULL;
+    }
+    return fmt;
+}
+
+void
+bfy_format_free(bfy_format* fmt) {
+    allocator.free(fmt);
+}
+
+size_t
+bfy_format_get_size(bfy_format const* fmt) {
+    return fmt->size;
+}
+
+enum { FORMAT_STACK_OPS = 16 };
+
+// Compiles a format string for a single call. Most formats fit in
+// `stack_fmt`'s ops; longer ones are compiled on the heap and should
+// be freed with bfy_format_free() if they're not `stack_fmt`.
+static bfy_format*
+format_compile_once(bfy_format* stack_fmt, char const* format) {
+    int const ret = format_compile(stack_fmt, format, FORMAT_STACK_OPS);
+    if (ret < 0) {
+        return NULL;
+    }
+    return ret == 0 ? stack_fmt : bfy_format_new(format);
+}
+
+// Packs a record with a single reservation and a single commit
+static int
+buffer_pack(bfy_buffer* buf, bfy_format const* fmt, va_list* args) {
+    if (fmt->size == 0) {
+        return 0;
+    }
+
+    bfy_writer w = bfy_writer_init(buf);
+    unsigned char* out = bfy_writer_claim(&w, fmt->size);
+    int const ret = out != NULL ? 0 : -1;
+    if (ret == 0) {
+        for (size_t i = 0; i < fmt->n_ops; ++i) {
+            out = format_pack_op(out, fmt->ops[i], fmt->swap, args);
+        }
+    }
+    bfy_writer_destruct(&w);
+    return ret;
+}
+
+// Unpacks a record from the front of the buffer, or nothing at all
+// if the buffer doesn't hold a complete record
+static int
+buffer_unpack(bfy_buffer* buf, bfy_format const* fmt, va_list* args) {
+    int ret = 0;
+    unsigned char stack_scratch[256];
+    unsigned char* scratch = stack_scratch;
+
+    buffer_lock(buf);
+    struct bfy_page const* const page = pages_cbegin(buf);
+    unsigned char const* in = NULL;
+    if (fmt->size > buf->content_len) {
+        errno = ENOMSG;
+        ret = -1;
+    } else if (fmt->size <= page_get_content_len(page)) {
+        // the whole record is in the first page; decode it in place
+        in = page_read_cbegin(page);
+    } else {
+        if (fmt->size > sizeof(stack_scratch)) {
+            scratch = allocator.malloc(fmt->size);
+        }
+        if (scratch == NULL) {
+            errno = ENOMEM;
+            ret = -1;
+        } else {
+            buffer_peek_at(buf, 0, scratch, fmt->size);
+            in = scratch;
+        }
+    }
+
+    if (ret == 0) {
+        for (size_t i = 0; i < fmt->n_ops; ++i) {
+            in = format_unpack_op(in, fmt->ops[i], fmt->swap, args);
+        }
+        if (fmt->size > 0) {
+            buffer_drain_front(buf, fmt->size);
+        }
+    }
+    buffer_unlock(buf);
+
+    if (scratch != stack_scratch) {
+        allocator.free(scratch);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_pack(bfy_buffer* buf, char const* format, ...) {
+    struct format_op ops[FORMAT_STACK_OPS];
+    bfy_format stack_fmt = { .ops = ops };
+    bfy_format* const fmt = format_compile_once(&stack_fmt, format);
+    if (fmt == NULL) {
+        return -1;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int const ret = buffer_pack(buf, fmt, &args);
+    va_end(args);
+
+    if (fmt != &stack_fmt) {
+        bfy_format_free(fmt);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_pack_format(bfy_buffer* buf, bfy_format const* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int const ret = buffer_pack(buf, fmt, &args);
+    va_end(args);
+    return ret;
+}
+
+int
+bfy_buffer_unpack(bfy_buffer* buf, char const* format, ...) {
+    struct format_op ops[FORMAT_STACK_OPS];
+    bfy_format stack_fmt = { .ops = ops };
+    bfy_format* const fmt = format_compile_once(&stack_fmt, format);
+    if (fmt == NULL) {
+        return -1;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int const ret = buffer_unpack(buf, fmt, &args);
+    va_end(args);
+
+    if (fmt != &stack_fmt) {
+        bfy_format_free(fmt);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_unpack_format(bfy_buffer* buf, bfy_format const* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int const ret = buffer_unpack(buf, fmt, &args);
+    va_end(args);
+    return ret;
+}
+
+/// search
+
+// Two-Way string matching (Crochemore & Perrin), adapted from musl's memmem.
+// The needle is preprocessed once so that any number of haystack chunks
+// can be searched in O(n) time with O(1) extra state, and the shift table
+// lets the search skip ahead by up to needle_len bytes on a mismatch.
+
+#define BYTESET_BITS (8 * sizeof(size_t))
+
+static inline bool
+bytes_match(unsigned char a, unsigned char b, bool nocase) {
+    return nocase ? ascii_tolower(a) == ascii_tolower(b) : a == b;
+}
+
+static inline bool
+needle_bytes_match(unsigned char const* a, unsigned char const* b, size_t len, bool nocase) {
+    return nocase ? ascii_caseeq(a, b, len) : memcmp(a, b, len) == 0;
+}
+
+static size_t
+needle_maximal_suffix(unsigned char const* n, size_t l,
+                      bool reverse, bool nocase, size_t* setme_period) {
+    size_t ip = SIZE_MAX;  // i.e. -1
+    size_t jp = 0;
+    size_t k = 1;
+    size_t p = 1;
+
+    while (jp + k < l) {
+        unsigned char const a = nocase ? ascii_tolower(n[ip + k]) : n[ip + k];
+        unsigned char const b = nocase ? ascii_tolower(n[jp + k]) : n[jp + k];
+        if (a == b) {
+            if (k == p) {
+                jp += p;
+                k = 1;
+            } else {
+                ++k;
+            }
+        } else if (reverse ? a < b : a > b) {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        } else {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+
+    *setme_period = p;
+    return ip;
+}
+
+static void
+needle_init(bfy_searcher* needle, void const* str, size_t len, bool nocase) {
+    unsigned char const* const n = str;
+
+    needle->str = n;
+    needle->len = len;
+    needle->nocase = nocase;
+    needle->kernel = nocase ? search_kernel_nocase_select() : search_kernel_select();
+    memset(needle->byteset, 0, sizeof(needle->byteset));
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char ch = n[i];
+        needle->byteset[ch / BYTESET_BITS] |= (size_t)1 << (ch % BYTESET_BITS);
+        needle->shift[ch] = i + 1;
+        if (nocase && (unsigned)((ch | 0x20) - 'a') < 26u) {
+            // a letter matches both of its cases
+            ch ^= 0x20;
+            needle->byteset[ch / BYTESET_BITS] |= (size_t)1 << (ch % BYTESET_BITS);
+            needle->shift[ch] = i + 1;
+        }
+    }
+
+    // critical factorization: the longer of the two maximal suffixes
+    size_t p;
+    size_t p_rev;
+    size_t ms = needle_maximal_suffix(n, len, false, nocase, &p);
+    size_t const ms_rev = needle_maximal_suffix(n, len, true, nocase, &p_rev);
+    if (ms_rev + 1 > ms + 1) {
+        ms = ms_rev;
+        p = p_rev;
+    }
+
+    needle->ms = ms;
+    if (len > 0 && ms + 1 + p <= len && needle_bytes_match(n, n + p, ms + 1, nocase)) {
+        // periodic needle; remember how much of the period still matches
+        needle->p = p;
+        needle->mem0 = len - p;
+    } else {
+        needle->p = (ms > len - ms - 1 ? ms : len - ms - 1) + 1;
+        needle->mem0 = 0;
+    }
+}
+
+bfy_searcher
+bfy_searcher_init(void const* needle, size_t needle_len) {
+    bfy_searcher searcher;
+    needle_init(&searcher, needle, needle_len, false);
+    return searcher;
+}
+
+bfy_searcher
+bfy_searcher_init_nocase(void const* needle, size_t needle_len) {
+    bfy_searcher searcher;
+    needle_init(&searcher, needle, needle_len, true);
+    return searcher;
+}
+
+static bfy_searcher*
+searcher_new(void const* needle, size_t needle_len, bool nocase) {
+    // keep a private copy of the needle right after the searcher
+    bfy_searcher* searcher = allocator.malloc(sizeof(bfy_searcher) + needle_len);
+    if (searcher != NULL) {
+        void* const str = searcher + 1;
+        if (needle_len > 0) {
+            memcpy(str, needle, needle_len);
+        }
+        needle_init(searcher, str, needle_len, nocase);
+    }
+    return searcher;
+}
+
+bfy_searcher*
+bfy_searcher_new(void const* needle, size_t needle_len) {
+    return searcher_new(needle, needle_len, false);
+}
+
+bfy_searcher*
+bfy_searcher_new_nocase(void const* needle, size_t needle_len) {
+    return searcher_new(needle, needle_len, true);
+}
+
+void
+bfy_searcher_destruct(bfy_searcher* searcher) {
+    (void) searcher;
+}
+
+void
+bfy_searcher_free(bfy_searcher* searcher) {
+    bfy_searcher_destruct(searcher);
+    allocator.free(searcher);
+}
+
+static inline bool
+needle_has_byte(bfy_searcher const* needle, unsigned char ch) {
+    return (needle->byteset[ch / BYTESET_BITS] >> (ch % BYTESET_BITS)) & 1;
+}
+
+static inline unsigned char
+haystack_at(unsigned char const* h, size_t h_len, size_t i, bool reverse) {
+    return reverse ? h[h_len - 1 - i] : h[i];
+}
+
+// Two-Way search for the needle in h[0..h_len), or in h[0..h_len) read
+// back to front if `reverse` is true. Returns the offset of the first
+// match (counting from the back if reversed), or h_len if there is none.
+static size_t
+two_way_search(bfy_searcher const* needle,
+               unsigned char const* h, size_t h_len,
+               bool reverse) {
+    unsigned char const* const n = needle->str;
+    size_t const l = needle->len;
+    size_t const ms = needle->ms;
+    bool const nocase = needle->nocase;
+    size_t mem = 0;
+    size_t pos = 0;
+    while (h_len - pos >= l) {
+        // check the last byte first; skip ahead on a mismatch
+        unsigned char const last = haystack_at(h, h_len, pos + l - 1, reverse);
+        if (!needle_has_byte(needle, last)) {
+            pos += l;
+            mem = 0;
+            continue;
+        }
+        size_t k = l - needle->shift[last];
+        if (k != 0) {
+            pos += k < mem ? mem : k;
+            mem = 0;
+            continue;
+        }
+
+        // compare the right half
+        for (k = ms + 1 > mem ? ms + 1 : mem; k < l && bytes_match(n[k], haystack_at(h, h_len, pos + k, reverse), nocase); ++k) {
+        }
+        if (k < l) {
+            pos += k - ms;
+            mem = 0;
+            continue;
+        }
+
+        // compare the left half
+        for (k = ms + 1; k > mem && bytes_match(n[k - 1], haystack_at(h, h_len, pos + k - 1, reverse), nocase); --k) {
+        }
+        if (k <= mem) {
+            return pos;
+        }
+        pos += needle->p;
+        mem = needle->mem0;
+    }
+
+    return h_len;
+}
+
+// returns the offset of the first match in [h..h+h_len), or h_len if none
+static size_t
+needle_search(bfy_searcher const* needle, void const* vh, size_t h_len) {
+    unsigned char const* const n = needle->str;
+    size_t const l = needle->len;
+    unsigned char const* const begin = vh;
+
+    if (l == 0) {
+        return 0;
+    }
+
+    if (h_len < l) {
+        return h_len;
+    }
+    if (l == 1) {
+        if (needle->nocase) {
+            return needle->kernel(begin, h_len, n[0], n[0], 0);
+        }
+        unsigned char const* const hit = memchr(begin, *n, h_len);
+        return hit != NULL ? (size_t)(hit - begin) : h_len;
+    }
+
+    // Scanning for candidates that match the needle's first and last
+    // bytes is fastest when those are rare. If it keeps finding false
+    // candidates, switch to Two-Way, which bounds the work to O(h_len).
+    size_t const n_pos = h_len - l + 1;
+    size_t pos = 0;
+    size_t naive_work = 0;
+    for (;;) {
+        pos += needle->kernel(begin + pos, n_pos - pos, n[0], n[l - 1], l - 1);
+        if (pos == n_pos) {
+            return h_len;
+        }
+        if (needle_bytes_match(begin + pos + 1, n + 1, l - 2, needle->nocase)) {
+            return pos;
+        }
+        ++pos;
+        naive_work += l;
+        if (naive_work > pos + 8 * l) {
+            break;
+        }
+    }
+    return pos + two_way_search(needle, begin + pos, h_len - pos, false);
+}
+
+// Matches that straddle pages are found in a scratch window. The window
+// starts with the last needle_len-1 bytes of what's been searched so far,
+// since a match could start there, and is followed by the bytes after it:
+// either the start of the next big page, or a run of pages too small to
+// hold a match by themselves. Each byte passes through the window O(1)
+// times, so tiny pages don't make the search quadratic.
+//
+// Returns 0 if there's a match, -1 if there isn't, or -2 with errno
+// set to ENOMEM if the window couldn't be allocated.
+enum { SEARCH_SCRATCH_STACK_LEN = 256 };
+
+static int
+buffer_search_range(bfy_buffer const* buf,
+                    struct bfy_pos begin, struct bfy_pos end,
+                    bfy_searcher const* needle,
+                    size_t* setme) {
+    struct bfy_iter iter;
+
+    if (!iter_begin(&iter, buf, begin, end)) {
+        return -1;
+    }
+
+    size_t const overlap = needle->len > 0 ? needle->len - 1 : 0;
+    size_t const window_max = overlap * 3;  // plus `overlap` bytes of lookahead
+    char stack_scratch[SEARCH_SCRATCH_STACK_LEN];
+    char* scratch = stack_scratch;
+    if (window_max + overlap > sizeof(stack_scratch)) {
+        scratch = allocator.malloc(window_max + overlap);
+        if (scratch == NULL) {
+            errno = ENOMEM;
+            return -2;
+        }
+    }
+
+    int ret = -1;
+    size_t window_pos = iter.cur.content_pos;  // content_pos of scratch[0]
+    size_t window_len = 0;
+    do {
+        char const* const io_base = iter.io.iov_base;
+        size_t const io_len = iter.io.iov_len;
+
+        if (io_len < overlap) {
+            // too small to search by itself; add it to the window
+            if (window_len + io_len > window_max) {
+                size_t const hit = needle_search(needle, scratch, window_len);
+                if (hit < window_len) {
+                    ret = 0;
+                    if (setme != NULL) {
+                        *setme = window_pos + hit;
+                    }
+                    break;
+                }
+                memmove(scratch, scratch + window_len - overlap, overlap);
+                window_pos += window_len - overlap;
+                window_len = overlap;
+            }
+            memcpy(scratch + window_len, io_base, io_len);
+            window_len += io_len;
+            continue;
+        }
+
+        // look for a match that starts in the window
+        if (window_len > 0) {
+            memcpy(scratch + window_len, io_base, overlap);
+            size_t const hit = needle_search(needle, scratch, window_len + overlap);
+            if (hit < window_len + overlap) {
+                ret = 0;
+                if (setme != NULL) {
+                    *setme = window_pos + hit;
+                }
+                break;
+            }
+        }
+
+        // look for a match inside this page
+        size_t const hit = needle_search(needle, io_base, io_len);
+        if (hit < io_len) {
+            ret = 0;
+            if (setme != NULL) {
+                *setme = iter.cur.content_pos + hit;
+            }
+            break;
+        }
+
+        // a match could still start in this page's last bytes
+        memcpy(scratch, io_base + io_len - overlap, overlap);
+        window_pos = iter.cur.content_pos + io_len - overlap;
+        window_len = overlap;
+    } while (iter_next_page(&iter));
+
+    if (ret != 0 && window_len > 0) {
+        size_t const hit = needle_search(needle, scratch, window_len);
+        if (hit < window_len) {
+            ret = 0;
+            if (setme != NULL) {
+                *setme = window_pos + hit;
+            }
+        }
+    }
+
+    if (scratch != stack_scratch) {
+        allocator.free(scratch);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_search_range_with(bfy_buffer const* buf,
+                             size_t begin, size_t end,
+                             bfy_searcher const* searcher,
+                             size_t* setme_match) {
+    buffer_lock(buf);
+    int const ret = buffer_search_range(buf,
+                                        buffer_get_pos(buf, begin),
+                                        buffer_get_pos(buf, end),
+                                        searcher, setme_match);
+    buffer_unlock(buf);
+    return ret == 0 ? 0 : -1;
+}
+
+int
+bfy_buffer_search_all_with(bfy_buffer const* buf,
+                           bfy_searcher const* searcher,
+                           size_t* setme_match) {
+    return bfy_buffer_search_range_with(buf, 0, SIZE_MAX, searcher, setme_match);
+}
+
+size_t
+bfy_buffer_search_range_many(bfy_buffer const* buf,
+                             size_t begin, size_t end,
+                             bfy_searcher const* searcher,
+                             size_t* setme_matches, size_t max_matches) {
+    buffer_lock(buf);
+
+    // each search picks up where the last match ended,
+    // so the content is only walked once
+    size_t const step = searcher->len > 0 ? searcher->len : 1;
+    struct bfy_pos const end_pos = buffer_get_pos(buf, end);
+    struct bfy_pos pos = buffer_get_pos(buf, begin);
+    size_t n_matches = 0;
+    size_t match;
+    while (n_matches < max_matches &&
+           buffer_search_range(buf, pos, end_pos, searcher, &match) == 0) {
+        setme_matches[n_matches++] = match;
+        pos = buffer_get_pos_from(buf, pos, match + step);
+    }
+
+    buffer_unlock(buf);
+    return n_matches;
+}
+
+bfy_search_state
+bfy_search_state_init(void) {
+    bfy_search_state const state = {
+        .next_match_pos = 0
+    };
+    return state;
+}
+
+int
+bfy_buffer_search_resume(bfy_buffer const* buf,
+                         bfy_search_state* state,
+                         bfy_searcher const* searcher,
+                         size_t* setme_match) {
+    buffer_lock(buf);
+
+    // state->next_match_pos counts bytes drained from the front,
+    // so it stays put when the buffer's front moves
+    size_t const drained = buf->n_drained_front;
+    size_t const content_len = buf->content_len;
+    size_t const begin = state->next_match_pos > drained ? state->next_match_pos - drained : 0;
+
+    size_t match;
+    int const ret = buffer_search_range(buf,
+                                        buffer_get_pos(buf, begin),
+                                        buffer_get_pos(buf, content_len),
+                                        searcher, &match);
+
+    if (ret == 0) {
+        // keep reporting this match until it's drained
+        state->next_match_pos = drained + match;
+        if (setme_match != NULL) {
+            *setme_match = match;
+        }
+    } else if (ret == -1) {
+        // a match could still start in the last needle_len - 1 bytes
+        size_t const overlap = searcher->len > 0 ? searcher->len - 1 : 0;
+        size_t const next = content_len > overlap ? content_len - overlap : 0;
+        state->next_match_pos = drained + (next > begin ? next : begin);
+    }
+
+    buffer_unlock(buf);
+    return ret == 0 ? 0 : -1;
+}
+
+int
+bfy_buffer_search_range(bfy_buffer const* buf,
+                        size_t begin, size_t end,
+                        void const* needle, size_t needle_len,
+                        size_t* setme_match) {
+    bfy_searcher const searcher = bfy_searcher_init(needle, needle_len);
+    return bfy_buffer_search_range_with(buf, begin, end, &searcher, setme_match);
+}
+
+int
+bfy_buffer_search_range_nocase(bfy_buffer const* buf,
+                               size_t begin, size_t end,
+                               void const* needle, size_t needle_len,
+                               size_t* setme_match) {
+    bfy_searcher const searcher = bfy_searcher_init_nocase(needle, needle_len);
+    return bfy_buffer_search_range_with(buf, begin, end, &searcher, setme_match);
+}
+
+int
+bfy_buffer_search_all_nocase(bfy_buffer const* buf,
+                             void const* needle, size_t needle_len,
+                             size_t* setme_match) {
+    return bfy_buffer_search_range_nocase(buf, 0, SIZE_MAX,
+                                          needle, needle_len, setme_match);
+}
+
+struct search_tasks {
+    bfy_buffer const* buf;
+    struct bfy_pos const* bounds;
+    struct bfy_pos end;
+    bfy_searcher const* needle;
+    size_t* matches;
+};
+
+static void
+search_task(void* vtasks, size_t i) {
+    struct search_tasks const* const tasks = vtasks;
+
+    // extend the part by needle_len - 1 bytes so that
+    // matches which straddle two parts aren't missed
+    struct bfy_pos end = tasks->bounds[i + 1];
+    struct bfy_iter iter;
+    if (iter_begin(&iter, tasks->buf, end, tasks->end)) {
+        iter_advance_n_bytes(&iter, tasks->needle->len - 1);
+        end = iter.cur;
+    }
+
+    if (buffer_search_range(tasks->buf, tasks->bounds[i], end,
+                            tasks->needle, tasks->matches + i) != 0) {
+        tasks->matches[i] = SIZE_MAX;
+    }
+}
+
+static int
+buffer_search_range_parallel(bfy_buffer const* buf,
+                             struct bfy_pos begin, struct bfy_pos end,
+                             bfy_searcher const* needle,
+                             size_t* setme, size_t n_tasks,
+                             bfy_run_tasks_cb* run_tasks, void* run_tasks_data) {
+    size_t const needle_len = needle->len;
+    size_t const len = end.content_pos > begin.content_pos ? end.content_pos - begin.content_pos : 0;
+    n_tasks = needle_len > 0 && len > needle_len ? size_t_min(n_tasks, len / needle_len) : 1;
+    if (n_tasks <= 1 || run_tasks == NULL) {
+        return buffer_search_range(buf, begin, end, needle, setme) == 0 ? 0 : -1;
+    }
+
+    struct bfy_pos* bounds = allocator.malloc(sizeof(struct bfy_pos) * (n_tasks + 1));
+    size_t* matches = allocator.malloc(sizeof(size_t) * n_tasks);
+    int ret = -1;
+    if (bounds == NULL || matches == NULL) {
+        ret = buffer_search_range(buf, begin, end, needle, setme) == 0 ? 0 : -1;
+    } else {
+        buffer_split_range(buf, begin, end, n_tasks, bounds);
+        struct search_tasks tasks = {
+            .buf = buf,
+            .bounds = bounds,
+            .end = end,
+            .needle = needle,
+            .matches = matches
+        };
+        run_tasks(search_task, &tasks, n_tasks, run_tasks_data);
+
+        // the parts are in order, so the first part with a match has the earliest one
+        for (size_t i = 0; i < n_tasks; ++i) {
+            if (matches[i] != SIZE_MAX) {
+                if (setme != NULL) {
+                    *setme = matches[i];
+                }
+                ret = 0;
+                break;
+            }
+        }
+    }
+
+    allocator.free(matches);
+    allocator.free(bounds);
+    return ret;
+}
+
+int
+bfy_buffer_search_range_parallel(bfy_buffer const* buf,
+                                 size_t begin, size_t end,
+                                 void const* needle, size_t needle_len,
+                                 size_t* setme_match, size_t n_tasks,
+                                 bfy_run_tasks_cb* run_tasks, void* run_tasks_data) {
+    bfy_searcher const n = bfy_searcher_init(needle, needle_len);
+
+    buffer_lock(buf);
+    int const ret = buffer_search_range_parallel(buf,
+                                                 buffer_get_pos(buf, begin),
+                                                 buffer_get_pos(buf, end),
+                                                 &n, setme_match,
+                                                 n_tasks, run_tasks, run_tasks_data);
+    buffer_unlock(buf);
+    return ret;
+}
+
+int
+bfy_buffer_search(bfy_buffer const* buf, size_t len,
+                  void const* needle, size_t needle_len,
+                  size_t* setme_match) {
+    return bfy_buffer_search_range(buf, 0, len,
+                                   needle, needle_len, setme_match);
+}
+
+int
+bfy_buffer_search_all(bfy_buffer const* buf,
+                      void const* needle, size_t needle_len,
+                      size_t* setme_match) {
+    return bfy_buffer_search_range(buf, 0, SIZE_MAX,
+                                   needle, needle_len, setme_match);
+}
+
+// Returns the offset of the last match in [h..h+h_len), or h_len if none.
+// `rneedle` searches for the needle `n` written backwards, and its kernel
+// is an rsearch kernel, so this is needle_search() run back to front.
+static size_t
+needle_rsearch(bfy_searcher const* rneedle, unsigned char const* n,
+               void const* vh, size_t h_len) {
+    size_t const l = rneedle->len;
+    unsigned char const* const begin = vh;
+
+    if (l == 0 || h_len < l) {
+        return h_len;
+    }
+
+    size_t const n_pos = h_len - l + 1;
+    size_t pos = n_pos;
+    size_t naive_work = 0;
+    for (;;) {
+        size_t const hit = rneedle->kernel(begin, pos, n[0], n[l - 1], l - 1);
+        if (hit == pos) {
+            return h_len;
+        }
+        pos = hit;
+        if (l <= 2 || memcmp(begin + pos + 1, n + 1, l - 2) == 0) {
+            return pos;
+        }
+        naive_work += l;
+        if (naive_work > (n_pos - pos) + 8 * l) {
+            break;
+        }
+    }
+
+    // no match starts at or after `pos`
+    size_t const len = pos + l - 1;
+    size_t const rpos = two_way_search(rneedle, begin, len, true);
+    return rpos < len ? len - rpos - l : h_len;
+}
+
+// Like buffer_search_range(), but walks the pages back to front.
+// The scratch window holds the first needle_len-1 bytes of what's been
+// searched so far, since a match could end there, preceded by the bytes
+// before it: either the end of the previous big page, or a run of pages
+// too small to hold a match by themselves. The window is kept at the end
+// of the scratch buffer so that bytes can be prepended to it.
+static int
+buffer_rsearch_range(bfy_buffer const* buf,
+                     struct bfy_pos begin, struct bfy_pos end,
+                     void const* vneedle, size_t needle_len,
+                     size_t* setme) {
+    unsigned char const* const n = vneedle;
+
+    if (begin.content_pos >= end.content_pos) {
+        return -1;
+    }
+    if (needle_len == 0) {
+        if (setme != NULL) {
+            *setme = end.content_pos;
+        }
+        return 0;
+    }
+
+    size_t const overlap = needle_len - 1;
+    size_t const window_max = overlap * 3;  // plus `overlap` bytes of lookbehind
+    size_t const cap = window_max + overlap;
+    char stack_scratch[SEARCH_SCRATCH_STACK_LEN];
+    char* scratch = stack_scratch;
+    if (cap + needle_len > sizeof(stack_scratch)) {
+        scratch = allocator.malloc(cap + needle_len);
+        if (scratch == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    // the reversed needle lives right after the window
+    unsigned char* const rn = (unsigned char*) scratch + cap;
+    for (size_t i = 0; i < needle_len; ++i) {
+        rn[i] = n[needle_len - 1 - i];
+    }
+    bfy_searcher rneedle;
+    needle_init(&rneedle, rn, needle_len, false);
+    rneedle.kernel = rsearch_kernel_select();
+
+    int ret = -1;
+    size_t match = 0;
+    size_t window_pos = end.content_pos;  // content_pos of the window's first byte
+    size_t window_len = 0;
+    struct bfy_riter iter;
+    if (riter_begin(&iter, buf, begin, end)) do {
+        char const* const io_base = iter.io.iov_base;
+        size_t const io_len = iter.io.iov_len;
+
+        if (io_len < overlap) {
+            // too small to search by itself; add it to the window
+            if (window_len + io_len > window_max) {
+                size_t const hit = needle_rsearch(&rneedle, n, scratch + cap - window_len, window_len);
+                if (hit < window_len) {
+                    ret = 0;
+                    match = window_pos + hit;
+                    break;
+                }
+                memmove(scratch + cap - overlap, scratch + cap - window_len, overlap);
+                window_len = overlap;
+            }
+            memcpy(scratch + cap - window_len - io_len, io_base, io_len);
+            window_len += io_len;
+            window_pos = iter.content_pos;
+            continue;
+        }
+
+        // look for a match that ends in the window
+        if (window_len > 0) {
+            char* const lookbehind = scratch + cap - window_len - overlap;
+            memcpy(lookbehind, io_base + io_len - overlap, overlap);
+            size_t const hit = needle_rsearch(&rneedle, n, lookbehind, window_len + overlap);
+            if (hit < window_len + overlap) {
+                ret = 0;
+                match = window_pos - overlap + hit;
+                break;
+            }
+        }
+
+        // look for a match inside this page
+        size_t const hit = needle_rsearch(&rneedle, n, io_base, io_len);
+        if (hit < io_len) {
+            ret = 0;
+            match = iter.content_pos + hit;
+            break;
+        }
+
+        // a match could still end in this page's first bytes
+        memcpy(scratch + cap - overlap, io_base, overlap);
+        window_pos = iter.content_pos;
+        window_len = overlap;
+    } while (riter_prev_page(&iter));
+
+    if (ret != 0 && window_len > 0) {
+        size_t const hit = needle_rsearch(&rneedle, n, scratch + cap - window_len, window_len);
+        if (hit < window_len) {
+            ret = 0;
+            match = window_pos + hit;
+        }
+    }
+
+    if (ret == 0 && setme != NULL) {
+        *setme = match;
+    }
+    if (scratch != stack_scratch) {
+        allocator.free(scratch);
+    }
+    return ret;
+}
+
+int
+bfy_buffer_rsearch_range(bfy_buffer const* buf,
+                         size_t begin, size_t end,
+                         void const* needle, size_t needle_len,
+                         size_t* setme_match) {
+    buffer_lock(buf);
+    int const ret = buffer_rsearch_range(buf,
+                                         buffer_get_pos(buf, begin),
+                                         buffer_get_pos(buf, end),
+                                         needle, needle_len, setme_match);
+    buffer_unlock(buf);
+    return ret;
+}
+
+int
+bfy_buffer_rsearch_all(bfy_buffer const* buf,
+                       void const* needle, size_t needle_len,
+                       size_t* setme_match) {
+    return bfy_buffer_rsearch_range(buf, 0, SIZE_MAX,
+                                    needle, needle_len, setme_match);
+}
+
+/// multi-pattern search
+
+// Aho-Corasick automaton with every failure transition resolved ahead
+// of time, so each content byte costs one table lookup. To keep the
+// table small, bytes that appear in no pattern share a single column.
+
+#define MULTISEARCHER_NO_STATE UINT32_MAX
+
+struct bfy_multisearcher {
+    size_t n_needles;
+    size_t* needle_lens;
+    size_t max_needle_len;
+
+    // byte -> column in `next`. Column 0 is for bytes in no pattern
+    uint16_t byte_class[256];
+    size_t n_classes;
+
+    // nonzero for bytes that some pattern starts with
+    uint8_t is_first_byte[256];
+
+    size_t n_states;
+    uint32_t* next;      // next[state * n_classes + class]
+    uint32_t* fail;      // longest proper suffix that's also a state
+    size_t* out;         // the pattern that ends at this state, or SIZE_MAX
+    uint32_t* dict;      // nearest state on the fail chain with an `out`
+};
+
+void
+bfy_multisearcher_free(bfy_multisearcher* ms) {
+    if (ms != NULL) {
+        allocator.free(ms->dict);
+        allocator.free(ms->out);
+        allocator.free(ms->fail);
+        allocator.free(ms->next);
+        allocator.free(ms->needle_lens);
+        allocator.free(ms);
+    }
+}
+
+static bool
+multisearcher_build(bfy_multisearcher* ms,
+                    void const* const* needles,
+                    size_t const* needle_lens) {
+    size_t const n_classes = ms->n_classes;
+    uint32_t* const next = ms->next;
+
+    // build the trie. Until the automaton is finished, 0 means no child
+    ms->n_states = 1;
+    for (size_t i = 0; i < ms->n_needles; ++i) {
+        unsigned char const* const needle = needles[i];
+        uint32_t state = 0;
+        for (size_t j = 0; j < needle_lens[i]; ++j) {
+            uint32_t* const child = next + state * n_classes + ms->byte_class[needle[j]];
+            if (*child == 0) {
+                *child = (uint32_t) ms->n_states++;
+            }
+            state = *child;
+        }
+        if (ms->out[state] == SIZE_MAX) {  // on duplicates, the first one wins
+            ms->out[state] = i;
+        }
+    }
+
+    // walk the trie breadth-first to fill in fail and dict,
+    // replacing missing children with their failure transitions
+    uint32_t* const queue = allocator.malloc(sizeof(uint32_t) * ms->n_states);
+    if (queue == NULL) {
+        return false;
+    }
+    size_t head = 0;
+    size_t tail = 0;
+    ms->fail[0] = 0;
+    ms->dict[0] = MULTISEARCHER_NO_STATE;
+    for (size_t c = 0; c < n_classes; ++c) {
+        uint32_t const child = next[c];
+        if (child != 0) {
+            ms->fail[child] = 0;
+            ms->dict[child] = MULTISEARCHER_NO_STATE;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        uint32_t const state = queue[head++];
+        uint32_t const fail = ms->fail[state];
+        for (size_t c = 0; c < n_classes; ++c) {
+            uint32_t* const child = next + state * n_classes + c;
+            uint32_t const fail_next = next[fail * n_classes + c];
+            if (*child == 0) {
+                *child = fail_next;
+                continue;
+            }
+            ms->fail[*child] = fail_next;
+            ms->dict[*child] = ms->out[fail_next] != SIZE_MAX ? fail_next : ms->dict[fail_next];
+            queue[tail++] = *child;
+        }
+    }
+
+    allocator.free(queue);
+    return true;
+}
+
+bfy_multisearcher*
+bfy_multisearcher_new(void const* const* needles,
+                      size_t const* needle_lens,
+                      size_t n_needles) {
+    size_t max_states = 1;
+    for (size_t i = 0; i < n_needles; ++i) {
+        if (needle_lens[i] == 0) {
+            errno = EINVAL;
+            return NULL;
+        }
+        max_states += needle_lens[i];
+    }
+    if (n_needles == 0 || max_states > MULTISEARCHER_NO_STATE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    bfy_multisearcher* ms = allocator.calloc(1, sizeof(bfy_multisearcher));
+    if (ms == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ms->n_needles = n_needles;
+    ms->n_classes = 1;
+    for (size_t i = 0; i < n_needles; ++i) {
+        unsigned char const* const needle = needles[i];
+        for (size_t j = 0; j < needle_lens[i]; ++j) {
+            if (ms->byte_class[needle[j]] == 0) {
+                ms->byte_class[needle[j]] = (uint16_t) ms->n_classes++;
+            }
+        }
+        ms->is_first_byte[needle[0]] = 1;
+        if (ms->max_needle_len < needle_lens[i]) {
+            ms->max_needle_len = needle_lens[i];
+        }
+    }
+
+    ms->needle_lens = allocator.malloc(sizeof(size_t) * n_needles);
+    ms->next = allocator.calloc(max_states * ms->n_classes, sizeof(uint32_t));
+    ms->fail = allocator.malloc(sizeof(uint32_t) * max_states);
+    ms->out = allocator.malloc(sizeof(size_t) * max_states);
+    ms->dict = allocator.malloc(sizeof(uint32_t) * max_states);
+    if (ms->needle_lens == NULL || ms->next == NULL || ms->fail == NULL ||
+        ms->out == NULL || ms->dict == NULL) {
+        bfy_multisearcher_free(ms);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(ms->needle_lens, needle_lens, sizeof(size_t) * n_needles);
+    for (size_t i = 0; i < max_states; ++i) {
+        ms->out[i] = SIZE_MAX;
+    }
+
+    if (!multisearcher_build(ms, needles, needle_lens)) {
+        bfy_multisearcher_free(ms);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return ms;
+}
+
+static int
+buffer_search_range_any(bfy_buffer const* buf,
+                        struct bfy_pos begin, struct bfy_pos end,
+                        bfy_multisearcher const* ms,
+                        size_t* setme_match, size_t* setme_which) {
+    struct bfy_iter iter;
+    if (!iter_begin(&iter, buf, begin, end)) {
+        return -1;
+    }
+
+    // The first match found is the first to end, but a longer match that
+    // starts earlier may still be in progress. Keep going until no match
+    // can start before the best one, i.e. for max_needle_len - 1 more bytes.
+    size_t best_pos = SIZE_MAX;
+    size_t best_which = SIZE_MAX;
+    size_t stop_at = SIZE_MAX;
+
+    size_t const n_classes = ms->n_classes;
+    uint32_t state = 0;
+    do {
+        unsigned char const* const page_begin = iter.io.iov_base;
+        unsigned char const* const page_end = page_begin + iter.io.iov_len;
+        size_t const page_pos = iter.cur.content_pos;
+        for (unsigned char const* walk = page_begin; walk != page_end; ++walk) {
+            if (state == 0) {
+                // nothing in progress; skip to a byte that can start a match
+                while (walk != page_end && !ms->is_first_byte[*walk]) {
+                    ++walk;
+                }
+                if (walk == page_end) {
+                    break;
+                }
+            }
+            size_t const pos = page_pos + (size_t)(walk - page_begin);
+            if (pos >= stop_at) {
+                break;
+            }
+            state = ms->next[state * n_classes + ms->byte_class[*walk]];
+
+            uint32_t hit = ms->out[state] != SIZE_MAX ? state : ms->dict[state];
+            for (; hit != MULTISEARCHER_NO_STATE; hit = ms->dict[hit]) {
+                size_t const which = ms->out[hit];
+                size_t const match_pos = pos + 1 - ms->needle_lens[which];
+                if (match_pos < best_pos || (match_pos == best_pos && which < best_which)) {
+                    best_pos = match_pos;
+                    best_which = which;
+                    stop_at = match_pos + ms->max_needle_len;
+                }
+            }
+        }
+    } while (iter.cur.content_pos + iter.io.iov_len < stop_at && iter_next_page(&iter));
+
+    if (best_pos == SIZE_MAX) {
+        return -1;
+    }
+    if (setme_match != NULL) {
+        *setme_match = best_pos;
+    }
+    if (setme_which != NULL) {
+        *setme_which = best_which;
+    }
+    return 0;
+}
+
+int
+bfy_buffer_search_range_any(bfy_buffer const* buf,
+                            size_t begin, size_t end,
+                            bfy_multisearcher const* ms,
+                            size_t* setme_match, size_t* setme_which) {
+    buffer_lock(buf);
+    int const ret = buffer_search_range_any(buf,
+                                            buffer_get_pos(buf, begin),
+                                            buffer_get_pos(buf, end),
+                                            ms, setme_match, setme_which);
+    buffer_unlock(buf);
+    return ret;
+}
+
+int
+bfy_buffer_search_all_any(bfy_buffer const* buf,
+                          bfy_multisearcher const* ms,
+                          size_t* setme_match, size_t* setme_which) {
+    return bfy_buffer_search_range_any(buf, 0, SIZE_MAX, ms, setme_match, setme_which);
+}
+
+/// byte sets
+
+static int
+buffer_find_byteset(bfy_buffer const* buf,
+                    struct bfy_pos begin, struct bfy_pos end,
+                    struct byteset const* set, bool negate,
+                    size_t* setme) {
+    byteset_kernel_func* const kernel = byteset_kernel_select();
+    struct bfy_iter iter;
+
+    if (iter_begin(&iter, buf, begin, end)) do {
+        size_t const hit = kernel(iter.io.iov_base, iter.io.iov_len, set, negate);
+        if (hit < iter.io.iov_len) {
+            if (setme != NULL) {
+                *setme = iter.cur.content_pos + hit;
+            }
+            return 0;
+        }
+    } while (iter_next_page(&iter));
+
+    return -1;
+}
+
+int
+bfy_buffer_find_any(bfy_buffer const* buf,
+                    size_t begin, size_t end,
+                    void const* set, size_t set_len,
+                    size_t* setme_match) {
+    struct byteset byteset;
+    byteset_init(&byteset, set, set_len);
+
+    buffer_lock(buf);
+    int const ret = buffer_find_byteset(buf,
+                                        buffer_get_pos(buf, begin),
+                                        buffer_get_pos(buf, end),
+                                        &byteset, false, setme_match);
+    buffer_unlock(buf);
+    return ret;
+}
+
+int
+bfy_buffer_find_not_any(bfy_buffer const* buf,
+                        size_t begin, size_t end,
+                        void const* set, size_t set_len,
+                        size_t* setme_match) {
+    struct byteset byteset;
+    byteset_init(&byteset, set, set_len);
+
+    buffer_lock(buf);
+    int const ret = buffer_find_byteset(buf,
+                                        buffer_get_pos(buf, begin),
+                                        buffer_get_pos(buf, end),
+                                        &byteset, true, setme_match);
+    buffer_unlock(buf);
+    return ret;
+}
+
+/// regex
+
+// A small regex engine for patterns that compile to a DFA:
+//   literals and escapes: a \. \\ \n \r \t \f \v \0 \xHH
+//   byte classes: . [abc] [^a-z] \d \D \w \W \s \S
+//   grouping and alternation: (ab|cd) (?:ab|cd)
+//   repetition: * + ? {n} {n,} {n,m}
+//   anchors: ^ and $ match at the beginning and end of the searched range
+// There are no backreferences or captures. The pattern is parsed into a
+// tree, which becomes forward and reversed Thompson NFAs that are then
+// determinized up front. Matching costs one table lookup per byte, and
+// a compiled regex is never changed by searches.
+
+enum {
+    REGEX_MAX_DEPTH = 200,
+    REGEX_MAX_REPEAT = 1000,
+    REGEX_MAX_NFA_STATES = 20000,
+    REGEX_MAX_DFA_CELLS = (1 << 20),      // states * byte classes, per DFA
+    REGEX_MAX_DFA_SET_WORDS = (1 << 21),  // NFA states in all the DFA's states' sets
+    REGEX_MAX_DFA_WORK = (1 << 24)        // NFA states visited while building a DFA
+};
+
+#define REGEX_NO_MAX UINT32_MAX
+#define REGEX_NO_STATE UINT32_MAX
+
+// In a leftmost DFA state's set, these follow the NFA states
+#define REGEX_GROUP_END UINT32_MAX       // ends the threads that started at one position
+#define REGEX_MATCHED (UINT32_MAX - 1)  // a match was seen, so no new ones may start
+
+enum regex_node_type {
+    REGEX_NODE_EMPTY,
+    REGEX_NODE_SET,
+    REGEX_NODE_BOL,
+    REGEX_NODE_EOL,
+    REGEX_NODE_CAT,
+    REGEX_NODE_ALT,
+    REGEX_NODE_REPEAT
+};
+
+struct regex_node {
+    enum regex_node_type type;
+    size_t lhs;       // CAT, ALT, and the node that REPEAT repeats
+    size_t rhs;       // CAT, ALT
+    uint32_t min;     // REPEAT
+    uint32_t max;     // REPEAT; REGEX_NO_MAX if unbounded
+    bool empty;       // true if this only ever matches the empty string
+    uint8_t set[32];  // SET: bit c is set if byte c matches
+};
+
+struct regex_parser {
+    unsigned char const* pat;
+    size_t len;
+    size_t pos;
+    int depth;
+    struct regex_node* nodes;
+    size_t n_nodes;
+    size_t n_nodes_alloc;
+};
+
+static inline void
+regex_set_add(uint8_t* set, unsigned ch) {
+    set[ch >> 3] |= (uint8_t)(1u << (ch & 7));
+}
+
+static inline bool
+regex_set_has(uint8_t const* set, unsigned ch) {
+    return (set[ch >> 3] >> (ch & 7)) & 1;
+}
+
+static void
+regex_set_add_range(uint8_t* set, unsigned lo, unsigned hi) {
+    for (unsigned ch = lo; ch <= hi; ++ch) {
+        regex_set_add(set, ch);
+    }
+}
+
+static void
+regex_set_invert(uint8_t* set) {
+    for (size_t i = 0; i < 32; ++i) {
+        set[i] = (uint8_t) ~set[i];
+    }
+}
+
+// adds \d, \w, \s, or their complements \D, \W, \S
+static void
+regex_set_add_escape_class(uint8_t* set, unsigned char name) {
+    uint8_t cls[32] = { 0 };
+    switch (name | 0x20) {
+    case 'd':
+        regex_set_add_range(cls, '0', '9');
+        break;
+    case 'w':
+        regex_set_add_range(cls, '0', '9');
+        regex_set_add_range(cls, 'A', 'Z');
+        regex_set_add_range(cls, 'a', 'z');
+        regex_set_add(cls, '_');
+        break;
+    default:  // 's'
+        regex_set_add(cls, ' ');
+        regex_set_add_range(cls, '\t', '\r');  // \t \n \v \f \r
+        break;
+    }
+    if (name < 'a') {
+        regex_set_invert(cls);
+    }
+    for (size_t i = 0; i < 32; ++i) {
+        set[i] |= cls[i];
+    }
+}
+
+static int
+regex_hex_digit(unsigned char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    ch |= 0x20;
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    return -1;
+}
+
+// Parses the escape after a backslash. Returns the byte it stands for,
+// or adds a class like \d to `set` and returns -2, or returns -1 on error.
+static int
+regex_parse_escape(struct regex_parser* p, uint8_t* set) {
+    if (p->pos >= p->len) {
+        return -1;
+    }
+    unsigned char const ch = p->pat[p->pos++];
+    switch (ch) {
+    case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+        regex_set_add_escape_class(set, ch);
+        return -2;
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case '0': return '\0';
+    case 'x': {
+        if (p->pos + 2 > p->len) {
+            return -1;
+        }
+        int const hi = regex_hex_digit(p->pat[p->pos]);
+        int const lo = regex_hex_digit(p->pat[p->pos + 1]);
+        if (hi < 0 || lo < 0) {
+            return -1;
+        }
+        p->pos += 2;
+        return hi * 16 + lo;
+    }
+    default:
+        // other letters and digits are reserved, e.g. for backreferences
+        if ((ch >= '0' && ch <= '9') || (unsigned)((ch | 0x20) - 'a') < 26u) {
+            return -1;
+        }
+        return ch;
+    }
+}
+
+static size_t
+regex_add_node(struct regex_parser* p, enum regex_node_type type) {
+    if (p->n_nodes == p->n_nodes_alloc) {
+        size_t const n_alloc = p->n_nodes_alloc == 0 ? 16 : p->n_nodes_alloc * 2;
+        struct regex_node* const nodes = allocator.realloc(p->nodes, n_alloc * sizeof(struct regex_node));
+        if (nodes == NULL) {
+            errno = ENOMEM;
+            return SIZE_MAX;
+        }
+        p->nodes = nodes;
+        p->n_nodes_alloc = n_alloc;
+    }
+
+    struct regex_node* const node = p->nodes + p->n_nodes;
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->empty = type == REGEX_NODE_EMPTY;
+    return p->n_nodes++;
+}
+
+static size_t
+regex_parse_bracket(struct regex_parser* p) {
+    size_t const node = regex_add_node(p, REGEX_NODE_SET);
+    if (node == SIZE_MAX) {
+        return SIZE_MAX;
+    }
+    uint8_t* const set = p->nodes[node].set;
+
+    bool const negate = p->pos < p->len && p->pat[p->pos] == '^';
+    if (negate) {
+        ++p->pos;
+    }
+
+    // a ']' right after the '[' or '[^' is a literal
+    bool first = true;
+    for (;;) {
+        if (p->pos >= p->len) {
+            errno = EINVAL;
+            return SIZE_MAX;
+        }
+        unsigned char ch = p->pat[p->pos++];
+        if (ch == ']' && !first) {
+            break;
+        }
+        first = false;
+
+        int lo = ch;
+        if (ch == '\\' && (lo = regex_parse_escape(p, set)) == -2) {
+            continue;
+        }
+        if (lo < 0) {
+            errno = EINVAL;
+            return SIZE_MAX;
+        }
+
+        int hi = lo;
+        if (p->pos + 1 < p->len && p->pat[p->pos] == '-' && p->pat[p->pos + 1] != ']') {
+            p->pos += 1;
+            ch = p->pat[p->pos++];
+            hi = ch;
+            if (ch == '\\') {
+                uint8_t unused[32] = { 0 };
+                hi = regex_parse_escape(p, unused);
+            }
+            if (hi < lo) {  // also catches errors and classes like [a-\d]
+                errno = EINVAL;
+                return SIZE_MAX;
+            }
+        }
+        regex_set_add_range(set, (unsigned) lo, (unsigned) hi);
+    }
+
+    if (negate) {
+        regex_set_invert(set);
+    }
+    return node;
+}
+
+static size_t regex_parse_alt(struct regex_parser* p);
+
+static size_t
+regex_parse_atom(struct regex_parser* p) {
+    unsigned char const ch = p->pat[p->pos++];
+    size_t node;
+    int lit;
+
+    switch (ch) {
+    case '(':
+        if (++p->depth > REGEX_MAX_DEPTH) {
+            errno = EINVAL;
+            return SIZE_MAX;
+        }
+        if (p->pos + 1 < p->len && p->pat[p->pos] == '?' && p->pat[p->pos + 1] == ':') {
+            p->pos += 2;
+        }
+        node = regex_parse_alt(p);
+        if (node == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        if (p->pos >= p->len || p->pat[p->pos] != ')') {
+            errno = EINVAL;
+            return SIZE_MAX;
+        }
+        ++p->pos;
+        --p->depth;
+        return node;
+
+    case '[':
+        return regex_parse_bracket(p);
+
+    case '^':
+        return regex_add_node(p, REGEX_NODE_BOL);
+
+    case '$':
+        return regex_add_node(p, REGEX_NODE_EOL);
+
+    case '*': case '+': case '?': case '{':
+        // nothing to repeat
+        errno = EINVAL;
+        return SIZE_MAX;
+
+    default:
+        node = regex_add_node(p, REGEX_NODE_SET);
+        if (node == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        lit = ch;
+        if (ch == '.') {
+            regex_set_add_range(p->nodes[node].set, 0, 255);
+            p->nodes[node].set['\n' >> 3] &= (uint8_t) ~(1u << ('\n' & 7));
+            return node;
+        }
+        if (ch == '\\' && (lit = regex_parse_escape(p, p->nodes[node].set)) == -2) {
+            return node;
+        }
+        if (lit < 0) {
+            errno = EINVAL;
+            return SIZE_MAX;
+        }
+        regex_set_add(p->nodes[node].set, (unsigned) lit);
+        return node;
+    }
+}
+
+static bool
+regex_parse_number(struct regex_parser* p, uint32_t* setme) {
+    size_t const begin = p->pos;
+    uint32_t val = 0;
+    while (p->pos < p->len && p->pat[p->pos] >= '0' && p->pat[p->pos] <= '9') {
+        val = val * 10 + (p->pat[p->pos++] - '0');
+        if (val > REGEX_MAX_REPEAT) {
+            return false;
+        }
+    }
+    *setme = val;
+    return p->pos > begin;
+}
+
+// parses the rest of {n}, {n,}, or {n,m}
+static bool
+regex_parse_bounds(struct regex_parser* p, uint32_t* setme_min, uint32_t* setme_max) {
+    if (!regex_parse_number(p, setme_min)) {
+        return false;
+    }
+    *setme_max = *setme_min;
+    if (p->pos < p->len && p->pat[p->pos] == ',') {
+        ++p->pos;
+        *setme_max = REGEX_NO_MAX;
+        if (p->pos < p->len && p->pat[p->pos] != '}' &&
+            (!regex_parse_number(p, setme_max) || *setme_max < *setme_min)) {
+            return false;
+        }
+    }
+    if (p->pos >= p->len || p->pat[p->pos] != '}') {
+        return false;
+    }
+    ++p->pos;
+    return true;
+}
+
+static size_t
+regex_parse_repeat(struct regex_parser* p) {
+    size_t node = regex_parse_atom(p);
+
+    // stacked quantifiers like a*?+ nest, so they count toward the depth
+    for (int depth = p->depth; node != SIZE_MAX && p->pos < p->len; ++depth) {
+        uint32_t min;
+        uint32_t max;
+        unsigned char const ch = p->pat[p->pos];
+        if (ch == '*') {
+            min = 0;
+            max = REGEX_NO_MAX;
+        } else if (ch == '+') {
+            min = 1;
+            max = REGEX_NO_MAX;
+        } else if (ch == '?') {
+            min = 0;
+            max = 1;
+        } else if (ch != '{') {
+            break;
+        }
+        ++p->pos;
+        if (depth >= REGEX_MAX_DEPTH || (ch == '{' && !regex_parse_bounds(p, &min, &max))) {
+            errno = EINVAL;
+            return SIZE_MAX;
+        }
+
+        size_t const repeat = regex_add_node(p, REGEX_NODE_REPEAT);
+        if (repeat == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        p->nodes[repeat].lhs = node;
+        p->nodes[repeat].min = min;
+        p->nodes[repeat].max = max;
+        p->nodes[repeat].empty = p->nodes[node].empty || max == 0;
+        node = repeat;
+    }
+
+    return node;
+}
+
+static size_t
+regex_parse_cat(struct regex_parser* p) {
+    size_t node = regex_add_node(p, REGEX_NODE_EMPTY);
+
+    while (node != SIZE_MAX && p->pos < p->len &&
+           p->pat[p->pos] != '|' && p->pat[p->pos] != ')') {
+        size_t const rhs = regex_parse_repeat(p);
+        if (rhs == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        size_t const cat = regex_add_node(p, REGEX_NODE_CAT);
+        if (cat == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        p->nodes[cat].lhs = node;
+        p->nodes[cat].rhs = rhs;
+        p->nodes[cat].empty = p->nodes[node].empty && p->nodes[rhs].empty;
+        node = cat;
+    }
+
+    return node;
+}
+
+static size_t
+regex_parse_alt(struct regex_parser* p) {
+    size_t node = regex_parse_cat(p);
+
+    while (node != SIZE_MAX && p->pos < p->len && p->pat[p->pos] == '|') {
+        ++p->pos;
+        size_t const rhs = regex_parse_cat(p);
+        if (rhs == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        size_t const alt = regex_add_node(p, REGEX_NODE_ALT);
+        if (alt == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        p->nodes[alt].lhs = node;
+        p->nodes[alt].rhs = rhs;
+        node = alt;
+    }
+
+    return node;
+}
+
+// NFA
+
+enum regex_nfa_type {
+    REGEX_NFA_SET,
+    REGEX_NFA_SPLIT,
+    REGEX_NFA_BOL,
+    REGEX_NFA_EOL,
+    REGEX_NFA_MATCH
+};
+
+struct regex_nfa_state {
+    enum regex_nfa_type type;
+    uint32_t out;
+    uint32_t out1;  // SPLIT's second branch
+    size_t node;    // SET's node, for its set
+};
+
+struct regex_nfa {
+    struct regex_node const* nodes;
+    bool reverse;  // build the NFA for the pattern read back to front
+
+    struct regex_nfa_state* states;
+    size_t n_states;
+    size_t n_states_alloc;
+    uint32_t start;
+
+    // scratch for flattening concatenations
+    size_t* stack;
+    size_t stack_len;
+};
+
+static uint32_t
+regex_nfa_add(struct regex_nfa* nfa, enum regex_nfa_type type, uint32_t out, uint32_t out1) {
+    if (nfa->n_states == nfa->n_states_alloc) {
+        if (nfa->n_states >= REGEX_MAX_NFA_STATES) {
+            errno = ENOMEM;
+            return REGEX_NO_STATE;
+        }
+        size_t const n_alloc = nfa->n_states_alloc == 0 ? 64 : nfa->n_states_alloc * 2;
+        struct regex_nfa_state* const states = allocator.realloc(nfa->states, n_alloc * sizeof(struct regex_nfa_state));
+        if (states == NULL) {
+            errno = ENOMEM;
+            return REGEX_NO_STATE;
+        }
+        nfa->states = states;
+        nfa->n_states_alloc = n_alloc;
+    }
+
+    struct regex_nfa_state* const state = nfa->states + nfa->n_states;
+    state->type = type;
+    state->out = out;
+    state->out1 = out1;
+    state->node = 0;
+    return (uint32_t) nfa->n_states++;
+}
+
+// Emits the states for `node`, followed by `next`, and returns the first
+// one. Builds back to front so that every state's successors already exist.
+static uint32_t
+regex_nfa_emit(struct regex_nfa* nfa, size_t node, uint32_t next) {
+    struct regex_node const* const n = nfa->nodes + node;
+    uint32_t state;
+
+    if (n->empty) {
+        // e.g. `()` or `a{0}`. Skipping these keeps `(){1000}{1000}` cheap.
+        return next;
+    }
+
+    switch (n->type) {
+
+    case REGEX_NODE_SET:
+        state = regex_nfa_add(nfa, REGEX_NFA_SET, next, REGEX_NO_STATE);
+        if (state != REGEX_NO_STATE) {
+            nfa->states[state].node = node;
+        }
+        return state;
+
+    case REGEX_NODE_BOL:
+    case REGEX_NODE_EOL:
+        // reading back to front, the beginning becomes the end
+        return regex_nfa_add(nfa, (n->type == REGEX_NODE_BOL) != nfa->reverse ? REGEX_NFA_BOL : REGEX_NFA_EOL,
+                             next, REGEX_NO_STATE);
+
+    case REGEX_NODE_CAT: {
+        // flatten the left-leaning chain so long patterns don't recurse deeply
+        size_t const base = nfa->stack_len;
+        size_t walk = node;
+        for (; nfa->nodes[walk].type == REGEX_NODE_CAT; walk = nfa->nodes[walk].lhs) {
+            nfa->stack[nfa->stack_len++] = nfa->nodes[walk].rhs;
+        }
+        nfa->stack[nfa->stack_len++] = walk;
+
+        // the stack holds the chain's parts last to first
+        state = next;
+        size_t const n_parts = nfa->stack_len - base;
+        for (size_t i = 0; i < n_parts && state != REGEX_NO_STATE; ++i) {
+            size_t const part = nfa->reverse ? nfa->stack[nfa->stack_len - 1 - i] : nfa->stack[base + i];
+            state = regex_nfa_emit(nfa, part, state);
+        }
+        nfa->stack_len = base;
+        return state;
+    }
+
+    case REGEX_NODE_ALT: {
+        // the order of alternatives doesn't matter to a DFA
+        state = REGEX_NO_STATE;
+        size_t walk = node;
+        for (;;) {
+            bool const is_alt = nfa->nodes[walk].type == REGEX_NODE_ALT;
+            uint32_t const branch = regex_nfa_emit(nfa, is_alt ? nfa->nodes[walk].rhs : walk, next);
+            if (branch == REGEX_NO_STATE) {
+                return REGEX_NO_STATE;
+            }
+            state = state == REGEX_NO_STATE ? branch : regex_nfa_add(nfa, REGEX_NFA_SPLIT, branch, state);
+            if (!is_alt || state == REGEX_NO_STATE) {
+                return state;
+            }
+            walk = nfa->nodes[walk].lhs;
+        }
+    }
+
+    default: {  // REGEX_NODE_REPEAT
+        state = next;
+        if (n->max == REGEX_NO_MAX) {
+            // a loop: the split either runs the body again or moves on
+            uint32_t const split = regex_nfa_add(nfa, REGEX_NFA_SPLIT, REGEX_NO_STATE, next);
+            if (split == REGEX_NO_STATE) {
+                return REGEX_NO_STATE;
+            }
+            uint32_t const body = regex_nfa_emit(nfa, n->lhs, split);
+            if (body == REGEX_NO_STATE) {
+                return REGEX_NO_STATE;
+            }
+            nfa->states[split].out = body;
+            state = split;
+        } else {
+            // nest the optional copies: (x(x(x)?)?)?
+            for (uint32_t i = n->min; i < n->max && state != REGEX_NO_STATE; ++i) {
+                uint32_t const body = regex_nfa_emit(nfa, n->lhs, state);
+                state = body == REGEX_NO_STATE ? body : regex_nfa_add(nfa, REGEX_NFA_SPLIT, body, next);
+            }
+        }
+        for (uint32_t i = 0; i < n->min && state != REGEX_NO_STATE; ++i) {
+            state = regex_nfa_emit(nfa, n->lhs, state);
+        }
+        return state;
+    }
+    }
+}
+
+static bool
+regex_nfa_build(struct regex_nfa* nfa, struct regex_node const* nodes,
+                size_t n_nodes, size_t root, bool reverse) {
+    memset(nfa, 0, sizeof(*nfa));
+    nfa->nodes = nodes;
+    nfa->reverse = reverse;
+    nfa->stack = allocator.malloc(sizeof(size_t) * n_nodes);
+    if (nfa->stack == NULL) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    uint32_t const match = regex_nfa_add(nfa, REGEX_NFA_MATCH, REGEX_NO_STATE, REGEX_NO_STATE);
+    nfa->start = match == REGEX_NO_STATE ? match : regex_nfa_emit(nfa, root, match);
+    allocator.free(nfa->stack);
+    nfa->stack = NULL;
+    return nfa->start != REGEX_NO_STATE;
+}
+
+static void
+regex_nfa_destruct(struct regex_nfa* nfa) {
+    allocator.free(nfa->states);
+}
+
+// DFA
+
+enum {
+    REGEX_DFA_DEAD = (1 << 0),          // no match is possible from here
+    REGEX_DFA_MATCH = (1 << 1),         // a match ends here
+    REGEX_DFA_MATCH_AT_END = (1 << 2),  // a match ends here if this is the range's end
+    REGEX_DFA_FLAGS = 7,
+    REGEX_DFA_FLAG_BITS = 3
+};
+
+// When matching, a state is held as its row in `next`, shifted left
+// by REGEX_DFA_FLAG_BITS and or'ed with its flags. Each byte then costs
+// one lookup, with no multiply and no separate load for the flags.
+struct regex_dfa {
+    size_t n_states;
+    uint32_t* next;     // next[row + class]; while building, next[state * n_classes + class]
+    uint8_t* flags;     // REGEX_DFA_*, by state; only used while building
+    uint32_t start[2];  // [0] at the range's boundary, [1] anywhere else
+};
+
+struct bfy_regex {
+    // bytes that no part of the pattern tells apart share a class
+    uint16_t byte_class[256];
+    size_t n_classes;
+
+    struct regex_dfa search;    // unanchored; finds where the first match ends
+    struct regex_dfa anchored;  // finds the longest match at a given start
+
+    // leftmost and ranchored can be much bigger than the others. If they'd
+    // be too big, their `next` is NULL and rsearch is built instead.
+    struct regex_dfa leftmost;   // unanchored; finds where the leftmost-longest match ends
+    struct regex_dfa ranchored;  // reversed and anchored; finds where that match starts
+    struct regex_dfa rsearch;    // reversed and unanchored; finds where matches start
+};
+
+// The DFA is built by subset construction. Each DFA state is a sorted
+// set of NFA states, stored in `pool`, that is interned with a hash table.
+//
+// A leftmost DFA's states also remember when each thread started, as
+// RE2's longest-match DFA does. The set is split into groups, oldest
+// start first, and each group is sorted. An NFA state that's already in
+// an older group is dropped from newer ones, and once a group matches,
+// the groups newer than it are dropped and no new groups are started.
+// So after the last match, the match belongs to the leftmost start.
+struct regex_dfa_builder {
+    struct regex_nfa const* nfa;
+    struct regex_dfa* dfa;
+    size_t n_classes;
+    bool leftmost;
+
+    uint32_t* pool;
+    size_t pool_len;
+    size_t pool_alloc;
+    size_t* set_begin;  // set_begin[dfa_state] is where its set is in `pool`
+    size_t* set_len;
+    size_t n_states_alloc;
+
+    uint32_t* table;    // hash table of DFA states; REGEX_NO_STATE if empty
+    size_t table_len;
+
+    // scratch for closures
+    uint32_t* marks;    // marks[nfa_state] == mark if already visited
+    uint32_t mark;
+    uint32_t* todo;
+    uint32_t* found;
+    size_t n_found;
+
+    // NFA states visited so far, to bound the time spent building
+    size_t work;
+};
+
+static void
+regex_closure_add(struct regex_dfa_builder* b, uint32_t state, bool at_begin, bool at_end) {
+    struct regex_nfa_state const* const states = b->nfa->states;
+    size_t n_todo = 0;
+
+    if (b->marks[state] == b->mark) {
+        return;
+    }
+    b->marks[state] = b->mark;
+    b->todo[n_todo++] = state;
+
+    while (n_todo > 0) {
+        ++b->work;
+        uint32_t const s = b->todo[--n_todo];
+        uint32_t next[2] = { REGEX_NO_STATE, REGEX_NO_STATE };
+        switch (states[s].type) {
+        case REGEX_NFA_SPLIT:
+            next[0] = states[s].out;
+            next[1] = states[s].out1;
+            break;
+        case REGEX_NFA_BOL:
+            if (at_begin) {
+                next[0] = states[s].out;
+            }
+            break;
+        case REGEX_NFA_EOL:
+            if (at_end) {
+                next[0] = states[s].out;
+            } else {
+                // keep it, in case this turns out to be the end
+                b->found[b->n_found++] = s;
+            }
+            break;
+        default:  // SET, MATCH
+            b->found[b->n_found++] = s;
+            break;
+        }
+        for (size_t i = 0; i < 2; ++i) {
+            if (next[i] != REGEX_NO_STATE && b->marks[next[i]] != b->mark) {
+                b->marks[next[i]] = b->mark;
+                b->todo[n_todo++] = next[i];
+            }
+        }
+    }
+}
+
+static void
+regex_closure_begin(struct regex_dfa_builder* b) {
+    ++b->mark;
+    b->n_found = 0;
+}
+
+static int
+regex_compare_u32(void const* va, void const* vb) {
+    uint32_t const a = *(uint32_t const*) va;
+    uint32_t const b = *(uint32_t const*) vb;
+    return a < b ? -1 : a > b;
+}
+
+static size_t
+regex_hash_set(uint32_t const* set, size_t len) {
+    size_t hash = (size_t) 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ set[i]) * (size_t) 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool
+regex_dfa_grow_table(struct regex_dfa_builder* b) {
+    size_t const table_len = b->table_len * 2;
+    uint32_t* const table = allocator.malloc(table_len * sizeof(uint32_t));
+    if (table == NULL) {
+        errno = ENOMEM;
+        return false;
+    }
+    memset(table, 0xFF, table_len * sizeof(uint32_t));
+
+    for (uint32_t state = 0; state < b->dfa->n_states; ++state) {
+        size_t slot = regex_hash_set(b->pool + b->set_begin[state], b->set_len[state]) & (table_len - 1);
+        while (table[slot] != REGEX_NO_STATE) {
+            slot = (slot + 1) & (table_len - 1);
+        }
+        table[slot] = state;
+    }
+
+    allocator.free(b->table);
+    b->table = table;
+    b->table_len = table_len;
+    return true;
+}
+
+// Returns the DFA state for the NFA states in b->found,
+// adding it if it's new, or REGEX_NO_STATE on error
+static uint32_t
+regex_dfa_intern(struct regex_dfa_builder* b) {
+    struct regex_nfa_state const* const states = b->nfa->states;
+    uint32_t* const set = b->found;
+    size_t const len = b->n_found;
+    if (!b->leftmost) {
+        qsort(set, len, sizeof(uint32_t), regex_compare_u32);
+    } else {
+        size_t group_begin = 0;
+        for (size_t i = 0; i < len; ++i) {
+            if (set[i] >= REGEX_MATCHED) {
+                qsort(set + group_begin, i - group_begin, sizeof(uint32_t), regex_compare_u32);
+                group_begin = i + 1;
+            }
+        }
+    }
+
+    size_t const mask = b->table_len - 1;
+    size_t slot = regex_hash_set(set, len) & mask;
+    for (; b->table[slot] != REGEX_NO_STATE; slot = (slot + 1) & mask) {
+        uint32_t const other = b->table[slot];
+        if (b->set_len[other] == len &&
+            (len == 0 || memcmp(b->pool + b->set_begin[other], set, len * sizeof(uint32_t)) == 0)) {
+            return other;
+        }
+    }
 
-void*
-bfy_buffer_make_contiguous(bfy_buffer* buf, size_t wanted) {
-    struct bfy_pos const pos = buffer_get_pos(buf, wanted);
+    // every set can be as big as the NFA, so bound their total
+    // size and the time spent finding them, not just the table's
+    struct regex_dfa* const dfa = b->dfa;
+    if ((dfa->n_states + 1) * b->n_classes > REGEX_MAX_DFA_CELLS ||
+        b->pool_len + len > REGEX_MAX_DFA_SET_WORDS ||
+        b->work > REGEX_MAX_DFA_WORK) {
+        errno = ENOMEM;
+        return REGEX_NO_STATE;
+    }
+    if (dfa->n_states == b->n_states_alloc) {
+        size_t const n_alloc = b->n_states_alloc * 2;
+        uint32_t* const next = allocator.realloc(dfa->next, n_alloc * b->n_classes * sizeof(uint32_t));
+        if (next != NULL) {
+            dfa->next = next;
+        }
+        uint8_t* const flags = allocator.realloc(dfa->flags, n_alloc);
+        if (flags != NULL) {
+            dfa->flags = flags;
+        }
+        size_t* const set_begin = allocator.realloc(b->set_begin, n_alloc * sizeof(size_t));
+        if (set_begin != NULL) {
+            b->set_begin = set_begin;
+        }
+        size_t* const set_len = allocator.realloc(b->set_len, n_alloc * sizeof(size_t));
+        if (set_len != NULL) {
+            b->set_len = set_len;
+        }
+        if (next == NULL || flags == NULL || set_begin == NULL || set_len == NULL) {
+            errno = ENOMEM;
+            return REGEX_NO_STATE;
+        }
+        b->n_states_alloc = n_alloc;
+    }
+    if (b->pool_len + len > b->pool_alloc) {
+        size_t n_alloc = b->pool_alloc * 2;
+        while (n_alloc < b->pool_len + len) {
+            n_alloc *= 2;
+        }
+        uint32_t* const pool = allocator.realloc(b->pool, n_alloc * sizeof(uint32_t));
+        if (pool == NULL) {
+            errno = ENOMEM;
+            return REGEX_NO_STATE;
+        }
+        b->pool = pool;
+        b->pool_alloc = n_alloc;
+    }
 
-    // if the first page already holds wanted, then we're done
-    if ((pos.page_idx == 0) || (pos.page_idx == 1 && pos.page_pos == 0)) {
-        return buffer_read_begin(buf);
+    uint32_t const state = (uint32_t) dfa->n_states++;
+    b->set_begin[state] = b->pool_len;
+    b->set_len[state] = len;
+    if (len > 0) {
+        memcpy(b->pool + b->pool_len, set, len * sizeof(uint32_t));
+    }
+    b->pool_len += len;
+    b->table[slot] = state;
+    if (dfa->n_states * 2 > b->table_len && !regex_dfa_grow_table(b)) {
+        return REGEX_NO_STATE;
     }
 
-    bfy_buffer_mute_change_events(buf);
+    // does a match end here, or would it if this were the end?
+    uint8_t flags = len == 0 ? REGEX_DFA_DEAD : 0;
+    bool has_eol = false;
+    for (size_t i = 0; i < len; ++i) {
+        if (set[i] >= REGEX_MATCHED) {
+            continue;
+        }
+        if (states[set[i]].type == REGEX_NFA_MATCH) {
+            flags |= REGEX_DFA_MATCH | REGEX_DFA_MATCH_AT_END;
+        }
+        has_eol |= states[set[i]].type == REGEX_NFA_EOL;
+    }
+    if (has_eol && (flags & REGEX_DFA_MATCH) == 0) {
+        // `set` is b->found, so copy the EOLs out before reusing it
+        size_t const begin = b->set_begin[state];
+        regex_closure_begin(b);
+        for (size_t i = 0; i < len; ++i) {
+            uint32_t const s = b->pool[begin + i];
+            if (s < REGEX_MATCHED && states[s].type == REGEX_NFA_EOL) {
+                regex_closure_add(b, states[s].out, false, true);
+            }
+        }
+        for (size_t i = 0; i < b->n_found; ++i) {
+            if (states[b->found[i]].type == REGEX_NFA_MATCH) {
+                flags |= REGEX_DFA_MATCH_AT_END;
+            }
+        }
+    }
+    dfa->flags[state] = flags;
+    return state;
+}
 
-    // if we have enough space, use it
-    struct bfy_iovec space = bfy_buffer_peek_space(buf);
-    if (space.iov_len >= pos.content_pos) {
-        size_t const n_copied = buffer_copyout(buf, buffer_get_pos(buf, 0), pos, space.iov_base);
-        bfy_buffer_commit_space(buf, n_copied);
-        bfy_buffer_drain(buf, n_copied);
+// Ends the leftmost DFA group that starts at b->found[group_begin].
+// Returns true if the group has a match.
+static bool
+regex_leftmost_end_group(struct regex_dfa_builder* b, size_t group_begin) {
+    if (group_begin == b->n_found) {
+        return false;  // every thread died or was already in an older group
+    }
+    bool matched = false;
+    for (size_t i = group_begin; i < b->n_found && !matched; ++i) {
+        matched = b->nfa->states[b->found[i]].type == REGEX_NFA_MATCH;
+    }
+    b->found[b->n_found++] = REGEX_GROUP_END;
+    return matched;
+}
+
+static bool
+regex_dfa_build(struct regex_dfa* dfa, struct regex_nfa const* nfa,
+                bfy_regex const* re, uint8_t const* class_bytes,
+                bool unanchored, bool leftmost) {
+    size_t const n_classes = re->n_classes;
+    size_t const initial_states = 16;
+    struct regex_dfa_builder b = {
+        .nfa = nfa,
+        .dfa = dfa,
+        .n_classes = n_classes,
+        .leftmost = leftmost,
+        .pool_alloc = 256,
+        .n_states_alloc = initial_states,
+        .table_len = 64
+    };
+    memset(dfa, 0, sizeof(*dfa));
+
+    dfa->next = allocator.malloc(initial_states * n_classes * sizeof(uint32_t));
+    dfa->flags = allocator.malloc(initial_states);
+    b.pool = allocator.malloc(b.pool_alloc * sizeof(uint32_t));
+    b.set_begin = allocator.malloc(initial_states * sizeof(size_t));
+    b.set_len = allocator.malloc(initial_states * sizeof(size_t));
+    b.table = allocator.malloc(b.table_len * sizeof(uint32_t));
+    b.marks = allocator.calloc(nfa->n_states, sizeof(uint32_t));
+    b.todo = allocator.malloc(nfa->n_states * sizeof(uint32_t));
+    b.found = allocator.malloc((nfa->n_states * 2 + 1) * sizeof(uint32_t));  // room for group ends
+
+    bool ok = dfa->next != NULL && dfa->flags != NULL && b.pool != NULL &&
+              b.set_begin != NULL && b.set_len != NULL && b.table != NULL &&
+              b.marks != NULL && b.todo != NULL && b.found != NULL;
+    if (!ok) {
+        errno = ENOMEM;
     } else {
-        // make some new free space, use it, and prepend it
-        int8_t* data = allocator.malloc(pos.content_pos);
-        size_t const n_moved = buffer_remove(buf, buffer_get_pos(buf, 0), pos, data);
-        struct bfy_page const newpage = {
-            .data = data,
-            .size = n_moved,
-            .write_pos = n_moved
-        };
-        buffer_prepend_pages(buf, &newpage, 1);
+        memset(b.table, 0xFF, b.table_len * sizeof(uint32_t));
+
+        // state 0 is the dead state
+        regex_closure_begin(&b);
+        ok = regex_dfa_intern(&b) == 0;
+        for (size_t i = 0; ok && i < 2; ++i) {
+            regex_closure_begin(&b);
+            regex_closure_add(&b, nfa->start, i == 0, false);
+            if (leftmost && regex_leftmost_end_group(&b, 0)) {
+                b.found[b.n_found++] = REGEX_MATCHED;
+            }
+            dfa->start[i] = regex_dfa_intern(&b);
+            ok = dfa->start[i] != REGEX_NO_STATE;
+        }
+
+        // fill in the transitions, discovering new states as we go
+        for (size_t state = 0; ok && state < dfa->n_states; ++state) {
+            for (size_t c = 0; ok && c < n_classes; ++c) {
+                regex_closure_begin(&b);
+                size_t const begin = b.set_begin[state];
+                size_t const len = b.set_len[state];
+                bool matched = len > 0 && b.pool[begin + len - 1] == REGEX_MATCHED;
+                size_t group_begin = 0;
+                b.work += len;
+                for (size_t i = 0; i < len; ++i) {
+                    uint32_t const id = b.pool[begin + i];
+                    if (id == REGEX_GROUP_END) {
+                        if (regex_leftmost_end_group(&b, group_begin)) {
+                            // drop the newer groups; they started after this match did
+                            matched = true;
+                            break;
+                        }
+                        group_begin = b.n_found;
+                        continue;
+                    }
+                    if (id == REGEX_MATCHED) {
+                        break;
+                    }
+                    struct regex_nfa_state const* const s = nfa->states + id;
+                    if (s->type == REGEX_NFA_SET && regex_set_has(b.nfa->nodes[s->node].set, class_bytes[c])) {
+                        regex_closure_add(&b, s->out, false, false);
+                    }
+                }
+                if (unanchored && state != 0 && !matched) {
+                    // a new match could start after any byte
+                    group_begin = b.n_found;
+                    regex_closure_add(&b, nfa->start, false, false);
+                    if (leftmost) {
+                        matched = regex_leftmost_end_group(&b, group_begin);
+                    }
+                }
+                if (matched && b.n_found > 0) {
+                    b.found[b.n_found++] = REGEX_MATCHED;
+                }
+                uint32_t const next = regex_dfa_intern(&b);
+                ok = next != REGEX_NO_STATE;
+                if (ok) {
+                    dfa->next[state * n_classes + c] = next;
+                }
+            }
+        }
     }
 
-    bfy_buffer_unmute_change_events(buf);
-    return buffer_read_begin(buf);
+    if (ok) {
+        size_t const n_cells = dfa->n_states * n_classes;
+        for (size_t i = 0; i < n_cells; ++i) {
+            uint32_t const state = dfa->next[i];
+            dfa->next[i] = (uint32_t) ((state * n_classes) << REGEX_DFA_FLAG_BITS) | dfa->flags[state];
+        }
+        for (size_t i = 0; i < 2; ++i) {
+            uint32_t const state = dfa->start[i];
+            dfa->start[i] = (uint32_t) ((state * n_classes) << REGEX_DFA_FLAG_BITS) | dfa->flags[state];
+        }
+    }
+    allocator.free(dfa->flags);
+    dfa->flags = NULL;
+
+    allocator.free(b.found);
+    allocator.free(b.todo);
+    allocator.free(b.marks);
+    allocator.free(b.table);
+    allocator.free(b.set_len);
+    allocator.free(b.set_begin);
+    allocator.free(b.pool);
+    return ok;
 }
 
-void*
-bfy_buffer_make_all_contiguous(bfy_buffer* buf) {
-    return bfy_buffer_make_contiguous(buf, SIZE_MAX);
+static void
+regex_dfa_destruct(struct regex_dfa* dfa) {
+    allocator.free(dfa->flags);
+    allocator.free(dfa->next);
 }
 
-/// search
+void
+bfy_regex_free(bfy_regex* re) {
+    if (re != NULL) {
+        regex_dfa_destruct(&re->rsearch);
+        regex_dfa_destruct(&re->ranchored);
+        regex_dfa_destruct(&re->leftmost);
+        regex_dfa_destruct(&re->anchored);
+        regex_dfa_destruct(&re->search);
+        allocator.free(re);
+    }
+}
+
+// Splits the bytes into the fewest classes such that every byte in
+// a class is either in or out of each of the pattern's sets
+static void
+regex_build_classes(bfy_regex* re, struct regex_node const* nodes, size_t n_nodes,
+                    uint8_t* setme_class_bytes) {
+    memset(re->byte_class, 0, sizeof(re->byte_class));
+    re->n_classes = 1;
+
+    for (size_t i = 0; i < n_nodes; ++i) {
+        if (nodes[i].type != REGEX_NODE_SET) {
+            continue;
+        }
+        uint16_t map[2][256];
+        memset(map, 0xFF, sizeof(map));
+        uint16_t n_classes = 0;
+        for (size_t ch = 0; ch < 256; ++ch) {
+            uint16_t* const mapped = &map[regex_set_has(nodes[i].set, (unsigned) ch)][re->byte_class[ch]];
+            if (*mapped == UINT16_MAX) {
+                *mapped = n_classes++;
+            }
+            re->byte_class[ch] = *mapped;
+        }
+        re->n_classes = n_classes;
+    }
+
+    for (size_t ch = 256; ch-- > 0; ) {
+        setme_class_bytes[re->byte_class[ch]] = (uint8_t) ch;
+    }
+}
+
+bfy_regex*
+bfy_regex_new(char const* pattern, size_t pattern_len) {
+    struct regex_parser p = {
+        .pat = (unsigned char const*) pattern,
+        .len = pattern_len
+    };
+    size_t const root = regex_parse_alt(&p);
+    if (root != SIZE_MAX && p.pos < p.len) {
+        errno = EINVAL;  // an unmatched ')'
+    }
+    if (root == SIZE_MAX || p.pos < p.len) {
+        allocator.free(p.nodes);
+        return NULL;
+    }
+
+    bfy_regex* re = allocator.calloc(1, sizeof(bfy_regex));
+    if (re == NULL) {
+        allocator.free(p.nodes);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uint8_t class_bytes[256];
+    regex_build_classes(re, p.nodes, p.n_nodes, class_bytes);
+
+    struct regex_nfa fwd = { .states = NULL };
+    struct regex_nfa rev = { .states = NULL };
+    bool ok = regex_nfa_build(&fwd, p.nodes, p.n_nodes, root, false) &&
+              regex_nfa_build(&rev, p.nodes, p.n_nodes, root, true) &&
+              regex_dfa_build(&re->search, &fwd, re, class_bytes, true, false) &&
+              regex_dfa_build(&re->anchored, &fwd, re, class_bytes, false, false);
+
+    // The leftmost DFA's states also track when matches started,
+    // so it can be far bigger than the others
+    if (ok && !(regex_dfa_build(&re->leftmost, &fwd, re, class_bytes, true, true) &&
+                regex_dfa_build(&re->ranchored, &rev, re, class_bytes, false, false))) {
+        regex_dfa_destruct(&re->ranchored);
+        regex_dfa_destruct(&re->leftmost);
+        memset(&re->ranchored, 0, sizeof(re->ranchored));
+        memset(&re->leftmost, 0, sizeof(re->leftmost));
+        ok = regex_dfa_build(&re->rsearch, &rev, re, class_bytes, true, false);
+    }
+    int const err = errno;
+    regex_nfa_destruct(&rev);
+    regex_nfa_destruct(&fwd);
+    allocator.free(p.nodes);
+    if (!ok) {
+        bfy_regex_free(re);
+        errno = err;
+        return NULL;
+    }
+
+    return re;
+}
+
+static inline uint32_t
+regex_dfa_step(bfy_regex const* re, struct regex_dfa const* dfa, uint32_t state, unsigned char ch) {
+    return dfa->next[(state >> REGEX_DFA_FLAG_BITS) + re->byte_class[ch]];
+}
 
+// Finds where the first match to end in [begin..end) ends
 static bool
-buffer_contains_at(bfy_buffer const* buf, struct bfy_iter it,
-                   void const* needle, size_t needle_len) {
-    if (it.io.iov_len == 0) {
-        return false;
+regex_find_first_end(bfy_buffer const* buf,
+                     struct bfy_pos begin, struct bfy_pos end,
+                     bfy_regex const* re, size_t* setme_end) {
+    struct regex_dfa const* const dfa = &re->search;
+    uint32_t state = dfa->start[0];
+    if ((state & REGEX_DFA_MATCH) != 0) {
+        *setme_end = begin.content_pos;
+        return true;
     }
-    if (it.io.iov_len >= needle_len) {
-        return memcmp(it.io.iov_base, needle, needle_len) == 0;
+
+    struct bfy_iter iter;
+    if (iter_begin(&iter, buf, begin, end)) do {
+        unsigned char const* const walk = iter.io.iov_base;
+        for (size_t i = 0; i < iter.io.iov_len; ++i) {
+            state = regex_dfa_step(re, dfa, state, walk[i]);
+            uint32_t const flags = state & REGEX_DFA_FLAGS;
+            if (flags != 0) {
+                if ((flags & REGEX_DFA_MATCH) != 0) {
+                    *setme_end = iter.cur.content_pos + i + 1;
+                    return true;
+                }
+                if ((flags & REGEX_DFA_DEAD) != 0) {
+                    return false;
+                }
+            }
+        }
+    } while (iter_next_page(&iter));
+
+    if ((state & REGEX_DFA_MATCH_AT_END) != 0) {
+        *setme_end = end.content_pos;
+        return true;
     }
-    if (memcmp(it.io.iov_base, needle, it.io.iov_len) != 0) {
-        return false;
+    return false;
+}
+
+// Finds the longest match that starts at `from`. Returns 1 if there's a
+// match, 0 if there isn't, or -1 if that can't be decided before `*work`
+// bytes have been looked at.
+static int
+regex_find_longest(bfy_buffer const* buf,
+                   struct bfy_pos begin, struct bfy_pos from, struct bfy_pos end,
+                   bfy_regex const* re, size_t* work, size_t* setme_end) {
+    struct regex_dfa const* const dfa = &re->anchored;
+    uint32_t state = dfa->start[from.content_pos == begin.content_pos ? 0 : 1];
+    size_t match_end = (state & REGEX_DFA_MATCH) != 0 ? from.content_pos : SIZE_MAX;
+
+    bool dead = false;
+    struct bfy_iter iter;
+    if (iter_begin(&iter, buf, from, end)) do {
+        unsigned char const* const walk = iter.io.iov_base;
+        size_t const n = size_t_min(iter.io.iov_len, *work);
+        size_t i;
+        for (i = 0; i < n && !dead; ++i) {
+            state = regex_dfa_step(re, dfa, state, walk[i]);
+            uint32_t const flags = state & REGEX_DFA_FLAGS;
+            dead = (flags & REGEX_DFA_DEAD) != 0;
+            if ((flags & REGEX_DFA_MATCH) != 0) {
+                match_end = iter.cur.content_pos + i + 1;
+            }
+        }
+        *work -= i;
+        if (dead) {
+            break;
+        }
+        if (n < iter.io.iov_len) {
+            return -1;
+        }
+    } while (iter_next_page(&iter));
+
+    if (!dead && (state & REGEX_DFA_MATCH_AT_END) != 0) {
+        match_end = end.content_pos;
+    }
+    if (match_end == SIZE_MAX) {
+        return 0;
     }
+    *setme_end = match_end;
+    return 1;
+}
+
+// Finds where the leftmost-longest match ends, in one forward pass
+// that stops as soon as no longer match is possible
+static bool
+regex_find_leftmost_end(bfy_buffer const* buf,
+                        struct bfy_pos begin, struct bfy_pos end,
+                        bfy_regex const* re, size_t* setme_end) {
+    struct regex_dfa const* const dfa = &re->leftmost;
+    uint32_t state = dfa->start[0];
+    size_t match_end = (state & REGEX_DFA_MATCH) != 0 ? begin.content_pos : SIZE_MAX;
+
+    bool dead = false;
+    struct bfy_iter iter;
+    if (iter_begin(&iter, buf, begin, end)) do {
+        unsigned char const* const walk = iter.io.iov_base;
+        for (size_t i = 0; i < iter.io.iov_len && !dead; ++i) {
+            state = regex_dfa_step(re, dfa, state, walk[i]);
+            uint32_t const flags = state & REGEX_DFA_FLAGS;
+            dead = (flags & REGEX_DFA_DEAD) != 0;
+            if ((flags & REGEX_DFA_MATCH) != 0) {
+                match_end = iter.cur.content_pos + i + 1;
+            }
+        }
+    } while (!dead && iter_next_page(&iter));
 
-    needle = (char const*)needle + it.io.iov_len;
-    needle_len -= it.io.iov_len;
-    if (!iter_next_page(&it)) {
+    if (!dead && (state & REGEX_DFA_MATCH_AT_END) != 0) {
+        match_end = end.content_pos;
+    }
+    if (match_end == SIZE_MAX) {
         return false;
     }
-    // FIXME: recursive function could be smashed
-    return buffer_contains_at(buf, it, needle, needle_len);
+    *setme_end = match_end;
+    return true;
 }
 
+// Finds where the leftmost match that ends at `match_end` starts by
+// running the reversed pattern back from there. This stops as soon as
+// no earlier start is possible, so it doesn't scan the whole range.
 static size_t
-buffer_search_iovec(struct bfy_iovec const io,
-                    void const* needle, size_t needle_len) {
-    char const* const begin = io.iov_base;
-    char const* const end = begin + io.iov_len;
-    char const* walk = begin;
+regex_find_leftmost_start(bfy_buffer const* buf,
+                          struct bfy_pos begin, struct bfy_pos match_end, struct bfy_pos end,
+                          bfy_regex const* re) {
+    struct regex_dfa const* const dfa = &re->ranchored;
+    uint32_t state = dfa->start[match_end.content_pos == end.content_pos ? 0 : 1];
+    size_t start = (state & REGEX_DFA_MATCH) != 0 ? match_end.content_pos : SIZE_MAX;
+
+    struct bfy_riter iter;
+    if (riter_begin(&iter, buf, begin, match_end)) do {
+        unsigned char const* const walk = iter.io.iov_base;
+        for (size_t i = iter.io.iov_len; i-- > 0; ) {
+            state = regex_dfa_step(re, dfa, state, walk[i]);
+            uint32_t const flags = state & REGEX_DFA_FLAGS;
+            if ((flags & REGEX_DFA_MATCH) != 0) {
+                start = iter.content_pos + i;
+            }
+            if ((flags & REGEX_DFA_DEAD) != 0) {
+                return start;
+            }
+        }
+    } while (riter_prev_page(&iter));
 
-    while ((walk = memchr(walk, *(char const*)needle, end - walk))) {
-        size_t const len = size_t_min(needle_len, end - walk);
-        if (memcmp(walk, needle, len) == 0) {
-            return walk - begin;
+    if ((state & REGEX_DFA_MATCH_AT_END) != 0) {
+        start = begin.content_pos;
+    }
+    return start;
+}
+
+// Finds where the leftmost match starts by running the reversed
+// pattern from the end of the range back to its beginning. This is
+// only used if the leftmost DFA would be too big.
+static size_t
+regex_rfind_leftmost_start(bfy_buffer const* buf,
+                           struct bfy_pos begin, struct bfy_pos end,
+                           bfy_regex const* re) {
+    struct regex_dfa const* const dfa = &re->rsearch;
+    uint32_t state = dfa->start[0];
+    size_t start = (state & REGEX_DFA_MATCH) != 0 ? end.content_pos : SIZE_MAX;
+
+    struct bfy_riter iter;
+    if (riter_begin(&iter, buf, begin, end)) do {
+        unsigned char const* const walk = iter.io.iov_base;
+        for (size_t i = iter.io.iov_len; i-- > 0; ) {
+            state = regex_dfa_step(re, dfa, state, walk[i]);
+            uint32_t const flags = state & REGEX_DFA_FLAGS;
+            if ((flags & REGEX_DFA_MATCH) != 0) {
+                start = iter.content_pos + i;
+            }
+            if ((flags & REGEX_DFA_DEAD) != 0) {
+                return start;
+            }
         }
-        ++walk;
+    } while (riter_prev_page(&iter));
+
+    if ((state & REGEX_DFA_MATCH_AT_END) != 0) {
+        start = begin.content_pos;
     }
-    return io.iov_len;
+    return start;
 }
 
 static int
-buffer_search_range(bfy_buffer const* buf,
-                    struct bfy_pos begin, struct bfy_pos end,
-                    void const* needle, size_t needle_len,
-                    size_t* setme) {
-    struct bfy_iter iter;
+buffer_search_range_regex(bfy_buffer const* buf,
+                          struct bfy_pos begin, struct bfy_pos end,
+                          bfy_regex const* re,
+                          size_t* setme_match, size_t* setme_len) {
+    if (begin.content_pos >= end.content_pos) {
+        return -1;
+    }
 
-    if (!iter_begin(&iter, buf, begin, end)) {
+    // First find where the earliest-ending match ends. The leftmost match
+    // can't start after that, so try each start up to there in turn. Those
+    // tries usually fail fast, but if they've looked at too many bytes,
+    // find the leftmost-longest match's end in one forward pass instead,
+    // then walk back from that end to where the match starts, as RE2 does.
+    size_t first_end;
+    if (!regex_find_first_end(buf, begin, end, re, &first_end)) {
         return -1;
     }
-    while (iter.cur.content_pos < end.content_pos) {
-      size_t const hit = buffer_search_iovec(iter.io, needle, needle_len);
-      if (hit == iter.io.iov_len) {
-          if (iter_next_page(&iter)) {
-              continue;
-          }
-          break;
-      }
-      if (!iter_advance_n_bytes(&iter, hit)) {
-          break;
-      }
-      if (buffer_contains_at(buf, iter, needle, needle_len)) {
-          *setme = iter.cur.content_pos;
-          return 0;
-      }
-      if (!iter_advance_n_bytes(&iter, 1)) {
-          break;
-      }
+
+    size_t work = 4 * (first_end - begin.content_pos) + 4096;
+    size_t match_end;
+    struct bfy_pos pos = begin;
+    for (;;) {
+        int const ret = regex_find_longest(buf, begin, pos, end, re, &work, &match_end);
+        if (ret > 0) {
+            break;
+        }
+        if (ret < 0 && re->leftmost.next == NULL) {
+            // no leftmost DFA, so scan back from the end of the range
+            work = SIZE_MAX;
+            pos = buffer_get_pos_from(buf, begin, regex_rfind_leftmost_start(buf, begin, end, re));
+            regex_find_longest(buf, begin, pos, end, re, &work, &match_end);
+            break;
+        }
+        if (ret < 0) {
+            regex_find_leftmost_end(buf, begin, end, re, &match_end);
+            struct bfy_pos const match_end_pos = buffer_get_pos_from(buf, begin, match_end);
+            pos = buffer_get_pos_from(buf, begin, regex_find_leftmost_start(buf, begin, match_end_pos, end, re));
+            break;
+        }
+        pos = buffer_get_pos_from(buf, pos, pos.content_pos + 1);
     }
 
-    return -1;
+    if (setme_match != NULL) {
+        *setme_match = pos.content_pos;
+    }
+    if (setme_len != NULL) {
+        *setme_len = match_end - pos.content_pos;
+    }
+    return 0;
 }
 
 int
-bfy_buffer_search_range(bfy_buffer const* buf,
-                        size_t begin, size_t end,
-                        void const* needle, size_t needle_len,
-                        size_t* setme_match) {
-    return buffer_search_range(buf,
-                               buffer_get_pos(buf, begin),
-                               buffer_get_pos(buf, end),
-                               needle, needle_len, setme_match);
+bfy_buffer_search_range_regex(bfy_buffer const* buf,
+                              size_t begin, size_t end,
+                              bfy_regex const* re,
+                              size_t* setme_match, size_t* setme_len) {
+    buffer_lock(buf);
+    int const ret = buffer_search_range_regex(buf,
+                                              buffer_get_pos(buf, begin),
+                                              buffer_get_pos(buf, end),
+                                              re, setme_match, setme_len);
+    buffer_unlock(buf);
+    return ret;
 }
 
 int
-bfy_buffer_search(bfy_buffer const* buf, size_t len,
-                  void const* needle, size_t needle_len,
-                  size_t* setme_match) {
-    return bfy_buffer_search_range(buf, 0, len,
-                                   needle, needle_len, setme_match);
+bfy_buffer_search_all_regex(bfy_buffer const* buf,
+                            bfy_regex const* re,
+                            size_t* setme_match, size_t* setme_len) {
+    return bfy_buffer_search_range_regex(buf, 0, SIZE_MAX, re, setme_match, setme_len);
+}
+
+/// pagequeue
+
+struct bfy_pagequeue_node {
+    struct bfy_pagequeue_node* next;
+    size_t content_len;
+    size_t n_pages;
+    struct bfy_page pages[];
+};
+
+// move every page that has content into `node`.
+// empty pages are kept by `buf` so that their space can be reused.
+static void
+buffer_detach_content_pages(bfy_buffer* buf, struct bfy_pagequeue_node* node) {
+    struct bfy_page* keep = pages_begin(buf);
+    struct bfy_page const* const end = pages_cend(buf);
+    for (struct bfy_page* walk = keep; walk != end; ++walk) {
+        size_t const content_len = page_get_content_len(walk);
+        if (content_len > 0) {
+            node->pages[node->n_pages++] = *walk;
+            node->content_len += content_len;
+        } else {
+            *keep++ = *walk;
+        }
+    }
+
+    if (buf->pages == NULL) {
+        if (keep == &buf->page) {
+            buf->page = InitPage;
+        }
+    } else {
+        buf->n_pages = keep - pages_cbegin(buf);
+        if (buf->n_pages == 0) {
+            allocator.free(buf->pages);
+            buf->pages = NULL;
+            buf->n_pages_alloc = 0;
+        }
+    }
+
+    buf->n_drained_front += node->content_len;
+    buffer_record_content_removed(buf, node->content_len);
 }
 
 int
-bfy_buffer_search_all(bfy_buffer const* buf,
-                      void const* needle, size_t needle_len,
-                      size_t* setme_match) {
-    return bfy_buffer_search_range(buf, 0, SIZE_MAX,
-                                   needle, needle_len, setme_match);
+bfy_pagequeue_add_buffer(bfy_pagequeue* queue, bfy_buffer* src) {
+    buffer_lock(src);
+    if (src->content_len == 0) {
+        buffer_unlock(src);
+        return 0;
+    }
+
+    size_t const n_pages = buffer_count_pages(src);
+    struct bfy_pagequeue_node* node = allocator.malloc(sizeof(struct bfy_pagequeue_node) + sizeof(struct bfy_page) * n_pages);
+    if (node == NULL) {
+        buffer_unlock(src);
+        errno = ENOMEM;
+        return -1;
+    }
+    node->content_len = 0;
+    node->n_pages = 0;
+    buffer_detach_content_pages(src, node);
+    buffer_unlock(src);
+
+    // push the node onto the stack
+    void* head = atomic_load_ptr((void**)&queue->head);
+    do {
+        node->next = head;
+    } while (!atomic_compare_exchange_ptr((void**)&queue->head, &head, node));
+
+    return 0;
+}
+
+static struct bfy_pagequeue_node*
+pagequeue_take_all(bfy_pagequeue* queue) {
+    struct bfy_pagequeue_node* node = atomic_exchange_ptr((void**)&queue->head, NULL);
+
+    // the stack is newest-first; reverse it to get the order they were added
+    struct bfy_pagequeue_node* fifo = NULL;
+    while (node != NULL) {
+        struct bfy_pagequeue_node* const next = node->next;
+        node->next = fifo;
+        fifo = node;
+        node = next;
+    }
+    return fifo;
+}
+
+// put `stack` back into the queue, behind anything that producers
+// pushed since it was taken, so that the next take_all() sees it first
+static void
+pagequeue_requeue(bfy_pagequeue* queue, struct bfy_pagequeue_node* stack) {
+    for (;;) {
+        void* head = NULL;
+        if (atomic_compare_exchange_ptr((void**)&queue->head, &head, stack)) {
+            return;
+        }
+
+        // producers pushed newer nodes; take them and stack them on top
+        struct bfy_pagequeue_node* const newer = atomic_exchange_ptr((void**)&queue->head, NULL);
+        if (newer != NULL) {
+            struct bfy_pagequeue_node* bottom = newer;
+            while (bottom->next != NULL) {
+                bottom = bottom->next;
+            }
+            bottom->next = stack;
+            stack = newer;
+        }
+    }
+}
+
+static void
+pagequeue_node_free(struct bfy_pagequeue_node* node) {
+    for (size_t i = 0; i < node->n_pages; ++i) {
+        page_release(node->pages + i);
+    }
+    allocator.free(node);
+}
+
+size_t
+bfy_pagequeue_remove_buffer(bfy_pagequeue* queue, bfy_buffer* tgt) {
+    struct bfy_pagequeue_node* const nodes = pagequeue_take_all(queue);
+    if (nodes == NULL) {
+        return 0;
+    }
+
+    size_t content_len = 0;
+    size_t n_pages = 0;
+    for (struct bfy_pagequeue_node const* it = nodes; it != NULL; it = it->next) {
+        content_len += it->content_len;
+        n_pages += it->n_pages;
+    }
+
+    // gather the pages so they can be spliced into tgt all at once
+    struct bfy_page* pages = nodes->pages;
+    if (nodes->next != NULL) {
+        pages = allocator.malloc(sizeof(struct bfy_page) * n_pages);
+    }
+
+    size_t n_moved = 0;
+    buffer_lock(tgt);
+    if (pages == NULL) {
+        // can't batch them, so fall back to one splice per node
+        bfy_buffer_begin_coalescing_change_events(tgt);
+        for (struct bfy_pagequeue_node* it = nodes; it != NULL; it = it->next) {
+            if (buffer_append_pages(tgt, it->pages, it->n_pages) != 0) {
+                break;  // keep the rest queued so their order is kept
+            }
+            n_moved += it->content_len;
+            it->n_pages = 0;
+        }
+        bfy_buffer_end_coalescing_change_events(tgt);
+    } else {
+        if (pages != nodes->pages) {
+            struct bfy_page* walk = pages;
+            for (struct bfy_pagequeue_node const* it = nodes; it != NULL; it = it->next) {
+                memcpy(walk, it->pages, sizeof(struct bfy_page) * it->n_pages);
+                walk += it->n_pages;
+            }
+        }
+        if (buffer_append_pages(tgt, pages, n_pages) == 0) {
+            n_moved = content_len;
+            for (struct bfy_pagequeue_node* it = nodes; it != NULL; it = it->next) {
+                it->n_pages = 0;
+            }
+        }
+        if (pages != nodes->pages) {
+            allocator.free(pages);
+        }
+    }
+    buffer_unlock(tgt);
+
+    // free the emptied nodes and requeue any that couldn't be moved.
+    // the unmoved nodes are the tail of the fifo list, so push them
+    // back in stack order: newest-first.
+    struct bfy_pagequeue_node* unmoved = NULL;
+    for (struct bfy_pagequeue_node* it = nodes; it != NULL; ) {
+        struct bfy_pagequeue_node* const next = it->next;
+        if (it->n_pages == 0) {
+            allocator.free(it);
+        } else {
+            it->next = unmoved;
+            unmoved = it;
+        }
+        it = next;
+    }
+    if (unmoved != NULL) {
+        pagequeue_requeue(queue, unmoved);
+    }
+
+    return n_moved;
+}
+
+bfy_pagequeue
+bfy_pagequeue_init(void) {
+    bfy_pagequeue const queue = {
+        .head = NULL
+    };
+    return queue;
+}
+
+bfy_pagequeue*
+bfy_pagequeue_new(void) {
+    bfy_pagequeue* queue = allocator.malloc(sizeof(bfy_pagequeue));
+    if (queue != NULL) {
+        *queue = bfy_pagequeue_init();
+    }
+    return queue;
+}
+
+void
+bfy_pagequeue_destruct(bfy_pagequeue* queue) {
+    for (struct bfy_pagequeue_node* it = pagequeue_take_all(queue); it != NULL; ) {
+        struct bfy_pagequeue_node* const next = it->next;
+        pagequeue_node_free(it);
+        it = next;
+    }
+}
+
+void
+bfy_pagequeue_free(bfy_pagequeue* queue) {
+    bfy_pagequeue_destruct(queue);
+    allocator.free(queue);
 }
 
 /// life cycle
@@ -1227,7 +6759,18 @@ bfy_buffer_new_unmanaged(void* space, size_t len) {
 
 void
 bfy_buffer_destruct(bfy_buffer* buf) {
+    if (buf->deferred_pending) {
+        deferred_queue_remove(buf->deferred, buf);
+    }
+    buf->deferred = NULL;
+
     buffer_drain_all(buf, DRAIN_FLAG_NORECYCLE);
+
+    if (buf->lock_owned) {
+        lock_functions.lock_free(buf->lock);
+    }
+    buf->lock = NULL;
+    buf->lock_owned = 0;
 }
 
 void
@@ -3,7 +3,8 @@
 * @brief  Convert Endianness of shorts, longs, long longs, regardless of architecture/OS
 *
 * Defines (without pulling in platform-specific network include headers):
-* bswap16, bswap32, bswap64, ntoh16, hton16, ntoh32 hton32, ntoh64, hton64
+* bswap16, bswap32, bswap64, ntoh16, hton16, ntoh32 hton32, ntoh64, hton64,
+* ltoh16, htol16, ltoh32, htol32, ltoh64, htol64
 *
 * Should support linux / macos / solaris / windows.
 * Supports GCC (on any platform, including embedded), MSVC2015, and clang,
@@ -19,6 +20,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 /* Detect platform endianness at compile time */
 
@@ -102,7 +104,7 @@
 #endif
 
 
-/* Defines network - host byte swaps as needed depending upon platform endianness */
+/* Defines network - host and little-endian - host byte swaps as needed depending upon platform endianness */
 // note that network order is big endian)
 
 #if defined(__LITTLE_ENDIAN__)
@@ -112,6 +114,12 @@
 #  define hton32(x)     bswap32((x))
 #  define ntoh64(x)     bswap64((x))
 #  define hton64(x)     bswap64((x))
+#  define ltoh16(x)     (x)
+#  define htol16(x)     (x)
+#  define ltoh32(x)     (x)
+#  define htol32(x)     (x)
+#  define ltoh64(x)     (x)
+#  define htol64(x)     (x)
 #elif defined(__BIG_ENDIAN__)
 #  define ntoh16(x)     (x)
 #  define hton16(x)     (x)
@@ -119,6 +127,12 @@
 #  define hton32(x)     (x)
 #  define ntoh64(x)     (x)
 #  define hton64(x)     (x)
+#  define ltoh16(x)     bswap16((x))
+#  define htol16(x)     bswap16((x))
+#  define ltoh32(x)     bswap32((x))
+#  define htol32(x)     bswap32((x))
+#  define ltoh64(x)     bswap64((x))
+#  define htol64(x)     bswap64((x))
 #  else
 #    warning "UNKNOWN Platform / endianness; network / host byte swaps not defined."
 #endif
@@ -126,27 +140,21 @@
 
 //! Convert 32-bit float from host to network byte order
 static inline float htonf(float f) {
-#ifdef __cplusplus
-    static_assert(sizeof(float) == sizeof(uint32_t), "Unexpected float format");
-    uint32_t val = hton32(*(reinterpret_cast<const uint32_t *>(&f)));
-    return *(reinterpret_cast<float *>(&val));
-#else
-    uint32_t val = hton32(*(const uint32_t *)(&f));
-    return *((float *)(&val));
-#endif
+    uint32_t val;
+    memcpy(&val, &f, sizeof(val));
+    val = hton32(val);
+    memcpy(&f, &val, sizeof(f));
+    return f;
 }
 #define ntohf(x)   htonf((x))
 
 //! Convert 64-bit double from host to network byte order
 static inline double htond(double f) {
-#ifdef __cplusplus
-    static_assert(sizeof(double) == sizeof(uint64_t), "Unexpected double format");
-    uint64_t val = hton64(*(reinterpret_cast<const uint64_t *>(&f)));
-    return *(reinterpret_cast<double *>(&val));
-#else
-    uint64_t val = hton64(*(const uint64_t *)(&f));
-    return *((double *)(&val));
-#endif
+    uint64_t val;
+    memcpy(&val, &f, sizeof(val));
+    val = hton64(val);
+    memcpy(&f, &val, sizeof(f));
+    return f;
 }
 #define ntohd(x)   htond((x))
 
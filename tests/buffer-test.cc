@@ -24,17 +24,37 @@
 #include <algorithm>
 #include <array>
 #include <cerrno>
+#include <chrono>
 #include <cinttypes>
+#include <cmath>  // HUGE_VAL, NAN
 #include <cstring>  // memcmp()
+#include <functional>
+#include <iterator>
+#include <mutex>
 #include <numeric>
+#include <random>
+#include <set>
 #include <string_view>
+#include <thread>
 #include <type_traits>
+#include <vector>
 
 #include "buffy/buffer.h"
+#include "buffy/buffer.hpp"
 #include "../src/endianness.h"
 
 #include "gtest/gtest.h"
 
+#if defined(BFY_HAVE_FMT)
+#include <fmt/format.h>
+#endif
+
+#if __has_include(<sys/mman.h>)
+#include <sys/mman.h>  // mmap()
+#include <unistd.h>  // sysconf()
+#define HAVE_MMAN
+#endif
+
 ///
 
 bool operator== (bfy_iovec const& a, bfy_iovec const& b) {
@@ -144,6 +164,61 @@ class BufferWithReadonlyStrings {
     }
 };
 
+
+// Random text made of bytes from `alphabet`
+std::string random_string(std::mt19937& rng, std::string_view alphabet, size_t len) {
+    auto str = std::string(len, '\0');
+    for (auto& ch : str) {
+        ch = alphabet[rng() % std::size(alphabet)];
+    }
+    return str;
+}
+
+// Random text split across readonly pages of random sizes, so that
+// searches run into lots of page seams. Each page holds between 1 and
+// `max_page_size` bytes, where `max_page_size` is picked at random from
+// `max_page_sizes` -- e.g. { 7, 300 } mixes tiny pages with big ones.
+class RandomPagedBuffer {
+ public:
+    std::string allstrs;
+    bfy_buffer buf;
+
+    RandomPagedBuffer(std::mt19937& rng, std::string_view alphabet, size_t len,
+                      std::initializer_list<size_t> max_page_sizes):
+        allstrs{random_string(rng, alphabet, len)},
+        buf{bfy_buffer_init()}
+    {
+        auto const n_sizes = std::size(max_page_sizes);
+        for (size_t pos = 0; pos < std::size(allstrs); ) {
+            auto const max_page_size = std::data(max_page_sizes)[n_sizes > 1 ? rng() % n_sizes : 0];
+            auto const page_len = std::min(size_t { 1 + rng() % max_page_size }, std::size(allstrs) - pos);
+            bfy_buffer_add_readonly(&buf, std::data(allstrs) + pos, page_len);
+            pos += page_len;
+        }
+    }
+
+    ~RandomPagedBuffer() {
+        bfy_buffer_destruct(&buf);
+    }
+};
+
+// an allocator whose allocations fail while `allocations_fail` is set
+bool allocations_fail = false;
+
+struct bfy_allocator failable_allocator = {
+    .malloc = [](size_t size) { return allocations_fail ? nullptr : malloc(size); },
+    .free = free,
+    .calloc = [](size_t nmemb, size_t size) { return allocations_fail ? nullptr : calloc(nmemb, size); },
+    .realloc = [](void* ptr, size_t size) { return allocations_fail ? nullptr : realloc(ptr, size); }
+};
+
+struct bfy_allocator system_allocator = {
+    .malloc = malloc,
+    .free = free,
+    .calloc = calloc,
+    .realloc = realloc
+};
+
 }  // anonymous namespace
 
 ///
@@ -384,6 +459,68 @@ TEST(Buffer, add_printf_when_not_enough_space) {
     EXPECT_EQ(expected, buffer_remove_string(&local.buf));
 }
 
+TEST(Buffer, add_integer_text) {
+    auto values = std::vector<uint64_t> { 0, 1, 9, 10, 99, 100, 12345, UINT32_MAX, UINT64_MAX };
+    for (uint64_t pow10 = 1; pow10 <= UINT64_MAX / 10; pow10 *= 10) {
+        values.push_back(pow10 - 1);
+        values.push_back(pow10);
+    }
+
+    // the small local array forces the fallback for lack of free space
+    BufferWithLocalArray<4> local;
+    auto buf = bfy_buffer_init();
+    for (auto* b : { &buf, &local.buf }) {
+        for (auto const val : values) {
+            char expected[64];
+            EXPECT_EQ(0, bfy_buffer_add_u64_dec(b, val));
+            snprintf(expected, sizeof(expected), "%" PRIu64, val);
+            EXPECT_EQ(expected, buffer_remove_string(b));
+            EXPECT_EQ(0, bfy_buffer_add_u64_hex(b, val));
+            snprintf(expected, sizeof(expected), "%" PRIx64, val);
+            EXPECT_EQ(expected, buffer_remove_string(b));
+            auto const sval = int64_t(val);
+            EXPECT_EQ(0, bfy_buffer_add_i64_dec(b, sval));
+            snprintf(expected, sizeof(expected), "%" PRId64, sval);
+            EXPECT_EQ(expected, buffer_remove_string(b));
+        }
+    }
+    EXPECT_EQ(0, bfy_buffer_add_i64_dec(&buf, INT64_MIN));
+    EXPECT_EQ("-9223372036854775808", buffer_remove_string(&buf));
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, add_double_text) {
+    auto const expected = std::vector<std::pair<double, std::string_view>> {
+        { 0.0, "0" }, { -0.0, "-0" }, { 1.0, "1" }, { 100.0, "100" }, { -2.5, "-2.5" },
+        { 0.1, "0.1" }, { 1.0 / 3, "0.3333333333333333" }, { 0.000001, "0.000001" },
+        { 1.5e-7, "1.5e-7" }, { 1e21, "1e+21" }, { 123456789012345680000.0, "123456789012345680000" },
+        { 5e-324, "5e-324" }, { 1.7976931348623157e308, "1.7976931348623157e+308" },
+        { 2.2250738585072014e-308, "2.2250738585072014e-308" },
+        { HUGE_VAL, "inf" }, { -HUGE_VAL, "-inf" }, { NAN, "nan" }
+    };
+    auto buf = bfy_buffer_init();
+    for (auto const& [val, str] : expected) {
+        EXPECT_EQ(0, bfy_buffer_add_double(&buf, val));
+        EXPECT_EQ(str, buffer_remove_string(&buf));
+    }
+
+    // random doubles all parse back to themselves
+    auto rng = std::mt19937_64 { 2020 };
+    for (int i = 0; i < 100000; ++i) {
+        auto const bits = rng();
+        auto val = double {};
+        memcpy(&val, &bits, sizeof(val));
+        if (!std::isfinite(val)) {
+            continue;
+        }
+        EXPECT_EQ(0, bfy_buffer_add_double(&buf, val));
+        auto const str = buffer_remove_string(&buf);
+        auto const parsed = strtod(str.c_str(), nullptr);
+        EXPECT_EQ(0, memcmp(&val, &parsed, sizeof(val))) << str;
+    }
+    bfy_buffer_destruct(&buf);
+}
+
 TEST(Buffer, make_contiguous_when_only_one_page) {
     BufferWithLocalArray<64> local;
 
@@ -684,6 +821,28 @@ TEST(Buffer, drain_too_much) {
     bfy_buffer_destruct(&buf);
 }
 
+TEST(Buffer, drain_single_page_then_add_pages) {
+    // setup: a buffer whose one page is recycled when drained
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add(&buf, std::data(str1), std::size(str1));
+    EXPECT_EQ(std::size(str1), bfy_buffer_drain_all(&buf));
+
+    // add more pages
+    bfy_buffer_add_readonly(&buf, std::data(str2), std::size(str2));
+    bfy_buffer_add_readonly(&buf, std::data(str3), std::size(str3));
+
+    // confirm that the new pages follow the empty recycled one
+    auto const pages = buffer_get_pages(&buf);
+    ASSERT_EQ(3, std::size(pages));
+    EXPECT_EQ(0, pages[0].iov_len);
+    EXPECT_EQ(std::data(str2), pages[1].iov_base);
+    EXPECT_EQ(std::data(str3), pages[2].iov_base);
+    EXPECT_EQ(std::size(str2) + std::size(str3), bfy_buffer_get_content_len(&buf));
+
+    // cleanup
+    bfy_buffer_destruct(&buf);
+}
+
 TEST(Buffer, remove_string) {
     BufferWithReadonlyStrings local;
 
@@ -892,6 +1051,370 @@ TEST(Buffer, endian_64) {
     EXPECT_EQ(in, bfy_buffer_remove_ntoh_u64(&local.buf));
 }
 
+TEST(Buffer, remove_ntoh_across_pages) {
+    // setup: big-endian numbers split across small pages
+    auto constexpr bytes = std::array<uint8_t, 15> { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                                                     0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F };
+    auto buf = bfy_buffer_init();
+    for (size_t pos = 0; pos < std::size(bytes); pos += 3) {
+        bfy_buffer_add_readonly(&buf, std::data(bytes) + pos, 3);
+    }
+
+    EXPECT_EQ(0x01, bfy_buffer_remove_ntoh_u8(&buf));
+    EXPECT_EQ(0x0203, bfy_buffer_remove_ntoh_u16(&buf));
+    EXPECT_EQ(0x04050607, bfy_buffer_remove_ntoh_u32(&buf));
+    EXPECT_EQ(0x08090A0B, bfy_buffer_remove_ntoh_u32(&buf));
+    EXPECT_EQ(4, bfy_buffer_get_content_len(&buf));
+
+    // too short: nothing is removed
+    errno = 0;
+    EXPECT_EQ(0, bfy_buffer_remove_ntoh_u64(&buf));
+    EXPECT_EQ(ENOMSG, errno);
+    EXPECT_EQ(4, bfy_buffer_get_content_len(&buf));
+    EXPECT_EQ(0x0C0D0E0F, bfy_buffer_remove_ntoh_u32(&buf));
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, peek_ntoh_at) {
+    auto constexpr bytes = std::array<uint8_t, 10> { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09 };
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add(&buf, std::data(bytes), 4);
+    bfy_buffer_add_readonly(&buf, std::data(bytes) + 4, std::size(bytes) - 4);
+
+    auto u8 = uint8_t {};
+    auto u16 = uint16_t {};
+    auto u32 = uint32_t {};
+    auto u64 = uint64_t {};
+    EXPECT_EQ(0, bfy_buffer_peek_ntoh_u8_at(&buf, 9, &u8));
+    EXPECT_EQ(0x09, u8);
+    EXPECT_EQ(0, bfy_buffer_peek_ntoh_u16_at(&buf, 1, &u16));
+    EXPECT_EQ(0x0102, u16);
+    EXPECT_EQ(0, bfy_buffer_peek_ntoh_u32_at(&buf, 2, &u32));  // crosses pages
+    EXPECT_EQ(0x02030405, u32);
+    EXPECT_EQ(0, bfy_buffer_peek_ntoh_u64_at(&buf, 2, &u64));
+    EXPECT_EQ(0x0203040506070809, u64);
+
+    // reading past the end fails
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_peek_ntoh_u64_at(&buf, 3, &u64));
+    EXPECT_EQ(ENOMSG, errno);
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_peek_ntoh_u8_at(&buf, SIZE_MAX, &u8));
+    EXPECT_EQ(ENOMSG, errno);
+
+    // nothing was removed
+    EXPECT_EQ(std::size(bytes), bfy_buffer_get_content_len(&buf));
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, little_endian) {
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_add_le_u16(&buf, 0x0102));
+    EXPECT_EQ(0, bfy_buffer_add_le_u32(&buf, 0x03040506));
+    EXPECT_EQ(0, bfy_buffer_add_le_u64(&buf, 0x0708090A0B0C0D0E));
+    EXPECT_EQ(0, bfy_buffer_add_le_float(&buf, 1.5F));
+    EXPECT_EQ(0, bfy_buffer_add_le_double(&buf, -2.25));
+
+    // check the wire bytes
+    auto constexpr expected = std::array<uint8_t, 26> {
+        0x02, 0x01,
+        0x06, 0x05, 0x04, 0x03,
+        0x0E, 0x0D, 0x0C, 0x0B, 0x0A, 0x09, 0x08, 0x07,
+        0x00, 0x00, 0xC0, 0x3F,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0xC0 };
+    auto bytes = std::array<uint8_t, std::size(expected)> {};
+    EXPECT_EQ(std::size(bytes), bfy_buffer_copyout(&buf, std::size(bytes), std::data(bytes)));
+    EXPECT_EQ(expected, bytes);
+
+    // read them back split across small pages
+    auto split = bfy_buffer_init();
+    for (size_t pos = 0; pos < std::size(bytes); pos += 3) {
+        bfy_buffer_add_readonly(&split, std::data(bytes) + pos, std::min(size_t { 3 }, std::size(bytes) - pos));
+    }
+    auto u64 = uint64_t {};
+    auto f = float {};
+    auto d = double {};
+    EXPECT_EQ(0, bfy_buffer_peek_le_u64_at(&split, 6, &u64));
+    EXPECT_EQ(0x0708090A0B0C0D0E, u64);
+    EXPECT_EQ(0, bfy_buffer_peek_le_float_at(&split, 14, &f));
+    EXPECT_EQ(1.5F, f);
+    EXPECT_EQ(0, bfy_buffer_peek_le_double_at(&split, 18, &d));
+    EXPECT_EQ(-2.25, d);
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_peek_le_double_at(&split, 19, &d));
+    EXPECT_EQ(ENOMSG, errno);
+
+    EXPECT_EQ(0x0102, bfy_buffer_remove_le_u16(&split));
+    EXPECT_EQ(0x03040506, bfy_buffer_remove_le_u32(&split));
+    EXPECT_EQ(0x0708090A0B0C0D0E, bfy_buffer_remove_le_u64(&split));
+    EXPECT_EQ(1.5F, bfy_buffer_remove_le_float(&split));
+    EXPECT_EQ(-2.25, bfy_buffer_remove_le_double(&split));
+    EXPECT_EQ(0, bfy_buffer_get_content_len(&split));
+
+    bfy_buffer_destruct(&split);
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, ntoh_arrays) {
+    // enough numbers to cover the SIMD blocks and a scalar tail
+    auto in16 = std::vector<uint16_t>(37);
+    auto in32 = std::vector<uint32_t>(37);
+    auto in64 = std::vector<uint64_t>(37);
+    for (size_t i = 0; i < std::size(in16); ++i) {
+        in16[i] = uint16_t(0x0102 * (i + 1));
+        in32[i] = uint32_t(0x01020304 * (i + 1));
+        in64[i] = uint64_t(0x0102030405060708) * (i + 1);
+    }
+
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_add_hton_u16_array(&buf, std::data(in16), std::size(in16)));
+    EXPECT_EQ(0, bfy_buffer_add_hton_u32_array(&buf, std::data(in32), std::size(in32)));
+    EXPECT_EQ(0, bfy_buffer_add_hton_u64_array(&buf, std::data(in64), std::size(in64)));
+
+    // the wire bytes match the per-number helpers
+    auto expected = bfy_buffer_init();
+    for (size_t i = 0; i < std::size(in16); ++i) {
+        bfy_buffer_add_hton_u16(&expected, in16[i]);
+    }
+    for (size_t i = 0; i < std::size(in32); ++i) {
+        bfy_buffer_add_hton_u32(&expected, in32[i]);
+    }
+    for (size_t i = 0; i < std::size(in64); ++i) {
+        bfy_buffer_add_hton_u64(&expected, in64[i]);
+    }
+    auto const bytes = buffer_copyout(&expected);
+    EXPECT_EQ(bytes, buffer_copyout(&buf));
+
+    // read them back split across small pages
+    auto split = bfy_buffer_init();
+    for (size_t pos = 0; pos < std::size(bytes); pos += 5) {
+        bfy_buffer_add_readonly(&split, std::data(bytes) + pos, std::min(size_t { 5 }, std::size(bytes) - pos));
+    }
+    auto out16 = std::vector<uint16_t>(std::size(in16));
+    auto out32 = std::vector<uint32_t>(std::size(in32));
+    auto out64 = std::vector<uint64_t>(std::size(in64));
+    auto const offset32 = std::size(in16) * sizeof(uint16_t);
+    EXPECT_EQ(0, bfy_buffer_peek_ntoh_u32_array_at(&split, offset32, std::data(out32), std::size(out32)));
+    EXPECT_EQ(in32, out32);
+    auto const offset64 = offset32 + std::size(in32) * sizeof(uint32_t);
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_peek_ntoh_u64_array_at(&split, offset64 + 1, std::data(out64), std::size(out64)));
+    EXPECT_EQ(ENOMSG, errno);
+
+    out32.assign(std::size(out32), 0);
+    EXPECT_EQ(0, bfy_buffer_remove_ntoh_u16_array(&split, std::data(out16), std::size(out16)));
+    EXPECT_EQ(0, bfy_buffer_remove_ntoh_u32_array(&split, std::data(out32), std::size(out32)));
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_remove_ntoh_u64_array(&split, std::data(out64), SIZE_MAX));
+    EXPECT_EQ(ENOMSG, errno);
+    EXPECT_EQ(0, bfy_buffer_remove_ntoh_u64_array(&split, std::data(out64), std::size(out64)));
+    EXPECT_EQ(in16, out16);
+    EXPECT_EQ(in32, out32);
+    EXPECT_EQ(in64, out64);
+    EXPECT_EQ(0, bfy_buffer_get_content_len(&split));
+
+    bfy_buffer_destruct(&split);
+    bfy_buffer_destruct(&expected);
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, varint_round_trip) {
+    auto values = std::vector<uint64_t> { 0, 1, 127, 128, 300, 16383, 16384, UINT32_MAX, UINT64_MAX };
+    for (int shift = 0; shift < 64; ++shift) {
+        values.push_back(uint64_t { 1 } << shift);
+        values.push_back((uint64_t { 1 } << shift) - 1);
+    }
+    auto constexpr svalues = std::array<int64_t, 7> { 0, -1, 1, -64, 64, INT64_MIN, INT64_MAX };
+
+    auto buf = bfy_buffer_init();
+    for (auto const val : values) {
+        EXPECT_EQ(0, bfy_buffer_add_varint_u64(&buf, val));
+    }
+    for (auto const val : svalues) {
+        EXPECT_EQ(0, bfy_buffer_add_varint_s64(&buf, val));
+    }
+
+    // read them back split across pages of every small size,
+    // and then from a single page
+    auto const bytes = buffer_copyout(&buf);
+    auto page_lens = std::vector<size_t> { std::size(bytes) };
+    for (size_t page_len = 1; page_len <= 11; ++page_len) {
+        page_lens.push_back(page_len);
+    }
+    for (auto const page_len : page_lens) {
+        auto split = bfy_buffer_init();
+        for (size_t pos = 0; pos < std::size(bytes); pos += page_len) {
+            bfy_buffer_add_readonly(&split, std::data(bytes) + pos, std::min(page_len, std::size(bytes) - pos));
+        }
+        for (auto const expected : values) {
+            auto peeked = uint64_t {};
+            auto len = size_t {};
+            EXPECT_EQ(0, bfy_buffer_peek_varint_u64_at(&split, 0, &peeked, &len));
+            EXPECT_EQ(expected, peeked);
+            auto const pre_len = bfy_buffer_get_content_len(&split);
+            auto val = uint64_t {};
+            EXPECT_EQ(0, bfy_buffer_remove_varint_u64(&split, &val));
+            EXPECT_EQ(expected, val);
+            EXPECT_EQ(pre_len - len, bfy_buffer_get_content_len(&split));
+        }
+        for (auto const expected : svalues) {
+            auto val = int64_t {};
+            EXPECT_EQ(0, bfy_buffer_remove_varint_s64(&split, &val));
+            EXPECT_EQ(expected, val);
+        }
+        EXPECT_EQ(0, bfy_buffer_get_content_len(&split));
+        bfy_buffer_destruct(&split);
+    }
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, varint_wire_format) {
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add_varint_u64(&buf, 300);
+    bfy_buffer_add_varint_s64(&buf, -2);
+    EXPECT_EQ((std::vector<char> { char(0xAC), 0x02, 0x03 }), buffer_copyout(&buf));
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, varint_rejects_truncated_and_malformed) {
+    auto val = uint64_t {};
+
+    // truncated: nothing is removed
+    auto constexpr truncated = std::array<uint8_t, 3> { 0x80, 0x80, 0x80 };
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add(&buf, std::data(truncated), std::size(truncated));
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_remove_varint_u64(&buf, &val));
+    EXPECT_EQ(ENOMSG, errno);
+    EXPECT_EQ(std::size(truncated), bfy_buffer_get_content_len(&buf));
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_peek_varint_u64_at(&buf, 10, &val, nullptr));
+    EXPECT_EQ(ENOMSG, errno);
+    bfy_buffer_destruct(&buf);
+
+    // eleven bytes long, or too big for a uint64_t
+    auto constexpr too_long = std::array<uint8_t, 11> { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01 };
+    auto constexpr too_big = std::array<uint8_t, 10> { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x02 };
+    buf = bfy_buffer_init();
+    bfy_buffer_add(&buf, std::data(too_long), std::size(too_long));
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_remove_varint_u64(&buf, &val));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ(std::size(too_long), bfy_buffer_get_content_len(&buf));
+    bfy_buffer_drain_all(&buf);
+    bfy_buffer_add(&buf, std::data(too_big), std::size(too_big));
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_peek_varint_u64_at(&buf, 0, &val, nullptr));
+    EXPECT_EQ(EINVAL, errno);
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, pack_wire_format) {
+    // same bytes as Python's struct.pack('!HIQ3sx', ...)
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_pack(&buf, "!HIQ3sx", uint16_t { 0x0102 }, uint32_t { 0x03040506 },
+                                 uint64_t { 0x0708090A0B0C0D0E }, "abc"));
+    auto const expected = std::vector<char> {
+        0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+        0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 'a', 'b', 'c', 0x00 };
+    EXPECT_EQ(expected, buffer_copyout(&buf));
+    bfy_buffer_drain_all(&buf);
+
+    EXPECT_EQ(0, bfy_buffer_pack(&buf, "<2h", int16_t { -2 }, int16_t { 0x0102 }));
+    EXPECT_EQ((std::vector<char> { char(0xFE), char(0xFF), 0x02, 0x01 }), buffer_copyout(&buf));
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, pack_unpack_round_trip) {
+    auto* const fmt = bfy_format_new("!cbBhHiIqQfd5s");
+    ASSERT_NE(nullptr, fmt);
+    EXPECT_EQ(48, bfy_format_get_size(fmt));
+
+    auto buf = bfy_buffer_init();
+    auto constexpr n_records = size_t { 3 };
+    for (size_t i = 0; i < n_records; ++i) {
+        EXPECT_EQ(0, bfy_buffer_pack_format(&buf, fmt, 'z', int8_t { -8 }, uint8_t { 200 },
+                                            int16_t { -1600 }, uint16_t { 60000 },
+                                            int32_t { -320000 }, uint32_t { 4000000000 },
+                                            int64_t { INT64_MIN }, uint64_t { UINT64_MAX },
+                                            1.5F, 0.1, "hello"));
+    }
+    EXPECT_EQ(n_records * bfy_format_get_size(fmt), bfy_buffer_get_content_len(&buf));
+
+    // read them back split across pages of every small size
+    auto const bytes = buffer_copyout(&buf);
+    for (size_t page_len = 1; page_len <= 48; ++page_len) {
+        auto split = bfy_buffer_init();
+        for (size_t pos = 0; pos < std::size(bytes); pos += page_len) {
+            bfy_buffer_add_readonly(&split, std::data(bytes) + pos, std::min(page_len, std::size(bytes) - pos));
+        }
+        for (size_t i = 0; i < n_records; ++i) {
+            auto c = char {};
+            auto b = int8_t {};
+            auto B = uint8_t {};
+            auto h = int16_t {};
+            auto H = uint16_t {};
+            auto i32 = int32_t {};
+            auto I = uint32_t {};
+            auto q = int64_t {};
+            auto Q = uint64_t {};
+            auto f = float {};
+            auto d = double {};
+            auto s = std::array<char, 5> {};
+            auto const ret = i % 2
+                ? bfy_buffer_unpack_format(&split, fmt, &c, &b, &B, &h, &H, &i32, &I, &q, &Q, &f, &d, std::data(s))
+                : bfy_buffer_unpack(&split, "!cbBhHiIqQfd5s", &c, &b, &B, &h, &H, &i32, &I, &q, &Q, &f, &d, std::data(s));
+            EXPECT_EQ(0, ret);
+            EXPECT_EQ('z', c);
+            EXPECT_EQ(-8, b);
+            EXPECT_EQ(200, B);
+            EXPECT_EQ(-1600, h);
+            EXPECT_EQ(60000, H);
+            EXPECT_EQ(-320000, i32);
+            EXPECT_EQ(4000000000, I);
+            EXPECT_EQ(INT64_MIN, q);
+            EXPECT_EQ(UINT64_MAX, Q);
+            EXPECT_EQ(1.5F, f);
+            EXPECT_EQ(0.1, d);
+            EXPECT_EQ(0, memcmp("hello", std::data(s), std::size(s)));
+        }
+        EXPECT_EQ(0, bfy_buffer_get_content_len(&split));
+        bfy_buffer_destruct(&split);
+    }
+
+    bfy_buffer_destruct(&buf);
+    bfy_format_free(fmt);
+}
+
+TEST(Buffer, pack_rejects_malformed_and_short) {
+    for (auto const* const format : { "!Z", "!3", "!H!", "99999999999999999999999B" }) {
+        errno = 0;
+        EXPECT_EQ(nullptr, bfy_format_new(format));
+        EXPECT_EQ(EINVAL, errno);
+    }
+
+    auto buf = bfy_buffer_init();
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_pack(&buf, "!HZ", uint16_t { 1 }));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ(0, bfy_buffer_get_content_len(&buf));
+
+    // a short record is left in the buffer
+    bfy_buffer_add_hton_u16(&buf, 1);
+    auto H = uint16_t {};
+    auto I = uint32_t {};
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_unpack(&buf, "!HI", &H, &I));
+    EXPECT_EQ(ENOMSG, errno);
+    EXPECT_EQ(2, bfy_buffer_get_content_len(&buf));
+    EXPECT_EQ(0, bfy_buffer_unpack(&buf, "! H", &H));
+    EXPECT_EQ(1, H);
+    bfy_buffer_destruct(&buf);
+}
+
 TEST(Buffer, add_buffer) {
     auto a = BufferWithReadonlyStrings {};
     auto b = BufferWithReadonlyStrings {};
@@ -1083,6 +1606,212 @@ TEST(Buffer, commit_space) {
     bfy_buffer_destruct(&buf);
 }
 
+TEST(Buffer, writer_matches_buffer_adds) {
+    auto expected = bfy_buffer_init();
+    auto buf = bfy_buffer_init();
+    auto n_changes = size_t {};
+    auto const changed_cb = [](auto* /*buf*/, auto const* /*info*/, void* data) {
+        ++*reinterpret_cast<size_t*>(data);
+    };
+    bfy_buffer_set_changed_cb(&buf, changed_cb, &n_changes);
+
+    // compose a message from many small fields
+    auto constexpr str = std::string_view { "Lorem ipsum dolor sit amet" };
+    auto w = bfy_writer_init(&buf);
+    EXPECT_EQ(0, bfy_writer_add(&w, std::data(str), 0));
+    for (uint32_t i = 0; i < 10; ++i) {
+        EXPECT_EQ(0, bfy_writer_add_ch(&w, char('a' + i)));
+        EXPECT_EQ(0, bfy_writer_add_hton_u16(&w, uint16_t(0x0102 * i)));
+        EXPECT_EQ(0, bfy_writer_add_hton_u32(&w, 0x01020304 * i));
+        EXPECT_EQ(0, bfy_writer_add_hton_u64(&w, 0x0102030405060708 * i));
+        EXPECT_EQ(0, bfy_writer_add_le_u16(&w, uint16_t(0x0102 * i)));
+        EXPECT_EQ(0, bfy_writer_add_le_u32(&w, 0x01020304 * i));
+        EXPECT_EQ(0, bfy_writer_add_le_u64(&w, 0x0102030405060708 * i));
+        EXPECT_EQ(0, bfy_writer_add(&w, std::data(str), std::size(str)));
+        bfy_buffer_add_ch(&expected, char('a' + i));
+        bfy_buffer_add_hton_u16(&expected, uint16_t(0x0102 * i));
+        bfy_buffer_add_hton_u32(&expected, 0x01020304 * i);
+        bfy_buffer_add_hton_u64(&expected, 0x0102030405060708 * i);
+        bfy_buffer_add_le_u16(&expected, uint16_t(0x0102 * i));
+        bfy_buffer_add_le_u32(&expected, 0x01020304 * i);
+        bfy_buffer_add_le_u64(&expected, 0x0102030405060708 * i);
+        bfy_buffer_add(&expected, std::data(str), std::size(str));
+    }
+
+    // nothing is visible until the writer is flushed
+    EXPECT_EQ(0, bfy_buffer_get_content_len(&buf));
+    EXPECT_EQ(0, n_changes);
+    EXPECT_EQ(0, bfy_writer_flush(&w));
+    EXPECT_EQ(1, n_changes);
+    EXPECT_EQ(buffer_copyout(&expected), buffer_copyout(&buf));
+
+    // the writer keeps working after a flush
+    EXPECT_EQ(0, bfy_writer_add_ch(&w, 'z'));
+    bfy_writer_destruct(&w);
+    EXPECT_EQ(2, n_changes);
+    EXPECT_EQ(bfy_buffer_get_content_len(&expected) + 1, bfy_buffer_get_content_len(&buf));
+
+    bfy_buffer_destruct(&expected);
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, writer_outgrows_unmanaged_space) {
+    BufferWithLocalArray<16> local;
+    auto constexpr str = std::string_view { "Lorem ipsum dolor sit amet" };
+    auto constexpr n = 100;
+
+    auto w = bfy_writer_init(&local.buf);
+    for (int i = 0; i < n; ++i) {
+        EXPECT_EQ(0, bfy_writer_add(&w, std::data(str), std::size(str)));
+    }
+    bfy_writer_destruct(&w);
+
+    auto expected = std::string {};
+    for (int i = 0; i < n; ++i) {
+        expected += str;
+    }
+    EXPECT_EQ(expected, buffer_remove_string(&local.buf));
+}
+
+TEST(Buffer, cpp_writer_iterator) {
+    static_assert(std::output_iterator<bfy::buffer_writer::iterator, char>);
+
+    // outgrow the local array so the iterator has to move to new pages
+    BufferWithLocalArray<16> local;
+    auto constexpr str = std::string_view { "Lorem ipsum dolor sit amet" };
+    auto constexpr n = 100;
+    auto expected = std::string {};
+    {
+        auto w = bfy::buffer_writer { &local.buf };
+        w.write(std::data(str), 0);
+        auto out = w.out();
+        for (int i = 0; i < n; ++i) {
+            out = std::copy(std::begin(str), std::end(str), out);
+            expected += str;
+        }
+        out = std::fill_n(out, 3, '!');
+        expected += "!!!";
+        EXPECT_EQ(0, w.flush());
+    }
+    EXPECT_GT(buffer_count_pages(&local.buf), 1);
+    EXPECT_EQ(expected, buffer_remove_string(&local.buf));
+
+#if defined(__cpp_lib_format)
+    EXPECT_EQ(0, bfy::format_to(&local.buf, "{}-{:x}-{}", 42, 255, "abc"));
+    EXPECT_EQ("42-ff-abc", buffer_remove_string(&local.buf));
+#endif
+
+#if defined(BFY_HAVE_FMT)
+    // fmt::format_to() copies the iterator around too
+    BufferWithLocalArray<16> fmt_local;
+    {
+        auto w = bfy::buffer_writer { &fmt_local.buf };
+        for (int i = 0; i < n; ++i) {
+            fmt::format_to(w.out(), "GET /items/{}?page={} HTTP/1.1\r\n", i, i & 63);
+        }
+        EXPECT_EQ(0, w.flush());
+    }
+    expected.clear();
+    for (int i = 0; i < n; ++i) {
+        expected += "GET /items/" + std::to_string(i) + "?page=" + std::to_string(i & 63) + " HTTP/1.1\r\n";
+    }
+    EXPECT_GT(buffer_count_pages(&fmt_local.buf), 1);
+    EXPECT_EQ(expected, buffer_remove_string(&fmt_local.buf));
+#endif
+}
+
+TEST(Buffer, reader_reads_across_pages) {
+    // setup: write fields, then split them across small pages
+    auto buf = bfy_buffer_init();
+    auto constexpr str = std::string_view { "Lorem ipsum" };
+    auto constexpr n_msgs = 10;
+    auto w = bfy_writer_init(&buf);
+    for (uint32_t i = 0; i < n_msgs; ++i) {
+        bfy_writer_add_ch(&w, char('a' + i));
+        bfy_writer_add_hton_u16(&w, uint16_t(0x0102 * i));
+        bfy_writer_add_hton_u32(&w, 0x01020304 * i);
+        bfy_writer_add_hton_u64(&w, 0x0102030405060708 * i);
+        bfy_writer_add_le_u16(&w, uint16_t(0x0102 * i));
+        bfy_writer_add_le_u32(&w, 0x01020304 * i);
+        bfy_writer_add_le_u64(&w, 0x0102030405060708 * i);
+        bfy_writer_add(&w, std::data(str), std::size(str));
+    }
+    bfy_writer_destruct(&w);
+    auto const bytes = buffer_copyout(&buf);
+    bfy_buffer_destruct(&buf);
+
+    for (size_t page_len = 1; page_len <= 9; page_len += 4) {
+        auto split = bfy_buffer_init();
+        for (size_t pos = 0; pos < std::size(bytes); pos += page_len) {
+            bfy_buffer_add_readonly(&split, std::data(bytes) + pos, std::min(page_len, std::size(bytes) - pos));
+        }
+        auto n_changes = size_t {};
+        auto const changed_cb = [](auto* /*buf*/, auto const* /*info*/, void* data) {
+            ++*reinterpret_cast<size_t*>(data);
+        };
+        bfy_buffer_set_changed_cb(&split, changed_cb, &n_changes);
+
+        auto r = bfy_reader_init(&split);
+        for (uint32_t i = 0; i < n_msgs; ++i) {
+            auto u8 = uint8_t {};
+            auto u16 = uint16_t {};
+            auto u32 = uint32_t {};
+            auto u64 = uint64_t {};
+            auto chars = std::array<char, std::size(str)> {};
+            EXPECT_EQ(0, bfy_reader_read_u8(&r, &u8));
+            EXPECT_EQ('a' + i, u8);
+            EXPECT_EQ(0, bfy_reader_read_ntoh_u16(&r, &u16));
+            EXPECT_EQ(uint16_t(0x0102 * i), u16);
+            EXPECT_EQ(0, bfy_reader_read_ntoh_u32(&r, &u32));
+            EXPECT_EQ(0x01020304 * i, u32);
+            EXPECT_EQ(0, bfy_reader_read_ntoh_u64(&r, &u64));
+            EXPECT_EQ(0x0102030405060708 * i, u64);
+            EXPECT_EQ(0, bfy_reader_read_le_u16(&r, &u16));
+            EXPECT_EQ(uint16_t(0x0102 * i), u16);
+            EXPECT_EQ(0, bfy_reader_read_le_u32(&r, &u32));
+            EXPECT_EQ(0x01020304 * i, u32);
+            EXPECT_EQ(0, bfy_reader_read_le_u64(&r, &u64));
+            EXPECT_EQ(0x0102030405060708 * i, u64);
+            EXPECT_EQ(0, bfy_reader_read(&r, std::data(chars), std::size(chars)));
+            EXPECT_EQ(str, std::string_view(std::data(chars), std::size(chars)));
+        }
+
+        // nothing is drained until the reader is done
+        EXPECT_EQ(0, bfy_reader_get_content_len(&r));
+        EXPECT_EQ(std::size(bytes), bfy_buffer_get_content_len(&split));
+        EXPECT_EQ(0, n_changes);
+        bfy_reader_destruct(&r);
+        EXPECT_EQ(0, bfy_buffer_get_content_len(&split));
+        EXPECT_EQ(1, n_changes);
+
+        bfy_buffer_set_changed_cb(&split, nullptr, nullptr);
+        bfy_buffer_destruct(&split);
+    }
+}
+
+TEST(Buffer, reader_short_read_reads_nothing) {
+    BufferWithReadonlyStrings local;
+    auto const content_len = bfy_buffer_get_content_len(&local.buf);
+
+    auto r = bfy_reader_init(&local.buf);
+    auto ch = uint8_t {};
+    EXPECT_EQ(0, bfy_reader_read_u8(&r, &ch));
+    EXPECT_EQ(local.allstrs.front(), ch);
+    auto big = std::vector<char>(content_len);
+    errno = 0;
+    EXPECT_EQ(-1, bfy_reader_read(&r, std::data(big), std::size(big)));
+    EXPECT_EQ(ENOMSG, errno);
+    EXPECT_EQ(content_len - 1, bfy_reader_get_content_len(&r));
+    EXPECT_EQ(0, bfy_reader_read(&r, std::data(big), content_len - 1));
+    EXPECT_EQ(local.allstrs.substr(1), std::string_view(std::data(big), content_len - 1));
+    errno = 0;
+    EXPECT_EQ(-1, bfy_reader_read_u8(&r, &ch));
+    EXPECT_EQ(ENOMSG, errno);
+    bfy_reader_destruct(&r);
+
+    EXPECT_EQ(0, bfy_buffer_get_content_len(&local.buf));
+}
+
 TEST(Buffer, reset) {
     auto constexpr n_bytes = 64;
     auto array = std::array<char, n_bytes> {};
@@ -1171,6 +1900,104 @@ TEST(Buffer, add_reference_callback_reached_after_ownership_changed) {
     EXPECT_EQ(std::data(str), io.iov_base);
 }
 
+TEST(Buffer, readln_eol_styles) {
+    struct LineTest {
+        std::string_view content;
+        bfy_eol style;
+        std::string_view expected_line;
+        size_t expected_eol_len;
+    };
+    using namespace std::literals;
+    auto const tests = std::array<LineTest, 12> {{
+        { "one\ntwo\n"sv, BFY_EOL_LF, "one"sv, 1 },
+        { "one\r\ntwo\n"sv, BFY_EOL_LF, "one\r"sv, 1 },
+        { "one\r\ntwo\n"sv, BFY_EOL_CRLF, "one"sv, 2 },
+        { "one\ntwo\r\n"sv, BFY_EOL_CRLF, "one"sv, 1 },
+        { "one\ntwo\r\n"sv, BFY_EOL_CRLF_STRICT, "one\ntwo"sv, 2 },
+        { "one\rtwo\r\n"sv, BFY_EOL_CRLF_STRICT, "one\rtwo"sv, 2 },
+        { "one\0two"sv, BFY_EOL_NUL, "one"sv, 1 },
+        { "one\r\n\r\ntwo"sv, BFY_EOL_ANY, "one"sv, 4 },
+        { "one\rtwo"sv, BFY_EOL_ANY, "one"sv, 1 },
+        { "\ntwo"sv, BFY_EOL_ANY, ""sv, 1 },
+        { "one\r"sv, BFY_EOL_CRLF_STRICT, ""sv, 0 },
+        { "one"sv, BFY_EOL_LF, ""sv, 0 },
+    }};
+
+    for (auto const& test : tests) {
+        // one byte per page, so that every EOL crosses a page boundary
+        auto buf = bfy_buffer_init();
+        for (auto const& ch : test.content) {
+            bfy_buffer_add_readonly(&buf, &ch, 1);
+        }
+
+        auto line_len = size_t {};
+        auto eol_len = size_t {};
+        auto line = std::array<char, 64> {};
+        if (test.expected_eol_len == 0) {
+            errno = 0;
+            EXPECT_EQ(-1, bfy_buffer_peekln(&buf, test.style, &line_len, &eol_len));
+            EXPECT_EQ(ENOMSG, errno);
+            EXPECT_EQ(-1, bfy_buffer_readln(&buf, test.style, std::data(line), std::size(line), &line_len));
+            EXPECT_EQ(std::size(test.content), bfy_buffer_get_content_len(&buf));
+        } else {
+            EXPECT_EQ(0, bfy_buffer_peekln(&buf, test.style, &line_len, &eol_len));
+            EXPECT_EQ(std::size(test.expected_line), line_len);
+            EXPECT_EQ(test.expected_eol_len, eol_len);
+            EXPECT_EQ(0, bfy_buffer_readln(&buf, test.style, std::data(line), std::size(line), &line_len));
+            EXPECT_EQ(test.expected_line, std::string_view(std::data(line), line_len));
+            EXPECT_EQ(std::size(test.content) - line_len - eol_len, bfy_buffer_get_content_len(&buf));
+        }
+
+        bfy_buffer_destruct(&buf);
+    }
+}
+
+TEST(Buffer, readln_too_long) {
+    auto constexpr content = std::string_view { "Lorem ipsum\n" };
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add_readonly(&buf, std::data(content), std::size(content));
+
+    auto line = std::array<char, 4> {};
+    auto line_len = size_t {};
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_readln(&buf, BFY_EOL_LF, std::data(line), std::size(line), &line_len));
+    EXPECT_EQ(ENOBUFS, errno);
+    EXPECT_EQ(std::size(content) - 1, line_len);
+    EXPECT_EQ(std::size(content), bfy_buffer_get_content_len(&buf));
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, readln_string) {
+    auto constexpr one = std::string_view { "PING\r\n" };
+    auto constexpr two = std::string_view { "ECHO hello\r\n" };
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add(&buf, std::data(one), std::size(one));
+    bfy_buffer_add_readonly(&buf, std::data(two), std::size(two));
+
+    // the first line is all of a malloc'ed page, so the page is handed over
+    auto io = bfy_iovec {};
+    EXPECT_EQ(1, bfy_buffer_peek(&buf, 1, &io, 1));
+    auto len = size_t {};
+    auto* str = bfy_buffer_readln_string(&buf, BFY_EOL_CRLF, &len);
+    EXPECT_EQ(io.iov_base, str);
+    EXPECT_EQ("PING", std::string_view(str, len));
+    EXPECT_EQ('\0', str[len]);
+    free(str);
+
+    // the second line is readonly, so it gets copied
+    str = bfy_buffer_readln_string(&buf, BFY_EOL_CRLF, &len);
+    EXPECT_EQ("ECHO hello", std::string_view(str, len));
+    EXPECT_EQ('\0', str[len]);
+    free(str);
+
+    errno = 0;
+    EXPECT_EQ(nullptr, bfy_buffer_readln_string(&buf, BFY_EOL_CRLF, &len));
+    EXPECT_EQ(ENOMSG, errno);
+
+    bfy_buffer_destruct(&buf);
+}
+
 TEST(Buffer, search_not_present) {
     BufferWithReadonlyStrings local;
     auto constexpr expected_pos = size_t { 999 };
@@ -1320,45 +2147,789 @@ TEST(Buffer, search_very_long_buffer) {
     bfy_buffer_destruct(&buf);
 }
 
-TEST(Buffer, make_contiguous_fires_no_change_events) {
-    BufferWithReadonlyStrings local;
+TEST(Buffer, search_matches_naive_search) {
+    // small alphabet and tiny pages, so that there are lots
+    // of partial matches and lots of matches across page seams
+    auto rng = std::mt19937 {};
+    RandomPagedBuffer local { rng, "ab", 2000, { 7 } };
+
+    for (int i = 0; i < 500; ++i) {
+        auto const needle = random_string(rng, "ab", 1 + rng() % 12);
+        auto const begin = size_t { rng() % std::size(local.allstrs) };
+        auto const end = begin + rng() % (std::size(local.allstrs) - begin + 1);
+        auto const window = std::string_view { local.allstrs }.substr(0, end);
+        auto const expected = window.find(needle, begin);
+
+        auto pos = size_t {};
+        auto const ret = bfy_buffer_search_range(&local.buf, begin, end,
+                                                 std::data(needle), std::size(needle), &pos);
+        if (expected == std::string_view::npos) {
+            EXPECT_EQ(-1, ret) << needle << ' ' << begin << ' ' << end;
+        } else {
+            EXPECT_EQ(0, ret) << needle << ' ' << begin << ' ' << end;
+            EXPECT_EQ(expected, pos);
+        }
+    }
+}
 
-    local.start_listening_to_changes();
-    EXPECT_TRUE(bfy_buffer_make_all_contiguous(&local.buf));
-    EXPECT_EQ(0, std::size(local.changes));
+TEST(Buffer, search_at_every_offset) {
+    // walk the needle across the SIMD block boundaries and into the
+    // tail that's too short for a full block, with decoys that match
+    // the needle's first and last bytes but not its middle
+    auto constexpr needle = std::string_view { "x-marks-the-spot" };
+    auto constexpr decoy = std::string_view { "x-marks-the-sp-t" };
+
+    for (size_t len = std::size(needle); len < 100; ++len) {
+        for (size_t pos = 0; pos + std::size(needle) <= len; ++pos) {
+            auto haystack = std::string(len, 'x');
+            if (pos >= std::size(decoy)) {
+                haystack.replace(0, std::size(decoy), decoy);
+            }
+            haystack.replace(pos, std::size(needle), needle);
+
+            auto buf = bfy_buffer_init();
+            bfy_buffer_add_readonly(&buf, std::data(haystack), std::size(haystack));
+            auto match = size_t {};
+            EXPECT_EQ(0, bfy_buffer_search_all(&buf, std::data(needle), std::size(needle), &match));
+            EXPECT_EQ(pos, match);
+            EXPECT_EQ(-1, bfy_buffer_search(&buf, pos + std::size(needle) - 1,
+                                            std::data(needle), std::size(needle), &match));
+            bfy_buffer_destruct(&buf);
+        }
+    }
 }
 
-TEST(Buffer, change_event_add) {
-    BufferWithReadonlyStrings local;
-    auto constexpr str = std::string_view { "Lorem ipsum dolor sit amet" };
-    auto constexpr size = std::size(str);
-    auto const expected = bfy_changed_cb_info {
-        .orig_size = bfy_buffer_get_content_len(&local.buf),
-        .n_added = size,
-        .n_deleted = 0
-    };
+TEST(Buffer, rsearch_matches_naive_search) {
+    // like search_matches_naive_search, but with some pages
+    // big enough to be searched in place
+    auto rng = std::mt19937 {};
+    RandomPagedBuffer local { rng, "ab", 4000, { 300, 7 } };
+
+    for (int i = 0; i < 500; ++i) {
+        auto const needle = random_string(rng, "ab", 1 + rng() % 24);
+        auto const begin = size_t { rng() % std::size(local.allstrs) };
+        auto const end = begin + rng() % (std::size(local.allstrs) - begin + 1);
+        auto const window = std::string_view { local.allstrs }.substr(0, end);
+        auto expected = window.rfind(needle);
+        if (expected < begin) {
+            expected = std::string_view::npos;
+        }
 
-    local.start_listening_to_changes();
-    bfy_buffer_add(&local.buf, std::data(str), size);
-    EXPECT_EQ(1, std::size(local.changes));
-    EXPECT_EQ(expected, local.changes.front());
+        auto pos = size_t {};
+        auto const ret = bfy_buffer_rsearch_range(&local.buf, begin, end,
+                                                  std::data(needle), std::size(needle), &pos);
+        if (expected == std::string_view::npos) {
+            EXPECT_EQ(-1, ret) << needle << ' ' << begin << ' ' << end;
+        } else {
+            EXPECT_EQ(0, ret) << needle << ' ' << begin << ' ' << end;
+            EXPECT_EQ(expected, pos);
+        }
+    }
+
+    auto pos = size_t {};
+    EXPECT_EQ(0, bfy_buffer_rsearch_range(&local.buf, 10, 20, "", 0, &pos));
+    EXPECT_EQ(20, pos);
+    EXPECT_EQ(-1, bfy_buffer_rsearch_range(&local.buf, 20, 20, "", 0, &pos));
+}
+
+TEST(Buffer, rsearch_at_every_offset) {
+    auto constexpr needle = std::string_view { "x-marks-the-spot" };
+    auto constexpr decoy = std::string_view { "x-marks-the-sp-t" };
+
+    for (size_t len = std::size(needle); len < 100; ++len) {
+        for (size_t pos = 0; pos + std::size(needle) <= len; ++pos) {
+            auto haystack = std::string(len, 'x');
+            if (pos + std::size(needle) + std::size(decoy) <= len) {
+                haystack.replace(len - std::size(decoy), std::size(decoy), decoy);
+            }
+            haystack.replace(pos, std::size(needle), needle);
+
+            auto buf = bfy_buffer_init();
+            bfy_buffer_add_readonly(&buf, std::data(haystack), std::size(haystack));
+            auto match = size_t {};
+            EXPECT_EQ(0, bfy_buffer_rsearch_all(&buf, std::data(needle), std::size(needle), &match));
+            EXPECT_EQ(pos, match);
+            EXPECT_EQ(-1, bfy_buffer_rsearch_range(&buf, pos + 1, SIZE_MAX,
+                                                   std::data(needle), std::size(needle), &match));
+            bfy_buffer_destruct(&buf);
+        }
+    }
 }
 
-TEST(Buffer, change_event_add_buffer) {
-    BufferWithReadonlyStrings local;
-    BufferWithReadonlyStrings donor;
-    auto const expected = bfy_changed_cb_info {
-        .orig_size = bfy_buffer_get_content_len(&local.buf),
-        .n_added = bfy_buffer_get_content_len(&donor.buf),
-        .n_deleted = 0
-    };
+TEST(Buffer, rsearch_long_periodic_needle_across_pages) {
+    auto const needle = 'b' + std::string(500, 'a');
+    auto const allstrs = 'b' + std::string(5000, 'a');
+    auto buf = bfy_buffer_init();
+    for (size_t pos = 0; pos < std::size(allstrs); pos += 13) {
+        auto const len = std::min(size_t { 13 }, std::size(allstrs) - pos);
+        bfy_buffer_add_readonly(&buf, std::data(allstrs) + pos, len);
+    }
 
-    local.start_listening_to_changes();
-    EXPECT_EQ(0, bfy_buffer_add_buffer(&local.buf, &donor.buf));
-    EXPECT_EQ(changes_t{expected}, local.changes);
+    auto pos = size_t {};
+    EXPECT_EQ(0, bfy_buffer_rsearch_all(&buf, std::data(needle), std::size(needle), &pos));
+    EXPECT_EQ(0, pos);
+    EXPECT_EQ(-1, bfy_buffer_rsearch_range(&buf, 1, SIZE_MAX,
+                                           std::data(needle), std::size(needle), &pos));
+
+    bfy_buffer_destruct(&buf);
 }
 
-TEST(Buffer, change_event_add_ch) {
+TEST(Buffer, search_nocase_matches_naive_search) {
+    // include bytes that are 0x20 apart but aren't letters,
+    // since those must not be folded together
+    auto rng = std::mt19937 {};
+    auto tolower = [](std::string str) {
+        for (auto& ch : str) {
+            if (ch >= 'A' && ch <= 'Z') {
+                ch += 'a' - 'A';
+            }
+        }
+        return str;
+    };
+
+    RandomPagedBuffer local { rng, "aAbB@`[{", 4000, { 300, 7 } };
+    auto const lowered = tolower(local.allstrs);
+
+    for (int i = 0; i < 500; ++i) {
+        auto const needle = random_string(rng, "aAbB@`[{", 1 + rng() % 16);
+        auto const begin = size_t { rng() % std::size(local.allstrs) };
+        auto const end = begin + rng() % (std::size(local.allstrs) - begin + 1);
+        auto const window = std::string_view { lowered }.substr(0, end);
+        auto const expected = window.find(tolower(needle), begin);
+
+        auto pos = size_t {};
+        auto const ret = bfy_buffer_search_range_nocase(&local.buf, begin, end,
+                                                        std::data(needle), std::size(needle), &pos);
+        if (expected == std::string_view::npos) {
+            EXPECT_EQ(-1, ret) << needle << ' ' << begin << ' ' << end;
+        } else {
+            EXPECT_EQ(0, ret) << needle << ' ' << begin << ' ' << end;
+            EXPECT_EQ(expected, pos);
+        }
+    }
+}
+
+TEST(Buffer, search_nocase_header_across_pages) {
+    auto constexpr part1 = std::string_view { "HTTP/1.1 200 OK\r\nServer: x\r\nCONTENT-" };
+    auto constexpr part2 = std::string_view { "length: 42\r\n\r\n" };
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add_readonly(&buf, std::data(part1), std::size(part1));
+    bfy_buffer_add_readonly(&buf, std::data(part2), std::size(part2));
+
+    auto constexpr needle = std::string_view { "\r\nContent-Length:" };
+    auto* searcher = bfy_searcher_new_nocase(std::data(needle), std::size(needle));
+    auto pos = size_t {};
+    EXPECT_EQ(0, bfy_buffer_search_all_with(&buf, searcher, &pos));
+    EXPECT_EQ(26, pos);
+    EXPECT_EQ(-1, bfy_buffer_search_all(&buf, std::data(needle), std::size(needle), &pos));
+    bfy_searcher_free(searcher);
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, search_range_many) {
+    auto rng = std::mt19937 {};
+    RandomPagedBuffer local { rng, "ab", 4000, { 50 } };
+
+    for (auto const needle : { std::string_view { "aab" }, std::string_view { "aaa" }, std::string_view { "babba" } }) {
+        auto expected = std::vector<size_t> {};
+        for (auto pos = local.allstrs.find(needle); pos != std::string::npos; pos = local.allstrs.find(needle, pos + std::size(needle))) {
+            expected.push_back(pos);
+        }
+
+        // get the matches in small batches
+        auto const searcher = bfy_searcher_init(std::data(needle), std::size(needle));
+        auto matches = std::vector<size_t> {};
+        auto batch = std::array<size_t, 7> {};
+        size_t begin = 0;
+        for (;;) {
+            auto const n = bfy_buffer_search_range_many(&local.buf, begin, SIZE_MAX, &searcher,
+                                                        std::data(batch), std::size(batch));
+            matches.insert(std::end(matches), std::begin(batch), std::begin(batch) + n);
+            if (n < std::size(batch)) {
+                break;
+            }
+            begin = batch[n - 1] + std::size(needle);
+        }
+        EXPECT_EQ(expected, matches) << needle;
+    }
+}
+
+TEST(Buffer, search_long_periodic_needle_across_pages) {
+    // a needle longer than the pages, made of a byte that's
+    // everywhere in the buffer, with the real match at the end
+    auto const needle = std::string(500, 'a') + 'b';
+    auto const allstrs = std::string(5000, 'a') + 'b';
+    auto buf = bfy_buffer_init();
+    for (size_t pos = 0; pos < std::size(allstrs); pos += 13) {
+        auto const len = std::min(size_t { 13 }, std::size(allstrs) - pos);
+        bfy_buffer_add_readonly(&buf, std::data(allstrs) + pos, len);
+    }
+
+    auto pos = size_t {};
+    auto const expected_pos = std::size(allstrs) - std::size(needle);
+    EXPECT_EQ(0, bfy_buffer_search_all(&buf, std::data(needle), std::size(needle), &pos));
+    EXPECT_EQ(expected_pos, pos);
+    EXPECT_EQ(-1, bfy_buffer_search(&buf, std::size(allstrs) - 1,
+                                    std::data(needle), std::size(needle), &pos));
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, searcher_reused_across_buffers) {
+    auto constexpr needle = std::string_view { "\r\n\r\n" };
+    auto* searcher = bfy_searcher_new(std::data(needle), std::size(needle));
+    ASSERT_NE(nullptr, searcher);
+
+    BufferWithReadonlyStrings local;
+    auto pos = size_t {};
+    EXPECT_EQ(-1, bfy_buffer_search_all_with(&local.buf, searcher, &pos));
+
+    auto constexpr request = std::string_view { "GET / HTTP/1.1\r\nHost: example.com\r\n\r\nbody" };
+    for (size_t page_len = 1; page_len < std::size(request); ++page_len) {
+        auto buf = bfy_buffer_init();
+        for (size_t i = 0; i < std::size(request); i += page_len) {
+            bfy_buffer_add_readonly(&buf, std::data(request) + i,
+                                    std::min(page_len, std::size(request) - i));
+        }
+        EXPECT_EQ(0, bfy_buffer_search_all_with(&buf, searcher, &pos));
+        EXPECT_EQ(request.find(needle), pos);
+        EXPECT_EQ(-1, bfy_buffer_search_range_with(&buf, pos + 1, SIZE_MAX, searcher, &pos));
+        bfy_buffer_destruct(&buf);
+    }
+
+    bfy_searcher_free(searcher);
+}
+
+TEST(Buffer, searcher_init) {
+    BufferWithReadonlyStrings local;
+    auto const needle = std::string { local.allstrs.substr(std::size(str1) - 2, 5) };
+    auto searcher = bfy_searcher_init(std::data(needle), std::size(needle));
+
+    auto pos = size_t {};
+    EXPECT_EQ(0, bfy_buffer_search_all_with(&local.buf, &searcher, &pos));
+    EXPECT_EQ(std::size(str1) - 2, pos);
+
+    bfy_searcher_destruct(&searcher);
+}
+
+TEST(Buffer, search_resume_slow_drip) {
+    auto constexpr needle = std::string_view { "\r\n\r\n" };
+    auto constexpr requests = std::string_view {
+        "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n"
+        "GET /favicon.ico HTTP/1.1\r\nHost: example.com\r\n\r\n" };
+    auto searcher = bfy_searcher_init(std::data(needle), std::size(needle));
+    auto state = bfy_search_state_init();
+    auto buf = bfy_buffer_init();
+    auto n_found = size_t {};
+
+    // add one byte at a time, draining each request when it's complete
+    for (auto const ch : requests) {
+        EXPECT_EQ(0, bfy_buffer_add_ch(&buf, ch));
+        auto pos = size_t {};
+        if (bfy_buffer_search_resume(&buf, &state, &searcher, &pos) != 0) {
+            continue;
+        }
+        // the match isn't drained yet, so it's found again
+        auto const content_len = bfy_buffer_get_content_len(&buf);
+        EXPECT_EQ(content_len, pos + std::size(needle));
+        EXPECT_EQ(pos, bfy_buffer_drain(&buf, pos));
+        EXPECT_EQ(0, bfy_buffer_search_resume(&buf, &state, &searcher, &pos));
+        EXPECT_EQ(0, pos);
+
+        EXPECT_EQ(std::size(needle), bfy_buffer_drain_all(&buf));
+        ++n_found;
+    }
+
+    EXPECT_EQ(2, n_found);
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, search_resume_keeps_state_if_out_of_memory) {
+    // a needle this long needs a heap-allocated window
+    auto const needle = std::string(100, 'x');
+    auto const content = needle + std::string(300, 'y');
+    auto searcher = bfy_searcher_init(std::data(needle), std::size(needle));
+    auto state = bfy_search_state_init();
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_add(&buf, std::data(content), std::size(content)));
+
+    // a failed search isn't mistaken for a miss that moves the state forward
+    auto pos = size_t {};
+    bfy_set_allocator(&failable_allocator);
+    allocations_fail = true;
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_search_resume(&buf, &state, &searcher, &pos));
+    EXPECT_EQ(ENOMEM, errno);
+    allocations_fail = false;
+    bfy_set_allocator(&system_allocator);
+    EXPECT_EQ(0, bfy_buffer_search_resume(&buf, &state, &searcher, &pos));
+    EXPECT_EQ(0, pos);
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, search_resume_after_partial_drain) {
+    auto constexpr needle = std::string_view { "needle" };
+    auto searcher = bfy_searcher_init(std::data(needle), std::size(needle));
+    auto state = bfy_search_state_init();
+    auto buf = bfy_buffer_init();
+
+    auto pos = size_t {};
+    EXPECT_EQ(0, bfy_buffer_add(&buf, "haystack nee", 12));
+    EXPECT_EQ(-1, bfy_buffer_search_resume(&buf, &state, &searcher, &pos));
+    EXPECT_EQ(9, bfy_buffer_drain(&buf, 9));
+    EXPECT_EQ(-1, bfy_buffer_search_resume(&buf, &state, &searcher, &pos));
+    EXPECT_EQ(0, bfy_buffer_add(&buf, "dle", 3));
+    EXPECT_EQ(0, bfy_buffer_search_resume(&buf, &state, &searcher, &pos));
+    EXPECT_EQ(0, pos);
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, find_any_matches_find_first_of) {
+    auto rng = std::mt19937 {};
+    auto allstrs = std::string(2000, '\0');
+    for (auto& ch : allstrs) {
+        ch = static_cast<char>(rng() % 256);
+    }
+    auto buf = bfy_buffer_init();
+    for (size_t pos = 0; pos < std::size(allstrs); ) {
+        auto const len = std::min(size_t { 1 + rng() % 100 }, std::size(allstrs) - pos);
+        bfy_buffer_add_readonly(&buf, std::data(allstrs) + pos, len);
+        pos += len;
+    }
+
+    for (int i = 0; i < 500; ++i) {
+        // small sets mostly miss and large sets mostly hit,
+        // so test both find_any and find_not_any with a range of sizes
+        auto set = std::string(rng() % 250, '\0');
+        for (auto& ch : set) {
+            ch = static_cast<char>(rng() % 256);
+        }
+        auto const begin = size_t { rng() % std::size(allstrs) };
+        auto const end = begin + rng() % (std::size(allstrs) - begin + 1);
+        auto const window = std::string_view { allstrs }.substr(0, end);
+
+        auto pos = size_t {};
+        auto expected = window.find_first_of(set, begin);
+        auto ret = bfy_buffer_find_any(&buf, begin, end, std::data(set), std::size(set), &pos);
+        if (expected == std::string_view::npos) {
+            EXPECT_EQ(-1, ret);
+        } else {
+            EXPECT_EQ(0, ret);
+            EXPECT_EQ(expected, pos);
+        }
+
+        expected = window.find_first_not_of(set, begin);
+        ret = bfy_buffer_find_not_any(&buf, begin, end, std::data(set), std::size(set), &pos);
+        if (expected == std::string_view::npos) {
+            EXPECT_EQ(-1, ret);
+        } else {
+            EXPECT_EQ(0, ret);
+            EXPECT_EQ(expected, pos);
+        }
+    }
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, find_any_tokens) {
+    auto constexpr whitespace = std::string_view { " \t\r\n" };
+    auto constexpr digits = std::string_view { "0123456789" };
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add_readonly(&buf, "Content-Length:", 15);
+    bfy_buffer_add_readonly(&buf, " 12", 3);
+    bfy_buffer_add_readonly(&buf, "34\r\n", 4);
+
+    auto pos = size_t {};
+    EXPECT_EQ(0, bfy_buffer_find_any(&buf, 0, SIZE_MAX, std::data(whitespace), std::size(whitespace), &pos));
+    EXPECT_EQ(15, pos);
+    EXPECT_EQ(0, bfy_buffer_find_not_any(&buf, 16, SIZE_MAX, std::data(digits), std::size(digits), &pos));
+    EXPECT_EQ(20, pos);
+    EXPECT_EQ(-1, bfy_buffer_find_not_any(&buf, 16, 20, std::data(digits), std::size(digits), &pos));
+    EXPECT_EQ(-1, bfy_buffer_find_any(&buf, 0, SIZE_MAX, "", 0, &pos));
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, search_any_matches_naive_search) {
+    auto rng = std::mt19937 {};
+    RandomPagedBuffer local { rng, "abc", 1000, { 7 } };
+
+    for (int i = 0; i < 200; ++i) {
+        auto needles = std::vector<std::string>(1 + rng() % 6);
+        auto ptrs = std::vector<void const*>{};
+        auto lens = std::vector<size_t>{};
+        for (auto& needle : needles) {
+            needle = random_string(rng, "abc", 1 + rng() % 8);
+            ptrs.push_back(std::data(needle));
+            lens.push_back(std::size(needle));
+        }
+        auto* ms = bfy_multisearcher_new(std::data(ptrs), std::data(lens), std::size(needles));
+        ASSERT_NE(nullptr, ms);
+
+        auto const begin = size_t { rng() % std::size(local.allstrs) };
+        auto const end = begin + rng() % (std::size(local.allstrs) - begin + 1);
+        auto const window = std::string_view { local.allstrs }.substr(0, end);
+        auto expected_pos = std::string_view::npos;
+        auto expected_which = size_t {};
+        for (size_t j = 0; j < std::size(needles); ++j) {
+            auto const pos = window.find(needles[j], begin);
+            if (pos < expected_pos) {
+                expected_pos = pos;
+                expected_which = j;
+            }
+        }
+
+        auto pos = size_t {};
+        auto which = size_t {};
+        auto const ret = bfy_buffer_search_range_any(&local.buf, begin, end, ms, &pos, &which);
+        if (expected_pos == std::string_view::npos) {
+            EXPECT_EQ(-1, ret);
+        } else {
+            EXPECT_EQ(0, ret);
+            EXPECT_EQ(expected_pos, pos);
+            EXPECT_EQ(expected_which, which);
+        }
+
+        bfy_multisearcher_free(ms);
+    }
+}
+
+TEST(Buffer, search_any_prefers_earlier_start) {
+    // "bc" is found first, but "abcd" starts earlier
+    auto constexpr needles = std::array<std::string_view, 2> { "bc", "abcd" };
+    auto constexpr content = std::string_view { "xxabcdxx" };
+    auto ptrs = std::array<void const*, 2> { std::data(needles[0]), std::data(needles[1]) };
+    auto lens = std::array<size_t, 2> { std::size(needles[0]), std::size(needles[1]) };
+    auto* ms = bfy_multisearcher_new(std::data(ptrs), std::data(lens), std::size(needles));
+
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add_readonly(&buf, std::data(content), std::size(content));
+    auto pos = size_t {};
+    auto which = size_t {};
+    EXPECT_EQ(0, bfy_buffer_search_all_any(&buf, ms, &pos, &which));
+    EXPECT_EQ(2, pos);
+    EXPECT_EQ(1, which);
+    EXPECT_EQ(0, bfy_buffer_search_range_any(&buf, 3, SIZE_MAX, ms, &pos, &which));
+    EXPECT_EQ(3, pos);
+    EXPECT_EQ(0, which);
+
+    bfy_buffer_destruct(&buf);
+    bfy_multisearcher_free(ms);
+}
+
+TEST(Buffer, multisearcher_rejects_empty_needles) {
+    auto constexpr needle = std::string_view { "" };
+    void const* ptr = std::data(needle);
+    auto len = std::size(needle);
+
+    errno = 0;
+    EXPECT_EQ(nullptr, bfy_multisearcher_new(&ptr, &len, 1));
+    EXPECT_EQ(EINVAL, errno);
+
+    errno = 0;
+    EXPECT_EQ(nullptr, bfy_multisearcher_new(nullptr, nullptr, 0));
+    EXPECT_EQ(EINVAL, errno);
+}
+
+TEST(Buffer, search_regex_matches_naive_search) {
+    auto rng = std::mt19937 {};
+
+    // a random regex over "abc", and where its matches from `pos` can end
+    using ends_t = std::function<std::set<size_t>(std::string_view, size_t)>;
+    struct Pattern {
+        std::string str;
+        ends_t ends;
+    };
+    auto byte_set = [](std::string str, std::string_view bytes) {
+        return Pattern { str, [bytes](std::string_view text, size_t pos) {
+            auto ends = std::set<size_t> {};
+            if (pos < std::size(text) && bytes.find(text[pos]) != std::string_view::npos) {
+                ends.insert(pos + 1);
+            }
+            return ends;
+        }};
+    };
+    auto cat = [](Pattern a, Pattern b) {
+        return Pattern { a.str + b.str, [a, b](std::string_view text, size_t pos) {
+            auto ends = std::set<size_t> {};
+            for (auto const mid : a.ends(text, pos)) {
+                ends.merge(b.ends(text, mid));
+            }
+            return ends;
+        }};
+    };
+    auto alt = [](Pattern a, Pattern b) {
+        return Pattern { "(" + a.str + "|" + b.str + ")", [a, b](std::string_view text, size_t pos) {
+            auto ends = a.ends(text, pos);
+            ends.merge(b.ends(text, pos));
+            return ends;
+        }};
+    };
+    auto repeat = [](Pattern a, size_t min, size_t max, std::string suffix) {
+        return Pattern { "(" + a.str + ")" + suffix, [a, min, max](std::string_view text, size_t pos) {
+            auto ends = std::set<size_t> {};
+            auto cur = std::set<size_t> { pos };
+            for (size_t n = 0; !std::empty(cur); ++n) {
+                if (n >= min) {
+                    auto fresh = std::set<size_t> {};
+                    for (auto const end : cur) {
+                        if (ends.insert(end).second) {
+                            fresh.insert(end);
+                        }
+                    }
+                    cur = fresh;
+                }
+                if (n == max) {
+                    break;
+                }
+                auto next = std::set<size_t> {};
+                for (auto const mid : cur) {
+                    next.merge(a.ends(text, mid));
+                }
+                cur = next;
+            }
+            return ends;
+        }};
+    };
+    auto const bol = Pattern { "^", [](std::string_view, size_t pos) {
+        return pos == 0 ? std::set<size_t> { pos } : std::set<size_t> {};
+    }};
+    auto const eol = Pattern { "$", [](std::string_view text, size_t pos) {
+        return pos == std::size(text) ? std::set<size_t> { pos } : std::set<size_t> {};
+    }};
+
+    std::function<Pattern(int)> random_pattern = [&](int depth) {
+        auto pattern = Pattern { "", [](std::string_view, size_t pos) { return std::set<size_t> { pos }; } };
+        for (size_t i = 0, n = 1 + rng() % 2; i < n; ++i) {
+            auto part = Pattern {};
+            switch (depth > 0 ? rng() % 9 : rng() % 6) {
+            case 0: pattern = cat(pattern, bol); continue;
+            case 1: pattern = cat(pattern, eol); continue;
+            case 2: part = byte_set(".", "abc"); break;
+            case 3: part = byte_set("[ab]", "ab"); break;
+            case 4: part = byte_set("[^a]", "bc"); break;
+            case 5: part = byte_set("\\x63", "c"); break;
+            case 6: part = alt(random_pattern(depth - 1), random_pattern(depth - 1)); break;
+            default: part = random_pattern(depth - 1); part.str = "(?:" + part.str + ")"; break;
+            }
+            switch (rng() % 8) {
+            case 0: part = repeat(part, 0, SIZE_MAX, "*"); break;
+            case 1: part = repeat(part, 1, SIZE_MAX, "+"); break;
+            case 2: part = repeat(part, 0, 1, "?"); break;
+            case 3: part = repeat(part, 2, 2, "{2}"); break;
+            case 4: part = repeat(part, 1, 3, "{1,3}"); break;
+            case 5: part = repeat(part, 2, SIZE_MAX, "{2,}"); break;
+            default: break;
+            }
+            pattern = cat(pattern, part);
+        }
+        for (auto const ch : random_string(rng, "abc", rng() % 3)) {
+            pattern = cat(pattern, byte_set(std::string(1, ch), ch == 'a' ? "a" : ch == 'b' ? "b" : "c"));
+        }
+        return pattern;
+    };
+
+    RandomPagedBuffer local { rng, "abc", 300, { 7 } };
+
+    for (int i = 0; i < 500; ++i) {
+        auto const pattern = random_pattern(2);
+        errno = 0;
+        auto* re = bfy_regex_new(std::data(pattern.str), std::size(pattern.str));
+        if (re == nullptr) {  // its DFA would be too big
+            EXPECT_EQ(ENOMEM, errno) << pattern.str;
+            continue;
+        }
+
+        // leftmost-longest. An empty range never matches.
+        auto const begin = size_t { rng() % std::size(local.allstrs) };
+        auto const end = begin + rng() % (std::size(local.allstrs) - begin + 1);
+        auto const text = std::string_view { local.allstrs }.substr(begin, end - begin);
+        auto expected_pos = std::string_view::npos;
+        auto expected_len = size_t {};
+        for (size_t pos = 0; !std::empty(text) && pos <= std::size(text) && expected_pos == std::string_view::npos; ++pos) {
+            auto const ends = pattern.ends(text, pos);
+            if (!std::empty(ends)) {
+                expected_pos = begin + pos;
+                expected_len = *ends.rbegin() - pos;
+            }
+        }
+
+        auto pos = size_t {};
+        auto len = size_t {};
+        auto const ret = bfy_buffer_search_range_regex(&local.buf, begin, end, re, &pos, &len);
+        if (expected_pos == std::string_view::npos) {
+            EXPECT_EQ(-1, ret) << pattern.str;
+        } else {
+            EXPECT_EQ(0, ret) << pattern.str;
+            EXPECT_EQ(expected_pos, pos) << pattern.str;
+            EXPECT_EQ(expected_len, len) << pattern.str;
+        }
+
+        bfy_regex_free(re);
+    }
+}
+
+TEST(Buffer, search_regex_across_pages) {
+    auto constexpr pages = std::array<std::string_view, 4> {
+        "GET /index.html HTTP/1.1\r\nHost: exa", "mple.com\r\nContent-Le",
+        "ngth: 1", "234\r\n\r\n"
+    };
+    auto buf = bfy_buffer_init();
+    for (auto const page : pages) {
+        bfy_buffer_add_readonly(&buf, std::data(page), std::size(page));
+    }
+
+    auto constexpr pattern = std::string_view { "content-length: *\\d+" };
+    auto constexpr nocase_pattern = std::string_view { "[Cc]ontent-[Ll]ength: *(\\d+)\\r\\n" };
+    auto* re = bfy_regex_new(std::data(pattern), std::size(pattern));
+    auto* nocase_re = bfy_regex_new(std::data(nocase_pattern), std::size(nocase_pattern));
+    ASSERT_NE(nullptr, re);
+    ASSERT_NE(nullptr, nocase_re);
+
+    auto pos = size_t {};
+    auto len = size_t {};
+    EXPECT_EQ(-1, bfy_buffer_search_all_regex(&buf, re, &pos, &len));
+    EXPECT_EQ(0, bfy_buffer_search_all_regex(&buf, nocase_re, &pos, &len));
+    EXPECT_EQ(45, pos);
+    EXPECT_EQ(22, len);
+
+    // a range that cuts the number short
+    EXPECT_EQ(-1, bfy_buffer_search_range_regex(&buf, 0, 65, nocase_re, &pos, &len));
+
+    bfy_regex_free(nocase_re);
+    bfy_regex_free(re);
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, search_regex_anchors_match_range_edges) {
+    auto constexpr content = std::string_view { "key=value;key2=value2" };
+    auto buf = bfy_buffer_init();
+    bfy_buffer_add_readonly(&buf, std::data(content), std::size(content));
+
+    auto constexpr pattern = std::string_view { "^\\w+=[^;]*$" };
+    auto* re = bfy_regex_new(std::data(pattern), std::size(pattern));
+    ASSERT_NE(nullptr, re);
+
+    auto pos = size_t {};
+    auto len = size_t {};
+    EXPECT_EQ(-1, bfy_buffer_search_all_regex(&buf, re, &pos, &len));
+    EXPECT_EQ(0, bfy_buffer_search_range_regex(&buf, 0, 9, re, &pos, &len));
+    EXPECT_EQ(0, pos);
+    EXPECT_EQ(9, len);
+    EXPECT_EQ(0, bfy_buffer_search_range_regex(&buf, 10, SIZE_MAX, re, &pos, &len));
+    EXPECT_EQ(10, pos);
+    EXPECT_EQ(11, len);
+    EXPECT_EQ(-1, bfy_buffer_search_range_regex(&buf, 9, SIZE_MAX, re, &pos, &len));
+
+    bfy_regex_free(re);
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, search_regex_fallback_stops_at_the_match) {
+#if !defined(HAVE_MMAN)
+    GTEST_SKIP() << "needs mmap() for a guard page";
+#else
+    // every try from the x's fails only at the 'z', so trying each
+    // start in turn looks at too many bytes and the search falls back.
+    // The fallback must not read past the match: the rest of the
+    // range is a page that can't be read.
+    auto const page_size = size_t(sysconf(_SC_PAGESIZE));
+    auto* const guard = mmap(nullptr, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(MAP_FAILED, guard);
+    auto const content = std::string(2000, 'x') + "zq";
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_add_readonly(&buf, std::data(content), std::size(content)));
+    EXPECT_EQ(0, bfy_buffer_add_readonly(&buf, guard, page_size));
+
+    auto constexpr pattern = std::string_view { "x*y|z" };
+    auto* re = bfy_regex_new(std::data(pattern), std::size(pattern));
+    ASSERT_NE(nullptr, re);
+    auto pos = size_t {};
+    auto len = size_t {};
+    EXPECT_EQ(0, bfy_buffer_search_all_regex(&buf, re, &pos, &len));
+    EXPECT_EQ(2000, pos);
+    EXPECT_EQ(1, len);
+
+    bfy_regex_free(re);
+    bfy_buffer_destruct(&buf);
+    munmap(guard, page_size);
+#endif
+}
+
+TEST(Buffer, regex_rejects_bad_patterns) {
+    auto constexpr patterns = std::array<std::string_view, 11> {
+        "(", "a)", "[a", "*a", "a{2,1}", "a{1001}", "\\", "\\q", "\\1", "[b-a]", "\\xg0"
+    };
+    for (auto const pattern : patterns) {
+        errno = 0;
+        EXPECT_EQ(nullptr, bfy_regex_new(std::data(pattern), std::size(pattern))) << pattern;
+        EXPECT_EQ(EINVAL, errno) << pattern;
+    }
+
+    // nested too deeply
+    auto const deep = std::string(201, '(') + 'a' + std::string(201, ')');
+    errno = 0;
+    EXPECT_EQ(nullptr, bfy_regex_new(std::data(deep), std::size(deep)));
+    EXPECT_EQ(EINVAL, errno);
+
+    // too many states
+    auto constexpr huge = std::string_view { "(a{1000}){1000}" };
+    errno = 0;
+    EXPECT_EQ(nullptr, bfy_regex_new(std::data(huge), std::size(huge)));
+    EXPECT_EQ(ENOMEM, errno);
+
+    // small enough to parse, but its DFA sets would take gigabytes
+    for (auto const nested : { std::string_view { "(a{100}){100}" }, std::string_view { "(a{200}){100}" } }) {
+        auto const begin = std::chrono::steady_clock::now();
+        errno = 0;
+        EXPECT_EQ(nullptr, bfy_regex_new(std::data(nested), std::size(nested)));
+        EXPECT_EQ(ENOMEM, errno);
+        EXPECT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds { 5 });
+    }
+}
+
+TEST(Buffer, make_contiguous_fires_no_change_events) {
+    BufferWithReadonlyStrings local;
+
+    local.start_listening_to_changes();
+    EXPECT_TRUE(bfy_buffer_make_all_contiguous(&local.buf));
+    EXPECT_EQ(0, std::size(local.changes));
+}
+
+TEST(Buffer, change_event_add) {
+    BufferWithReadonlyStrings local;
+    auto constexpr str = std::string_view { "Lorem ipsum dolor sit amet" };
+    auto constexpr size = std::size(str);
+    auto const expected = bfy_changed_cb_info {
+        .orig_size = bfy_buffer_get_content_len(&local.buf),
+        .n_added = size,
+        .n_deleted = 0
+    };
+
+    local.start_listening_to_changes();
+    bfy_buffer_add(&local.buf, std::data(str), size);
+    EXPECT_EQ(1, std::size(local.changes));
+    EXPECT_EQ(expected, local.changes.front());
+}
+
+TEST(Buffer, change_event_add_buffer) {
+    BufferWithReadonlyStrings local;
+    BufferWithReadonlyStrings donor;
+    auto const expected = bfy_changed_cb_info {
+        .orig_size = bfy_buffer_get_content_len(&local.buf),
+        .n_added = bfy_buffer_get_content_len(&donor.buf),
+        .n_deleted = 0
+    };
+
+    local.start_listening_to_changes();
+    EXPECT_EQ(0, bfy_buffer_add_buffer(&local.buf, &donor.buf));
+    EXPECT_EQ(changes_t{expected}, local.changes);
+}
+
+TEST(Buffer, change_event_add_ch) {
     BufferWithReadonlyStrings local;
     auto const expected = bfy_changed_cb_info {
         .orig_size = bfy_buffer_get_content_len(&local.buf),
@@ -1624,3 +3195,592 @@ TEST(Buffer, change_event_coalesce) {
     bfy_buffer_end_coalescing_change_events(&local.buf);
     EXPECT_EQ(changes_t{expected}, local.changes);
 }
+
+TEST(Buffer, change_event_deferred) {
+    BufferWithReadonlyStrings local;
+    auto constexpr str = std::string_view { "Lorem ipsum dolor sit amet" };
+    auto const orig_size = bfy_buffer_get_content_len(&local.buf);
+    auto const expected = bfy_changed_cb_info {
+        .orig_size = orig_size,
+        .n_added = std::size(str),
+        .n_deleted = 1
+    };
+
+    auto n_wakeups = size_t {};
+    auto const wakeup_cb = [](auto* /*queue*/, void* data) {
+        ++*reinterpret_cast<size_t*>(data);
+    };
+    auto queue = bfy_deferred_queue_init();
+    bfy_deferred_queue_set_wakeup_cb(&queue, wakeup_cb, &n_wakeups);
+
+    local.start_listening_to_changes();
+    bfy_buffer_defer_callbacks(&local.buf, &queue);
+    EXPECT_EQ(0, bfy_buffer_add_readonly(&local.buf, std::data(str), std::size(str)));
+    EXPECT_EQ(1, bfy_buffer_drain(&local.buf, 1));
+    EXPECT_EQ(0, std::size(local.changes));
+    EXPECT_EQ(1, n_wakeups);
+
+    // all the changes are folded into a single callback
+    EXPECT_EQ(1, bfy_run_deferred_callbacks(&queue));
+    EXPECT_EQ(changes_t{expected}, local.changes);
+    EXPECT_EQ(0, bfy_run_deferred_callbacks(&queue));
+
+    // the next change wakes the queue up again
+    EXPECT_EQ(1, bfy_buffer_drain(&local.buf, 1));
+    EXPECT_EQ(2, n_wakeups);
+
+    bfy_deferred_queue_destruct(&queue);
+    EXPECT_EQ(2, std::size(local.changes));
+    bfy_buffer_defer_callbacks(&local.buf, nullptr);
+}
+
+TEST(Buffer, change_event_deferred_reentrant) {
+    auto buf = bfy_buffer_init();
+    auto queue = bfy_deferred_queue_init();
+    auto n_calls = size_t {};
+    auto const changed_cb = [](auto* changed_buf, auto const* /*info*/, void* data) {
+        ++*reinterpret_cast<size_t*>(data);
+        bfy_buffer_add_ch(changed_buf, 'x');
+    };
+    bfy_buffer_set_changed_cb(&buf, changed_cb, &n_calls);
+    bfy_buffer_defer_callbacks(&buf, &queue);
+
+    // a callback that changes its own buffer queues the
+    // buffer for the next run instead of looping
+    EXPECT_EQ(0, bfy_buffer_add_ch(&buf, 'x'));
+    EXPECT_EQ(1, bfy_run_deferred_callbacks(&queue));
+    EXPECT_EQ(1, n_calls);
+    EXPECT_EQ(1, bfy_run_deferred_callbacks(&queue));
+    EXPECT_EQ(2, n_calls);
+    EXPECT_EQ(3, bfy_buffer_get_content_len(&buf));
+
+    // destructing a buffer removes it from the queue
+    bfy_buffer_set_changed_cb(&buf, nullptr, nullptr);
+    bfy_buffer_destruct(&buf);
+    EXPECT_EQ(0, bfy_run_deferred_callbacks(&queue));
+    bfy_deferred_queue_destruct(&queue);
+}
+
+TEST(Buffer, change_event_deferred_callback_removes_others) {
+    struct Context {
+        bfy_buffer* a;
+        bfy_buffer* b;
+        bfy_buffer* c;
+        bfy_buffer* d;
+        std::vector<bfy_buffer*> called;
+    };
+    auto ctx = Context {
+        .a = bfy_buffer_new(),
+        .b = bfy_buffer_new(),
+        .c = bfy_buffer_new(),
+        .d = bfy_buffer_new(),
+        .called = {}
+    };
+    auto const changed_cb = [](auto* changed_buf, auto const* /*info*/, void* data) {
+        auto* self = reinterpret_cast<Context*>(data);
+        self->called.push_back(changed_buf);
+        if (changed_buf == self->a) {
+            // b and c are still waiting in the same batch as a
+            bfy_buffer_set_changed_cb(self->b, nullptr, nullptr);
+            bfy_buffer_free(self->b);
+            self->b = nullptr;
+            bfy_buffer_defer_callbacks(self->c, nullptr);
+        }
+    };
+
+    auto queue = bfy_deferred_queue_init();
+    for (auto* buf : { ctx.a, ctx.b, ctx.c, ctx.d }) {
+        bfy_buffer_set_changed_cb(buf, changed_cb, &ctx);
+        bfy_buffer_defer_callbacks(buf, &queue);
+        EXPECT_EQ(0, bfy_buffer_add_ch(buf, 'x'));
+    }
+
+    // c fires when it's un-deferred, not from the queue,
+    // and removing b and c doesn't cut d out of the batch
+    EXPECT_EQ(2, bfy_run_deferred_callbacks(&queue));
+    EXPECT_EQ((std::vector<bfy_buffer*>{ ctx.a, ctx.c, ctx.d }), ctx.called);
+    EXPECT_EQ(0, bfy_run_deferred_callbacks(&queue));
+
+    // c is back to immediate callbacks
+    EXPECT_EQ(0, bfy_buffer_add_ch(ctx.c, 'x'));
+    EXPECT_EQ((std::vector<bfy_buffer*>{ ctx.a, ctx.c, ctx.d, ctx.c }), ctx.called);
+
+    for (auto* buf : { ctx.a, ctx.c, ctx.d }) {
+        bfy_buffer_set_changed_cb(buf, nullptr, nullptr);
+        bfy_buffer_free(buf);
+    }
+    bfy_deferred_queue_destruct(&queue);
+}
+
+TEST(Buffer, change_event_deferred_to_immediate) {
+    BufferWithReadonlyStrings local;
+    auto const orig_size = bfy_buffer_get_content_len(&local.buf);
+    auto queue = bfy_deferred_queue_init();
+
+    local.start_listening_to_changes();
+    bfy_buffer_defer_callbacks(&local.buf, &queue);
+    EXPECT_EQ(1, bfy_buffer_drain(&local.buf, 1));
+    EXPECT_EQ(0, std::size(local.changes));
+
+    // going back to immediate mode fires the pending change
+    bfy_buffer_defer_callbacks(&local.buf, nullptr);
+    auto const expected = bfy_changed_cb_info {
+        .orig_size = orig_size,
+        .n_added = 0,
+        .n_deleted = 1
+    };
+    EXPECT_EQ(changes_t{expected}, local.changes);
+    EXPECT_EQ(0, bfy_run_deferred_callbacks(&queue));
+    bfy_deferred_queue_destruct(&queue);
+}
+
+TEST(Pagequeue, add_and_remove_buffer) {
+    auto queue = bfy_pagequeue_init();
+    BufferWithReadonlyStrings a;
+    BufferWithReadonlyStrings b;
+    auto const expected = a.allstrs + b.allstrs;
+
+    EXPECT_EQ(0, bfy_pagequeue_add_buffer(&queue, &a.buf));
+    EXPECT_EQ(0, bfy_pagequeue_add_buffer(&queue, &b.buf));
+    EXPECT_EQ(0, bfy_buffer_get_content_len(&a.buf));
+    EXPECT_EQ(0, bfy_buffer_get_content_len(&b.buf));
+
+    auto tgt = bfy_buffer_init();
+    EXPECT_EQ(std::size(expected), bfy_pagequeue_remove_buffer(&queue, &tgt));
+    EXPECT_EQ(expected, buffer_remove_string(&tgt));
+    EXPECT_EQ(0, bfy_pagequeue_remove_buffer(&queue, &tgt));
+
+    bfy_buffer_destruct(&tgt);
+    bfy_pagequeue_destruct(&queue);
+}
+
+TEST(Pagequeue, remove_buffer_keeps_content_queued_if_out_of_memory) {
+    bfy_set_allocator(&failable_allocator);
+    auto queue = bfy_pagequeue_init();
+    BufferWithReadonlyStrings a;
+    BufferWithReadonlyStrings b;
+    auto const expected = a.allstrs + b.allstrs;
+    EXPECT_EQ(0, bfy_pagequeue_add_buffer(&queue, &a.buf));
+    EXPECT_EQ(0, bfy_pagequeue_add_buffer(&queue, &b.buf));
+
+    // nothing can be moved, so nothing should be lost
+    auto tgt = bfy_buffer_init();
+    allocations_fail = true;
+    EXPECT_EQ(0, bfy_pagequeue_remove_buffer(&queue, &tgt));
+    allocations_fail = false;
+    EXPECT_EQ(0, bfy_buffer_get_content_len(&tgt));
+
+    // content queued in the meantime still comes out after it
+    BufferWithReadonlyStrings c;
+    EXPECT_EQ(0, bfy_pagequeue_add_buffer(&queue, &c.buf));
+    EXPECT_EQ(std::size(expected + c.allstrs), bfy_pagequeue_remove_buffer(&queue, &tgt));
+    EXPECT_EQ(expected + c.allstrs, buffer_remove_string(&tgt));
+
+    bfy_buffer_destruct(&tgt);
+    bfy_pagequeue_destruct(&queue);
+    bfy_set_allocator(&system_allocator);
+}
+
+TEST(Pagequeue, add_keeps_empty_pages_for_reuse) {
+    auto queue = bfy_pagequeue_init();
+    auto src = bfy_buffer_init();
+    auto constexpr str = std::string_view { "Lorem ipsum dolor sit amet" };
+
+    EXPECT_EQ(0, bfy_buffer_add(&src, std::data(str), std::size(str)));
+    EXPECT_EQ(0, bfy_pagequeue_add_buffer(&queue, &src));
+    EXPECT_EQ(0, bfy_buffer_get_content_len(&src));
+    EXPECT_EQ(0, bfy_buffer_add(&src, std::data(str), std::size(str)));
+    EXPECT_EQ(0, bfy_pagequeue_add_buffer(&queue, &src));
+
+    // confirm that queued pages are released by the queue's destructor
+    bfy_pagequeue_destruct(&queue);
+    bfy_buffer_destruct(&src);
+}
+
+TEST(Pagequeue, remove_fires_one_change_event) {
+    auto* queue = bfy_pagequeue_new();
+    BufferWithReadonlyStrings tgt;
+    auto constexpr n_producers = 3;
+    auto expected = bfy_changed_cb_info {
+        .orig_size = bfy_buffer_get_content_len(&tgt.buf),
+        .n_added = 0,
+        .n_deleted = 0
+    };
+    for (int i = 0; i < n_producers; ++i) {
+        BufferWithReadonlyStrings src;
+        expected.n_added += bfy_buffer_get_content_len(&src.buf);
+        EXPECT_EQ(0, bfy_pagequeue_add_buffer(queue, &src.buf));
+    }
+
+    tgt.start_listening_to_changes();
+    EXPECT_EQ(expected.n_added, bfy_pagequeue_remove_buffer(queue, &tgt.buf));
+    EXPECT_EQ(changes_t{expected}, tgt.changes);
+    bfy_pagequeue_free(queue);
+}
+
+TEST(Pagequeue, many_producers) {
+    auto queue = bfy_pagequeue_init();
+    auto constexpr n_producers = 8;
+    auto constexpr n_messages = 1000;
+
+    auto producers = std::vector<std::thread>{};
+    for (int i = 0; i < n_producers; ++i) {
+        producers.emplace_back([&queue, i]() {
+            auto src = bfy_buffer_init();
+            for (int j = 0; j < n_messages; ++j) {
+                bfy_buffer_add_hton_u32(&src, uint32_t(i));
+                bfy_buffer_add_hton_u32(&src, uint32_t(j));
+                EXPECT_EQ(0, bfy_pagequeue_add_buffer(&queue, &src));
+            }
+            bfy_buffer_destruct(&src);
+        });
+    }
+
+    // consume while the producers are still running
+    auto constexpr message_len = sizeof(uint32_t) * 2;
+    auto tgt = bfy_buffer_init();
+    auto next = std::array<uint32_t, n_producers>{};
+    auto n_consumed = size_t{};
+    while (n_consumed < n_producers * n_messages) {
+        bfy_pagequeue_remove_buffer(&queue, &tgt);
+        while (bfy_buffer_get_content_len(&tgt) >= message_len) {
+            auto const producer = bfy_buffer_remove_ntoh_u32(&tgt);
+            auto const message = bfy_buffer_remove_ntoh_u32(&tgt);
+            ASSERT_LT(producer, n_producers);
+            EXPECT_EQ(next[producer]++, message);
+            ++n_consumed;
+        }
+    }
+
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    EXPECT_EQ(0, bfy_pagequeue_remove_buffer(&queue, &tgt));
+    bfy_buffer_destruct(&tgt);
+    bfy_pagequeue_destruct(&queue);
+}
+
+/// locking
+
+// bfy_buffer_enable_locking() always fails when locking is compiled out
+#ifdef BFY_DISABLE_LOCKING
+#define SKIP_IF_LOCKING_DISABLED() GTEST_SKIP() << "built with BFY_DISABLE_LOCKING"
+#else
+#define SKIP_IF_LOCKING_DISABLED() static_cast<void>(0)
+#endif
+
+namespace {
+
+// a recursive lock that remembers how deeply it's been locked
+struct CountingLock {
+    std::recursive_mutex mutex;
+    int depth = 0;
+};
+
+void use_counting_locks() {
+    auto fns = bfy_lock_functions {
+        .lock_new = []() -> void* { return new CountingLock{}; },
+        .lock_free = [](void* lock) { delete static_cast<CountingLock*>(lock); },
+        .lock = [](void* vlock) {
+            auto* lock = static_cast<CountingLock*>(vlock);
+            lock->mutex.lock();
+            ++lock->depth;
+        },
+        .unlock = [](void* vlock) {
+            auto* lock = static_cast<CountingLock*>(vlock);
+            --lock->depth;
+            lock->mutex.unlock();
+        }
+    };
+    bfy_set_lock_functions(&fns);
+}
+
+}  // anonymous namespace
+
+TEST(Buffer, enable_locking_requires_lock_functions) {
+    auto fns = bfy_lock_functions {};
+    bfy_set_lock_functions(&fns);
+
+    auto buf = bfy_buffer_init();
+    errno = 0;
+    EXPECT_EQ(-1, bfy_buffer_enable_locking(&buf, nullptr));
+    EXPECT_EQ(ENOTSUP, errno);
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, enable_locking_twice_fails) {
+    SKIP_IF_LOCKING_DISABLED();
+    use_counting_locks();
+
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_enable_locking(&buf, nullptr));
+    EXPECT_EQ(-1, bfy_buffer_enable_locking(&buf, nullptr));
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, locking_with_caller_lock) {
+    SKIP_IF_LOCKING_DISABLED();
+    use_counting_locks();
+
+    auto lock = CountingLock {};
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_enable_locking(&buf, &lock));
+
+    auto constexpr str = std::string_view { "Lorem ipsum dolor sit amet" };
+    EXPECT_EQ(0, bfy_buffer_add(&buf, std::data(str), std::size(str)));
+    EXPECT_EQ(0, lock.depth);
+    EXPECT_EQ(str, buffer_remove_string(&buf));
+    EXPECT_EQ(0, lock.depth);
+
+    bfy_buffer_lock(&buf);
+    EXPECT_EQ(1, lock.depth);
+    bfy_buffer_unlock(&buf);
+    EXPECT_EQ(0, lock.depth);
+
+    // confirm the caller's lock isn't freed by the buffer
+    bfy_buffer_destruct(&buf);
+    EXPECT_EQ(0, lock.depth);
+}
+
+TEST(Buffer, locking_coalesce_holds_lock) {
+    SKIP_IF_LOCKING_DISABLED();
+    use_counting_locks();
+
+    auto lock = CountingLock {};
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_enable_locking(&buf, &lock));
+
+    bfy_buffer_begin_coalescing_change_events(&buf);
+    EXPECT_EQ(1, lock.depth);
+    EXPECT_EQ(0, bfy_buffer_add_ch(&buf, 'x'));
+    EXPECT_EQ(1, lock.depth);
+    bfy_buffer_end_coalescing_change_events(&buf);
+    EXPECT_EQ(0, lock.depth);
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, locking_writer_holds_lock) {
+    SKIP_IF_LOCKING_DISABLED();
+    use_counting_locks();
+
+    auto lock = CountingLock {};
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_enable_locking(&buf, &lock));
+
+    auto w = bfy_writer_init(&buf);
+    EXPECT_EQ(1, lock.depth);
+    EXPECT_EQ(0, bfy_writer_add_hton_u32(&w, 1));
+    EXPECT_EQ(0, bfy_writer_flush(&w));
+    EXPECT_EQ(1, lock.depth);
+    bfy_writer_destruct(&w);
+    EXPECT_EQ(0, lock.depth);
+    EXPECT_EQ(4, bfy_buffer_get_content_len(&buf));
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, locking_reader_holds_lock) {
+    SKIP_IF_LOCKING_DISABLED();
+    use_counting_locks();
+
+    auto lock = CountingLock {};
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_enable_locking(&buf, &lock));
+    EXPECT_EQ(0, bfy_buffer_add_hton_u32(&buf, 1));
+
+    auto r = bfy_reader_init(&buf);
+    EXPECT_EQ(1, lock.depth);
+    auto val = uint32_t {};
+    EXPECT_EQ(0, bfy_reader_read_ntoh_u32(&r, &val));
+    EXPECT_EQ(1, val);
+    EXPECT_EQ(1, lock.depth);
+    bfy_reader_destruct(&r);
+    EXPECT_EQ(0, lock.depth);
+    EXPECT_EQ(0, bfy_buffer_get_content_len(&buf));
+
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, locking_many_threads) {
+    SKIP_IF_LOCKING_DISABLED();
+    use_counting_locks();
+
+    auto buf = bfy_buffer_init();
+    EXPECT_EQ(0, bfy_buffer_enable_locking(&buf, nullptr));
+
+    auto constexpr n_threads = 8;
+    auto constexpr n_messages = 1000;
+    auto threads = std::vector<std::thread>{};
+    for (int i = 0; i < n_threads; ++i) {
+        threads.emplace_back([&buf, i]() {
+            for (int j = 0; j < n_messages; ++j) {
+                // each message is added as an atomic batch
+                bfy_buffer_begin_coalescing_change_events(&buf);
+                bfy_buffer_add_hton_u32(&buf, uint32_t(i));
+                bfy_buffer_add_hton_u32(&buf, uint32_t(j));
+                bfy_buffer_end_coalescing_change_events(&buf);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(n_threads * n_messages * sizeof(uint32_t) * 2, bfy_buffer_get_content_len(&buf));
+    auto next = std::array<uint32_t, n_threads>{};
+    while (bfy_buffer_get_content_len(&buf) > 0) {
+        auto const thread = bfy_buffer_remove_ntoh_u32(&buf);
+        auto const message = bfy_buffer_remove_ntoh_u32(&buf);
+        ASSERT_LT(thread, n_threads);
+        EXPECT_EQ(next[thread]++, message);
+    }
+
+    bfy_buffer_destruct(&buf);
+}
+
+/// parallel
+
+namespace {
+
+// a bfy_run_tasks_cb that runs each task on its own thread
+void run_tasks_on_threads(bfy_task_cb* task, void* task_data, size_t n_tasks, void* /*user_data*/) {
+    auto threads = std::vector<std::thread>{};
+    for (size_t i = 0; i < n_tasks; ++i) {
+        threads.emplace_back(task, task_data, i);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// builds a buffer with many pages of uneven sizes
+class BufferWithManyPages {
+ public:
+    bfy_buffer buf = bfy_buffer_init();
+    std::string allstrs;
+
+    explicit BufferWithManyPages(size_t n_pages = 100) {
+        for (size_t i = 0; i < n_pages; ++i) {
+            auto str = std::string{};
+            for (size_t j = 0, n = 1 + (i * 7) % 53; j < n; ++j) {
+                str += char('a' + (i + j) % 26);
+            }
+            bfy_buffer_add_pagebreak(&buf);
+            bfy_buffer_add(&buf, std::data(str), std::size(str));
+            allstrs += str;
+        }
+    }
+
+    ~BufferWithManyPages() {
+        bfy_buffer_destruct(&buf);
+    }
+};
+
+}  // anonymous namespace
+
+TEST(Buffer, copyout_range_parallel) {
+    BufferWithManyPages local;
+    auto const len = std::size(local.allstrs);
+    auto const ranges = std::array<std::pair<size_t, size_t>, 4> {{
+        { 0, len }, { 1, len - 1 }, { len / 3, len / 2 }, { 5, 6 }
+    }};
+
+    for (auto const n_tasks : { 0, 1, 2, 3, 7, 64 }) {
+        for (auto const& [begin, end] : ranges) {
+            auto out = std::string(end - begin, '\0');
+            EXPECT_EQ(end - begin, bfy_buffer_copyout_range_parallel(&local.buf, begin, end,
+                                                                     std::data(out), n_tasks,
+                                                                     run_tasks_on_threads, nullptr));
+            EXPECT_EQ(local.allstrs.substr(begin, end - begin), out);
+        }
+    }
+}
+
+TEST(Buffer, copyout_range_parallel_without_runner) {
+    BufferWithManyPages local;
+    auto const len = std::size(local.allstrs);
+
+    auto out = std::string(len, '\0');
+    EXPECT_EQ(len, bfy_buffer_copyout_range_parallel(&local.buf, 0, SIZE_MAX, std::data(out), 8, nullptr, nullptr));
+    EXPECT_EQ(local.allstrs, out);
+}
+
+TEST(Buffer, copyout_range_parallel_empty) {
+    auto buf = bfy_buffer_init();
+    auto out = std::array<char, 8> {};
+    EXPECT_EQ(0, bfy_buffer_copyout_range_parallel(&buf, 0, SIZE_MAX, std::data(out), 8, run_tasks_on_threads, nullptr));
+    bfy_buffer_destruct(&buf);
+}
+
+TEST(Buffer, remove_range_parallel) {
+    BufferWithManyPages local;
+    auto const len = std::size(local.allstrs);
+    auto const begin = size_t { 10 };
+    auto const end = len - 10;
+
+    auto out = std::string(end - begin, '\0');
+    EXPECT_EQ(end - begin, bfy_buffer_remove_range_parallel(&local.buf, begin, end,
+                                                            std::data(out), 4,
+                                                            run_tasks_on_threads, nullptr));
+    EXPECT_EQ(local.allstrs.substr(begin, end - begin), out);
+    EXPECT_EQ(len - (end - begin), bfy_buffer_get_content_len(&local.buf));
+    auto const expected = local.allstrs.substr(0, begin) + local.allstrs.substr(end);
+    EXPECT_EQ(expected, buffer_remove_string(&local.buf));
+}
+
+TEST(Buffer, search_range_parallel) {
+    BufferWithManyPages local;
+    auto const len = std::size(local.allstrs);
+
+    for (auto const n_tasks : { 2, 3, 7 }) {
+        for (auto const needle_len : { 1, 5, 40 }) {
+            for (size_t offset = 0; offset + needle_len <= len; offset += 37) {
+                auto const needle = local.allstrs.substr(offset, needle_len);
+                auto const expected = local.allstrs.find(needle);
+                auto match = size_t {};
+                EXPECT_EQ(0, bfy_buffer_search_range_parallel(&local.buf, 0, SIZE_MAX,
+                                                              std::data(needle), std::size(needle),
+                                                              &match, n_tasks,
+                                                              run_tasks_on_threads, nullptr));
+                EXPECT_EQ(expected, match);
+            }
+        }
+    }
+}
+
+TEST(Buffer, search_range_parallel_respects_range) {
+    BufferWithManyPages local;
+    auto const len = std::size(local.allstrs);
+    auto const needle = local.allstrs.substr(len / 2, 20);
+    auto const expected = local.allstrs.find(needle);
+    auto match = size_t {};
+
+    // range ends one byte before the match does
+    EXPECT_EQ(-1, bfy_buffer_search_range_parallel(&local.buf, 0, expected + std::size(needle) - 1,
+                                                   std::data(needle), std::size(needle),
+                                                   &match, 4, run_tasks_on_threads, nullptr));
+    // range begins one byte after the match does
+    auto const later = local.allstrs.find(needle, expected + 1);
+    auto const expected_later = later == std::string::npos ? -1 : 0;
+    EXPECT_EQ(expected_later, bfy_buffer_search_range_parallel(&local.buf, expected + 1, SIZE_MAX,
+                                                               std::data(needle), std::size(needle),
+                                                               &match, 4, run_tasks_on_threads, nullptr));
+    // range is exactly the match
+    EXPECT_EQ(0, bfy_buffer_search_range_parallel(&local.buf, expected, expected + std::size(needle),
+                                                  std::data(needle), std::size(needle),
+                                                  &match, 4, run_tasks_on_threads, nullptr));
+    EXPECT_EQ(expected, match);
+}
+
+TEST(Buffer, search_range_parallel_not_present) {
+    BufferWithManyPages local;
+    auto constexpr needle = std::string_view { "0123" };
+    auto constexpr expected_pos = size_t { 999 };
+    auto match = expected_pos;
+
+    EXPECT_EQ(-1, bfy_buffer_search_range_parallel(&local.buf, 0, SIZE_MAX,
+                                                   std::data(needle), std::size(needle),
+                                                   &match, 4, run_tasks_on_threads, nullptr));
+    EXPECT_EQ(expected_pos, match);
+}